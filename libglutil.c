@@ -54,6 +54,14 @@ glutil_shader_compile_prog3(GLuint vertex_shader, GLuint fragment_shader, GLuint
 	return program;
 }
 
+inline
+void
+glutil_shader_uniform1i(GLuint shader, const char *name, GLint x)
+{
+	GLuint location = glGetUniformLocation(shader, name);
+	glUniform1i(location, x);
+}
+
 inline
 void
 glutil_shader_uniform1f(GLuint shader, const char *name, GLfloat x)
@@ -70,6 +78,14 @@ glutil_shader_uniform2f(GLuint shader, const char *name, GLfloat x, GLfloat y)
 	glUniform2f(location, x, y);
 }
 
+inline
+void
+glutil_shader_uniform4f(GLuint shader, const char *name, GLfloat x, GLfloat y, GLfloat z, GLfloat w)
+{
+	GLuint location = glGetUniformLocation(shader, name);
+	glUniform4f(location, x, y, z, w);
+}
+
 inline
 void 
 _check_shader_link(GLuint program)
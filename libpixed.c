@@ -1,39 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include "libpixed.h"
+#include "libpixed_private.h"
 
 int read_uint32_big_endian(FILE *, uint32_t *);
-int write_uint32_big_endian(FILE *, uint32_t);
 
+static PixedDocument *pixed_document_alloc(const char *, uint32_t, uint32_t);
+static uint32_t      *pixed_document_alloc_tile(PixedDocument *, uint32_t);
+static int            pixed_document_write_banded(PixedDocument *, int);
+static void           pixed_document_flatten_rows(void *, uint32_t, uint32_t);
+static int            pixed_document_tile_canvas(PixedDocument *);
+static int            pixed_document_index_canvas(PixedDocument *);
+
+typedef struct {
+	PixedDocument *document;
+	uint32_t      *canvas;
+} PixedFlattenJob;
+
+/* Shared by every tile that was never written to, must stay all zeros */
+static uint32_t pixed_empty_tile[PIXED_TILE_PIXELS];
+
+/*
+ * Allocates the document and its name out of one arena of its own but leaves
+ * the canvas to the caller. Until it gets one the document can be freed.
+ */
+static
 PixedDocument *
-pixed_document_new(const char *name, uint32_t width, uint32_t height)
+pixed_document_alloc(const char *name, uint32_t width, uint32_t height)
 {
-	PixedDocument *document = malloc(sizeof(PixedDocument));
+	// One block for both, each rounded up to 16 bytes
+	PixedArena arena;
+	pixed_arena_init(&arena, sizeof(PixedDocument) + strlen(name) + 1 + 32);
+
+	PixedDocument *document = pixed_arena_alloc(&arena, sizeof(PixedDocument));
 	if (!document)
 		return 0;
 
-	document->name = malloc(sizeof(char) * strlen(name));
+	document->name = pixed_arena_strdup(&arena, name);
 	if (!document->name) {
-		free(document);
+		pixed_arena_free(&arena);
 		return 0;
 	}
 
-	strncpy(document->name, name, sizeof(char) * strlen(name));
+	document->arena = arena;
+	document->canvas = 0;
+	document->mapping = 0;
+	document->mapping_length = 0;
+	document->width = width;
+	document->height = height;
 
-	document->canvas = malloc(sizeof(uint32_t) * (width * height));
-	if (!document->canvas) {
-		free(document->name);
-		free(document);
-		return 0;
-	}
+	document->storage = PIXED_STORAGE_FLAT;
+	document->tiles = 0;
+	document->tiles_x = (width + PIXED_TILE_SIZE - 1) / PIXED_TILE_SIZE;
+	document->tiles_y = (height + PIXED_TILE_SIZE - 1) / PIXED_TILE_SIZE;
+	document->pool = 0;
+	document->pooled = 0;
+
+	document->indices = 0;
+	document->palette_length = 0;
 
-	memset(document->canvas, 0, sizeof(uint32_t) * (width * height));
+	document->dirty_x0 = 0;
+	document->dirty_y0 = 0;
+	document->dirty_x1 = 0;
+	document->dirty_y1 = 0;
 
+	document->history = 0;
+	document->colors = 0;
+
+	document->layers = 0;
+	document->layers_length = 0;
+
+	return document;
+}
+
+/* Hands a new flat canvas to the document, releasing whatever backed it before */
+void
+pixed_document_replace_canvas(PixedDocument *document, uint32_t *canvas, uint32_t width, uint32_t height)
+{
+	pixed_document_release_canvas(document);
+
+	document->canvas = canvas;
 	document->width = width;
 	document->height = height;
+	document->storage = PIXED_STORAGE_FLAT;
+	document->tiles_x = (width + PIXED_TILE_SIZE - 1) / PIXED_TILE_SIZE;
+	document->tiles_y = (height + PIXED_TILE_SIZE - 1) / PIXED_TILE_SIZE;
+
+	if (document->colors)
+		pixed_color_index_invalidate(document->colors);
+
+	pixed_document_mark_dirty(document, 0, 0, width, height);
+}
+
+void
+pixed_document_release_canvas(PixedDocument *document)
+{
+	if (document->mapping)
+		munmap(document->mapping, document->mapping_length);
+	else
+		free(document->canvas);
+
+	if (document->tiles) {
+		size_t i = 0, tiles_length = (size_t)document->tiles_x * document->tiles_y;
+		for (; i < tiles_length; i++) {
+			if (document->pooled && document->pooled[i])
+				pixed_tile_pool_release(document->pool, document->tiles[i]);
+			else if (document->tiles[i] != pixed_empty_tile)
+				free(document->tiles[i]);
+		}
+
+		free(document->tiles);
+	}
+
+	free(document->pooled);
+	free(document->indices);
+
+	document->canvas = 0;
+	document->mapping = 0;
+	document->mapping_length = 0;
+	document->tiles = 0;
+	document->pooled = 0;
+	document->indices = 0;
+	document->palette_length = 0;
+}
+
+PixedDocument *
+pixed_document_new(const char *name, uint32_t width, uint32_t height)
+{
+	PixedDocument *document = pixed_document_alloc(name, width, height);
+	if (!document)
+		return 0;
+
+	document->canvas = calloc((size_t)width * height, sizeof(uint32_t));
+	if (!document->canvas) {
+		pixed_document_free(document);
+		return 0;
+	}
 
 	return document;
 }
@@ -41,9 +155,19 @@ pixed_document_new(const char *name, uint32_t width, uint32_t height)
 void
 pixed_document_free(PixedDocument *document)
 {
-	free(document->name);
-	free(document->canvas);
-	free(document);
+	uint32_t i = 0;
+	for (; i < document->layers_length; i++)
+		pixed_document_free(document->layers[i].pixels);
+
+	pixed_history_free(document->history);
+	pixed_color_index_free(document->colors);
+
+	free(document->layers);
+	pixed_document_release_canvas(document);
+
+	// The document lives in its arena
+	PixedArena arena = document->arena;
+	pixed_arena_free(&arena);
 }
 
 PixedDocument *
@@ -58,26 +182,26 @@ pixed_document_read_file(const char *file_name)
 	if (!file)
 		return 0;
 
-	// Read PiXd magic header
-	char magic[4];
-	fread(&magic, 1, 4, file);
-
-	// Wrong file format
-	if (strncmp(magic, PIXED_HEADER_MAGIC, 4) != 0) {
+	// Read PiXd magic header, width and height in one go
+	unsigned char header[PIXED_HEADER_SIZE];
+	if (fread(header, 1, PIXED_HEADER_SIZE, file) < PIXED_HEADER_SIZE) {
 		fclose(file);
 		return 0;
 	}
 
-	// Read width and height in big endian order
-	uint32_t width = 0, height = 0;
-	if (read_uint32_big_endian(file, &width) != 0) {
+	// Wrong file format
+	if (strncmp((char *)header, PIXED_HEADER_MAGIC, 4) != 0) {
 		fclose(file);
 		return 0;
 	}
 
-	if (read_uint32_big_endian(file, &height) != 0) {
+	uint32_t width = parse_uint32_big_endian(header + 4);
+	uint32_t height = parse_uint32_big_endian(header + 8);
+
+	// Compressed documents are decoded straight from a mapping
+	if (width == 0) {
 		fclose(file);
-		return 0;
+		return pixed_document_map_file(file_name);
 	}
 
 	// Document dimensions can't be equal or less than 0
@@ -86,16 +210,20 @@ pixed_document_read_file(const char *file_name)
 		return 0;
 	}
 
-	document = pixed_document_new(file_name, width, height);
+	// Every pixel is read over, the canvas doesn't need zeroing
+	document = pixed_document_alloc(file_name, width, height);
+	if (document)
+		document->canvas = malloc(sizeof(uint32_t) * width * height);
+
+	if (!document || !document->canvas) {
+		if (document)
+			pixed_document_free(document);
 
-	uint32_t pixels_length = width * height;
-	document->canvas = malloc(sizeof(uint32_t) * pixels_length);
-	if (!document->canvas) {
-		pixed_document_free(document);
 		fclose(file);
 		return 0;
 	}
 
+	size_t pixels_length = (size_t)width * height;
 	size_t read_pixels = fread(document->canvas, sizeof(uint32_t), pixels_length, file);
 	if (read_pixels < pixels_length) {
 		pixed_document_free(document);
@@ -107,77 +235,878 @@ pixed_document_read_file(const char *file_name)
 	return document;
 }
 
+/*
+ * Maps the file privately and points the canvas straight at the pixel block,
+ * pages are only copied by the kernel once they are written to. Compressed
+ * documents can't be used in place and are decoded into a new canvas.
+ */
+PixedDocument *
+pixed_document_map_file(const char *file_name)
+{
+	if (strlen(file_name) <= 0)
+		return 0;
+
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size < PIXED_HEADER_SIZE) {
+		close(fd);
+		return 0;
+	}
+
+	size_t mapping_length = (size_t)file_stat.st_size;
+	void *mapping = mmap(0, mapping_length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (mapping == MAP_FAILED)
+		return 0;
+
+	const unsigned char *header = mapping;
+
+	// Wrong file format
+	if (strncmp((const char *)header, PIXED_HEADER_MAGIC, 4) != 0) {
+		munmap(mapping, mapping_length);
+		return 0;
+	}
+
+	uint32_t width = parse_uint32_big_endian(header + 4);
+	uint32_t height = parse_uint32_big_endian(header + 8);
+	size_t pixels_length = (size_t)width * height;
+
+	if (width == 0) {
+		PixedDocument *decoded = pixed_document_decode(file_name, header, mapping_length, 0, UINT32_MAX);
+		munmap(mapping, mapping_length);
+		return decoded;
+	}
+
+	// Empty or truncated pixel block
+	if (pixels_length == 0 || mapping_length - PIXED_HEADER_SIZE < pixels_length * sizeof(uint32_t)) {
+		munmap(mapping, mapping_length);
+		return 0;
+	}
+
+	PixedDocument *document = pixed_document_alloc(file_name, width, height);
+	if (!document) {
+		munmap(mapping, mapping_length);
+		return 0;
+	}
+
+	document->mapping = mapping;
+	document->mapping_length = mapping_length;
+	document->canvas = (uint32_t *)((unsigned char *)mapping + PIXED_HEADER_SIZE);
+
+	return document;
+}
+
+/*
+ * Loads rows [y, y + height) of the document only. Compressed documents only
+ * decode the chunks covering those rows.
+ */
+PixedDocument *
+pixed_document_read_region(const char *file_name, uint32_t y, uint32_t height)
+{
+	PixedDocument *region = 0;
+	PixedDocument *mapped = 0;
+
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size < PIXED_HEADER_SIZE) {
+		close(fd);
+		return 0;
+	}
+
+	size_t mapping_length = (size_t)file_stat.st_size;
+	const unsigned char *header = mmap(0, mapping_length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (header == MAP_FAILED)
+		return 0;
+
+	if (strncmp((const char *)header, PIXED_HEADER_MAGIC, 4) != 0) {
+		munmap((void *)header, mapping_length);
+		return 0;
+	}
+
+	if (parse_uint32_big_endian(header + 4) == 0) {
+		region = pixed_document_decode(file_name, header, mapping_length, y, height);
+		munmap((void *)header, mapping_length);
+		return region;
+	}
+
+	munmap((void *)header, mapping_length);
+
+	// Raw documents are cheap to map, only the copied rows get paged in
+	mapped = pixed_document_map_file(file_name);
+	if (!mapped)
+		return 0;
+
+	if (y >= mapped->height) {
+		pixed_document_free(mapped);
+		return 0;
+	}
+
+	height = PIXED_MIN(height, mapped->height - y);
+	region = pixed_document_new(file_name, mapped->width, height);
+	if (region)
+		memcpy(region->canvas, mapped->canvas + (size_t)y * mapped->width, sizeof(uint32_t) * (size_t)mapped->width * height);
+
+	pixed_document_free(mapped);
+	return region;
+}
+
 int
 pixed_document_write_file(PixedDocument *document, char *file_name)
 {
 	if (!document)
 		return -1;
 
-	FILE *file = fopen(file_name, "wb");
-	if (!file)
+	char *temp_name = 0;
+	int fd = open_replacement(file_name, &temp_name);
+	if (fd < 0)
 		return -1;
 
-	if (fwrite(PIXED_HEADER_MAGIC, sizeof(char), 4, file) < 1) {
-		fclose(file);
-		return -1;
+	unsigned char header[PIXED_HEADER_SIZE];
+	memcpy(header, PIXED_HEADER_MAGIC, 4);
+	store_uint32_big_endian(header + 4, document->width);
+	store_uint32_big_endian(header + 8, document->height);
+
+	// Canvas is already in file byte order, so it goes out as it is
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = PIXED_HEADER_SIZE;
+	iov[1].iov_base = document->canvas;
+	iov[1].iov_len = sizeof(uint32_t) * ((size_t)document->width * document->height);
+
+	int iov_count = document->storage == PIXED_STORAGE_FLAT ? 2 : 1;
+	int result = write_vector(fd, iov, iov_count);
+
+	if (result == 0 && document->storage != PIXED_STORAGE_FLAT)
+		result = pixed_document_write_banded(document, fd);
+
+	return finish_replacement(fd, temp_name, file_name, result);
+}
+
+PixedDocument *
+pixed_document_new_tiled(const char *name, uint32_t width, uint32_t height)
+{
+	PixedDocument *document = pixed_document_alloc(name, width, height);
+	if (!document)
+		return 0;
+
+	size_t i = 0, tiles_length = (size_t)document->tiles_x * document->tiles_y;
+
+	document->tiles = malloc(sizeof(uint32_t *) * tiles_length);
+	if (!document->tiles) {
+		pixed_document_free(document);
+		return 0;
 	}
 
-	if (write_uint32_big_endian(file, document->width) < 1) {
-		fclose(file);
+	for (; i < tiles_length; i++)
+		document->tiles[i] = pixed_empty_tile;
+
+	document->storage = PIXED_STORAGE_TILED;
+	return document;
+}
+
+/*
+ * Moves the pixels of document into a new document of the same size, the
+ * document is left with a transparent flat canvas. Returns 0 on failure.
+ */
+PixedDocument *
+pixed_document_take_pixels(PixedDocument *document)
+{
+	uint32_t *canvas = calloc((size_t)document->width * document->height, sizeof(uint32_t));
+	PixedDocument *pixels = pixed_document_alloc("layer", document->width, document->height);
+
+	if (!canvas || !pixels) {
+		free(canvas);
+		if (pixels)
+			pixed_document_free(pixels);
+
+		return 0;
+	}
+
+	pixels->canvas = document->canvas;
+	pixels->mapping = document->mapping;
+	pixels->mapping_length = document->mapping_length;
+	pixels->storage = document->storage;
+	pixels->tiles = document->tiles;
+	pixels->pool = document->pool;
+	pixels->pooled = document->pooled;
+	pixels->indices = document->indices;
+	pixels->palette_length = document->palette_length;
+	memcpy(pixels->palette, document->palette, sizeof(uint32_t) * document->palette_length);
+
+	document->canvas = 0;
+	document->mapping = 0;
+	document->tiles = 0;
+	document->pooled = 0;
+	document->indices = 0;
+
+	pixed_document_replace_canvas(document, canvas, document->width, document->height);
+	return pixels;
+}
+
+/* Converts the document between flat, tiled and indexed canvas layouts */
+int
+pixed_document_set_storage(PixedDocument *document, PixedStorage storage)
+{
+	if (!document)
 		return -1;
+
+	if (document->storage == storage)
+		return 0;
+
+	// The composite of layered documents stays flat, their layers can be converted
+	if (document->layers_length > 0)
+		return -1;
+
+	// Every conversion goes through the flat layout
+	if (document->storage != PIXED_STORAGE_FLAT) {
+		uint32_t *canvas = malloc(sizeof(uint32_t) * (size_t)document->width * document->height);
+		if (!canvas)
+			return -1;
+
+		PixedFlattenJob job;
+		job.document = document;
+		job.canvas = canvas;
+
+		pixed_parallel_rows(document->height, document->width, pixed_document_flatten_rows, &job);
+		pixed_document_replace_canvas(document, canvas, document->width, document->height);
 	}
 
-	if (write_uint32_big_endian(file, document->height) < 1) {
-		fclose(file);
+	switch (storage) {
+	case PIXED_STORAGE_TILED:
+		return pixed_document_tile_canvas(document);
+
+	case PIXED_STORAGE_INDEXED:
+		return pixed_document_index_canvas(document);
+
+	default:
+		return 0;
+	}
+}
+
+static
+void
+pixed_document_flatten_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedFlattenJob *job = ctx;
+	pixed_document_copy_rows(job->document, begin, end - begin, job->canvas + (size_t)begin * job->document->width);
+}
+
+static
+int
+pixed_document_tile_canvas(PixedDocument *document)
+{
+	uint32_t tx = 0, ty = 0, row = 0;
+	size_t i = 0, tiles_length = (size_t)document->tiles_x * document->tiles_y;
+	PixedTile tile;
+
+	uint32_t **tiles = malloc(sizeof(uint32_t *) * tiles_length);
+	if (!tiles)
 		return -1;
+
+	for (i = 0; i < tiles_length; i++)
+		tiles[i] = pixed_empty_tile;
+
+	for (ty = 0; ty < document->tiles_y; ty++) {
+		for (tx = 0; tx < document->tiles_x; tx++) {
+			pixed_document_get_tile(document, tx, ty, 0, &tile);
+
+			// Fully transparent tiles stay shared
+			int blank = 1;
+			for (row = 0; blank && row < tile.height; row++) {
+				uint32_t *line = tile.pixels + (size_t)row * tile.stride;
+				blank = line[0] == 0 && memcmp(line, line + 1, sizeof(uint32_t) * (tile.width - 1)) == 0;
+			}
+
+			if (blank)
+				continue;
+
+			uint32_t *pixels = calloc(PIXED_TILE_PIXELS, sizeof(uint32_t));
+			if (!pixels) {
+				for (i = 0; i < tiles_length; i++) {
+					if (tiles[i] != pixed_empty_tile)
+						free(tiles[i]);
+				}
+
+				free(tiles);
+				return -1;
+			}
+
+			for (row = 0; row < tile.height; row++)
+				memcpy(pixels + row * PIXED_TILE_SIZE, tile.pixels + (size_t)row * tile.stride, sizeof(uint32_t) * tile.width);
+
+			tiles[(size_t)ty * document->tiles_x + tx] = pixels;
+		}
 	}
 
-	uint32_t pixels_length = document->width * document->height;
-	
-	int i = 0;
+	pixed_document_release_canvas(document);
+	document->tiles = tiles;
+	document->storage = PIXED_STORAGE_TILED;
+
+	return 0;
+}
+
+/*
+ * Builds the palette from the colors in the canvas and swaps the canvas for
+ * palette indices. Fails and keeps the flat canvas above PIXED_PALETTE_MAX colors.
+ */
+static
+int
+pixed_document_index_canvas(PixedDocument *document)
+{
+	size_t i = 0, pixels_length = (size_t)document->width * document->height;
+
+	uint8_t *indices = malloc(pixels_length);
+	if (!indices)
+		return -1;
+
+	// Open addressing over canvas values, twice the palette so probes stay short
+	uint32_t keys[PIXED_PALETTE_MAX * 2];
+	int16_t values[PIXED_PALETTE_MAX * 2];
+	uint32_t palette[PIXED_PALETTE_MAX];
+	uint32_t palette_length = 0;
+	uint32_t last_color = 0;
+	int last_index = -1;
+
+	memset(values, 0xff, sizeof(values));
+
 	for (; i < pixels_length; i++) {
-		if (write_uint32_big_endian(file, document->canvas[i]) < 1) {
-			fclose(file);
-			return -1;
+		uint32_t color = document->canvas[i];
+
+		// Pixel art is mostly runs, skip the lookup for them
+		if (last_index >= 0 && color == last_color) {
+			indices[i] = last_index;
+			continue;
+		}
+
+		uint32_t slot = (color * 2654435761u) >> 23;
+		while (values[slot] >= 0 && keys[slot] != color)
+			slot = (slot + 1) & (PIXED_PALETTE_MAX * 2 - 1);
+
+		if (values[slot] < 0) {
+			if (palette_length == PIXED_PALETTE_MAX) {
+				free(indices);
+				return -1;
+			}
+
+			keys[slot] = color;
+			values[slot] = palette_length;
+			palette[palette_length++] = color;
 		}
+
+		last_color = color;
+		last_index = values[slot];
+		indices[i] = last_index;
 	}
 
-	fclose(file);
+	pixed_document_release_canvas(document);
+
+	memcpy(document->palette, palette, sizeof(uint32_t) * palette_length);
+	document->palette_length = palette_length;
+	document->indices = indices;
+	document->storage = PIXED_STORAGE_INDEXED;
+
 	return 0;
 }
 
-int
-pixed_document_resize(PixedDocument *document, int width, int height)
+PixedDocument *
+pixed_document_new_indexed(const char *name, uint32_t width, uint32_t height)
 {
+	PixedDocument *document = pixed_document_alloc(name, width, height);
 	if (!document)
-		return -1;
+		return 0;
 
-	// Skip unnecessary process
-	if (document->width == width && document->height == height)
+	document->indices = calloc((size_t)width * height, sizeof(uint8_t));
+	if (!document->indices) {
+		pixed_document_free(document);
 		return 0;
+	}
+
+	// Index 0 starts out as the transparent background
+	document->palette[0] = 0;
+	document->palette_length = 1;
+	document->storage = PIXED_STORAGE_INDEXED;
+
+	return document;
+}
+
+/* Returns the palette index of color, -1 when the palette doesn't have it */
+int
+pixed_document_palette_index(PixedDocument *document, uint32_t color)
+{
+	uint32_t i = 0, value = pixed_canvas_color(color);
+
+	for (; i < document->palette_length; i++) {
+		if (document->palette[i] == value)
+			return i;
+	}
 
 	return -1;
 }
 
+/* Changes or appends palette entry index, every pixel using it follows */
+int
+pixed_document_set_palette_color(PixedDocument *document, uint32_t index, uint32_t color)
+{
+	if (index >= PIXED_PALETTE_MAX || index > document->palette_length)
+		return -1;
+
+	if (index == document->palette_length || document->palette[index] != pixed_canvas_color(color)) {
+		if (document->history)
+			pixed_history_capture_palette(document->history);
+
+		// Every pixel using a changed entry changes with it
+		if (index < document->palette_length)
+			pixed_document_mark_dirty(document, 0, 0, document->width, document->height);
+	}
+
+	document->palette[index] = pixed_canvas_color(color);
+	if (index == document->palette_length)
+		document->palette_length++;
+
+	return 0;
+}
+
+/* Clips area, 0 for the whole document, returns 0 when nothing of it is left */
+int
+pixed_document_clip_area(PixedDocument *document, const PixedRect *area, PixedRect *clipped)
+{
+	if (!area) {
+		clipped->x = 0;
+		clipped->y = 0;
+		clipped->width = document->width;
+		clipped->height = document->height;
+	} else {
+		if (area->x >= document->width || area->y >= document->height)
+			return 0;
+
+		clipped->x = area->x;
+		clipped->y = area->y;
+		clipped->width = PIXED_MIN(area->width, document->width - area->x);
+		clipped->height = PIXED_MIN(area->height, document->height - area->y);
+	}
+
+	return clipped->width > 0 && clipped->height > 0;
+}
+
+/* Adds the rectangle at x, y to the dirty region, clipped against the document */
+void
+pixed_document_mark_dirty(PixedDocument *document, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	if (x >= document->width || y >= document->height || width == 0 || height == 0)
+		return;
+
+	width = PIXED_MIN(width, document->width - x);
+	height = PIXED_MIN(height, document->height - y);
+
+	pixed_document_mark_pixel(document, x, y);
+	pixed_document_mark_pixel(document, x + width - 1, y + height - 1);
+}
+
+/* Called before the pixels in the rectangle change, keeps them for undo and marks them dirty */
+void
+pixed_document_modify(PixedDocument *document, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	if (document->history)
+		pixed_history_capture(document->history, x, y, width, height);
+
+	if (document->colors)
+		pixed_color_index_capture(document->colors, x, y, width, height);
+
+	pixed_document_mark_dirty(document, x, y, width, height);
+}
+
+/*
+ * Moves the bounding rectangle of every pixel changed since the last call into
+ * rect and starts over with a clean document. Returns 0 when nothing changed.
+ */
+int
+pixed_document_take_dirty(PixedDocument *document, PixedRect *rect)
+{
+	if (document->dirty_x0 >= document->dirty_x1)
+		return 0;
+
+	rect->x = document->dirty_x0;
+	rect->y = document->dirty_y0;
+	rect->width = PIXED_MIN(document->dirty_x1, document->width) - rect->x;
+	rect->height = PIXED_MIN(document->dirty_y1, document->height) - rect->y;
+
+	document->dirty_x0 = 0;
+	document->dirty_y0 = 0;
+	document->dirty_x1 = 0;
+	document->dirty_y1 = 0;
+
+	// A canvas that shrank after the pixels were marked has nothing left there
+	return rect->x < document->width && rect->y < document->height;
+}
+
+uint32_t
+pixed_document_read_pixel(PixedDocument *document, uint32_t x, uint32_t y)
+{
+	if (document->storage == PIXED_STORAGE_FLAT)
+		return pixed_document_get_pixel(document, x, y);
+
+	if (document->storage == PIXED_STORAGE_INDEXED)
+		return pixed_canvas_color(document->palette[document->indices[(size_t)y * document->width + x]]);
+
+	uint32_t *tile = document->tiles[(y / PIXED_TILE_SIZE) * document->tiles_x + (x / PIXED_TILE_SIZE)];
+	return pixed_canvas_color(tile[(y % PIXED_TILE_SIZE) * PIXED_TILE_SIZE + (x % PIXED_TILE_SIZE)]);
+}
+
+int
+pixed_document_write_pixel(PixedDocument *document, uint32_t x, uint32_t y, uint32_t color)
+{
+	if (x >= document->width || y >= document->height)
+		return -1;
+
+	if (document->storage == PIXED_STORAGE_FLAT) {
+		pixed_document_set_pixel(document, x, y, color);
+		return 0;
+	}
+
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		int index = pixed_document_palette_index(document, color);
+
+		// New colors take a free palette entry
+		if (index < 0) {
+			index = document->palette_length;
+			if (pixed_document_set_palette_color(document, index, color) != 0)
+				return -1;
+		}
+
+		pixed_document_modify_pixel(document, x, y);
+		document->indices[(size_t)y * document->width + x] = index;
+		return 0;
+	}
+
+	uint32_t index = (y / PIXED_TILE_SIZE) * document->tiles_x + (x / PIXED_TILE_SIZE);
+	uint32_t *tile = document->tiles[index];
+
+	// Clearing an untouched pixel doesn't need a tile of its own
+	if (tile == pixed_empty_tile && color == 0)
+		return 0;
+
+	pixed_document_modify_pixel(document, x, y);
+
+	// Tiles shared with other frames are copied before the first write
+	if (document->pooled && document->pooled[index]) {
+		tile = pixed_document_unshare_tile(document, index);
+		if (!tile)
+			return -1;
+	}
+
+	if (tile == pixed_empty_tile) {
+		tile = pixed_document_alloc_tile(document, index);
+		if (!tile)
+			return -1;
+	}
+
+	tile[(y % PIXED_TILE_SIZE) * PIXED_TILE_SIZE + (x % PIXED_TILE_SIZE)] = pixed_canvas_color(color);
+	return 0;
+}
+
+/*
+ * Fills tile with a view of the tile at tile_x, tile_y. Flat documents hand
+ * out views into the canvas, tiled ones allocate the tile when writable is set.
+ */
+int
+pixed_document_get_tile(PixedDocument *document, uint32_t tile_x, uint32_t tile_y, int writable, PixedTile *tile)
+{
+	if (tile_x >= document->tiles_x || tile_y >= document->tiles_y || document->storage == PIXED_STORAGE_INDEXED)
+		return -1;
+
+	tile->x = tile_x * PIXED_TILE_SIZE;
+	tile->y = tile_y * PIXED_TILE_SIZE;
+	tile->width = document->width - tile->x < PIXED_TILE_SIZE ? document->width - tile->x : PIXED_TILE_SIZE;
+	tile->height = document->height - tile->y < PIXED_TILE_SIZE ? document->height - tile->y : PIXED_TILE_SIZE;
+
+	// Writable tiles are assumed to be written to
+	if (writable)
+		pixed_document_modify(document, tile->x, tile->y, tile->width, tile->height);
+
+	if (document->storage == PIXED_STORAGE_FLAT) {
+		tile->stride = document->width;
+		tile->pixels = document->canvas + (size_t)tile->y * document->width + tile->x;
+		tile->empty = 0;
+		return 0;
+	}
+
+	uint32_t index = tile_y * document->tiles_x + tile_x;
+
+	tile->stride = PIXED_TILE_SIZE;
+	tile->pixels = document->tiles[index];
+	tile->empty = tile->pixels == pixed_empty_tile;
+
+	if (writable && document->pooled && document->pooled[index]) {
+		tile->pixels = pixed_document_unshare_tile(document, index);
+		if (!tile->pixels)
+			return -1;
+	}
+
+	if (writable && tile->empty) {
+		tile->pixels = pixed_document_alloc_tile(document, index);
+		if (!tile->pixels)
+			return -1;
+
+		tile->empty = 0;
+	}
+
+	return 0;
+}
+
+void
+pixed_tile_iterator_init(PixedTileIterator *it, PixedDocument *document, int skip_empty)
+{
+	it->document = document;
+	it->next = 0;
+	it->skip_empty = skip_empty;
+}
+
+/* Returns the next tile in row major order, 0 when all tiles are visited */
+PixedTile *
+pixed_tile_iterator_next(PixedTileIterator *it)
+{
+	PixedDocument *document = it->document;
+	uint32_t tiles_length = document->tiles_x * document->tiles_y;
+
+	while (it->next < tiles_length) {
+		uint32_t index = it->next++;
+
+		if (pixed_document_get_tile(document, index % document->tiles_x, index / document->tiles_x, 0, &it->tile) != 0)
+			return 0;
+
+		if (!(it->skip_empty && it->tile.empty))
+			return &it->tile;
+	}
+
+	return 0;
+}
+
+static
+uint32_t *
+pixed_document_alloc_tile(PixedDocument *document, uint32_t index)
+{
+	uint32_t *tile = calloc(PIXED_TILE_PIXELS, sizeof(uint32_t));
+	if (!tile)
+		return 0;
+
+	document->tiles[index] = tile;
+	return tile;
+}
+
+/* Gives the tile at index back to the shared empty tile */
+void
+pixed_document_clear_tile(PixedDocument *document, uint32_t index)
+{
+	if (document->pooled && document->pooled[index]) {
+		pixed_tile_pool_release(document->pool, document->tiles[index]);
+		document->pooled[index] = 0;
+	} else if (document->tiles[index] != pixed_empty_tile) {
+		free(document->tiles[index]);
+	}
+
+	document->tiles[index] = pixed_empty_tile;
+}
+
+/* Swaps the pooled tile at index for a private copy the document can write to */
+uint32_t *
+pixed_document_unshare_tile(PixedDocument *document, uint32_t index)
+{
+	uint32_t *tile = malloc(sizeof(uint32_t) * PIXED_TILE_PIXELS);
+	if (!tile)
+		return 0;
+
+	memcpy(tile, document->tiles[index], sizeof(uint32_t) * PIXED_TILE_PIXELS);
+	pixed_tile_pool_release(document->pool, document->tiles[index]);
+
+	document->tiles[index] = tile;
+	document->pooled[index] = 0;
+	return tile;
+}
+
+/* Expands one band of rows at a time into a staging buffer and writes it out */
+static
+int
+pixed_document_write_banded(PixedDocument *document, int fd)
+{
+	uint32_t *band = malloc(sizeof(uint32_t) * (size_t)document->width * PIXED_TILE_SIZE);
+	if (!band)
+		return -1;
+
+	uint32_t y = 0;
+	for (; y < document->height; y += PIXED_TILE_SIZE) {
+		uint32_t rows = PIXED_MIN(PIXED_TILE_SIZE, document->height - y);
+		pixed_document_copy_rows(document, y, rows, band);
+
+		struct iovec iov;
+		iov.iov_base = band;
+		iov.iov_len = sizeof(uint32_t) * (size_t)document->width * rows;
+
+		if (write_vector(fd, &iov, 1) != 0) {
+			free(band);
+			return -1;
+		}
+	}
+
+	free(band);
+	return 0;
+}
+
+/* Copies rows [y, y + rows) into dst in canvas order, whatever the storage */
+void
+pixed_document_copy_rows(PixedDocument *document, uint32_t y, uint32_t rows, uint32_t *dst)
+{
+	if (document->storage == PIXED_STORAGE_FLAT) {
+		memcpy(dst, document->canvas + (size_t)y * document->width, sizeof(uint32_t) * (size_t)document->width * rows);
+		return;
+	}
+
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		const uint8_t *indices = document->indices + (size_t)y * document->width;
+		size_t i = 0, length = (size_t)document->width * rows;
+
+		for (; i < length; i++)
+			dst[i] = document->palette[indices[i]];
+
+		return;
+	}
+
+	uint32_t row = y, tx = 0;
+	for (; row < y + rows; row++) {
+		uint32_t *line = dst + (size_t)(row - y) * document->width;
+
+		for (tx = 0; tx < document->tiles_x; tx++) {
+			uint32_t *tile = document->tiles[(row / PIXED_TILE_SIZE) * document->tiles_x + tx];
+			uint32_t x = tx * PIXED_TILE_SIZE;
+
+			memcpy(line + x, tile + (row % PIXED_TILE_SIZE) * PIXED_TILE_SIZE,
+				sizeof(uint32_t) * PIXED_MIN(PIXED_TILE_SIZE, document->width - x));
+		}
+	}
+}
+
 int read_uint32_big_endian(FILE *file, uint32_t *value)
 {
-	char buf[4];
+	unsigned char buf[4];
 
 	if (fread(buf, 1, 4, file) < 4)
 		return -1;
 
-	*value = (buf[0] << 24) + (buf[1] << 16) + (buf[2] << 8) + buf[3];
+	*value = parse_uint32_big_endian(buf);
 	return 0;
 }
 
-int write_uint32_big_endian(FILE * file, uint32_t number)
+uint32_t parse_uint32_big_endian(const unsigned char *bytes)
 {
-	char bytes[4];
+	return ((uint32_t)bytes[0] << 24) + ((uint32_t)bytes[1] << 16) + ((uint32_t)bytes[2] << 8) + bytes[3];
+}
 
+void store_uint32_big_endian(unsigned char *bytes, uint32_t number)
+{
 	bytes[0] = number >> 24;
 	bytes[1] = number >> 16;
 	bytes[2] = number >> 8;
 	bytes[3] = number;
+}
+
+/*
+ * Writes every vector completely, few large writev calls instead of one per
+ * pixel. Calls are capped at PIXED_WRITE_CHUNK since some kernels reject
+ * vectors larger than INT_MAX.
+ */
+int write_vector(int fd, struct iovec *iov, int count)
+{
+	struct iovec batch[PIXED_WRITE_MAX_IOV];
+
+	// Skip empty vectors up front
+	while (count > 0 && iov->iov_len == 0) {
+		iov++;
+		count--;
+	}
+
+	while (count > 0) {
+		size_t total = 0;
+		int used = 0;
+
+		for (; used < count && used < PIXED_WRITE_MAX_IOV && total < PIXED_WRITE_CHUNK; used++) {
+			batch[used] = iov[used];
+			if (batch[used].iov_len > PIXED_WRITE_CHUNK - total)
+				batch[used].iov_len = PIXED_WRITE_CHUNK - total;
+
+			total += batch[used].iov_len;
+		}
+
+		ssize_t written = writev(fd, batch, used);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (unsigned char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Opens a file next to file_name to write it in place of. Documents mapped
+ * from file_name keep reading the old file until finish_replacement renames
+ * the new one over it. Returns -1 on failure.
+ */
+int open_replacement(const char *file_name, char **temp_name)
+{
+	size_t length = strlen(file_name) + 32;
+	*temp_name = malloc(length);
+	if (!*temp_name)
+		return -1;
+
+	snprintf(*temp_name, length, "%s.%ld.tmp", file_name, (long)getpid());
+
+	// Files that exist keep their permissions
+	struct stat file_stat;
+	int fd = open(*temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0 && stat(file_name, &file_stat) == 0)
+		fchmod(fd, file_stat.st_mode & 07777);
+
+	if (fd < 0) {
+		free(*temp_name);
+		*temp_name = 0;
+	}
+
+	return fd;
+}
+
+/* Closes fd and renames it over file_name when result is 0, removes it otherwise */
+int finish_replacement(int fd, char *temp_name, const char *file_name, int result)
+{
+	if (close(fd) != 0)
+		result = -1;
+
+	if (result == 0 && rename(temp_name, file_name) != 0)
+		result = -1;
+
+	if (result != 0)
+		unlink(temp_name);
 
-	return fwrite(bytes, sizeof(char), 4, file);
+	free(temp_name);
+	return result;
 }
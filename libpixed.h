@@ -1,26 +1,343 @@
+#ifndef LIBPIXED_H
+#define LIBPIXED_H
+
+#include <stddef.h>
 #include <stdint.h>
 
 /* PiXD */
 #define PIXED_HEADER_MAGIC "PiXd" 
+#define PIXED_HEADER_SIZE  12 // magic, width, height
+
+/* Tiled storage */
+#define PIXED_TILE_SIZE    64
+#define PIXED_TILE_PIXELS  (PIXED_TILE_SIZE * PIXED_TILE_SIZE)
+
+/* Indexed color */
+#define PIXED_PALETTE_MAX  256
+
+typedef enum {
+	PIXED_STORAGE_FLAT,   // one width * height canvas
+	PIXED_STORAGE_TILED,  // PIXED_TILE_SIZE square tiles, allocated on first write
+	PIXED_STORAGE_INDEXED // one byte palette index per pixel
+} PixedStorage;
+
+/* Resizing */
+typedef enum {
+	PIXED_ANCHOR_TOP_LEFT,
+	PIXED_ANCHOR_TOP,
+	PIXED_ANCHOR_TOP_RIGHT,
+	PIXED_ANCHOR_LEFT,
+	PIXED_ANCHOR_CENTER,
+	PIXED_ANCHOR_RIGHT,
+	PIXED_ANCHOR_BOTTOM_LEFT,
+	PIXED_ANCHOR_BOTTOM,
+	PIXED_ANCHOR_BOTTOM_RIGHT
+} PixedAnchor;
+
+typedef enum {
+	PIXED_SCALE_NEAREST,  // exact pixel replication, the one for pixel art
+	PIXED_SCALE_BOX,      // area average, for downscaled thumbnails
+	PIXED_SCALE_BILINEAR
+} PixedScaleFilter;
+
+/* Color quantization, see libpixed_quantize.c */
+typedef enum {
+	PIXED_QUANTIZE_MEDIAN_CUT, // splits the box of colors with the most error at its median
+	PIXED_QUANTIZE_KMEANS      // median cut refined by rounds of k-means
+} PixedQuantizeMethod;
+
+typedef enum {
+	PIXED_DITHER_NONE,
+	PIXED_DITHER_ORDERED,        // 4x4 Bayer matrix, rows stay independent
+	PIXED_DITHER_FLOYD_STEINBERG // error diffusion, one row after the other
+} PixedDither;
+
+/* Blitting, see libpixed_blit.c */
+typedef enum {
+	PIXED_BLIT_COPY, // source pixels replace the destination ones
+	PIXED_BLIT_OVER  // straight alpha source over the destination
+} PixedBlitMode;
+
+/* Layers */
+typedef enum {
+	PIXED_BLEND_NORMAL,
+	PIXED_BLEND_MULTIPLY,
+	PIXED_BLEND_ADD,
+	PIXED_BLEND_SCREEN
+} PixedBlendMode;
+
+typedef struct PixedHistory  PixedHistory; // undo and redo of a document, see pixed_history_new
+typedef struct PixedLayer    PixedLayer;
+typedef struct PixedTilePool PixedTilePool; // content hashed tiles shared between documents, see libpixed_frames.c
+typedef struct PixedColorIndex PixedColorIndex; // pixels of every color of a document, see libpixed_colors.c
+
+/* Arenas and pools, see libpixed_arena.c */
+typedef struct PixedArenaBlock PixedArenaBlock;
+
+typedef struct
+{
+	PixedArenaBlock *blocks;     // newest first, allocations come from the newest
+	size_t           block_size; // smallest block taken from the heap
+	size_t           used;       // bytes handed out of the newest block
+} PixedArena; // everything allocated is given back at once by reset or free
+
+typedef struct
+{
+	PixedArenaBlock *blocks;
+	void            *released; // free list, linked through the first bytes of the elements
+	size_t           element_size;
+	size_t           per_block;
+} PixedPool; // fixed size elements, released ones are reused before a new block is taken
+
+typedef struct
+{
+	uint64_t heap_allocations; // blocks arenas and pools took from the heap
+	uint64_t heap_frees;
+	uint64_t heap_bytes;       // held by arenas and pools right now
+	uint64_t arena_allocations;
+	uint64_t pool_allocations;
+} PixedAllocStats;
 
 typedef struct
 {
+	PixedArena arena; // holds the document itself and its name
 	char *name;
 	uint32_t width, height;
-	uint32_t *canvas; // 8-bit rgba
+	uint32_t *canvas; // 8-bit rgba, kept in file (R, G, B, A byte) order
+
+	void     *mapping; // file mapping backing canvas, 0 when canvas is malloc'd
+	size_t    mapping_length;
+
+	PixedStorage storage;
+	uint32_t   **tiles; // tiles_x * tiles_y, untouched ones share the empty tile
+	uint32_t     tiles_x, tiles_y;
+
+	PixedTilePool *pool;   // tiled documents of an animation share identical tiles through it
+	uint8_t       *pooled; // tiles_x * tiles_y, set where the tile belongs to pool and is copied on write
+
+	uint8_t     *indices; // width * height palette indices
+	uint32_t     palette[PIXED_PALETTE_MAX]; // canvas order
+	uint32_t     palette_length;
+
+	uint32_t     dirty_x0, dirty_y0; // pixels changed since the last take_dirty,
+	uint32_t     dirty_x1, dirty_y1; // exclusive, clean when dirty_x0 >= dirty_x1
+
+	PixedHistory *history; // keeps pixels before they change, 0 without undo
+	PixedColorIndex *colors; // counts of every color, 0 without
+
+	PixedLayer  *layers;   // bottom first, canvas holds their composite. 0 for one canvas documents
+	uint32_t     layers_length;
 } PixedDocument;
 
+struct PixedLayer
+{
+	PixedDocument *pixels;  // same size as the document, any storage, written to instead of the canvas
+	uint8_t        opacity;
+	int            visible;
+	PixedBlendMode blend;
+};
+
+typedef struct
+{
+	PixedDocument *pixels;   // tiled, sharing tiles with the other frames
+	uint32_t       duration; // milliseconds
+} PixedFrame;
+
+typedef struct
+{
+	char          *name;
+	uint32_t       width, height;
+	PixedFrame    *frames;
+	uint32_t       frames_length;
+	PixedTilePool *pool;
+} PixedAnimation;
+
+typedef struct
+{
+	uint32_t x, y;
+	uint32_t width, height;
+} PixedRect;
+
+typedef struct
+{
+	uint8_t r[256], g[256], b[256], a[256];
+} PixedColorLut; // new value of every channel value, levels and curves, see pixed_document_apply_lut
+
+typedef struct
+{
+	uint32_t  x, y;          // top left pixel
+	uint32_t  width, height; // clipped against document bounds
+	uint32_t  stride;        // pixels between two rows
+	uint32_t *pixels;        // canvas order, read only while empty is set
+	int       empty;
+} PixedTile; // not available for indexed documents
+
+typedef struct
+{
+	void  *seeds;
+	size_t length, capacity;
+} PixedFillStack; // work stack of pixed_document_flood_fill
+
+typedef struct
+{
+	PixedDocument *document;
+	uint32_t       next;
+	int            skip_empty;
+	PixedTile      tile;
+} PixedTileIterator;
+
 PixedDocument * pixed_document_new(const char *, uint32_t, uint32_t);
 void            pixed_document_free(PixedDocument *);
 PixedDocument * pixed_document_read_file(const char *);
+PixedDocument * pixed_document_map_file(const char *);
+PixedDocument * pixed_document_read_region(const char *, uint32_t, uint32_t);
 int             pixed_document_write_file(PixedDocument *, char *);
-int             pixed_document_resize(PixedDocument *, int, int);
+int             pixed_document_write_file_compressed(PixedDocument *, char *);
+int             pixed_document_resize(PixedDocument *, int, int, PixedAnchor);
+int             pixed_document_scale(PixedDocument *, int, int, PixedScaleFilter);
+int             pixed_document_crop(PixedDocument *, uint32_t, uint32_t, uint32_t, uint32_t);
+
+PixedDocument * pixed_document_read_png(const char *);
+int             pixed_document_write_png(PixedDocument *, char *);
+PixedDocument * pixed_document_read_ppm(const char *);
+int             pixed_document_write_ppm(PixedDocument *, char *);
+
+int             pixed_thread_count(void);
+void            pixed_set_thread_count(int);
+
+PixedDocument * pixed_document_new_tiled(const char *, uint32_t, uint32_t);
+int             pixed_document_set_storage(PixedDocument *, PixedStorage);
+uint32_t        pixed_document_read_pixel(PixedDocument *, uint32_t, uint32_t);
+int             pixed_document_write_pixel(PixedDocument *, uint32_t, uint32_t, uint32_t);
+int             pixed_document_get_tile(PixedDocument *, uint32_t, uint32_t, int, PixedTile *);
+void            pixed_tile_iterator_init(PixedTileIterator *, PixedDocument *, int);
+PixedTile *     pixed_tile_iterator_next(PixedTileIterator *);
+
+PixedDocument * pixed_document_new_indexed(const char *, uint32_t, uint32_t);
+int             pixed_document_palette_index(PixedDocument *, uint32_t);
+int             pixed_document_set_palette_color(PixedDocument *, uint32_t, uint32_t);
+
+int             pixed_document_fill_span(PixedDocument *, int, int, int, uint32_t);
+int             pixed_document_draw_line(PixedDocument *, int, int, int, int, uint32_t, uint32_t, PixedRect *);
+int             pixed_document_flood_fill(PixedDocument *, uint32_t, uint32_t, uint32_t, PixedFillStack *, PixedRect *);
+int             pixed_document_replace_color(PixedDocument *, uint32_t, uint32_t);
+void            pixed_fill_stack_free(PixedFillStack *);
 
-#define         pixed_document_get_pixel(document, X, Y) ((document->canvas[((Y) * document->width) + X]))
-#define         pixed_document_set_pixel(document, X, Y, COLOR) (((document)->canvas[((Y) * (document)->width) + X]) = COLOR);
+void            pixed_color_lut_identity(PixedColorLut *);
+void            pixed_color_lut_levels(PixedColorLut *, uint8_t, uint8_t, float);
+int             pixed_document_apply_lut(PixedDocument *, const PixedRect *, const PixedColorLut *);
+int             pixed_document_adjust_hsl(PixedDocument *, const PixedRect *, float, float, float);
+int             pixed_document_remap_colors(PixedDocument *, const PixedRect *, const uint32_t *, const uint32_t *, uint32_t);
+int             pixed_document_map_palette(PixedDocument *, const PixedRect *, const uint32_t *, uint32_t, int);
+int             pixed_document_quantize_palette(PixedDocument *, const PixedRect *, PixedQuantizeMethod, uint32_t *, uint32_t);
+int             pixed_document_quantize(PixedDocument *, const PixedRect *, PixedQuantizeMethod, uint32_t, PixedDither);
+
+int             pixed_document_blit(PixedDocument *, int, int, PixedDocument *, const PixedRect *, const uint8_t *, PixedBlitMode);
+PixedDocument * pixed_document_copy_area(PixedDocument *, const PixedRect *, const uint8_t *);
+int             pixed_document_clear_area(PixedDocument *, const PixedRect *, const uint8_t *);
+
+void            pixed_document_mark_dirty(PixedDocument *, uint32_t, uint32_t, uint32_t, uint32_t);
+int             pixed_document_take_dirty(PixedDocument *, PixedRect *);
+
+int             pixed_document_add_layer(PixedDocument *);
+int             pixed_document_remove_layer(PixedDocument *, uint32_t);
+int             pixed_document_move_layer(PixedDocument *, uint32_t, uint32_t);
+int             pixed_document_set_layer(PixedDocument *, uint32_t, uint8_t, int, PixedBlendMode);
+int             pixed_document_composite(PixedDocument *);
+
+PixedAnimation *pixed_animation_new(const char *, uint32_t, uint32_t);
+void            pixed_animation_free(PixedAnimation *);
+int             pixed_animation_insert_frame(PixedAnimation *, uint32_t, PixedDocument *, uint32_t);
+int             pixed_animation_duplicate_frame(PixedAnimation *, uint32_t);
+int             pixed_animation_remove_frame(PixedAnimation *, uint32_t);
+int             pixed_animation_move_frame(PixedAnimation *, uint32_t, uint32_t);
+int             pixed_animation_share_tiles(PixedAnimation *);
+size_t          pixed_animation_size(PixedAnimation *);
+PixedAnimation *pixed_animation_read_file(const char *);
+int             pixed_animation_write_file(PixedAnimation *, char *);
+
+PixedHistory *  pixed_history_new(PixedDocument *, size_t);
+void            pixed_history_free(PixedHistory *);
+void            pixed_history_begin(PixedHistory *);
+void            pixed_history_end(PixedHistory *);
+int             pixed_history_undo(PixedHistory *);
+int             pixed_history_redo(PixedHistory *);
+void            pixed_history_clear(PixedHistory *);
+void            pixed_history_mark_saved(PixedHistory *);
+int             pixed_history_modified(PixedHistory *);
+size_t          pixed_history_size(PixedHistory *);
+void            pixed_history_capture(PixedHistory *, uint32_t, uint32_t, uint32_t, uint32_t);
+
+PixedColorIndex *pixed_color_index_new(PixedDocument *, int);
+void            pixed_color_index_free(PixedColorIndex *);
+void            pixed_color_index_capture(PixedColorIndex *, uint32_t, uint32_t, uint32_t, uint32_t);
+uint32_t        pixed_color_index_length(PixedColorIndex *);
+uint64_t        pixed_color_index_count(PixedColorIndex *, uint32_t);
+uint32_t        pixed_color_index_colors(PixedColorIndex *, uint32_t *, uint64_t *, uint32_t);
+int             pixed_color_index_tiles(PixedColorIndex *, uint32_t, uint8_t *);
+int             pixed_color_index_select(PixedColorIndex *, uint32_t, uint8_t *);
+
+void            pixed_arena_init(PixedArena *, size_t);
+void *          pixed_arena_alloc(PixedArena *, size_t);
+char *          pixed_arena_strdup(PixedArena *, const char *);
+void            pixed_arena_reset(PixedArena *);
+void            pixed_arena_free(PixedArena *);
+void            pixed_pool_init(PixedPool *, size_t, size_t);
+void *          pixed_pool_alloc(PixedPool *);
+void            pixed_pool_release(PixedPool *, void *);
+void            pixed_pool_free(PixedPool *);
+void            pixed_alloc_stats(PixedAllocStats *);
+
+/* Converts between a color value and its canvas (big endian) representation */
+static inline uint32_t
+pixed_canvas_color(uint32_t color)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return color;
+#else
+	return (color >> 24) | ((color >> 8) & 0x0000ff00) | ((color << 8) & 0x00ff0000) | (color << 24);
+#endif
+}
+
+/* Grows the dirty rectangle of document by one pixel */
+static inline void
+pixed_document_mark_pixel(PixedDocument *document, uint32_t x, uint32_t y)
+{
+	if (document->dirty_x0 >= document->dirty_x1) {
+		document->dirty_x0 = x;
+		document->dirty_y0 = y;
+		document->dirty_x1 = x + 1;
+		document->dirty_y1 = y + 1;
+		return;
+	}
+
+	if (x < document->dirty_x0) document->dirty_x0 = x;
+	if (y < document->dirty_y0) document->dirty_y0 = y;
+	if (x >= document->dirty_x1) document->dirty_x1 = x + 1;
+	if (y >= document->dirty_y1) document->dirty_y1 = y + 1;
+}
+
+/* Called before the pixel at x, y changes, keeps it for undo and marks it dirty */
+static inline void
+pixed_document_modify_pixel(PixedDocument *document, uint32_t x, uint32_t y)
+{
+	if (document->history)
+		pixed_history_capture(document->history, x, y, 1, 1);
+
+	if (document->colors)
+		pixed_color_index_capture(document->colors, x, y, 1, 1);
+
+	pixed_document_mark_pixel(document, x, y);
+}
+
+/* Direct canvas access, only valid for PIXED_STORAGE_FLAT documents */
+#define         pixed_document_get_pixel(document, X, Y) (pixed_canvas_color(document->canvas[((Y) * document->width) + X]))
+#define         pixed_document_set_pixel(document, X, Y, COLOR) (pixed_document_modify_pixel((document), (X), (Y)), ((document)->canvas[((Y) * (document)->width) + X]) = pixed_canvas_color(COLOR));
 #define         pixed_color_rgba(R, G, B, A) ((R << 24) + (G << 16) + (B << 8) + A)
 #define         pixed_color_rgb(R, G, B) (pixed_color_rgba(R, G, B, 0xFF)
 #define         pixed_color_r(COLOR) ((COLOR) >> 24)
 #define         pixed_color_g(COLOR) (((COLOR) >> 16) & 0x000000ff)
 #define         pixed_color_b(COLOR) ((COLOR >> 8) & 0x000000ff)
 #define         pixed_color_a(COLOR) ((COLOR) & 0x000000ff)
+
+#endif
@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * Arenas hand out memory by bumping an offset into blocks taken from the heap
+ * and give all of it back at once, pools keep fixed size elements on a free
+ * list. Both only call malloc when they run out, so a loop that resets its
+ * arena and releases what it took from its pools stops touching the heap
+ * once it saw its largest iteration.
+ */
+
+struct PixedArenaBlock {
+	PixedArenaBlock *next;
+	size_t           size; // usable bytes after the header
+};
+
+#define ARENA_ALIGN        16
+#define ARENA_HEADER       ((sizeof(PixedArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_BLOCK_SIZE   4096 // when init is given 0
+#define POOL_PER_BLOCK     16   // when init is given 0
+
+#define stats_add(FIELD, N) __atomic_add_fetch(&alloc_stats.FIELD, (N), __ATOMIC_RELAXED)
+#define stats_load(FIELD)   __atomic_load_n(&alloc_stats.FIELD, __ATOMIC_RELAXED)
+
+static PixedArenaBlock *arena_block_new(size_t);
+static void             arena_block_free(PixedArenaBlock *);
+
+static PixedAllocStats alloc_stats;
+
+void
+pixed_arena_init(PixedArena *arena, size_t block_size)
+{
+	arena->blocks = 0;
+	arena->block_size = block_size > 0 ? block_size : ARENA_BLOCK_SIZE;
+	arena->used = 0;
+}
+
+/* Returns size bytes aligned to 16, valid until the next reset or free */
+void *
+pixed_arena_alloc(PixedArena *arena, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	stats_add(arena_allocations, 1);
+
+	if (!arena->blocks || arena->blocks->size - arena->used < size) {
+		PixedArenaBlock *block = arena_block_new(PIXED_MAX(arena->block_size, size));
+		if (!block)
+			return 0;
+
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->used = 0;
+	}
+
+	unsigned char *memory = (unsigned char *)arena->blocks + ARENA_HEADER + arena->used;
+	arena->used += size;
+	return memory;
+}
+
+char *
+pixed_arena_strdup(PixedArena *arena, const char *string)
+{
+	size_t length = strlen(string) + 1;
+
+	char *copy = pixed_arena_alloc(arena, length);
+	if (copy)
+		memcpy(copy, string, length);
+
+	return copy;
+}
+
+/*
+ * Forgets every allocation. An arena that outgrew its first block trades its
+ * blocks for one as large as all of them, the next round fits in it.
+ */
+void
+pixed_arena_reset(PixedArena *arena)
+{
+	arena->used = 0;
+
+	if (!arena->blocks || !arena->blocks->next)
+		return;
+
+	size_t size = 0;
+	while (arena->blocks) {
+		PixedArenaBlock *next = arena->blocks->next;
+		size += arena->blocks->size;
+		arena_block_free(arena->blocks);
+		arena->blocks = next;
+	}
+
+	arena->blocks = arena_block_new(size);
+	if (arena->blocks)
+		arena->blocks->next = 0;
+}
+
+void
+pixed_arena_free(PixedArena *arena)
+{
+	while (arena->blocks) {
+		PixedArenaBlock *next = arena->blocks->next;
+		arena_block_free(arena->blocks);
+		arena->blocks = next;
+	}
+
+	arena->used = 0;
+}
+
+/* Elements are at least a pointer large and aligned to 16, per_block of them come in one heap block */
+void
+pixed_pool_init(PixedPool *pool, size_t element_size, size_t per_block)
+{
+	element_size = PIXED_MAX(element_size, sizeof(void *));
+
+	pool->blocks = 0;
+	pool->released = 0;
+	pool->element_size = (element_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	pool->per_block = per_block > 0 ? per_block : POOL_PER_BLOCK;
+}
+
+void *
+pixed_pool_alloc(PixedPool *pool)
+{
+	stats_add(pool_allocations, 1);
+
+	if (!pool->released) {
+		PixedArenaBlock *block = arena_block_new(pool->element_size * pool->per_block);
+		if (!block)
+			return 0;
+
+		block->next = pool->blocks;
+		pool->blocks = block;
+
+		// Thread the new elements onto the free list, first one on top
+		unsigned char *elements = (unsigned char *)block + ARENA_HEADER;
+		size_t i = pool->per_block;
+		while (i-- > 0) {
+			void **element = (void **)(elements + pool->element_size * i);
+			*element = pool->released;
+			pool->released = element;
+		}
+	}
+
+	void **element = pool->released;
+	pool->released = *element;
+	return element;
+}
+
+/* Hands element back for the next pixed_pool_alloc, 0 is ignored */
+void
+pixed_pool_release(PixedPool *pool, void *element)
+{
+	if (!element)
+		return;
+
+	*(void **)element = pool->released;
+	pool->released = element;
+}
+
+/* Frees every element, released or not */
+void
+pixed_pool_free(PixedPool *pool)
+{
+	PixedArenaBlock *block = pool->blocks;
+	while (block) {
+		PixedArenaBlock *next = block->next;
+		arena_block_free(block);
+		block = next;
+	}
+
+	pool->blocks = 0;
+	pool->released = 0;
+}
+
+/* Counters of every arena and pool of the process since it started */
+void
+pixed_alloc_stats(PixedAllocStats *stats)
+{
+	stats->heap_allocations = stats_load(heap_allocations);
+	stats->heap_frees = stats_load(heap_frees);
+	stats->heap_bytes = stats_load(heap_bytes);
+	stats->arena_allocations = stats_load(arena_allocations);
+	stats->pool_allocations = stats_load(pool_allocations);
+}
+
+static
+PixedArenaBlock *
+arena_block_new(size_t size)
+{
+	PixedArenaBlock *block = malloc(ARENA_HEADER + size);
+	if (!block)
+		return 0;
+
+	block->next = 0;
+	block->size = size;
+
+	stats_add(heap_allocations, 1);
+	stats_add(heap_bytes, ARENA_HEADER + size);
+	return block;
+}
+
+static
+void
+arena_block_free(PixedArenaBlock *block)
+{
+	stats_add(heap_frees, 1);
+	stats_add(heap_bytes, -(uint64_t)(ARENA_HEADER + block->size));
+	free(block);
+}
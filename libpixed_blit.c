@@ -0,0 +1,495 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * Blits copy a rectangle of one document to another one, or to another place
+ * of the same document. The destination is walked one tile at a time, the
+ * whole clipped rectangle for flat documents, and every row is a memcpy or a
+ * straight alpha over that only does arithmetic for translucent pixels.
+ *
+ * Moves inside one document visit tiles and rows starting from the side the
+ * rectangle moves towards, so no source row is written before it is read.
+ * Rows moving sideways onto themselves are copied out first.
+ */
+
+typedef struct {
+	PixedDocument *dst;
+	PixedDocument *src;      // 0 blits transparent pixels
+	int64_t        offset_x; // destination minus source position
+	int64_t        offset_y;
+	const uint8_t *mask;     // nonzero where the source pixel is blitted, 0 for all of them
+	uint32_t       mask_x, mask_y, mask_stride;
+	PixedBlitMode  mode;
+	int            backwards_x, backwards_y; // visit order of overlapping moves
+	int            staged;   // source rows are gathered into row first
+	uint32_t      *row;
+	PixedRect      rect;     // destination, clipped against both documents
+} PixedBlit;
+
+static int             blit_run(PixedBlit *, const PixedRect *);
+static int             blit_tiles(PixedBlit *, const PixedRect *);
+static void            blit_bands(void *, uint32_t, uint32_t);
+static int             blit_indexed(PixedBlit *, const PixedRect *);
+static void            blit_line(PixedBlit *, uint32_t *, uint32_t, uint32_t, uint32_t);
+static const uint32_t *blit_source(PixedDocument *, uint32_t, uint32_t, uint32_t *);
+static void            blit_gather(PixedDocument *, uint32_t, uint32_t, uint32_t, uint32_t *);
+static void            blit_row(uint32_t *, const uint32_t *, const uint8_t *, uint32_t, PixedBlitMode);
+static void            over_row(uint32_t *, const uint32_t *, uint32_t);
+static void            over_pixel(unsigned char *, const unsigned char *);
+
+static const uint32_t blit_zeros[PIXED_TILE_SIZE];
+
+/*
+ * Blits area of src (all of it when 0) to x, y of dst, where it may hang over
+ * any edge. dst may be src itself, overlapping moves come out right. mask, one
+ * byte per pixel of area, limits the blit to pixels with a nonzero byte.
+ * Returns -1 when memory, or the palette of an indexed dst, ran out.
+ */
+int
+pixed_document_blit(PixedDocument *dst, int x, int y, PixedDocument *src, const PixedRect *area, const uint8_t *mask, PixedBlitMode mode)
+{
+	PixedRect clipped, rect;
+	if (!pixed_document_clip_area(src, area, &clipped))
+		return 0;
+
+	int64_t x0 = PIXED_MAX(x, 0), y0 = PIXED_MAX(y, 0);
+	int64_t x1 = PIXED_MIN((int64_t)x + clipped.width, (int64_t)dst->width);
+	int64_t y1 = PIXED_MIN((int64_t)y + clipped.height, (int64_t)dst->height);
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+
+	rect.x = (uint32_t)x0;
+	rect.y = (uint32_t)y0;
+	rect.width = (uint32_t)(x1 - x0);
+	rect.height = (uint32_t)(y1 - y0);
+
+	PixedBlit blit;
+	blit.dst = dst;
+	blit.src = src;
+	blit.offset_x = (int64_t)x - clipped.x;
+	blit.offset_y = (int64_t)y - clipped.y;
+	blit.mask = mask;
+	blit.mask_x = clipped.x;
+	blit.mask_y = clipped.y;
+	blit.mask_stride = area ? area->width : src->width;
+	blit.mode = mode;
+
+	return blit_run(&blit, &rect);
+}
+
+/* New flat document holding area of document, pixels left out by mask are transparent */
+PixedDocument *
+pixed_document_copy_area(PixedDocument *document, const PixedRect *area, const uint8_t *mask)
+{
+	PixedRect clipped;
+	if (!pixed_document_clip_area(document, area, &clipped))
+		return 0;
+
+	PixedDocument *copy = pixed_document_new(document->name, clipped.width, clipped.height);
+	if (!copy)
+		return 0;
+
+	if (pixed_document_blit(copy, 0, 0, document, area, mask, PIXED_BLIT_COPY) != 0) {
+		pixed_document_free(copy);
+		return 0;
+	}
+
+	return copy;
+}
+
+/* Makes the pixels of area selected by mask (all of them when 0) transparent */
+int
+pixed_document_clear_area(PixedDocument *document, const PixedRect *area, const uint8_t *mask)
+{
+	PixedRect clipped;
+	if (!pixed_document_clip_area(document, area, &clipped))
+		return 0;
+
+	PixedBlit blit;
+	blit.dst = document;
+	blit.src = 0;
+	blit.offset_x = 0;
+	blit.offset_y = 0;
+	blit.mask = mask;
+	blit.mask_x = clipped.x;
+	blit.mask_y = clipped.y;
+	blit.mask_stride = area ? area->width : document->width;
+	blit.mode = PIXED_BLIT_COPY;
+
+	return blit_run(&blit, &clipped);
+}
+
+/* Blits to rect, already clipped against both documents */
+static
+int
+blit_run(PixedBlit *blit, const PixedRect *rect)
+{
+	int same = blit->src == blit->dst;
+
+	blit->backwards_x = same && blit->offset_x > 0;
+	blit->backwards_y = same && blit->offset_y > 0;
+	blit->staged = blit->src && (blit->src->storage == PIXED_STORAGE_INDEXED || (same && blit->offset_y == 0));
+	blit->row = 0;
+
+	if (blit->staged) {
+		blit->row = malloc(sizeof(uint32_t) * rect->width);
+		if (!blit->row)
+			return -1;
+	}
+
+	int result = blit->dst->storage == PIXED_STORAGE_INDEXED ? blit_indexed(blit, rect) : blit_tiles(blit, rect);
+
+	free(blit->row);
+	return result;
+}
+
+/*
+ * Makes every destination tile writable first, which keeps them for undo and
+ * is not thread safe, then blits bands of tile rows (pixel rows of flat
+ * documents) on every core unless the order of the rows matters.
+ */
+static
+int
+blit_tiles(PixedBlit *blit, const PixedRect *rect)
+{
+	PixedDocument *dst = blit->dst;
+	uint32_t tx = 0, ty = 0, bands = rect->height, band_pixels = rect->width;
+	PixedTile tile;
+
+	if (dst->storage == PIXED_STORAGE_FLAT) {
+		pixed_document_modify(dst, rect->x, rect->y, rect->width, rect->height);
+	} else {
+		for (ty = rect->y / PIXED_TILE_SIZE; ty <= (rect->y + rect->height - 1) / PIXED_TILE_SIZE; ty++) {
+			for (tx = rect->x / PIXED_TILE_SIZE; tx <= (rect->x + rect->width - 1) / PIXED_TILE_SIZE; tx++) {
+				if (pixed_document_get_tile(dst, tx, ty, 1, &tile) != 0)
+					return -1;
+			}
+		}
+
+		bands = (rect->y + rect->height - 1) / PIXED_TILE_SIZE - rect->y / PIXED_TILE_SIZE + 1;
+		band_pixels = rect->width * PIXED_TILE_SIZE;
+	}
+
+	blit->rect = *rect;
+
+	if (blit->staged || blit->src == blit->dst)
+		blit_bands(blit, 0, bands);
+	else
+		pixed_parallel_rows(bands, band_pixels, blit_bands, blit);
+
+	return 0;
+}
+
+/* Bands [begin, end) of blit_tiles, visited from the end when blit->backwards_y is set */
+static
+void
+blit_bands(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedBlit *blit = ctx;
+	PixedDocument *dst = blit->dst;
+	const PixedRect *rect = &blit->rect;
+	uint32_t i = 0, j = 0, k = 0;
+	PixedTile tile;
+
+	int flat = dst->storage == PIXED_STORAGE_FLAT;
+	uint32_t band = flat ? 1 : PIXED_TILE_SIZE, column = flat ? dst->width : PIXED_TILE_SIZE;
+	uint32_t first_band = rect->y / band, first_column = rect->x / column;
+	uint32_t columns = (rect->x + rect->width - 1) / column - first_column + 1;
+
+	if (flat) {
+		tile.x = 0;
+		tile.y = 0;
+		tile.width = dst->width;
+		tile.height = dst->height;
+		tile.stride = dst->width;
+		tile.pixels = dst->canvas;
+	}
+
+	// Row by row across the band, so the source is read in long runs
+	for (j = begin; j < end; j++) {
+		uint32_t by = first_band + (blit->backwards_y ? end - 1 - (j - begin) : j);
+		uint32_t y0 = PIXED_MAX(rect->y, by * band), y1 = PIXED_MIN(rect->y + rect->height, by * band + band);
+
+		for (k = 0; k < y1 - y0; k++) {
+			uint32_t y = blit->backwards_y ? y1 - 1 - k : y0 + k;
+
+			for (i = 0; i < columns; i++) {
+				uint32_t bx = first_column + (blit->backwards_x ? columns - 1 - i : i);
+
+				// Already made writable, this only looks the tile up
+				if (!flat)
+					pixed_document_get_tile(dst, bx, by, 0, &tile);
+
+				uint32_t x0 = PIXED_MAX(rect->x, tile.x), x1 = PIXED_MIN(rect->x + rect->width, tile.x + tile.width);
+				blit_line(blit, tile.pixels + (size_t)(y - tile.y) * tile.stride + (x0 - tile.x), x0, y, x1 - x0);
+			}
+		}
+	}
+}
+
+/* Indexed destinations blend a row of colors and write back the pixels that changed */
+static
+int
+blit_indexed(PixedBlit *blit, const PixedRect *rect)
+{
+	PixedDocument *dst = blit->dst;
+	uint32_t i = 0, k = 0;
+
+	uint32_t *row = malloc(sizeof(uint32_t) * rect->width);
+	if (!row)
+		return -1;
+
+	for (k = 0; k < rect->height; k++) {
+		uint32_t y = blit->backwards_y ? rect->y + rect->height - 1 - k : rect->y + k;
+		const uint8_t *indices = dst->indices + (size_t)y * dst->width + rect->x;
+
+		blit_gather(dst, rect->x, y, rect->width, row);
+		blit_line(blit, row, rect->x, y, rect->width);
+
+		for (i = 0; i < rect->width; i++) {
+			if (row[i] == dst->palette[indices[i]])
+				continue;
+
+			if (pixed_document_write_pixel(dst, rect->x + i, y, pixed_canvas_color(row[i])) != 0) {
+				free(row);
+				return -1;
+			}
+		}
+	}
+
+	free(row);
+	return 0;
+}
+
+/* Blits the source of length pixels at x, y of the destination to out */
+static
+void
+blit_line(PixedBlit *blit, uint32_t *out, uint32_t x, uint32_t y, uint32_t length)
+{
+	uint32_t sx = (uint32_t)(x - blit->offset_x), sy = (uint32_t)(y - blit->offset_y);
+	const uint8_t *mask = 0;
+
+	if (blit->mask)
+		mask = blit->mask + (size_t)(sy - blit->mask_y) * blit->mask_stride + (sx - blit->mask_x);
+
+	if (blit->staged) {
+		blit_gather(blit->src, sx, sy, length, blit->row);
+		blit_row(out, blit->row, mask, length, blit->mode);
+		return;
+	}
+
+	while (length > 0) {
+		uint32_t n = length;
+		const uint32_t *in = blit_source(blit->src, sx, sy, &n);
+
+		blit_row(out, in, mask, n, blit->mode);
+
+		out += n;
+		sx += n;
+		length -= n;
+		if (mask)
+			mask += n;
+	}
+}
+
+/* Source pixels from x, y on, length is cut to the ones contiguous with it */
+static
+const uint32_t *
+blit_source(PixedDocument *src, uint32_t x, uint32_t y, uint32_t *length)
+{
+	if (!src) {
+		*length = PIXED_MIN(*length, PIXED_TILE_SIZE);
+		return blit_zeros;
+	}
+
+	if (src->storage == PIXED_STORAGE_FLAT)
+		return src->canvas + (size_t)y * src->width + x;
+
+	uint32_t column = x % PIXED_TILE_SIZE;
+	*length = PIXED_MIN(*length, PIXED_TILE_SIZE - column);
+
+	uint32_t *tile = src->tiles[(y / PIXED_TILE_SIZE) * src->tiles_x + (x / PIXED_TILE_SIZE)];
+	return tile + (y % PIXED_TILE_SIZE) * PIXED_TILE_SIZE + column;
+}
+
+/* Copies length pixels from x, y of document to dst, in canvas order whatever the storage */
+static
+void
+blit_gather(PixedDocument *document, uint32_t x, uint32_t y, uint32_t length, uint32_t *dst)
+{
+	uint32_t i = 0;
+
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		const uint8_t *indices = document->indices + (size_t)y * document->width + x;
+		for (; i < length; i++)
+			dst[i] = document->palette[indices[i]];
+
+		return;
+	}
+
+	while (length > 0) {
+		uint32_t n = length;
+		memcpy(dst, blit_source(document, x, y, &n), sizeof(uint32_t) * n);
+
+		dst += n;
+		x += n;
+		length -= n;
+	}
+}
+
+/* One row of a blit, the runs of pixels selected by mask one after the other */
+static
+void
+blit_row(uint32_t *dst, const uint32_t *src, const uint8_t *mask, uint32_t length, PixedBlitMode mode)
+{
+	uint32_t i = 0, end = length;
+
+	while (i < length) {
+		if (mask) {
+			while (i < length && !mask[i])
+				i++;
+
+			for (end = i; end < length && mask[end]; end++)
+				;
+		}
+
+		if (mode == PIXED_BLIT_OVER)
+			over_row(dst + i, src + i, end - i);
+		else
+			memcpy(dst + i, src + i, sizeof(uint32_t) * (end - i));
+
+		i = end;
+	}
+}
+
+/*
+ * Straight alpha src over dst. Transparent and opaque runs of src are skipped
+ * or copied, as are translucent ones over a transparent dst. Over an opaque
+ * dst they blend as
+ *
+ *   d + (s - d) * sa
+ *
+ * in 16 bit lanes, anything else goes one pixel at a time.
+ */
+static
+void
+over_row(uint32_t *dst, const uint32_t *src, uint32_t length)
+{
+	uint32_t i = 0, j = 0;
+
+#if defined(PIXED_SIMD_SSE2)
+	__m128i zero = _mm_setzero_si128(), c255 = _mm_set1_epi16(255), c128 = _mm_set1_epi16(128);
+	__m128i alpha_bytes = _mm_set1_epi32((int)pixed_canvas_color(0x000000ff));
+
+	for (; i + 4 <= length; i += 4) {
+		__m128i s8 = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i alpha8 = _mm_and_si128(s8, alpha_bytes);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(alpha8, zero)) == 0xffff)
+			continue;
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(alpha8, alpha_bytes)) == 0xffff) {
+			_mm_storeu_si128((__m128i *)(dst + i), s8);
+			continue;
+		}
+
+		__m128i d8 = _mm_loadu_si128((const __m128i *)(dst + i)), halves[2];
+		__m128i dst_alpha8 = _mm_and_si128(d8, alpha_bytes);
+		int h = 0;
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(dst_alpha8, zero)) == 0xffff) {
+			_mm_storeu_si128((__m128i *)(dst + i), s8);
+			continue;
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(dst_alpha8, alpha_bytes)) != 0xffff) {
+			for (j = 0; j < 4; j++)
+				over_pixel((unsigned char *)(dst + i + j), (const unsigned char *)(src + i + j));
+
+			continue;
+		}
+
+		for (; h < 2; h++) {
+			__m128i s = h ? _mm_unpackhi_epi8(s8, zero) : _mm_unpacklo_epi8(s8, zero);
+			__m128i d = h ? _mm_unpackhi_epi8(d8, zero) : _mm_unpacklo_epi8(d8, zero);
+			__m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+
+			__m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s, sa), _mm_mullo_epi16(d, _mm_sub_epi16(c255, sa))), c128);
+			halves[h] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+		}
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_packus_epi16(halves[0], halves[1]), alpha_bytes));
+	}
+#elif defined(PIXED_SIMD_NEON)
+	uint16x8_t c255 = vdupq_n_u16(255), c128 = vdupq_n_u16(128);
+
+	for (; i + 8 <= length; i += 8) {
+		uint8x8x4_t s8 = vld4_u8((const uint8_t *)(src + i));
+		uint64_t alpha8 = vget_lane_u64(vreinterpret_u64_u8(s8.val[3]), 0);
+		int c = 0;
+
+		if (alpha8 == 0)
+			continue;
+
+		if (alpha8 == UINT64_MAX) {
+			memcpy(dst + i, src + i, sizeof(uint32_t) * 8);
+			continue;
+		}
+
+		uint8x8x4_t d8 = vld4_u8((const uint8_t *)(dst + i));
+		uint64_t dst_alpha8 = vget_lane_u64(vreinterpret_u64_u8(d8.val[3]), 0);
+
+		if (dst_alpha8 == 0) {
+			memcpy(dst + i, src + i, sizeof(uint32_t) * 8);
+			continue;
+		}
+
+		if (dst_alpha8 != UINT64_MAX) {
+			for (j = 0; j < 8; j++)
+				over_pixel((unsigned char *)(dst + i + j), (const unsigned char *)(src + i + j));
+
+			continue;
+		}
+
+		uint16x8_t sa = vmovl_u8(s8.val[3]), inverse_sa = vsubq_u16(c255, sa);
+
+		for (; c < 3; c++) {
+			uint16x8_t t = vmulq_u16(vmovl_u8(s8.val[c]), sa);
+			t = vaddq_u16(vaddq_u16(t, vmulq_u16(vmovl_u8(d8.val[c]), inverse_sa)), c128);
+			d8.val[c] = vmovn_u16(vshrq_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8));
+		}
+
+		vst4_u8((uint8_t *)(dst + i), d8);
+	}
+#endif
+
+	for (; i < length; i++)
+		over_pixel((unsigned char *)(dst + i), (const unsigned char *)(src + i));
+}
+
+/* One pixel of over_row, bytes in canvas (R, G, B, A) order */
+static
+void
+over_pixel(unsigned char *dst, const unsigned char *src)
+{
+	uint32_t sa = src[3], da = dst[3], c = 0;
+	if (sa == 0)
+		return;
+
+	if (sa == 255 || da == 0) {
+		memcpy(dst, src, 4);
+		return;
+	}
+
+	// Both weights are out of 255 * 255, the result alpha is their sum
+	uint32_t src_weight = sa * 255, dst_weight = da * (255 - sa), total = src_weight + dst_weight;
+
+	for (; c < 3; c++)
+		dst[c] = (unsigned char)((src[c] * src_weight + dst[c] * dst_weight + total / 2) / total);
+
+	dst[3] = (unsigned char)((total + 127) / 255);
+}
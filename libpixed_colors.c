@@ -0,0 +1,842 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * Counts of every color of a document. Counts are kept per 64x64 tile: a
+ * tile about to change is subtracted right away and counted again on the
+ * next query, so a stroke costs one scan of each tile it touched however
+ * many pixels it set. Indexed documents are counted by palette index and
+ * queries look the colors up in the palette, palette edits cost nothing.
+ *
+ * With bitsets every tile also keeps a bit per color it holds, queries for
+ * one color only visit the tiles that have it.
+ */
+
+#define COLORS_BITSET_MAX  4096 // documents with more colors drop their bitsets
+#define COLORS_CAPTURE_MAX 4    // capturing more than 1 / COLORS_CAPTURE_MAX of the tiles recounts all of them
+#define COLORS_TILE_SLOTS  (PIXED_TILE_PIXELS * 2)
+
+struct PixedColorIndex
+{
+	PixedDocument  *document;
+	uint32_t        width, height; // of the document when it was counted
+	int             indexed;       // keys are palette indices, colors otherwise
+	int             valid;         // 0 until every tile was counted once
+
+	uint32_t       *keys;   // by id, canvas order colors or palette indices
+	int64_t        *counts; // by id, ids stay when their count drops to 0
+	uint32_t        length, capacity;
+	uint32_t       *slots;  // open addressing over keys, id + 1, 0 when free
+	uint32_t        slots_mask;
+
+	uint32_t        tiles_x, tiles_y;
+	uint8_t        *stale;   // per tile, subtracted and waiting to be counted again
+	uint32_t       *pending; // stale tiles, in the order they went stale
+	uint32_t        pending_length;
+
+	int             bitsets; // asked for, bits is 0 while there are too many colors
+	uint64_t       *bits;    // words per tile, bit per id
+	uint32_t        words;
+
+	pthread_mutex_t lock;    // taken while tiles counted in parallel merge into the index
+	int             failed;  // an allocation failed while merging
+};
+
+typedef struct {
+	uint32_t keys[COLORS_TILE_SLOTS];
+	uint32_t counts[COLORS_TILE_SLOTS];
+	uint16_t used[PIXED_TILE_PIXELS]; // slots taken, a tile holds at most as many colors as pixels
+	uint32_t used_length;
+} PixedTileColors;
+
+typedef struct {
+	PixedColorIndex *index;
+	const uint32_t  *tiles;
+} PixedColorsJob;
+
+typedef struct {
+	PixedColorIndex *index;
+	uint32_t         key;
+	uint8_t         *tiles; // 0 scans every tile
+	uint8_t         *mask;
+} PixedSelectJob;
+
+static int      colors_update(PixedColorIndex *);
+static int      colors_reset(PixedColorIndex *);
+static void     colors_count_rows(void *, uint32_t, uint32_t);
+static void     colors_scan_tile(PixedColorIndex *, uint32_t, PixedTileColors *);
+static void     colors_tile_add(PixedTileColors *, uint32_t, uint32_t);
+static uint32_t colors_run(const uint32_t *, uint32_t, uint32_t);
+static void     colors_equal(uint8_t *, const uint32_t *, uint32_t, uint32_t);
+static int      colors_merge(PixedColorIndex *, uint32_t, PixedTileColors *, int);
+static uint32_t colors_hash(uint32_t);
+static int64_t  colors_id(PixedColorIndex *, uint32_t, int);
+static int      colors_grow_bits(PixedColorIndex *);
+static int      colors_key(PixedColorIndex *, uint32_t, uint32_t *, uint32_t);
+static void     colors_select_rows(void *, uint32_t, uint32_t);
+static int      colors_compare(const void *, const void *);
+
+/* Keeps the color counts of document from now on, see pixed_color_index_length and friends */
+PixedColorIndex *
+pixed_color_index_new(PixedDocument *document, int bitsets)
+{
+	PixedColorIndex *index = calloc(1, sizeof(PixedColorIndex));
+	if (!index)
+		return 0;
+
+	if (pthread_mutex_init(&index->lock, 0) != 0) {
+		free(index);
+		return 0;
+	}
+
+	index->document = document;
+	index->bitsets = bitsets;
+	document->colors = index;
+
+	return index;
+}
+
+void
+pixed_color_index_free(PixedColorIndex *index)
+{
+	if (!index)
+		return;
+
+	if (index->document->colors == index)
+		index->document->colors = 0;
+
+	pthread_mutex_destroy(&index->lock);
+	free(index->keys);
+	free(index->counts);
+	free(index->slots);
+	free(index->stale);
+	free(index->pending);
+	free(index->bits);
+	free(index);
+}
+
+/*
+ * Called before the pixels of the rectangle change. Tiles under it are
+ * subtracted from the counts once, until the next query counts them again.
+ */
+void
+pixed_color_index_capture(PixedColorIndex *index, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	PixedDocument *document = index->document;
+
+	if (!index->valid || width == 0 || height == 0 || x >= document->width || y >= document->height)
+		return;
+
+	if (document->width != index->width || document->height != index->height ||
+		(document->storage == PIXED_STORAGE_INDEXED) != index->indexed) {
+		index->valid = 0;
+		return;
+	}
+
+	uint32_t tile_x0 = x / PIXED_TILE_SIZE, tile_x1 = (PIXED_MIN(x + width, document->width) - 1) / PIXED_TILE_SIZE;
+	uint32_t tile_y0 = y / PIXED_TILE_SIZE, tile_y1 = (PIXED_MIN(y + height, document->height) - 1) / PIXED_TILE_SIZE;
+	uint64_t tiles_length = (uint64_t)index->tiles_x * index->tiles_y;
+
+	// Scanning most of the document twice costs more than counting it again
+	if ((uint64_t)(tile_x1 - tile_x0 + 1) * (tile_y1 - tile_y0 + 1) * COLORS_CAPTURE_MAX > tiles_length) {
+		index->valid = 0;
+		return;
+	}
+
+	PixedTileColors *colors = 0;
+	uint32_t tile_y = tile_y0, tile_x = 0;
+
+	for (; tile_y <= tile_y1; tile_y++) {
+		for (tile_x = tile_x0; tile_x <= tile_x1; tile_x++) {
+			uint32_t tile = tile_y * index->tiles_x + tile_x;
+			if (index->stale[tile])
+				continue;
+
+			if (!colors && !(colors = calloc(1, sizeof(PixedTileColors)))) {
+				index->valid = 0;
+				return;
+			}
+
+			colors_scan_tile(index, tile, colors);
+			colors_merge(index, tile, colors, -1);
+
+			index->stale[tile] = 1;
+			index->pending[index->pending_length++] = tile;
+		}
+	}
+
+	free(colors);
+}
+
+/* Colors in the document, 0 without an index */
+uint32_t
+pixed_color_index_length(PixedColorIndex *index)
+{
+	if (!index || colors_update(index) != 0)
+		return 0;
+
+	uint32_t length = 0, id = 0;
+	for (; id < index->length; id++)
+		length += index->counts[id] > 0;
+
+	// Palettes may hold a color twice
+	if (index->indexed)
+		length = pixed_color_index_colors(index, 0, 0, 0);
+
+	return length;
+}
+
+/* Pixels of color */
+uint64_t
+pixed_color_index_count(PixedColorIndex *index, uint32_t color)
+{
+	if (colors_update(index) != 0)
+		return 0;
+
+	uint32_t keys[PIXED_PALETTE_MAX];
+	uint64_t count = 0;
+	int i = 0, keys_length = colors_key(index, pixed_canvas_color(color), keys, PIXED_PALETTE_MAX);
+
+	for (; i < keys_length; i++) {
+		int64_t id = colors_id(index, keys[i], 0);
+		if (id >= 0)
+			count += (uint64_t)index->counts[id];
+	}
+
+	return count;
+}
+
+/*
+ * Fills colors and counts with up to max colors of the document, most used
+ * first. Returns how many colors the document has, either may be 0.
+ */
+uint32_t
+pixed_color_index_colors(PixedColorIndex *index, uint32_t *colors, uint64_t *counts, uint32_t max)
+{
+	if (colors_update(index) != 0)
+		return 0;
+
+	uint64_t *sorted = malloc(sizeof(uint64_t) * 2 * (index->length + 1));
+	uint32_t length = 0, id = 0, i = 0;
+
+	if (!sorted)
+		return 0;
+
+	// Pairs of count and canvas color, duplicates of indexed palettes added up
+	for (; id < index->length; id++) {
+		if (index->counts[id] <= 0)
+			continue;
+
+		uint32_t color = index->indexed ? index->document->palette[index->keys[id]] : index->keys[id];
+		for (i = 0; index->indexed && i < length && sorted[i * 2 + 1] != color; i++)
+			;
+
+		if (index->indexed && i < length) {
+			sorted[i * 2] += (uint64_t)index->counts[id];
+			continue;
+		}
+
+		sorted[length * 2] = (uint64_t)index->counts[id];
+		sorted[length * 2 + 1] = color;
+		length++;
+	}
+
+	qsort(sorted, length, sizeof(uint64_t) * 2, colors_compare);
+
+	for (i = 0; i < max && i < length; i++) {
+		if (colors)
+			colors[i] = pixed_canvas_color((uint32_t)sorted[i * 2 + 1]);
+
+		if (counts)
+			counts[i] = sorted[i * 2];
+	}
+
+	free(sorted);
+	return length;
+}
+
+/*
+ * Sets tiles[tile_y * tiles_x + tile_x] where that tile may hold color.
+ * Without bitsets every tile may.
+ */
+int
+pixed_color_index_tiles(PixedColorIndex *index, uint32_t color, uint8_t *tiles)
+{
+	if (colors_update(index) != 0)
+		return -1;
+
+	uint32_t keys[PIXED_PALETTE_MAX], tile = 0, tiles_length = index->tiles_x * index->tiles_y;
+	int i = 0, keys_length = colors_key(index, pixed_canvas_color(color), keys, PIXED_PALETTE_MAX);
+
+	if (!index->bits) {
+		memset(tiles, 1, tiles_length);
+		return 0;
+	}
+
+	memset(tiles, 0, tiles_length);
+
+	for (; i < keys_length; i++) {
+		int64_t id = colors_id(index, keys[i], 0);
+		if (id < 0 || index->counts[id] <= 0)
+			continue;
+
+		for (tile = 0; tile < tiles_length; tile++) {
+			if (index->bits[(size_t)tile * index->words + id / 64] & ((uint64_t)1 << (id % 64)))
+				tiles[tile] = 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Sets mask[y * width + x] to 1 where the pixel is color and to 0 everywhere else */
+int
+pixed_color_index_select(PixedColorIndex *index, uint32_t color, uint8_t *mask)
+{
+	PixedDocument *document = index->document;
+	uint32_t keys[PIXED_PALETTE_MAX];
+
+	if (colors_update(index) != 0)
+		return -1;
+
+	memset(mask, 0, (size_t)document->width * document->height);
+
+	// Palettes holding the color twice are rare enough to scan every tile for
+	int keys_length = colors_key(index, pixed_canvas_color(color), keys, PIXED_PALETTE_MAX);
+	if (keys_length == 0 || pixed_color_index_count(index, color) == 0)
+		return 0;
+
+	PixedSelectJob job;
+	job.index = index;
+	job.key = keys[0];
+	job.mask = mask;
+	job.tiles = 0;
+
+	if (keys_length == 1 && index->bits) {
+		job.tiles = malloc((size_t)index->tiles_x * index->tiles_y);
+		if (!job.tiles || pixed_color_index_tiles(index, color, job.tiles) != 0) {
+			free(job.tiles);
+			return -1;
+		}
+	}
+
+	if (keys_length == 1) {
+		pixed_parallel_rows(index->tiles_y, index->tiles_x * PIXED_TILE_PIXELS, colors_select_rows, &job);
+	} else {
+		int i = 0;
+		for (; i < keys_length; i++) {
+			job.key = keys[i];
+			pixed_parallel_rows(index->tiles_y, index->tiles_x * PIXED_TILE_PIXELS, colors_select_rows, &job);
+		}
+	}
+
+	free(job.tiles);
+	return 0;
+}
+
+/*
+ * Every pixel with key from now has key to, called before they change.
+ * Counts and bits move over without a scan.
+ */
+void
+pixed_color_index_replace(PixedColorIndex *index, uint32_t from, uint32_t to)
+{
+	if (colors_update(index) != 0)
+		return;
+
+	int64_t from_id = colors_id(index, from, 0);
+	if (from_id < 0 || index->counts[from_id] == 0)
+		return;
+
+	int64_t to_id = colors_id(index, to, 1);
+	if (to_id < 0) {
+		index->valid = 0;
+		return;
+	}
+
+	index->counts[to_id] += index->counts[from_id];
+	index->counts[from_id] = 0;
+
+	if (!index->bits)
+		return;
+
+	uint64_t from_bit = (uint64_t)1 << (from_id % 64), to_bit = (uint64_t)1 << (to_id % 64);
+	uint32_t tile = 0, tiles_length = index->tiles_x * index->tiles_y;
+
+	for (; tile < tiles_length; tile++) {
+		uint64_t *bits = index->bits + (size_t)tile * index->words;
+
+		if (bits[from_id / 64] & from_bit) {
+			bits[from_id / 64] &= ~from_bit;
+			bits[to_id / 64] |= to_bit;
+		}
+	}
+}
+
+/* Counts everything again on the next query, for changes too large to follow */
+void
+pixed_color_index_invalidate(PixedColorIndex *index)
+{
+	index->valid = 0;
+}
+
+/* Counts the stale tiles, or every tile when the counts are no longer valid */
+static
+int
+colors_update(PixedColorIndex *index)
+{
+	PixedDocument *document = index->document;
+
+	if (!index->valid || document->width != index->width || document->height != index->height ||
+		(document->storage == PIXED_STORAGE_INDEXED) != index->indexed) {
+		if (colors_reset(index) != 0)
+			return -1;
+	}
+
+	if (index->pending_length == 0)
+		return 0;
+
+	PixedColorsJob job;
+	job.index = index;
+	job.tiles = index->pending;
+
+	index->failed = 0;
+	pixed_parallel_rows(index->pending_length, PIXED_TILE_PIXELS, colors_count_rows, &job);
+
+	uint32_t i = 0;
+	for (; i < index->pending_length; i++)
+		index->stale[index->pending[i]] = 0;
+
+	index->pending_length = 0;
+
+	if (index->failed) {
+		index->valid = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Forgets every count and marks every tile stale */
+static
+int
+colors_reset(PixedColorIndex *index)
+{
+	PixedDocument *document = index->document;
+	uint32_t tiles_x = (document->width + PIXED_TILE_SIZE - 1) / PIXED_TILE_SIZE;
+	uint32_t tiles_y = (document->height + PIXED_TILE_SIZE - 1) / PIXED_TILE_SIZE;
+	size_t tiles_length = (size_t)tiles_x * tiles_y;
+
+	free(index->stale);
+	free(index->pending);
+	free(index->bits);
+	index->stale = malloc(tiles_length);
+	index->pending = malloc(sizeof(uint32_t) * PIXED_MAX(tiles_length, 1));
+	index->bits = 0;
+	index->words = 0;
+
+	if (!index->stale || !index->pending) {
+		index->valid = 0;
+		return -1;
+	}
+
+	index->width = document->width;
+	index->height = document->height;
+	index->indexed = document->storage == PIXED_STORAGE_INDEXED;
+	index->tiles_x = tiles_x;
+	index->tiles_y = tiles_y;
+	index->length = 0;
+
+	if (index->slots)
+		memset(index->slots, 0, sizeof(uint32_t) * (index->slots_mask + 1));
+
+	if (index->bitsets) {
+		index->words = 4;
+		index->bits = calloc(tiles_length, sizeof(uint64_t) * index->words);
+		if (!index->bits)
+			index->words = 0;
+	}
+
+	uint32_t i = 0;
+	for (; i < tiles_length; i++)
+		index->pending[i] = i;
+
+	memset(index->stale, 1, tiles_length);
+	index->pending_length = (uint32_t)tiles_length;
+	index->valid = 1;
+	return 0;
+}
+
+/* Counts pending tiles [begin, end), merging each into the index */
+static
+void
+colors_count_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedColorsJob *job = ctx;
+	PixedColorIndex *index = job->index;
+
+	PixedTileColors *colors = calloc(1, sizeof(PixedTileColors));
+	if (!colors) {
+		pthread_mutex_lock(&index->lock);
+		index->failed = 1;
+		pthread_mutex_unlock(&index->lock);
+		return;
+	}
+
+	uint32_t i = begin;
+	for (; i < end; i++) {
+		colors_scan_tile(index, job->tiles[i], colors);
+
+		pthread_mutex_lock(&index->lock);
+		if (colors_merge(index, job->tiles[i], colors, 1) != 0)
+			index->failed = 1;
+		pthread_mutex_unlock(&index->lock);
+	}
+
+	free(colors);
+}
+
+/* Counts the keys of tile into colors, runs of one key at a time */
+static
+void
+colors_scan_tile(PixedColorIndex *index, uint32_t tile, PixedTileColors *colors)
+{
+	PixedDocument *document = index->document;
+	uint32_t tile_x = tile % index->tiles_x, tile_y = tile / index->tiles_x;
+	uint32_t x = tile_x * PIXED_TILE_SIZE, y = tile_y * PIXED_TILE_SIZE;
+	uint32_t width = PIXED_MIN(PIXED_TILE_SIZE, document->width - x);
+	uint32_t height = PIXED_MIN(PIXED_TILE_SIZE, document->height - y);
+	uint32_t row = 0, i = 0;
+
+	for (i = 0; i < colors->used_length; i++)
+		colors->counts[colors->used[i]] = 0;
+
+	colors->used_length = 0;
+
+	if (index->indexed) {
+		for (row = 0; row < height; row++) {
+			const uint8_t *indices = document->indices + (size_t)(y + row) * document->width + x;
+
+			for (i = 0; i < width; ) {
+				uint32_t start = i;
+				while (i < width && indices[i] == indices[start])
+					i++;
+
+				colors_tile_add(colors, indices[start], i - start);
+			}
+		}
+
+		return;
+	}
+
+	PixedTile view;
+	if (pixed_document_get_tile(document, tile_x, tile_y, 0, &view) != 0)
+		return;
+
+	// Untouched tiles of tiled documents are all transparent
+	if (view.empty) {
+		colors_tile_add(colors, 0, width * height);
+		return;
+	}
+
+	for (row = 0; row < height; row++) {
+		const uint32_t *pixels = view.pixels + (size_t)row * view.stride;
+
+		for (i = 0; i < width; ) {
+			uint32_t run = colors_run(pixels + i, width - i, pixels[i]);
+			colors_tile_add(colors, pixels[i], run);
+			i += run;
+		}
+	}
+}
+
+static
+void
+colors_tile_add(PixedTileColors *colors, uint32_t key, uint32_t count)
+{
+	uint32_t slot = (key * 2654435761u) >> (32 - 13); // COLORS_TILE_SLOTS bits
+
+	while (colors->counts[slot] && colors->keys[slot] != key)
+		slot = (slot + 1) & (COLORS_TILE_SLOTS - 1);
+
+	if (!colors->counts[slot]) {
+		colors->keys[slot] = key;
+		colors->used[colors->used_length++] = (uint16_t)slot;
+	}
+
+	colors->counts[slot] += count;
+}
+
+/* Length of the run of color at the start of pixels, at least one */
+static
+uint32_t
+colors_run(const uint32_t *pixels, uint32_t length, uint32_t color)
+{
+	uint32_t i = 1;
+
+#if defined(PIXED_SIMD_SSE2)
+	__m128i color4 = _mm_set1_epi32((int)color);
+	for (; i + 4 <= length; i += 4) {
+		int equal = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(pixels + i)), color4));
+		if (equal != 0xffff)
+			return i + __builtin_ctz(~equal) / 4;
+	}
+#elif defined(PIXED_SIMD_NEON)
+	uint32x4_t color4 = vdupq_n_u32(color);
+	for (; i + 4 <= length; i += 4) {
+		uint32x4_t equal = vceqq_u32(vld1q_u32(pixels + i), color4);
+		if ((vgetq_lane_u32(equal, 0) & vgetq_lane_u32(equal, 1) & vgetq_lane_u32(equal, 2) & vgetq_lane_u32(equal, 3)) == 0)
+			break;
+	}
+#endif
+
+	while (i < length && pixels[i] == color)
+		i++;
+
+	return i;
+}
+
+/* Sets mask[i] to 1 where pixels[i] is color and to 0 elsewhere */
+static
+void
+colors_equal(uint8_t *mask, const uint32_t *pixels, uint32_t length, uint32_t color)
+{
+	uint32_t i = 0;
+
+#if defined(PIXED_SIMD_SSE2)
+	__m128i color4 = _mm_set1_epi32((int)color), one = _mm_set1_epi8(1);
+	for (; i + 16 <= length; i += 16) {
+		__m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(pixels + i)), color4);
+		__m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(pixels + i + 4)), color4);
+		__m128i c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(pixels + i + 8)), color4);
+		__m128i d = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(pixels + i + 12)), color4);
+		__m128i packed = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+		_mm_storeu_si128((__m128i *)(mask + i), _mm_and_si128(packed, one));
+	}
+#elif defined(PIXED_SIMD_NEON)
+	uint32x4_t color4 = vdupq_n_u32(color);
+	for (; i + 8 <= length; i += 8) {
+		uint16x4_t a = vmovn_u32(vceqq_u32(vld1q_u32(pixels + i), color4));
+		uint16x4_t b = vmovn_u32(vceqq_u32(vld1q_u32(pixels + i + 4), color4));
+		vst1_u8(mask + i, vand_u8(vmovn_u16(vcombine_u16(a, b)), vdup_n_u8(1)));
+	}
+#endif
+
+	for (; i < length; i++)
+		mask[i] = pixels[i] == color;
+}
+
+/*
+ * Adds the counts of a tile to the index, or takes them away with sign -1
+ * along with the bits of the tile. Called with lock held while counting.
+ */
+static
+int
+colors_merge(PixedColorIndex *index, uint32_t tile, PixedTileColors *colors, int sign)
+{
+	uint32_t i = 0;
+
+	if (sign < 0 && index->bits)
+		memset(index->bits + (size_t)tile * index->words, 0, sizeof(uint64_t) * index->words);
+
+	for (; i < colors->used_length; i++) {
+		uint32_t slot = colors->used[i];
+
+		int64_t id = colors_id(index, colors->keys[slot], sign > 0);
+		if (id < 0)
+			return sign > 0 ? -1 : 0;
+
+		index->counts[id] += sign * (int64_t)colors->counts[slot];
+
+		if (sign > 0 && index->bits && id >= (int64_t)index->words * 64 && colors_grow_bits(index) != 0)
+			continue;
+
+		if (sign > 0 && index->bits)
+			index->bits[(size_t)tile * index->words + id / 64] |= (uint64_t)1 << (id % 64);
+	}
+
+	return 0;
+}
+
+/* Palette indices are small and colors often differ in one byte only, every bit has to reach the low ones */
+static
+uint32_t
+colors_hash(uint32_t key)
+{
+	key ^= key >> 16;
+	key *= 0x7feb352du;
+	key ^= key >> 15;
+	key *= 0x846ca68bu;
+	return key ^ (key >> 16);
+}
+
+/* Id of key, added with a count of 0 when insert is set. -1 when missing or out of memory */
+static
+int64_t
+colors_id(PixedColorIndex *index, uint32_t key, int insert)
+{
+	if (index->slots) {
+		uint32_t slot = colors_hash(key) & index->slots_mask;
+
+		while (index->slots[slot]) {
+			if (index->keys[index->slots[slot] - 1] == key)
+				return index->slots[slot] - 1;
+
+			slot = (slot + 1) & index->slots_mask;
+		}
+	}
+
+	if (!insert)
+		return -1;
+
+	if (index->length == index->capacity) {
+		uint32_t capacity = index->capacity ? index->capacity * 2 : 256;
+		uint32_t *keys = realloc(index->keys, sizeof(uint32_t) * capacity);
+		if (keys)
+			index->keys = keys;
+
+		int64_t *counts = realloc(index->counts, sizeof(int64_t) * capacity);
+		if (counts)
+			index->counts = counts;
+
+		if (!keys || !counts)
+			return -1;
+
+		index->capacity = capacity;
+	}
+
+	// Slots stay at most half full, rehashing every id when they aren't
+	if (!index->slots || (index->length + 1) * 2 > index->slots_mask + 1) {
+		uint32_t slots_length = index->slots ? (index->slots_mask + 1) * 2 : 512, id = 0;
+		uint32_t *slots = calloc(slots_length, sizeof(uint32_t));
+		if (!slots)
+			return -1;
+
+		free(index->slots);
+		index->slots = slots;
+		index->slots_mask = slots_length - 1;
+
+		for (; id < index->length; id++) {
+			uint32_t slot = colors_hash(index->keys[id]) & index->slots_mask;
+			while (index->slots[slot])
+				slot = (slot + 1) & index->slots_mask;
+
+			index->slots[slot] = id + 1;
+		}
+	}
+
+	uint32_t slot = colors_hash(key) & index->slots_mask;
+	while (index->slots[slot])
+		slot = (slot + 1) & index->slots_mask;
+
+	index->keys[index->length] = key;
+	index->counts[index->length] = 0;
+	index->slots[slot] = ++index->length;
+
+	return index->length - 1;
+}
+
+/* Doubles the words of every tile, or drops the bitsets past COLORS_BITSET_MAX colors */
+static
+int
+colors_grow_bits(PixedColorIndex *index)
+{
+	size_t tiles_length = (size_t)index->tiles_x * index->tiles_y, tile = 0;
+	uint32_t words = index->words * 2;
+	uint64_t *bits = 0;
+
+	if (words * 64 <= COLORS_BITSET_MAX)
+		bits = calloc(tiles_length, sizeof(uint64_t) * words);
+
+	if (bits) {
+		for (; tile < tiles_length; tile++)
+			memcpy(bits + tile * words, index->bits + tile * index->words, sizeof(uint64_t) * index->words);
+	}
+
+	free(index->bits);
+	index->bits = bits;
+	index->words = bits ? words : 0;
+	return bits ? 0 : -1;
+}
+
+/* Keys of a canvas order color, palette indices holding it for indexed documents */
+static
+int
+colors_key(PixedColorIndex *index, uint32_t color, uint32_t *keys, uint32_t max)
+{
+	if (!index->indexed) {
+		keys[0] = color;
+		return 1;
+	}
+
+	PixedDocument *document = index->document;
+	uint32_t i = 0, length = 0;
+
+	for (; i < document->palette_length && length < max; i++) {
+		if (document->palette[i] == color)
+			keys[length++] = i;
+	}
+
+	return (int)length;
+}
+
+/* Marks the pixels of job->key in rows of tiles [begin, end) */
+static
+void
+colors_select_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedSelectJob *job = ctx;
+	PixedColorIndex *index = job->index;
+	PixedDocument *document = index->document;
+	uint32_t tile_y = begin, tile_x = 0, row = 0, i = 0;
+
+	// The mask may alias anything, a local key lets the compare loops vectorize
+	uint32_t key = job->key;
+
+	for (; tile_y < end; tile_y++) {
+		for (tile_x = 0; tile_x < index->tiles_x; tile_x++) {
+			if (job->tiles && !job->tiles[tile_y * index->tiles_x + tile_x])
+				continue;
+
+			uint32_t x = tile_x * PIXED_TILE_SIZE, y = tile_y * PIXED_TILE_SIZE;
+			uint32_t width = PIXED_MIN(PIXED_TILE_SIZE, document->width - x);
+			uint32_t height = PIXED_MIN(PIXED_TILE_SIZE, document->height - y);
+			PixedTile view;
+
+			if (!index->indexed && pixed_document_get_tile(document, tile_x, tile_y, 0, &view) != 0)
+				continue;
+
+			for (row = 0; row < height; row++) {
+				uint8_t *mask = job->mask + (size_t)(y + row) * document->width + x;
+
+				if (index->indexed) {
+					const uint8_t *indices = document->indices + (size_t)(y + row) * document->width + x;
+					for (i = 0; i < width; i++)
+						mask[i] |= indices[i] == key;
+				} else if (view.empty) {
+					memset(mask, key == 0, width);
+				} else {
+					colors_equal(mask, view.pixels + (size_t)row * view.stride, width, key);
+				}
+			}
+		}
+	}
+}
+
+/* Most pixels first, colors break ties */
+static
+int
+colors_compare(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	if (x[0] != y[0])
+		return x[0] > y[0] ? -1 : 1;
+
+	return x[1] < y[1] ? -1 : x[1] > y[1];
+}
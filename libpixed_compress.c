@@ -0,0 +1,808 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * Compressed PiXd (v2) layout, every number is big endian:
+ *
+ *   "PiXd", 0, version, width, height, codec, chunk rows, chunk count
+ *   chunk count * (offset u64, size u32, flags u32)
+ *   chunk data
+ *
+ * The zero where v1 files keep their width makes old readers reject the file.
+ * Every chunk holds chunk rows full rows and is compressed on its own, so
+ * chunks can be decoded in parallel or one by one for partial loads.
+ *
+ * Indexed documents are stored as version 3, the same layout with the palette
+ * length and palette colors between header and index, and one byte palette
+ * indices instead of pixels in the chunks.
+ *
+ * Layered documents are stored as version 4, every layer a complete v2 or v3
+ * document of its own after the layer index:
+ *
+ *   "PiXd", 0, version, width, height, layer count, 0, 0
+ *   layer count * (offset u64, size u32, opacity u8, blend u8, visible u8, 0)
+ *   layer documents
+ */
+#define PIXED_V2_HEADER_SIZE 32
+#define PIXED_V2_INDEX_SIZE  16
+#define PIXED_V2_CHUNK_ROWS  64
+
+#define PIXED_CODEC_RLZ      1 // run, literal and match tokens over whole pixels
+#define PIXED_CHUNK_STORED   1 // chunk didn't compress, raw pixels follow
+
+/*
+ * Token byte: two type bits and six bits of length - 1. Length 64 and
+ * above stores 63 and the rest as a varint. Literals are followed by the
+ * pixels, runs by the repeated pixel and matches by a varint distance in
+ * pixels back from the current position.
+ */
+#define TOKEN_LITERAL 0x00
+#define TOKEN_RUN     0x40
+#define TOKEN_MATCH   0x80
+#define TOKEN_TYPE    0xc0
+#define TOKEN_LENGTH  0x3f
+
+#define CODEC_LONG_RUN   8
+
+typedef struct {
+	unsigned char *data;
+	size_t         size;
+	uint32_t       flags;
+} PixedChunk;
+
+typedef struct {
+	PixedDocument *document;
+	PixedChunk    *chunks;
+	uint32_t       chunk_rows;
+} PixedCompressJob;
+
+typedef struct {
+	unsigned char *header; // header, palette and chunk index
+	size_t         header_size;
+	PixedChunk    *chunks;
+	uint32_t       chunk_count;
+	uint64_t       size;   // header and chunks
+} PixedEncoding;
+
+typedef struct {
+	const unsigned char *data;
+	size_t               length;
+	size_t               index_offset;
+	unsigned char       *out;     // canvas or palette indices of the document
+	size_t               element; // bytes per pixel in out
+	uint32_t             width, height;
+	uint32_t             chunk_rows;
+	uint32_t             first_chunk;
+	uint32_t             first_row, rows;
+	int                 *results;
+} PixedDecodeJob;
+
+static int            encode_document(PixedDocument *, PixedEncoding *);
+static int            encoding_vectors(PixedEncoding *, struct iovec *);
+static void           encoding_free(PixedEncoding *);
+static int            write_layers(PixedDocument *, int);
+static PixedDocument *decode_layers(const char *, const unsigned char *, size_t, uint32_t, uint32_t);
+static void           compress_chunks(void *, uint32_t, uint32_t);
+static void           decode_chunks(void *, uint32_t, uint32_t);
+static unsigned char *emit_token(unsigned char *, unsigned char, size_t);
+static unsigned char *emit_literals(unsigned char *, const unsigned char *, size_t, size_t);
+static unsigned char *emit_varint(unsigned char *, uint64_t);
+static int            read_varint(const unsigned char **, const unsigned char *, uint64_t *);
+
+int
+pixed_document_write_file_compressed(PixedDocument *document, char *file_name)
+{
+	if (!document)
+		return -1;
+
+	// Mapped documents are read while the file is written, it is renamed over them at the end
+	char *temp_name = 0;
+	int fd = open_replacement(file_name, &temp_name);
+	if (fd < 0)
+		return -1;
+
+	int result = -1;
+
+	if (document->layers_length > 0) {
+		result = write_layers(document, fd);
+	} else {
+		PixedEncoding encoding;
+		struct iovec *iov = 0;
+
+		if (encode_document(document, &encoding) == 0) {
+			iov = malloc(sizeof(struct iovec) * (encoding.chunk_count + 1));
+			if (iov)
+				result = write_vector(fd, iov, encoding_vectors(&encoding, iov));
+
+			encoding_free(&encoding);
+		}
+
+		free(iov);
+	}
+
+	return finish_replacement(fd, temp_name, file_name, result);
+}
+
+/*
+ * Decodes rows [first_row, first_row + rows) of a compressed document held
+ * in data, rows is clamped against the document height.
+ */
+PixedDocument *
+pixed_document_decode(const char *name, const unsigned char *data, size_t length, uint32_t first_row, uint32_t rows)
+{
+	if (length < PIXED_V2_HEADER_SIZE || strncmp((const char *)data, PIXED_HEADER_MAGIC, 4) != 0)
+		return 0;
+
+	uint32_t version = parse_uint32_big_endian(data + 8);
+
+	if (parse_uint32_big_endian(data + 4) == 0 && version == PIXED_VERSION_LAYERED)
+		return decode_layers(name, data, length, first_row, rows);
+
+	if (parse_uint32_big_endian(data + 4) != 0 ||
+		(version != PIXED_VERSION_COMPRESSED && version != PIXED_VERSION_INDEXED) ||
+		parse_uint32_big_endian(data + 20) != PIXED_CODEC_RLZ)
+		return 0;
+
+	uint32_t width = parse_uint32_big_endian(data + 12);
+	uint32_t height = parse_uint32_big_endian(data + 16);
+	uint32_t chunk_rows = parse_uint32_big_endian(data + 24);
+	uint32_t chunk_count = parse_uint32_big_endian(data + 28);
+	uint32_t palette_length = 0;
+	size_t index_offset = PIXED_V2_HEADER_SIZE;
+
+	if (width == 0 || height == 0 || chunk_rows == 0 || first_row >= height)
+		return 0;
+
+	if (version == PIXED_VERSION_INDEXED) {
+		if (length < PIXED_V2_HEADER_SIZE + 4)
+			return 0;
+
+		palette_length = parse_uint32_big_endian(data + PIXED_V2_HEADER_SIZE);
+		index_offset += sizeof(uint32_t) * (1 + (size_t)palette_length);
+
+		if (palette_length == 0 || palette_length > PIXED_PALETTE_MAX || length < index_offset)
+			return 0;
+	}
+
+	if (chunk_count != (height + (uint64_t)chunk_rows - 1) / chunk_rows ||
+		(length - index_offset) / PIXED_V2_INDEX_SIZE < chunk_count)
+		return 0;
+
+	rows = PIXED_MIN(rows, height - first_row);
+
+	uint32_t first_chunk = first_row / chunk_rows;
+	uint32_t last_chunk = (first_row + rows - 1) / chunk_rows;
+	uint32_t chunks_length = last_chunk - first_chunk + 1;
+
+	PixedDocument *document = version == PIXED_VERSION_INDEXED
+		? pixed_document_new_indexed(name, width, rows)
+		: pixed_document_new(name, width, rows);
+	int *results = calloc(chunks_length, sizeof(int));
+
+	if (!document || !results) {
+		if (document)
+			pixed_document_free(document);
+
+		free(results);
+		return 0;
+	}
+
+	PixedDecodeJob job;
+	job.data = data;
+	job.length = length;
+	job.index_offset = index_offset;
+	job.width = width;
+	job.height = height;
+	job.chunk_rows = chunk_rows;
+	job.first_chunk = first_chunk;
+	job.first_row = first_row;
+	job.rows = rows;
+	job.results = results;
+
+	if (version == PIXED_VERSION_INDEXED) {
+		memcpy(document->palette, data + PIXED_V2_HEADER_SIZE + 4, sizeof(uint32_t) * palette_length);
+		document->palette_length = palette_length;
+
+		job.out = document->indices;
+		job.element = sizeof(uint8_t);
+	} else {
+		job.out = (unsigned char *)document->canvas;
+		job.element = sizeof(uint32_t);
+	}
+
+	pixed_parallel_rows(chunks_length, width * chunk_rows, decode_chunks, &job);
+
+	uint32_t i = 0;
+	for (; i < chunks_length; i++) {
+		if (results[i] != 0) {
+			pixed_document_free(document);
+			document = 0;
+			break;
+		}
+	}
+
+	free(results);
+	return document;
+}
+
+/* Compresses document into a v2 or v3 header and chunks, offsets start at the header */
+static
+int
+encode_document(PixedDocument *document, PixedEncoding *encoding)
+{
+	int indexed = document->storage == PIXED_STORAGE_INDEXED;
+	uint32_t chunk_count = (document->height + PIXED_V2_CHUNK_ROWS - 1) / PIXED_V2_CHUNK_ROWS;
+	size_t palette_size = indexed ? sizeof(uint32_t) * (1 + document->palette_length) : 0;
+	size_t index_offset = PIXED_V2_HEADER_SIZE + palette_size;
+	size_t header_size = index_offset + (size_t)PIXED_V2_INDEX_SIZE * chunk_count;
+	uint32_t i = 0;
+
+	encoding->header = malloc(header_size);
+	encoding->header_size = header_size;
+	encoding->chunks = calloc(chunk_count, sizeof(PixedChunk));
+	encoding->chunk_count = chunk_count;
+
+	if (!encoding->header || !encoding->chunks) {
+		encoding_free(encoding);
+		return -1;
+	}
+
+	PixedCompressJob job;
+	job.document = document;
+	job.chunks = encoding->chunks;
+	job.chunk_rows = PIXED_V2_CHUNK_ROWS;
+
+	pixed_parallel_rows(chunk_count, document->width * PIXED_V2_CHUNK_ROWS, compress_chunks, &job);
+
+	unsigned char *header = encoding->header;
+	memcpy(header, PIXED_HEADER_MAGIC, 4);
+	store_uint32_big_endian(header + 4, 0);
+	store_uint32_big_endian(header + 8, indexed ? PIXED_VERSION_INDEXED : PIXED_VERSION_COMPRESSED);
+	store_uint32_big_endian(header + 12, document->width);
+	store_uint32_big_endian(header + 16, document->height);
+	store_uint32_big_endian(header + 20, PIXED_CODEC_RLZ);
+	store_uint32_big_endian(header + 24, PIXED_V2_CHUNK_ROWS);
+	store_uint32_big_endian(header + 28, chunk_count);
+
+	if (indexed) {
+		store_uint32_big_endian(header + PIXED_V2_HEADER_SIZE, document->palette_length);
+		memcpy(header + PIXED_V2_HEADER_SIZE + 4, document->palette, sizeof(uint32_t) * document->palette_length);
+	}
+
+	uint64_t offset = header_size;
+	for (i = 0; i < chunk_count; i++) {
+		unsigned char *entry = header + index_offset + (size_t)i * PIXED_V2_INDEX_SIZE;
+
+		if (!encoding->chunks[i].data) {
+			encoding_free(encoding);
+			return -1;
+		}
+
+		store_uint32_big_endian(entry, offset >> 32);
+		store_uint32_big_endian(entry + 4, (uint32_t)offset);
+		store_uint32_big_endian(entry + 8, encoding->chunks[i].size);
+		store_uint32_big_endian(entry + 12, encoding->chunks[i].flags);
+
+		offset += encoding->chunks[i].size;
+	}
+
+	encoding->size = offset;
+	return 0;
+}
+
+/* Fills chunk count + 1 vectors with the header and chunks, returns how many */
+static
+int
+encoding_vectors(PixedEncoding *encoding, struct iovec *iov)
+{
+	uint32_t i = 0;
+
+	iov[0].iov_base = encoding->header;
+	iov[0].iov_len = encoding->header_size;
+
+	for (; i < encoding->chunk_count; i++) {
+		iov[i + 1].iov_base = encoding->chunks[i].data;
+		iov[i + 1].iov_len = encoding->chunks[i].size;
+	}
+
+	return encoding->chunk_count + 1;
+}
+
+static
+void
+encoding_free(PixedEncoding *encoding)
+{
+	uint32_t i = 0;
+	for (; encoding->chunks && i < encoding->chunk_count; i++)
+		free(encoding->chunks[i].data);
+
+	free(encoding->chunks);
+	free(encoding->header);
+
+	encoding->chunks = 0;
+	encoding->header = 0;
+}
+
+/* Every layer is compressed as a document of its own, then written after the layer index */
+static
+int
+write_layers(PixedDocument *document, int fd)
+{
+	uint32_t layers_length = document->layers_length, i = 0;
+	size_t header_size = PIXED_V2_HEADER_SIZE + (size_t)PIXED_V2_INDEX_SIZE * layers_length;
+	PixedEncoding *encodings = calloc(layers_length, sizeof(PixedEncoding));
+	unsigned char *header = calloc(header_size, 1);
+	struct iovec *iov = 0;
+	int result = -1, iov_count = 1;
+
+	if (!encodings || !header)
+		goto cleanup;
+
+	memcpy(header, PIXED_HEADER_MAGIC, 4);
+	store_uint32_big_endian(header + 8, PIXED_VERSION_LAYERED);
+	store_uint32_big_endian(header + 12, document->width);
+	store_uint32_big_endian(header + 16, document->height);
+	store_uint32_big_endian(header + 20, layers_length);
+
+	uint64_t offset = header_size;
+	for (i = 0; i < layers_length; i++) {
+		PixedLayer *layer = &document->layers[i];
+		unsigned char *entry = header + PIXED_V2_HEADER_SIZE + (size_t)i * PIXED_V2_INDEX_SIZE;
+
+		if (encode_document(layer->pixels, &encodings[i]) != 0 || encodings[i].size > UINT32_MAX) {
+			layers_length = i + 1;
+			goto cleanup;
+		}
+
+		store_uint32_big_endian(entry, offset >> 32);
+		store_uint32_big_endian(entry + 4, (uint32_t)offset);
+		store_uint32_big_endian(entry + 8, (uint32_t)encodings[i].size);
+		entry[12] = layer->opacity;
+		entry[13] = (unsigned char)layer->blend;
+		entry[14] = layer->visible ? 1 : 0;
+
+		offset += encodings[i].size;
+		iov_count += encodings[i].chunk_count + 1;
+	}
+
+	iov = malloc(sizeof(struct iovec) * iov_count);
+	if (!iov)
+		goto cleanup;
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_size;
+
+	for (i = 0, iov_count = 1; i < layers_length; i++)
+		iov_count += encoding_vectors(&encodings[i], iov + iov_count);
+
+	result = write_vector(fd, iov, iov_count);
+
+cleanup:
+	for (i = 0; encodings && i < layers_length; i++)
+		encoding_free(&encodings[i]);
+
+	free(encodings);
+	free(header);
+	free(iov);
+
+	return result;
+}
+
+/* Decodes rows [first_row, first_row + rows) of every layer and composites them */
+static
+PixedDocument *
+decode_layers(const char *name, const unsigned char *data, size_t length, uint32_t first_row, uint32_t rows)
+{
+	uint32_t width = parse_uint32_big_endian(data + 12);
+	uint32_t height = parse_uint32_big_endian(data + 16);
+	uint32_t layers_length = parse_uint32_big_endian(data + 20);
+	uint32_t i = 0;
+
+	if (width == 0 || height == 0 || layers_length == 0 || first_row >= height ||
+		(length - PIXED_V2_HEADER_SIZE) / PIXED_V2_INDEX_SIZE < layers_length)
+		return 0;
+
+	rows = PIXED_MIN(rows, height - first_row);
+
+	PixedDocument *document = pixed_document_new(name, width, rows);
+	PixedLayer *layers = calloc(layers_length, sizeof(PixedLayer));
+
+	if (!document || !layers) {
+		if (document)
+			pixed_document_free(document);
+
+		free(layers);
+		return 0;
+	}
+
+	document->layers = layers;
+
+	for (; i < layers_length; i++) {
+		const unsigned char *entry = data + PIXED_V2_HEADER_SIZE + (size_t)i * PIXED_V2_INDEX_SIZE;
+		uint64_t offset = ((uint64_t)parse_uint32_big_endian(entry) << 32) | parse_uint32_big_endian(entry + 4);
+		uint32_t size = parse_uint32_big_endian(entry + 8);
+
+		// Layers can't nest and have to cover the whole document
+		PixedDocument *pixels = offset >= PIXED_V2_HEADER_SIZE + (uint64_t)PIXED_V2_INDEX_SIZE * layers_length &&
+			offset <= length && size <= length - offset && size >= 12 &&
+			parse_uint32_big_endian(data + offset + 8) != PIXED_VERSION_LAYERED
+			? pixed_document_decode(name, data + offset, size, first_row, rows)
+			: 0;
+
+		if (!pixels || pixels->width != width || pixels->height != rows ||
+			entry[13] > PIXED_BLEND_SCREEN) {
+			if (pixels)
+				pixed_document_free(pixels);
+
+			pixed_document_free(document);
+			return 0;
+		}
+
+		layers[i].pixels = pixels;
+		layers[i].opacity = entry[12];
+		layers[i].blend = (PixedBlendMode)entry[13];
+		layers[i].visible = entry[14] != 0;
+		document->layers_length++;
+	}
+
+	pixed_document_mark_dirty(layers[0].pixels, 0, 0, width, rows);
+
+	if (pixed_document_composite(document) != 0) {
+		pixed_document_free(document);
+		return 0;
+	}
+
+	return document;
+}
+
+static
+void
+compress_chunks(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedCompressJob *job = ctx;
+	PixedDocument *document = job->document;
+
+	int tiled = document->storage == PIXED_STORAGE_TILED;
+	size_t element = document->storage == PIXED_STORAGE_INDEXED ? sizeof(uint8_t) : sizeof(uint32_t);
+	size_t band_length = (size_t)document->width * job->chunk_rows;
+	uint32_t *table = malloc(sizeof(uint32_t) * PIXED_CODEC_TABLE_SIZE);
+	uint32_t *band = tiled ? malloc(sizeof(uint32_t) * band_length) : 0;
+
+	if (!table || (tiled && !band)) {
+		free(table);
+		free(band);
+		return;
+	}
+
+	uint32_t chunk = begin;
+	for (; chunk < end; chunk++) {
+		uint32_t y = chunk * job->chunk_rows;
+		uint32_t rows = PIXED_MIN(job->chunk_rows, document->height - y);
+		size_t length = (size_t)document->width * rows;
+		const unsigned char *pixels = element == sizeof(uint8_t)
+			? document->indices + (size_t)y * document->width
+			: (const unsigned char *)(document->canvas + (size_t)y * document->width);
+
+		if (tiled) {
+			pixed_document_copy_rows(document, y, rows, band);
+			pixels = (const unsigned char *)band;
+		}
+
+		// Worst case is a one pixel literal between every two pixel match
+		unsigned char *data = malloc(length * (element + 2) + 16);
+		if (!data)
+			continue;
+
+		size_t size = pixed_codec_encode(pixels, length, element, document->width, table, data);
+		uint32_t flags = 0;
+
+		if (size >= length * element) {
+			size = length * element;
+			flags = PIXED_CHUNK_STORED;
+			memcpy(data, pixels, size);
+		}
+
+		unsigned char *shrunk = realloc(data, size);
+
+		job->chunks[chunk].data = shrunk ? shrunk : data;
+		job->chunks[chunk].size = size;
+		job->chunks[chunk].flags = flags;
+	}
+
+	free(table);
+	free(band);
+}
+
+static
+void
+decode_chunks(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedDecodeJob *job = ctx;
+	unsigned char *scratch = 0;
+
+	uint32_t i = begin;
+	for (; i < end; i++) {
+		uint32_t chunk = job->first_chunk + i;
+		const unsigned char *entry = job->data + job->index_offset + (size_t)chunk * PIXED_V2_INDEX_SIZE;
+
+		uint64_t offset = ((uint64_t)parse_uint32_big_endian(entry) << 32) | parse_uint32_big_endian(entry + 4);
+		uint32_t size = parse_uint32_big_endian(entry + 8);
+		uint32_t flags = parse_uint32_big_endian(entry + 12);
+
+		uint32_t y = chunk * job->chunk_rows;
+		uint32_t rows = PIXED_MIN(job->chunk_rows, job->height - y);
+		size_t length = (size_t)job->width * rows;
+
+		job->results[i] = -1;
+
+		if (offset > job->length || size > job->length - offset)
+			continue;
+
+		// Chunks sticking out of the requested rows go through scratch
+		unsigned char *out = job->out + (size_t)(y - PIXED_MIN(y, job->first_row)) * job->width * job->element;
+		int partial = y < job->first_row || y + rows > job->first_row + job->rows;
+
+		if (partial) {
+			if (!scratch)
+				scratch = malloc(job->element * (size_t)job->width * job->chunk_rows);
+
+			if (!scratch)
+				continue;
+
+			out = scratch;
+		}
+
+		if (flags & PIXED_CHUNK_STORED) {
+			if (size != length * job->element)
+				continue;
+
+			memcpy(out, job->data + offset, size);
+		} else if (pixed_codec_decode(job->data + offset, size, out, length, job->element) != 0) {
+			continue;
+		}
+
+		if (partial) {
+			uint32_t from = PIXED_MAX(y, job->first_row);
+			uint32_t to = PIXED_MIN(y + rows, job->first_row + job->rows);
+
+			memcpy(job->out + (size_t)(from - job->first_row) * job->width * job->element,
+				scratch + (size_t)(from - y) * job->width * job->element,
+				job->element * (size_t)job->width * (to - from));
+		}
+
+		job->results[i] = 0;
+	}
+
+	free(scratch);
+}
+
+/* Reads element i, pixels or palette indices */
+static inline
+uint32_t
+element_at(const unsigned char *data, size_t i, size_t element)
+{
+	uint32_t value = 0;
+
+	if (element == sizeof(uint8_t))
+		return data[i];
+
+	memcpy(&value, data + i * sizeof(uint32_t), sizeof(uint32_t));
+	return value;
+}
+
+/*
+ * Greedy encoder, takes the longest of the run at the current element, the
+ * match against the row above or the last position with the same two elements.
+ */
+size_t
+pixed_codec_encode(const unsigned char *data, size_t length, size_t element, uint32_t width, uint32_t *table, unsigned char *out)
+{
+	unsigned char *cursor = out;
+	size_t i = 0, literal = 0;
+
+	memset(table, 0xff, sizeof(uint32_t) * PIXED_CODEC_TABLE_SIZE);
+
+	while (i < length) {
+		uint32_t current = element_at(data, i, element);
+		size_t run = 1;
+
+		while (i + run < length && element_at(data, i + run, element) == current)
+			run++;
+
+		size_t best_length = 0, best_distance = 0;
+		size_t candidates[2] = { i >= width ? i - width : SIZE_MAX, SIZE_MAX };
+		int c = 0;
+
+		// Long runs are cheap enough, only rows repeating the one above beat them
+		if (run < CODEC_LONG_RUN && i + 1 < length) {
+			uint32_t hash = ((current * 2654435761u) ^ (element_at(data, i + 1, element) * 2246822519u)) >> (32 - PIXED_CODEC_TABLE_BITS);
+
+			candidates[1] = table[hash] == UINT32_MAX ? SIZE_MAX : table[hash];
+			table[hash] = i;
+		}
+
+		for (; c < 2; c++) {
+			size_t candidate = candidates[c], match = 0;
+			if (candidate >= i)
+				continue;
+
+			while (i + match < length && element_at(data, candidate + match, element) == element_at(data, i + match, element))
+				match++;
+
+			if (match > best_length) {
+				best_length = match;
+				best_distance = i - candidate;
+			}
+		}
+
+		if (best_length >= 2 && best_length > run) {
+			cursor = emit_literals(cursor, data + literal * element, i - literal, element);
+			cursor = emit_token(cursor, TOKEN_MATCH, best_length);
+			cursor = emit_varint(cursor, best_distance);
+
+			i += best_length;
+			literal = i;
+		} else if (run >= 2) {
+			cursor = emit_literals(cursor, data + literal * element, i - literal, element);
+			cursor = emit_token(cursor, TOKEN_RUN, run);
+			memcpy(cursor, data + i * element, element);
+			cursor += element;
+
+			i += run;
+			literal = i;
+		} else {
+			i++;
+		}
+	}
+
+	cursor = emit_literals(cursor, data + literal * element, i - literal, element);
+	return cursor - out;
+}
+
+int
+pixed_codec_decode(const unsigned char *in, size_t in_length, unsigned char *out, size_t length, size_t element)
+{
+	const unsigned char *end = in + in_length;
+	size_t position = 0;
+
+	while (position < length) {
+		if (in >= end)
+			return -1;
+
+		unsigned char token = *in++;
+		uint64_t count = token & TOKEN_LENGTH;
+		uint64_t extra = 0, distance = 0;
+
+		if (count == TOKEN_LENGTH) {
+			if (read_varint(&in, end, &extra) != 0)
+				return -1;
+
+			count += extra;
+		}
+
+		count++;
+		if (count > length - position)
+			return -1;
+
+		unsigned char *dst = out + position * element;
+
+		switch (token & TOKEN_TYPE) {
+		case TOKEN_LITERAL:
+			if ((size_t)(end - in) / element < count)
+				return -1;
+
+			memcpy(dst, in, element * count);
+			in += element * count;
+			break;
+
+		case TOKEN_RUN:
+			if ((size_t)(end - in) < element)
+				return -1;
+
+			if (element == sizeof(uint8_t)) {
+				memset(dst, *in, count);
+			} else {
+				uint32_t pixel, *run = (uint32_t *)dst, *run_end = run + count;
+				memcpy(&pixel, in, sizeof(uint32_t));
+
+				while (run < run_end)
+					*run++ = pixel;
+			}
+
+			in += element;
+			break;
+
+		case TOKEN_MATCH: {
+			if (read_varint(&in, end, &distance) != 0 || distance == 0 || distance > position)
+				return -1;
+
+			unsigned char *src = dst - distance * element;
+			if (distance >= count) {
+				memcpy(dst, src, element * count);
+			} else {
+				// Overlapping matches repeat the pattern
+				uint64_t k = 0;
+				for (; k < count * element; k++)
+					dst[k] = src[k];
+			}
+			break;
+		}
+
+		default:
+			return -1;
+		}
+
+		position += count;
+	}
+
+	return in == end ? 0 : -1;
+}
+
+static
+unsigned char *
+emit_token(unsigned char *cursor, unsigned char type, size_t length)
+{
+	size_t count = length - 1;
+
+	if (count < TOKEN_LENGTH) {
+		*cursor++ = type | count;
+		return cursor;
+	}
+
+	*cursor++ = type | TOKEN_LENGTH;
+	return emit_varint(cursor, count - TOKEN_LENGTH);
+}
+
+static
+unsigned char *
+emit_literals(unsigned char *cursor, const unsigned char *data, size_t length, size_t element)
+{
+	if (length == 0)
+		return cursor;
+
+	cursor = emit_token(cursor, TOKEN_LITERAL, length);
+	memcpy(cursor, data, element * length);
+
+	return cursor + element * length;
+}
+
+static
+unsigned char *
+emit_varint(unsigned char *cursor, uint64_t value)
+{
+	while (value >= 0x80) {
+		*cursor++ = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+
+	*cursor++ = value;
+	return cursor;
+}
+
+static
+int
+read_varint(const unsigned char **in, const unsigned char *end, uint64_t *value)
+{
+	const unsigned char *cursor = *in;
+	uint64_t result = 0;
+	int shift = 0;
+
+	for (; cursor < end && shift < 64; shift += 7) {
+		unsigned char byte = *cursor++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+
+		if (!(byte & 0x80)) {
+			*in = cursor;
+			*value = result;
+			return 0;
+		}
+	}
+
+	return -1;
+}
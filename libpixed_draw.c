@@ -0,0 +1,580 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+typedef struct {
+	int32_t x1, x2; // inclusive columns of the parent span
+	int32_t y, dy;  // row to scan and the direction it was reached from
+} PixedFillSeed;
+
+typedef struct {
+	PixedDocument *document;
+	uint32_t       from, to;  // canvas order
+	uint8_t       *changed;   // one flag per row
+	uint8_t       *tiles;     // set where a tile may hold from, 0 when any may
+	int            failed;    // a shared tile couldn't be copied
+} PixedReplaceJob;
+
+static void     fill_pixels(uint32_t *, uint32_t, uint32_t);
+static int      fill_push(PixedFillStack *, int64_t, int64_t, int64_t, int64_t, uint32_t);
+static int      fill_inside(PixedDocument *, int64_t, int64_t, uint32_t);
+static int64_t  fill_scan_right(PixedDocument *, int64_t, int64_t, uint32_t);
+static void     replace_rows(void *, uint32_t, uint32_t);
+static int      replace_pixels(uint32_t *, uint32_t, uint32_t, uint32_t);
+static int      tile_holds(const PixedTile *, uint32_t);
+
+/*
+ * Writes color over length pixels starting at x, y, clipped against the
+ * document. The whole span is recorded for undo and marked dirty at once.
+ */
+int
+pixed_document_fill_span(PixedDocument *document, int x, int y, int length, uint32_t color)
+{
+	if (y < 0 || y >= (int64_t)document->height || length <= 0)
+		return 0;
+
+	int64_t begin = PIXED_MAX(x, 0);
+	int64_t end = PIXED_MIN((int64_t)x + length, (int64_t)document->width);
+	if (begin >= end)
+		return 0;
+
+	uint32_t span_x = (uint32_t)begin, span_length = (uint32_t)(end - begin);
+	uint32_t canvas_color = pixed_canvas_color(color);
+
+	pixed_document_modify(document, span_x, y, span_length, 1);
+
+	if (document->storage == PIXED_STORAGE_FLAT) {
+		fill_pixels(document->canvas + (size_t)y * document->width + span_x, span_length, canvas_color);
+	} else if (document->storage == PIXED_STORAGE_INDEXED) {
+		int index = pixed_document_palette_index(document, color);
+
+		// New colors take a free palette entry
+		if (index < 0) {
+			index = document->palette_length;
+			if (pixed_document_set_palette_color(document, index, color) != 0)
+				return -1;
+		}
+
+		memset(document->indices + (size_t)y * document->width + span_x, index, span_length);
+	} else {
+		uint32_t tile_y = y / PIXED_TILE_SIZE, row = y % PIXED_TILE_SIZE;
+
+		while (span_length > 0) {
+			uint32_t tile_x = span_x / PIXED_TILE_SIZE, column = span_x % PIXED_TILE_SIZE;
+			uint32_t count = PIXED_MIN(span_length, PIXED_TILE_SIZE - column);
+			PixedTile tile;
+
+			// Clearing untouched pixels doesn't need tiles of their own
+			if (pixed_document_get_tile(document, tile_x, tile_y, 0, &tile) != 0)
+				return -1;
+
+			if (!tile.empty || canvas_color != 0) {
+				if (pixed_document_get_tile(document, tile_x, tile_y, 1, &tile) != 0)
+					return -1;
+
+				fill_pixels(tile.pixels + (size_t)row * tile.stride + column, count, canvas_color);
+			}
+
+			span_x += count;
+			span_length -= count;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Draws a stroke of a size x size square brush from x0, y0 to x1, y1. The
+ * brush follows the Bresenham line between the two points, every row of the
+ * stroke is written as a single span so no pixel is written twice. touched
+ * receives the bounding box of the written pixels, width 0 if none were.
+ */
+int
+pixed_document_draw_line(PixedDocument *document, int x0, int y0, int x1, int y1, uint32_t size, uint32_t color, PixedRect *touched)
+{
+	touched->x = touched->y = touched->width = touched->height = 0;
+
+	if (size == 0)
+		return 0;
+
+	int64_t before = (size - 1) / 2, after = size / 2;
+	int64_t top = PIXED_MIN(y0, y1) - before, bottom = PIXED_MAX(y0, y1) + after;
+
+	// Rows outside the document are never written
+	int64_t first_row = PIXED_MAX(top, 0), last_row = PIXED_MIN(bottom, (int64_t)document->height - 1);
+	if (first_row > last_row)
+		return 0;
+
+	size_t rows = (size_t)(last_row - first_row + 1);
+	int64_t *extents = malloc(sizeof(int64_t) * 2 * rows);
+	if (!extents)
+		return -1;
+
+	size_t i = 0;
+	for (; i < rows; i++) {
+		extents[2 * i] = INT64_MAX;
+		extents[2 * i + 1] = INT64_MIN;
+	}
+
+	int64_t dx = x1 > x0 ? (int64_t)x1 - x0 : (int64_t)x0 - x1, step_x = x1 > x0 ? 1 : -1;
+	int64_t dy = y1 > y0 ? (int64_t)y0 - y1 : (int64_t)y1 - y0, step_y = y1 > y0 ? 1 : -1;
+	int64_t error = dx + dy, x = x0, y = y0;
+
+	for (;;) {
+		// Stamp the brush into the rows it covers
+		int64_t row = PIXED_MAX(y - before, first_row), row_end = PIXED_MIN(y + after, last_row);
+		for (; row <= row_end; row++) {
+			int64_t *extent = extents + 2 * (row - first_row);
+
+			extent[0] = PIXED_MIN(extent[0], x - before);
+			extent[1] = PIXED_MAX(extent[1], x + after);
+		}
+
+		if (x == x1 && y == y1)
+			break;
+
+		int64_t error2 = 2 * error;
+		if (error2 >= dy) {
+			error += dy;
+			x += step_x;
+		}
+
+		if (error2 <= dx) {
+			error += dx;
+			y += step_y;
+		}
+	}
+
+	int64_t min_x = INT64_MAX, max_x = INT64_MIN, min_y = INT64_MAX, max_y = INT64_MIN;
+	int result = 0;
+
+	for (i = 0; i < rows; i++) {
+		int64_t begin = PIXED_MAX(extents[2 * i], 0);
+		int64_t end = PIXED_MIN(extents[2 * i + 1], (int64_t)document->width - 1);
+		if (begin > end)
+			continue;
+
+		if (pixed_document_fill_span(document, (int)begin, (int)(first_row + i), (int)(end - begin + 1), color) != 0)
+			result = -1;
+
+		min_x = PIXED_MIN(min_x, begin);
+		max_x = PIXED_MAX(max_x, end);
+		min_y = PIXED_MIN(min_y, first_row + (int64_t)i);
+		max_y = first_row + (int64_t)i;
+	}
+
+	if (min_x <= max_x) {
+		touched->x = (uint32_t)min_x;
+		touched->y = (uint32_t)min_y;
+		touched->width = (uint32_t)(max_x - min_x + 1);
+		touched->height = (uint32_t)(max_y - min_y + 1);
+	}
+
+	free(extents);
+	return result;
+}
+
+/*
+ * Scanline flood fill of the 4-connected region of the color at x, y. Spans
+ * waiting to be scanned live on stack, which can be kept between calls to
+ * reuse its memory (zero it before first use), or 0 for a temporary one.
+ */
+int
+pixed_document_flood_fill(PixedDocument *document, uint32_t x, uint32_t y, uint32_t color, PixedFillStack *stack, PixedRect *touched)
+{
+	touched->x = touched->y = touched->width = touched->height = 0;
+
+	if (x >= document->width || y >= document->height)
+		return -1;
+
+	PixedFillStack temporary = { 0, 0, 0 };
+	if (!stack)
+		stack = &temporary;
+
+	// Matching is done in storage representation, a palette index for indexed documents
+	uint32_t target = 0;
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		target = document->indices[(size_t)y * document->width + x];
+		if (document->palette[target] == pixed_canvas_color(color))
+			return 0;
+	} else {
+		target = pixed_canvas_color(pixed_document_read_pixel(document, x, y));
+		if (target == pixed_canvas_color(color))
+			return 0;
+	}
+
+	int64_t min_x = x, max_x = x, min_y = y, max_y = y;
+	int result = 0;
+
+	stack->length = 0;
+	if (fill_push(stack, x, x, y, 1, document->height) != 0 ||
+		fill_push(stack, x, x, (int64_t)y - 1, -1, document->height) != 0)
+		result = -1;
+
+	while (result == 0 && stack->length > 0) {
+		PixedFillSeed seed = ((PixedFillSeed *)stack->seeds)[--stack->length];
+		int64_t x1 = seed.x1, x2 = seed.x2, row = seed.y, dy = seed.dy;
+		int64_t start = x1;
+
+		if (fill_inside(document, start, row, target)) {
+			while (start > 0 && fill_inside(document, start - 1, row, target))
+				start--;
+
+			if (start < x1 && fill_push(stack, start, x1 - 1, row - dy, -dy, document->height) != 0)
+				result = -1;
+		}
+
+		while (x1 <= x2) {
+			x1 = fill_scan_right(document, x1, row, target);
+
+			if (x1 > start) {
+				if (pixed_document_fill_span(document, (int)start, (int)row, (int)(x1 - start), color) != 0 ||
+					fill_push(stack, start, x1 - 1, row + dy, dy, document->height) != 0)
+					result = -1;
+
+				min_x = PIXED_MIN(min_x, start);
+				max_x = PIXED_MAX(max_x, x1 - 1);
+				min_y = PIXED_MIN(min_y, row);
+				max_y = PIXED_MAX(max_y, row);
+			}
+
+			// The span leaked past its parent, look back the other way too
+			if (x1 - 1 > x2 && fill_push(stack, x2 + 1, x1 - 1, row - dy, -dy, document->height) != 0)
+				result = -1;
+
+			x1++;
+			while (x1 < x2 && !fill_inside(document, x1, row, target))
+				x1++;
+
+			start = x1;
+		}
+	}
+
+	touched->x = (uint32_t)min_x;
+	touched->y = (uint32_t)min_y;
+	touched->width = (uint32_t)(max_x - min_x + 1);
+	touched->height = (uint32_t)(max_y - min_y + 1);
+
+	if (stack == &temporary)
+		pixed_fill_stack_free(&temporary);
+
+	return result;
+}
+
+void
+pixed_fill_stack_free(PixedFillStack *stack)
+{
+	free(stack->seeds);
+
+	stack->seeds = 0;
+	stack->length = 0;
+	stack->capacity = 0;
+}
+
+/*
+ * Replaces every pixel of color from with color to, rows are compared and
+ * selected in parallel. Indexed documents only touch their palette unless
+ * to is already in it.
+ */
+int
+pixed_document_replace_color(PixedDocument *document, uint32_t from, uint32_t to)
+{
+	if (from == to)
+		return 0;
+
+	// The color index knows when there is nothing to replace
+	if (document->colors && pixed_color_index_count(document->colors, from) == 0)
+		return 0;
+
+	// The history has to see every pixel of from before it turns into to
+	if (document->history && !(document->storage == PIXED_STORAGE_INDEXED && pixed_document_palette_index(document, to) < 0))
+		pixed_history_capture_color(document->history, from);
+
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		int from_index = pixed_document_palette_index(document, from);
+		int to_index = pixed_document_palette_index(document, to);
+
+		if (from_index < 0)
+			return 0;
+
+		if (to_index < 0)
+			return pixed_document_set_palette_color(document, from_index, to);
+
+		if (document->colors)
+			pixed_color_index_replace(document->colors, from_index, to_index);
+
+		size_t i = 0, length = (size_t)document->width * document->height;
+		for (; i < length; i++) {
+			if (document->indices[i] == from_index)
+				document->indices[i] = to_index;
+		}
+
+		pixed_document_mark_dirty(document, 0, 0, document->width, document->height);
+		return 0;
+	}
+
+	PixedReplaceJob job;
+	job.document = document;
+	job.from = pixed_canvas_color(from);
+	job.to = pixed_canvas_color(to);
+	job.changed = calloc(document->height, sizeof(uint8_t));
+	job.tiles = 0;
+	job.failed = 0;
+	if (!job.changed)
+		return -1;
+
+	// Tiles the color index rules out are skipped, the counts move over without a scan
+	if (document->colors) {
+		job.tiles = malloc((size_t)document->tiles_x * document->tiles_y);
+		if (job.tiles && pixed_color_index_tiles(document->colors, from, job.tiles) != 0) {
+			free(job.tiles);
+			job.tiles = 0;
+		}
+
+		pixed_color_index_replace(document->colors, job.from, job.to);
+	}
+
+	if (document->storage == PIXED_STORAGE_FLAT)
+		pixed_parallel_rows(document->height, document->width, replace_rows, &job);
+	else
+		replace_rows(&job, 0, document->tiles_y);
+
+	// Only the rows that changed need to go to the GPU again
+	uint32_t first = 0, last = document->height;
+	while (first < document->height && !job.changed[first])
+		first++;
+
+	while (last > first && !job.changed[last - 1])
+		last--;
+
+	if (first < last)
+		pixed_document_mark_dirty(document, 0, first, document->width, last - first);
+
+	free(job.changed);
+	free(job.tiles);
+	return job.failed ? -1 : 0;
+}
+
+/* Rows of flat documents, rows of tiles for tiled documents */
+static
+void
+replace_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedReplaceJob *job = ctx;
+	PixedDocument *document = job->document;
+	uint32_t y = begin;
+
+	if (document->storage == PIXED_STORAGE_FLAT) {
+		uint32_t tile_x = 0;
+
+		for (; y < end && !job->tiles; y++)
+			job->changed[y] = replace_pixels(document->canvas + (size_t)y * document->width, document->width, job->from, job->to);
+
+		for (; y < end; y++) {
+			uint32_t *row = document->canvas + (size_t)y * document->width;
+			const uint8_t *tiles = job->tiles + (size_t)(y / PIXED_TILE_SIZE) * document->tiles_x;
+
+			for (tile_x = 0; tile_x < document->tiles_x; tile_x++) {
+				uint32_t x = tile_x * PIXED_TILE_SIZE;
+
+				if (tiles[tile_x] && replace_pixels(row + x, PIXED_MIN(PIXED_TILE_SIZE, document->width - x), job->from, job->to))
+					job->changed[y] = 1;
+			}
+		}
+
+		return;
+	}
+
+	for (; y < end; y++) {
+		uint32_t tile_x = 0, row = 0;
+
+		for (; tile_x < document->tiles_x; tile_x++) {
+			PixedTile tile;
+
+			if (job->tiles && !job->tiles[y * document->tiles_x + tile_x])
+				continue;
+
+			// Untouched tiles are transparent, nothing to replace unless that is from
+			if (pixed_document_get_tile(document, tile_x, y, 0, &tile) != 0 || (tile.empty && job->from != 0))
+				continue;
+
+			if (tile.empty && pixed_document_get_tile(document, tile_x, y, 1, &tile) != 0)
+				continue;
+
+			// Tiles shared with other frames are copied before they change, by hand since
+			// a writable tile would take them out of the color index a second time
+			uint32_t index = y * document->tiles_x + tile_x;
+			if (document->pooled && document->pooled[index] && tile_holds(&tile, job->from)) {
+				tile.pixels = pixed_document_unshare_tile(document, index);
+				if (!tile.pixels) {
+					job->failed = 1;
+					continue;
+				}
+			}
+
+			for (row = 0; row < tile.height; row++) {
+				if (replace_pixels(tile.pixels + (size_t)row * tile.stride, tile.width, job->from, job->to))
+					job->changed[tile.y + row] = 1;
+			}
+		}
+	}
+}
+
+/* Returns 1 when any pixel was replaced */
+static
+int
+replace_pixels(uint32_t *pixels, uint32_t length, uint32_t from, uint32_t to)
+{
+	uint32_t i = 0, changed = 0;
+
+#if defined(PIXED_SIMD_SSE2)
+	__m128i from4 = _mm_set1_epi32((int)from), to4 = _mm_set1_epi32((int)to), any = _mm_setzero_si128();
+	for (; i + 4 <= length; i += 4) {
+		__m128i value = _mm_loadu_si128((__m128i *)(pixels + i));
+		__m128i mask = _mm_cmpeq_epi32(value, from4);
+
+		_mm_storeu_si128((__m128i *)(pixels + i), _mm_or_si128(_mm_andnot_si128(mask, value), _mm_and_si128(mask, to4)));
+		any = _mm_or_si128(any, mask);
+	}
+	changed = _mm_movemask_epi8(any) != 0;
+#elif defined(PIXED_SIMD_NEON)
+	uint32x4_t from4 = vdupq_n_u32(from), to4 = vdupq_n_u32(to), any = vdupq_n_u32(0);
+	for (; i + 4 <= length; i += 4) {
+		uint32x4_t value = vld1q_u32(pixels + i);
+		uint32x4_t mask = vceqq_u32(value, from4);
+
+		vst1q_u32(pixels + i, vbslq_u32(mask, to4, value));
+		any = vorrq_u32(any, mask);
+	}
+	changed = (vgetq_lane_u32(any, 0) | vgetq_lane_u32(any, 1) | vgetq_lane_u32(any, 2) | vgetq_lane_u32(any, 3)) != 0;
+#endif
+
+	for (; i < length; i++) {
+		if (pixels[i] == from) {
+			pixels[i] = to;
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/* Seeds for rows outside of the document are never pushed */
+static
+int
+fill_push(PixedFillStack *stack, int64_t x1, int64_t x2, int64_t y, int64_t dy, uint32_t height)
+{
+	if (y < 0 || y >= height)
+		return 0;
+
+	if (stack->length == stack->capacity) {
+		size_t capacity = stack->capacity ? stack->capacity * 2 : PIXED_MAX(height * 2, 256);
+		PixedFillSeed *seeds = realloc(stack->seeds, sizeof(PixedFillSeed) * capacity);
+		if (!seeds)
+			return -1;
+
+		stack->seeds = seeds;
+		stack->capacity = capacity;
+	}
+
+	PixedFillSeed *seed = (PixedFillSeed *)stack->seeds + stack->length++;
+	seed->x1 = (int32_t)x1;
+	seed->x2 = (int32_t)x2;
+	seed->y = (int32_t)y;
+	seed->dy = (int32_t)dy;
+
+	return 0;
+}
+
+static inline
+int
+fill_inside(PixedDocument *document, int64_t x, int64_t y, uint32_t target)
+{
+	if (x < 0 || x >= document->width)
+		return 0;
+
+	size_t i = (size_t)y * document->width + x;
+
+	if (document->storage == PIXED_STORAGE_FLAT)
+		return document->canvas[i] == target;
+
+	if (document->storage == PIXED_STORAGE_INDEXED)
+		return document->indices[i] == target;
+
+	return pixed_canvas_color(pixed_document_read_pixel(document, (uint32_t)x, (uint32_t)y)) == target;
+}
+
+/* First column from x on that doesn't match target */
+static
+int64_t
+fill_scan_right(PixedDocument *document, int64_t x, int64_t y, uint32_t target)
+{
+	if (document->storage == PIXED_STORAGE_FLAT && x >= 0) {
+		const uint32_t *row = document->canvas + (size_t)y * document->width;
+
+#if defined(PIXED_SIMD_SSE2)
+		__m128i target4 = _mm_set1_epi32((int)target);
+		while (x + 4 <= document->width &&
+			_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(row + x)), target4)) == 0xffff)
+			x += 4;
+#endif
+
+		while (x < document->width && row[x] == target)
+			x++;
+
+		return x;
+	}
+
+	while (fill_inside(document, x, y, target))
+		x++;
+
+	return x;
+}
+
+static
+void
+fill_pixels(uint32_t *pixels, uint32_t length, uint32_t color)
+{
+	uint32_t i = 0;
+
+	// Colors with four equal bytes, like transparent black, are a memset
+	if ((color & 0xff) * 0x01010101u == color) {
+		memset(pixels, color & 0xff, sizeof(uint32_t) * length);
+		return;
+	}
+
+#if defined(PIXED_SIMD_SSE2)
+	__m128i value = _mm_set1_epi32((int)color);
+	for (; i + 4 <= length; i += 4)
+		_mm_storeu_si128((__m128i *)(pixels + i), value);
+#elif defined(PIXED_SIMD_NEON)
+	uint32x4_t value = vdupq_n_u32(color);
+	for (; i + 4 <= length; i += 4)
+		vst1q_u32(pixels + i, value);
+#endif
+
+	for (; i < length; i++)
+		pixels[i] = color;
+}
+
+/* Returns 1 when any pixel of tile is color, in canvas order */
+static
+int
+tile_holds(const PixedTile *tile, uint32_t color)
+{
+	uint32_t x = 0, y = 0;
+
+	for (; y < tile->height; y++) {
+		const uint32_t *row = tile->pixels + (size_t)y * tile->stride;
+
+		for (x = 0; x < tile->width; x++) {
+			if (row[x] == color)
+				return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,591 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * Color filters over a rectangle of a document. Every filter maps one color
+ * to another, the same one wherever it is, except for the dither offset
+ * added before mapping to a palette. Sprite sheets hold few distinct colors,
+ * so each row job keeps the colors it mapped in a small cache and the
+ * expensive conversions run about once per color instead of once per pixel.
+ */
+
+#define FILTER_CACHE_BITS 12
+#define FILTER_CACHE_SIZE (1 << FILTER_CACHE_BITS) // colors a row job remembers
+
+typedef enum {
+	FILTER_LUT,
+	FILTER_HSL,
+	FILTER_REMAP,
+	FILTER_PALETTE
+} PixedFilterKind;
+
+typedef struct {
+	PixedFilterKind      kind;
+	const PixedColorLut *lut;
+	float                hue, saturation, lightness; // hue in turns
+
+	uint32_t            *from, *to; // canvas order
+	uint32_t            *slots;     // open addressing, index into from + 1, 0 when free
+	uint32_t             shift;     // 32 minus the bits of a slot
+
+	uint32_t             palette[PIXED_PALETTE_MAX]; // canvas order
+	uint32_t             palette_length;
+	int                  dither;
+	int                  offsets[PIXED_DITHER_CELLS]; // added to r, g and b, by cell
+} PixedFilter;
+
+typedef struct {
+	uint32_t keys[FILTER_CACHE_SIZE];
+	uint32_t values[FILTER_CACHE_SIZE];
+} PixedFilterCache; // direct mapped, canvas order
+
+typedef struct {
+	PixedDocument     *document;
+	const PixedFilter *filter;
+	PixedRect          area;
+} PixedFilterJob;
+
+static const uint8_t filter_bayer[PIXED_DITHER_CELLS] = {
+	 0,  8,  2, 10,
+	12,  4, 14,  6,
+	 3, 11,  1,  9,
+	15,  7, 13,  5
+};
+
+static int      filter_document(PixedDocument *, const PixedRect *, const PixedFilter *);
+static int      filter_indexed(PixedDocument *, const PixedRect *, const PixedFilter *);
+static int      filter_tiled(PixedDocument *, const PixedRect *, const PixedFilter *);
+static void     filter_rows(void *, uint32_t, uint32_t);
+static void     filter_pixels(const PixedFilter *, PixedFilterCache *, uint32_t *, uint32_t, uint32_t, uint32_t);
+static void     filter_cache_init(const PixedFilter *, PixedFilterCache *);
+static uint32_t filter_cached(const PixedFilter *, PixedFilterCache *, uint32_t);
+static uint32_t filter_color(const PixedFilter *, uint32_t);
+static uint32_t filter_dither(const PixedFilter *, uint32_t, uint32_t, uint32_t);
+static uint32_t filter_hsl(const PixedFilter *, uint32_t);
+static float    filter_hue_channel(float, float, float);
+static uint32_t filter_nearest(const PixedFilter *, uint32_t);
+
+void
+pixed_color_lut_identity(PixedColorLut *lut)
+{
+	int i = 0;
+	for (; i < 256; i++)
+		lut->r[i] = lut->g[i] = lut->b[i] = lut->a[i] = (uint8_t)i;
+}
+
+/*
+ * Levels of r, g and b: black and below become 0, white and above 255, the
+ * range between is stretched and bent by gamma. Alpha is kept.
+ */
+void
+pixed_color_lut_levels(PixedColorLut *lut, uint8_t black, uint8_t white, float gamma)
+{
+	int i = 0;
+
+	pixed_color_lut_identity(lut);
+	if (white <= black || gamma <= 0)
+		return;
+
+	for (; i < 256; i++) {
+		float value = (float)(i - black) / (float)(white - black);
+		value = value < 0 ? 0 : value > 1 ? 1 : value;
+
+		lut->r[i] = lut->g[i] = lut->b[i] = (uint8_t)(powf(value, 1.0f / gamma) * 255.0f + 0.5f);
+	}
+}
+
+/* Runs every channel of the pixels in area through lut, 0 for the whole document */
+int
+pixed_document_apply_lut(PixedDocument *document, const PixedRect *area, const PixedColorLut *lut)
+{
+	PixedFilter filter;
+	memset(&filter, 0, sizeof(PixedFilter));
+	filter.kind = FILTER_LUT;
+	filter.lut = lut;
+
+	return filter_document(document, area, &filter);
+}
+
+/*
+ * Rotates hue by degrees and adds saturation and lightness, both in -1 to 1
+ * and clamped to it afterwards. Alpha is kept.
+ */
+int
+pixed_document_adjust_hsl(PixedDocument *document, const PixedRect *area, float hue, float saturation, float lightness)
+{
+	PixedFilter filter;
+	memset(&filter, 0, sizeof(PixedFilter));
+	filter.kind = FILTER_HSL;
+	filter.hue = fmodf(hue / 360.0f, 1.0f);
+	filter.saturation = saturation;
+	filter.lightness = lightness;
+
+	return filter_document(document, area, &filter);
+}
+
+/* Replaces exactly from[i] with to[i], colors not in from are kept. Later duplicates of from are ignored */
+int
+pixed_document_remap_colors(PixedDocument *document, const PixedRect *area, const uint32_t *from, const uint32_t *to, uint32_t length)
+{
+	if (length == 0)
+		return 0;
+
+	uint32_t capacity = 16, shift = 28, i = 0;
+	while (capacity < (uint64_t)length * 2) {
+		capacity *= 2;
+		shift--;
+	}
+
+	PixedFilter filter;
+	memset(&filter, 0, sizeof(PixedFilter));
+	filter.kind = FILTER_REMAP;
+	filter.shift = shift;
+	filter.from = malloc(sizeof(uint32_t) * ((size_t)length * 2 + capacity));
+	if (!filter.from)
+		return -1;
+
+	filter.to = filter.from + length;
+	filter.slots = filter.to + length;
+	memset(filter.slots, 0, sizeof(uint32_t) * capacity);
+
+	for (; i < length; i++) {
+		filter.from[i] = pixed_canvas_color(from[i]);
+		filter.to[i] = pixed_canvas_color(to[i]);
+
+		uint32_t slot = (filter.from[i] * 2654435761u) >> shift;
+		while (filter.slots[slot] && filter.from[filter.slots[slot] - 1] != filter.from[i])
+			slot = (slot + 1) & (capacity - 1);
+
+		if (!filter.slots[slot])
+			filter.slots[slot] = i + 1;
+	}
+
+	int result = filter_document(document, area, &filter);
+	free(filter.from);
+	return result;
+}
+
+/*
+ * Replaces every pixel with the nearest of the palette colors. With dither
+ * set, a 4x4 ordered dither spreads the error over neighbouring pixels,
+ * unlike error diffusion it keeps rows independent.
+ */
+int
+pixed_document_map_palette(PixedDocument *document, const PixedRect *area, const uint32_t *palette, uint32_t length, int dither)
+{
+	if (length == 0 || length > PIXED_PALETTE_MAX)
+		return -1;
+
+	PixedFilter filter;
+	memset(&filter, 0, sizeof(PixedFilter));
+	filter.kind = FILTER_PALETTE;
+	filter.palette_length = length;
+	filter.dither = dither;
+
+	uint32_t i = 0;
+	for (; i < length; i++)
+		filter.palette[i] = pixed_canvas_color(palette[i]);
+
+	pixed_dither_offsets(length, filter.offsets);
+	return filter_document(document, area, &filter);
+}
+
+/*
+ * Offsets of the ordered dither cells (y & 3) * 4 + (x & 3) for a palette of
+ * length colors, they span about the distance between two of its colors
+ */
+void
+pixed_dither_offsets(uint32_t length, int *offsets)
+{
+	float spread = 255.0f / cbrtf((float)length);
+	uint32_t i = 0;
+
+	for (; i < PIXED_DITHER_CELLS; i++)
+		offsets[i] = (int)(((filter_bayer[i] + 0.5f) / PIXED_DITHER_CELLS - 0.5f) * spread);
+}
+
+static
+int
+filter_document(PixedDocument *document, const PixedRect *area, const PixedFilter *filter)
+{
+	PixedRect clipped;
+	if (!pixed_document_clip_area(document, area, &clipped))
+		return 0;
+
+	if (document->storage == PIXED_STORAGE_INDEXED)
+		return filter_indexed(document, &clipped, filter);
+
+	pixed_document_modify(document, clipped.x, clipped.y, clipped.width, clipped.height);
+
+	if (document->storage == PIXED_STORAGE_TILED)
+		return filter_tiled(document, &clipped, filter);
+
+	PixedFilterJob job;
+	job.document = document;
+	job.filter = filter;
+	job.area = clipped;
+
+	pixed_parallel_rows(clipped.height, clipped.width, filter_rows, &job);
+	return 0;
+}
+
+/*
+ * Filters palette entries instead of pixels when the whole document changes
+ * the same way. Otherwise every index maps to the entry of its new color,
+ * added when the palette has room for it.
+ */
+static
+int
+filter_indexed(PixedDocument *document, const PixedRect *area, const PixedFilter *filter)
+{
+	uint32_t i = 0, x = 0, y = 0;
+
+	if (!filter->dither && area->width == document->width && area->height == document->height) {
+		for (; i < document->palette_length; i++) {
+			if (pixed_document_set_palette_color(document, i, pixed_canvas_color(filter_color(filter, document->palette[i]))) != 0)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	int16_t map[PIXED_DITHER_CELLS][PIXED_PALETTE_MAX];
+	memset(map, 0xff, sizeof(map));
+
+	pixed_document_modify(document, area->x, area->y, area->width, area->height);
+
+	for (y = area->y; y < area->y + area->height; y++) {
+		uint8_t *indices = document->indices + (size_t)y * document->width;
+
+		for (x = area->x; x < area->x + area->width; x++) {
+			uint32_t cell = filter->dither ? (y & 3) * 4 + (x & 3) : 0;
+			int16_t *index = &map[cell][indices[x]];
+
+			if (*index < 0) {
+				uint32_t color = pixed_canvas_color(filter_color(filter, filter_dither(filter, document->palette[indices[x]], x, y)));
+
+				int found = pixed_document_palette_index(document, color);
+				if (found < 0) {
+					found = document->palette_length;
+					if (pixed_document_set_palette_color(document, found, color) != 0)
+						return -1;
+				}
+
+				*index = (int16_t)found;
+			}
+
+			indices[x] = (uint8_t)*index;
+		}
+	}
+
+	return 0;
+}
+
+/* Tiles are allocated on write, so they are filtered on the calling thread */
+static
+int
+filter_tiled(PixedDocument *document, const PixedRect *area, const PixedFilter *filter)
+{
+	PixedFilterCache *cache = malloc(sizeof(PixedFilterCache));
+	if (!cache)
+		return -1;
+
+	filter_cache_init(filter, cache);
+
+	// Untouched tiles stay untouched unless transparent turns into something else
+	int keep_empty = !filter->dither && filter_color(filter, 0) == 0;
+
+	uint32_t tile_y = area->y / PIXED_TILE_SIZE, row = 0;
+	for (; tile_y <= (area->y + area->height - 1) / PIXED_TILE_SIZE; tile_y++) {
+		uint32_t tile_x = area->x / PIXED_TILE_SIZE;
+
+		for (; tile_x <= (area->x + area->width - 1) / PIXED_TILE_SIZE; tile_x++) {
+			PixedTile tile;
+
+			if (pixed_document_get_tile(document, tile_x, tile_y, 0, &tile) != 0 || (tile.empty && keep_empty))
+				continue;
+
+			// Writable allocates untouched tiles and copies the ones frames share
+			if (pixed_document_get_tile(document, tile_x, tile_y, 1, &tile) != 0) {
+				free(cache);
+				return -1;
+			}
+
+			uint32_t x0 = PIXED_MAX(area->x, tile.x), x1 = PIXED_MIN(area->x + area->width, tile.x + tile.width);
+			uint32_t y0 = PIXED_MAX(area->y, tile.y), y1 = PIXED_MIN(area->y + area->height, tile.y + tile.height);
+
+			for (row = y0; row < y1; row++) {
+				filter_pixels(filter, cache, tile.pixels + (size_t)(row - tile.y) * tile.stride + (x0 - tile.x),
+					x1 - x0, x0, row);
+			}
+		}
+	}
+
+	free(cache);
+	return 0;
+}
+
+/* Rows [begin, end) of the area of a flat document */
+static
+void
+filter_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedFilterJob *job = ctx;
+	PixedDocument *document = job->document;
+	PixedFilterCache *cache = 0;
+	uint32_t y = begin;
+
+	// Lookup tables need no cache, every other filter falls back to converting each pixel without one
+	if (job->filter->kind != FILTER_LUT) {
+		cache = malloc(sizeof(PixedFilterCache));
+		if (cache)
+			filter_cache_init(job->filter, cache);
+	}
+
+	for (; y < end; y++) {
+		uint32_t row = job->area.y + y;
+		filter_pixels(job->filter, cache, document->canvas + (size_t)row * document->width + job->area.x,
+			job->area.width, job->area.x, row);
+	}
+
+	free(cache);
+}
+
+/* Filters length pixels starting at column x of row y in place */
+static
+void
+filter_pixels(const PixedFilter *filter, PixedFilterCache *cache, uint32_t *pixels, uint32_t length, uint32_t x, uint32_t y)
+{
+	uint32_t i = 0;
+
+	// Canvas order is byte order, the tables index the bytes directly
+	if (filter->kind == FILTER_LUT) {
+		const PixedColorLut *lut = filter->lut;
+		unsigned char *bytes = (unsigned char *)pixels;
+
+		for (; i < length; i++, bytes += 4) {
+			bytes[0] = lut->r[bytes[0]];
+			bytes[1] = lut->g[bytes[1]];
+			bytes[2] = lut->b[bytes[2]];
+			bytes[3] = lut->a[bytes[3]];
+		}
+
+		return;
+	}
+
+	if (!cache) {
+		for (; i < length; i++)
+			pixels[i] = filter_color(filter, filter_dither(filter, pixels[i], x + i, y));
+
+		return;
+	}
+
+	// Runs of one color, the common case of pixel art, skip the cache as well
+	if (!filter->dither) {
+		uint32_t last = cache->keys[0], result = cache->values[0];
+
+		for (; i < length; i++) {
+			if (pixels[i] != last) {
+				last = pixels[i];
+				result = filter_cached(filter, cache, last);
+			}
+
+			pixels[i] = result;
+		}
+
+		return;
+	}
+
+	// Dithered rows repeat every four columns, each column keeps its own run
+	uint32_t last[4], result[4], valid = 0;
+
+	for (; i < length; i++) {
+		uint32_t column = (x + i) & 3;
+
+		if (!(valid & (1u << column)) || pixels[i] != last[column]) {
+			valid |= 1u << column;
+			last[column] = pixels[i];
+			result[column] = filter_cached(filter, cache, filter_dither(filter, pixels[i], x + i, y));
+		}
+
+		pixels[i] = result[column];
+	}
+}
+
+/* Every slot starts out holding transparent black, so no slot is ever invalid */
+static
+void
+filter_cache_init(const PixedFilter *filter, PixedFilterCache *cache)
+{
+	uint32_t value = filter_color(filter, 0), i = 0;
+
+	for (; i < FILTER_CACHE_SIZE; i++) {
+		cache->keys[i] = 0;
+		cache->values[i] = value;
+	}
+}
+
+static
+uint32_t
+filter_cached(const PixedFilter *filter, PixedFilterCache *cache, uint32_t color)
+{
+	uint32_t slot = (color * 2654435761u) >> (32 - FILTER_CACHE_BITS);
+
+	if (cache->keys[slot] != color) {
+		cache->keys[slot] = color;
+		cache->values[slot] = filter_color(filter, color);
+	}
+
+	return cache->values[slot];
+}
+
+/* The filtered color of color, both canvas order */
+static
+uint32_t
+filter_color(const PixedFilter *filter, uint32_t color)
+{
+	if (filter->kind == FILTER_LUT) {
+		unsigned char bytes[4];
+		memcpy(bytes, &color, sizeof(uint32_t));
+
+		bytes[0] = filter->lut->r[bytes[0]];
+		bytes[1] = filter->lut->g[bytes[1]];
+		bytes[2] = filter->lut->b[bytes[2]];
+		bytes[3] = filter->lut->a[bytes[3]];
+
+		memcpy(&color, bytes, sizeof(uint32_t));
+		return color;
+	}
+
+	if (filter->kind == FILTER_HSL)
+		return pixed_canvas_color(filter_hsl(filter, pixed_canvas_color(color)));
+
+	if (filter->kind == FILTER_PALETTE)
+		return filter_nearest(filter, color);
+
+	uint32_t mask = (uint32_t)(((uint64_t)1 << (32 - filter->shift)) - 1);
+	uint32_t slot = (color * 2654435761u) >> filter->shift;
+	while (filter->slots[slot]) {
+		if (filter->from[filter->slots[slot] - 1] == color)
+			return filter->to[filter->slots[slot] - 1];
+
+		slot = (slot + 1) & mask;
+	}
+
+	return color;
+}
+
+/* Adds the ordered dither offset of x, y to r, g and b of color, canvas order */
+static
+uint32_t
+filter_dither(const PixedFilter *filter, uint32_t color, uint32_t x, uint32_t y)
+{
+	if (!filter->dither)
+		return color;
+
+	int offset = filter->offsets[(y & 3) * 4 + (x & 3)];
+	unsigned char bytes[4];
+	int i = 0;
+
+	memcpy(bytes, &color, sizeof(uint32_t));
+	for (; i < 3; i++) {
+		int value = bytes[i] + offset;
+		bytes[i] = (unsigned char)(value < 0 ? 0 : value > 255 ? 255 : value);
+	}
+
+	memcpy(&color, bytes, sizeof(uint32_t));
+	return color;
+}
+
+/* color is a color value here, not canvas order */
+static
+uint32_t
+filter_hsl(const PixedFilter *filter, uint32_t color)
+{
+	float r = pixed_color_r(color) / 255.0f;
+	float g = pixed_color_g(color) / 255.0f;
+	float b = pixed_color_b(color) / 255.0f;
+
+	float max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+	float min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+	float delta = max - min;
+	float h = 0, s = 0, l = (max + min) / 2;
+
+	if (delta > 0) {
+		s = l > 0.5f ? delta / (2 - max - min) : delta / (max + min);
+
+		if (max == r)
+			h = (g - b) / delta + (g < b ? 6 : 0);
+		else if (max == g)
+			h = (b - r) / delta + 2;
+		else
+			h = (r - g) / delta + 4;
+
+		h /= 6;
+	}
+
+	h += filter->hue;
+	h -= floorf(h);
+	s = s + filter->saturation;
+	s = s < 0 ? 0 : s > 1 ? 1 : s;
+	l = l + filter->lightness;
+	l = l < 0 ? 0 : l > 1 ? 1 : l;
+
+	if (s == 0) {
+		r = g = b = l;
+	} else {
+		float q = l < 0.5f ? l * (1 + s) : l + s - l * s;
+		float p = 2 * l - q;
+
+		r = filter_hue_channel(p, q, h + 1.0f / 3);
+		g = filter_hue_channel(p, q, h);
+		b = filter_hue_channel(p, q, h - 1.0f / 3);
+	}
+
+	return ((uint32_t)(r * 255.0f + 0.5f) << 24) | ((uint32_t)(g * 255.0f + 0.5f) << 16) |
+		((uint32_t)(b * 255.0f + 0.5f) << 8) | pixed_color_a(color);
+}
+
+static
+float
+filter_hue_channel(float p, float q, float t)
+{
+	if (t < 0) t += 1;
+	if (t > 1) t -= 1;
+
+	if (t < 1.0f / 6) return p + (q - p) * 6 * t;
+	if (t < 1.0f / 2) return q;
+	if (t < 2.0f / 3) return p + (q - p) * (2.0f / 3 - t) * 6;
+
+	return p;
+}
+
+/* Palette color closest to color in squared distance over all four channels, byte order doesn't matter */
+static
+uint32_t
+filter_nearest(const PixedFilter *filter, uint32_t color)
+{
+	uint32_t best = filter->palette[0], best_distance = UINT32_MAX, i = 0;
+
+	for (; i < filter->palette_length && best_distance > 0; i++) {
+		uint32_t candidate = filter->palette[i], distance = 0;
+		int shift = 0;
+
+		for (; shift < 32; shift += 8) {
+			int delta = (int)((color >> shift) & 0xff) - (int)((candidate >> shift) & 0xff);
+			distance += (uint32_t)(delta * delta);
+		}
+
+		if (distance < best_distance) {
+			best = candidate;
+			best_distance = distance;
+		}
+	}
+
+	return best;
+}
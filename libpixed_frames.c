@@ -0,0 +1,813 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * Animations keep every frame as a tiled document. Tiles that look the same
+ * in several frames are kept once in a pool, found by a hash of their pixels,
+ * and every frame points at that one copy. Pooled tiles are read only, the
+ * first write to one gives the frame a private copy (copy on write) and
+ * pixed_animation_share_tiles puts private tiles back into the pool.
+ *
+ * Animation files are version 5 compressed files, every number big endian:
+ *
+ *   "PiXd", 0, version, width, height, frame count, tile count, 0
+ *   frame count * duration in milliseconds
+ *   tile count * (offset u64, size u32, flags u32)
+ *   frame count * tiles_x * tiles_y tile numbers, 0 for an empty tile
+ *   tile data
+ *
+ * Every unique tile is stored once, compressed on its own as a full
+ * PIXED_TILE_SIZE square, and tile number n of a frame refers to the nth.
+ */
+#define PIXED_ANIMATION_HEADER_SIZE 32
+#define PIXED_ANIMATION_INDEX_SIZE  16
+#define PIXED_TILE_STORED           1 // tile didn't compress, raw pixels follow
+#define PIXED_TILE_BYTES            (sizeof(uint32_t) * PIXED_TILE_PIXELS)
+
+#define POOL_INITIAL_CAPACITY 256
+
+/* Frames point at pixels, pooled flags which of their tiles have this header in front */
+typedef struct {
+	uint64_t hash;
+	uint32_t refs;   // frame tiles pointing at pixels
+	uint32_t number; // position in the file while it is written
+	uint32_t pixels[PIXED_TILE_PIXELS];
+} PixedPooledTile;
+
+#define POOLED_TILE(PIXELS) ((PixedPooledTile *)((char *)(PIXELS) - offsetof(PixedPooledTile, pixels)))
+
+struct PixedTilePool {
+	PixedPooledTile **slots;    // open addressing with linear probing, 0 for a free slot
+	uint32_t          capacity; // power of two, kept at least twice length
+	uint32_t          length;
+};
+
+typedef struct {
+	unsigned char *data;
+	size_t         size;
+	uint32_t       flags;
+} PixedEncodedTile;
+
+typedef struct {
+	PixedPooledTile **tiles;
+	PixedEncodedTile *encoded;
+} PixedTileEncodeJob;
+
+typedef struct {
+	const unsigned char *data;
+	size_t               length;
+	PixedPooledTile    **tiles; // decoded and hashed tiles, left 0 when a tile is broken
+} PixedTileDecodeJob;
+
+static PixedTilePool   *pool_new(void);
+static void             pool_free(PixedTilePool *);
+static uint32_t        *pool_intern(PixedTilePool *, uint32_t *);
+static PixedPooledTile *pool_add(PixedTilePool *, PixedPooledTile *);
+static int              pool_grow(PixedTilePool *);
+static void             pool_insert(PixedTilePool *, PixedPooledTile *);
+static void             pool_remove(PixedTilePool *, uint32_t);
+static uint64_t         tile_hash(const uint32_t *);
+static int              tile_blank(const uint32_t *);
+static int              share_tiles(PixedTilePool *, PixedDocument *);
+static int              frames_insert(PixedAnimation *, uint32_t, PixedDocument *, uint32_t);
+static void             encode_tiles(void *, uint32_t, uint32_t);
+static void             decode_tiles(void *, uint32_t, uint32_t);
+
+PixedAnimation *
+pixed_animation_new(const char *name, uint32_t width, uint32_t height)
+{
+	if (width == 0 || height == 0)
+		return 0;
+
+	PixedAnimation *animation = calloc(1, sizeof(PixedAnimation));
+	if (!animation)
+		return 0;
+
+	animation->name = malloc(strlen(name) + 1);
+	animation->pool = pool_new();
+
+	if (!animation->name || !animation->pool) {
+		pixed_animation_free(animation);
+		return 0;
+	}
+
+	memcpy(animation->name, name, strlen(name) + 1);
+	animation->width = width;
+	animation->height = height;
+
+	return animation;
+}
+
+void
+pixed_animation_free(PixedAnimation *animation)
+{
+	uint32_t i = 0;
+	for (; i < animation->frames_length; i++)
+		pixed_document_free(animation->frames[i].pixels);
+
+	// Frames gave their tiles back, the pool should be empty by now
+	if (animation->pool)
+		pool_free(animation->pool);
+
+	free(animation->frames);
+	free(animation->name);
+	free(animation);
+}
+
+/*
+ * Makes document the frame at index, converting it to tiled storage. The
+ * animation owns the document from then on. Layered documents can't be frames.
+ */
+int
+pixed_animation_insert_frame(PixedAnimation *animation, uint32_t index, PixedDocument *document, uint32_t duration)
+{
+	if (index > animation->frames_length || document->width != animation->width ||
+		document->height != animation->height || document->layers_length > 0 ||
+		(document->pool && document->pool != animation->pool))
+		return -1;
+
+	if (pixed_document_set_storage(document, PIXED_STORAGE_TILED) != 0)
+		return -1;
+
+	if (frames_insert(animation, index, document, duration) != 0)
+		return -1;
+
+	// Tiles that couldn't be pooled stay private, that only costs memory
+	share_tiles(animation->pool, document);
+	return 0;
+}
+
+/* Inserts a copy of the frame at index after it, sharing all of its tiles. Returns the new index */
+int
+pixed_animation_duplicate_frame(PixedAnimation *animation, uint32_t index)
+{
+	if (index >= animation->frames_length)
+		return -1;
+
+	PixedDocument *source = animation->frames[index].pixels;
+	if (share_tiles(animation->pool, source) != 0)
+		return -1;
+
+	PixedDocument *copy = pixed_document_new_tiled("frame", source->width, source->height);
+	if (!copy)
+		return -1;
+
+	size_t i = 0, tiles_length = (size_t)copy->tiles_x * copy->tiles_y;
+
+	copy->pool = animation->pool;
+	copy->pooled = calloc(tiles_length, sizeof(uint8_t));
+	if (!copy->pooled) {
+		pixed_document_free(copy);
+		return -1;
+	}
+
+	for (; i < tiles_length; i++) {
+		if (!source->pooled[i])
+			continue;
+
+		POOLED_TILE(source->tiles[i])->refs++;
+		copy->tiles[i] = source->tiles[i];
+		copy->pooled[i] = 1;
+	}
+
+	if (frames_insert(animation, index + 1, copy, animation->frames[index].duration) != 0) {
+		pixed_document_free(copy);
+		return -1;
+	}
+
+	return index + 1;
+}
+
+/* The last frame of an animation can't be removed */
+int
+pixed_animation_remove_frame(PixedAnimation *animation, uint32_t index)
+{
+	if (index >= animation->frames_length || animation->frames_length == 1)
+		return -1;
+
+	pixed_document_free(animation->frames[index].pixels);
+	memmove(animation->frames + index, animation->frames + index + 1,
+		sizeof(PixedFrame) * (animation->frames_length - index - 1));
+	animation->frames_length--;
+
+	return 0;
+}
+
+/* Moves the frame at from to index to, the frames in between shift over */
+int
+pixed_animation_move_frame(PixedAnimation *animation, uint32_t from, uint32_t to)
+{
+	if (from >= animation->frames_length || to >= animation->frames_length)
+		return -1;
+
+	PixedFrame frame = animation->frames[from];
+	if (from < to)
+		memmove(animation->frames + from, animation->frames + from + 1, sizeof(PixedFrame) * (to - from));
+	else
+		memmove(animation->frames + to + 1, animation->frames + to, sizeof(PixedFrame) * (from - to));
+
+	animation->frames[to] = frame;
+	return 0;
+}
+
+/*
+ * Pools the tiles frames were given to write to since they were last shared,
+ * so edited tiles that match another frame again are kept once.
+ */
+int
+pixed_animation_share_tiles(PixedAnimation *animation)
+{
+	int result = 0;
+	uint32_t i = 0;
+
+	for (; i < animation->frames_length; i++) {
+		if (share_tiles(animation->pool, animation->frames[i].pixels) != 0)
+			result = -1;
+	}
+
+	return result;
+}
+
+/* Bytes of pixels and tile tables the frames hold, shared tiles counted once */
+size_t
+pixed_animation_size(PixedAnimation *animation)
+{
+	size_t size = (size_t)animation->pool->length * sizeof(PixedPooledTile);
+	uint32_t i = 0;
+
+	for (; i < animation->frames_length; i++) {
+		PixedDocument *document = animation->frames[i].pixels;
+		PixedTileIterator it;
+		PixedTile *tile;
+
+		size += (size_t)document->tiles_x * document->tiles_y * (sizeof(uint32_t *) + sizeof(uint8_t));
+
+		pixed_tile_iterator_init(&it, document, 1);
+		while ((tile = pixed_tile_iterator_next(&it))) {
+			size_t index = (size_t)(tile->y / PIXED_TILE_SIZE) * document->tiles_x + tile->x / PIXED_TILE_SIZE;
+			if (!document->pooled || !document->pooled[index])
+				size += PIXED_TILE_BYTES;
+		}
+	}
+
+	return size;
+}
+
+PixedAnimation *
+pixed_animation_read_file(const char *file_name)
+{
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size < PIXED_ANIMATION_HEADER_SIZE) {
+		close(fd);
+		return 0;
+	}
+
+	size_t length = (size_t)file_stat.st_size;
+	void *mapping = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (mapping == MAP_FAILED)
+		return 0;
+
+	const unsigned char *data = mapping;
+	uint32_t width = parse_uint32_big_endian(data + 12);
+	uint32_t height = parse_uint32_big_endian(data + 16);
+	uint32_t frames_length = parse_uint32_big_endian(data + 20);
+	uint32_t tiles_length = parse_uint32_big_endian(data + 24);
+
+	size_t tiles_x = ((size_t)width + PIXED_TILE_SIZE - 1) / PIXED_TILE_SIZE;
+	size_t frame_tiles = tiles_x * (((size_t)height + PIXED_TILE_SIZE - 1) / PIXED_TILE_SIZE);
+	size_t index_offset = PIXED_ANIMATION_HEADER_SIZE + sizeof(uint32_t) * (size_t)frames_length;
+	size_t maps_offset = index_offset + (size_t)PIXED_ANIMATION_INDEX_SIZE * tiles_length;
+
+	if (strncmp((const char *)data, PIXED_HEADER_MAGIC, 4) != 0 || parse_uint32_big_endian(data + 4) != 0 ||
+		parse_uint32_big_endian(data + 8) != PIXED_VERSION_ANIMATION || frames_length == 0 ||
+		maps_offset > length || (length - maps_offset) / sizeof(uint32_t) / frames_length < frame_tiles) {
+		munmap(mapping, length);
+		return 0;
+	}
+
+	PixedAnimation *animation = pixed_animation_new(file_name, width, height);
+	PixedPooledTile **tiles = calloc((size_t)tiles_length + 1, sizeof(PixedPooledTile *));
+	int failed = !animation || !tiles;
+	size_t i = 0, f = 0, pooled_until = 1; // tiles before pooled_until belong to the pool
+
+	if (!failed) {
+		PixedTileDecodeJob job;
+		job.data = data;
+		job.length = length;
+		job.tiles = tiles + 1;
+
+		pixed_parallel_rows(tiles_length, PIXED_TILE_PIXELS, decode_tiles, &job);
+	}
+
+	// Written files keep every tile once, pool_add frees the ones it doesn't take
+	for (; !failed && pooled_until <= tiles_length; pooled_until++) {
+		PixedPooledTile *tile = tiles[pooled_until];
+		if (!tile || pool_add(animation->pool, tile) != tile)
+			failed = 1;
+	}
+
+	for (f = 0; !failed && f < frames_length; f++) {
+		PixedDocument *document = pixed_document_new_tiled("frame", width, height);
+		uint8_t *pooled = calloc(frame_tiles, sizeof(uint8_t));
+		uint32_t duration = parse_uint32_big_endian(data + PIXED_ANIMATION_HEADER_SIZE + sizeof(uint32_t) * f);
+
+		if (!document || !pooled || frames_insert(animation, f, document, duration) != 0) {
+			if (document)
+				pixed_document_free(document);
+
+			free(pooled);
+			failed = 1;
+			break;
+		}
+
+		document->pooled = pooled;
+
+		for (i = 0; i < frame_tiles; i++) {
+			uint32_t number = parse_uint32_big_endian(data + maps_offset + sizeof(uint32_t) * (f * frame_tiles + i));
+			if (number == 0)
+				continue;
+
+			if (number > tiles_length) {
+				failed = 1;
+				break;
+			}
+
+			tiles[number]->refs++;
+			document->tiles[i] = tiles[number]->pixels;
+			pooled[i] = 1;
+		}
+	}
+
+	// and every one of them is used by a frame
+	for (i = 1; !failed && i <= tiles_length; i++)
+		failed = tiles[i]->refs == 0;
+
+	for (i = pooled_until; tiles && i <= tiles_length; i++)
+		free(tiles[i]);
+
+	free(tiles);
+	munmap(mapping, length);
+
+	if (failed && animation) {
+		pixed_animation_free(animation);
+		return 0;
+	}
+
+	return animation;
+}
+
+int
+pixed_animation_write_file(PixedAnimation *animation, char *file_name)
+{
+	if (pixed_animation_share_tiles(animation) != 0)
+		return -1;
+
+	PixedTilePool *pool = animation->pool;
+	PixedDocument *first = animation->frames[0].pixels;
+	size_t frame_tiles = (size_t)first->tiles_x * first->tiles_y;
+	size_t index_offset = PIXED_ANIMATION_HEADER_SIZE + sizeof(uint32_t) * (size_t)animation->frames_length;
+	size_t maps_offset = index_offset + (size_t)PIXED_ANIMATION_INDEX_SIZE * pool->length;
+	size_t header_size = maps_offset + sizeof(uint32_t) * frame_tiles * animation->frames_length;
+
+	uint32_t tiles_length = 0, i = 0;
+	PixedPooledTile **tiles = malloc(sizeof(PixedPooledTile *) * (pool->length + 1));
+	PixedEncodedTile *encoded = calloc(pool->length + 1, sizeof(PixedEncodedTile));
+	struct iovec *iov = malloc(sizeof(struct iovec) * (pool->length + 1));
+	unsigned char *header = malloc(header_size);
+	int result = -1;
+
+	if (!tiles || !encoded || !iov || !header)
+		goto cleanup;
+
+	// Pooled tiles are numbered in slot order, from 1 as 0 is the empty tile
+	for (i = 0; i < pool->capacity; i++) {
+		if (!pool->slots[i])
+			continue;
+
+		tiles[tiles_length] = pool->slots[i];
+		tiles[tiles_length]->number = tiles_length + 1;
+		tiles_length++;
+	}
+
+	PixedTileEncodeJob job;
+	job.tiles = tiles;
+	job.encoded = encoded;
+
+	pixed_parallel_rows(tiles_length, PIXED_TILE_PIXELS, encode_tiles, &job);
+
+	memcpy(header, PIXED_HEADER_MAGIC, 4);
+	store_uint32_big_endian(header + 4, 0);
+	store_uint32_big_endian(header + 8, PIXED_VERSION_ANIMATION);
+	store_uint32_big_endian(header + 12, animation->width);
+	store_uint32_big_endian(header + 16, animation->height);
+	store_uint32_big_endian(header + 20, animation->frames_length);
+	store_uint32_big_endian(header + 24, tiles_length);
+	store_uint32_big_endian(header + 28, 0);
+
+	uint32_t f = 0;
+	for (; f < animation->frames_length; f++) {
+		PixedDocument *document = animation->frames[f].pixels;
+		store_uint32_big_endian(header + PIXED_ANIMATION_HEADER_SIZE + sizeof(uint32_t) * f, animation->frames[f].duration);
+
+		// Frames that were turned into something else since can't be written
+		if (document->storage != PIXED_STORAGE_TILED || !document->pooled)
+			goto cleanup;
+
+		size_t t = 0;
+		for (; t < frame_tiles; t++) {
+			uint32_t number = document->pooled[t] ? POOLED_TILE(document->tiles[t])->number : 0;
+			store_uint32_big_endian(header + maps_offset + sizeof(uint32_t) * (f * frame_tiles + t), number);
+		}
+	}
+
+	uint64_t offset = header_size;
+	for (i = 0; i < tiles_length; i++) {
+		unsigned char *entry = header + index_offset + (size_t)i * PIXED_ANIMATION_INDEX_SIZE;
+
+		if (!encoded[i].data)
+			goto cleanup;
+
+		store_uint32_big_endian(entry, offset >> 32);
+		store_uint32_big_endian(entry + 4, (uint32_t)offset);
+		store_uint32_big_endian(entry + 8, encoded[i].size);
+		store_uint32_big_endian(entry + 12, encoded[i].flags);
+
+		iov[i + 1].iov_base = encoded[i].data;
+		iov[i + 1].iov_len = encoded[i].size;
+		offset += encoded[i].size;
+	}
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_size;
+
+	int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto cleanup;
+
+	result = write_vector(fd, iov, tiles_length + 1);
+	if (close(fd) != 0)
+		result = -1;
+
+cleanup:
+	for (i = 0; encoded && i < tiles_length; i++)
+		free(encoded[i].data);
+
+	free(tiles);
+	free(encoded);
+	free(iov);
+	free(header);
+
+	return result;
+}
+
+/* Drops a reference to the pooled tile under pixels, the last one frees it */
+void
+pixed_tile_pool_release(PixedTilePool *pool, uint32_t *pixels)
+{
+	PixedPooledTile *tile = POOLED_TILE(pixels);
+	if (--tile->refs > 0)
+		return;
+
+	uint32_t mask = pool->capacity - 1, slot = (uint32_t)tile->hash & mask;
+	for (; pool->slots[slot]; slot = (slot + 1) & mask) {
+		if (pool->slots[slot] == tile) {
+			pool_remove(pool, slot);
+			break;
+		}
+	}
+
+	free(tile);
+}
+
+static
+PixedTilePool *
+pool_new()
+{
+	PixedTilePool *pool = malloc(sizeof(PixedTilePool));
+	if (!pool)
+		return 0;
+
+	pool->slots = calloc(POOL_INITIAL_CAPACITY, sizeof(PixedPooledTile *));
+	pool->capacity = POOL_INITIAL_CAPACITY;
+	pool->length = 0;
+
+	if (!pool->slots) {
+		free(pool);
+		return 0;
+	}
+
+	return pool;
+}
+
+static
+void
+pool_free(PixedTilePool *pool)
+{
+	uint32_t i = 0;
+	for (; i < pool->capacity; i++)
+		free(pool->slots[i]);
+
+	free(pool->slots);
+	free(pool);
+}
+
+/*
+ * Pools the private tile pixels with one reference and frees it, returns
+ * the pooled pixels. Returns 0 on failure, pixels is left alone then.
+ */
+static
+uint32_t *
+pool_intern(PixedTilePool *pool, uint32_t *pixels)
+{
+	PixedPooledTile *tile = malloc(sizeof(PixedPooledTile));
+	if (!tile)
+		return 0;
+
+	memcpy(tile->pixels, pixels, PIXED_TILE_BYTES);
+	tile->hash = tile_hash(pixels);
+	tile->refs = 0;
+
+	tile = pool_add(pool, tile);
+	if (!tile)
+		return 0;
+
+	free(pixels);
+	tile->refs++;
+	return tile->pixels;
+}
+
+/*
+ * Adds the hashed tile to the pool and returns it, or frees it and returns
+ * the pooled tile with the same pixels. Returns 0 on failure, freeing tile.
+ */
+static
+PixedPooledTile *
+pool_add(PixedTilePool *pool, PixedPooledTile *tile)
+{
+	uint32_t mask = pool->capacity - 1, slot = (uint32_t)tile->hash & mask;
+
+	for (; pool->slots[slot]; slot = (slot + 1) & mask) {
+		PixedPooledTile *pooled = pool->slots[slot];
+
+		if (pooled->hash == tile->hash && memcmp(pooled->pixels, tile->pixels, PIXED_TILE_BYTES) == 0) {
+			free(tile);
+			return pooled;
+		}
+	}
+
+	if ((pool->length + 1) * 2 > pool->capacity && pool_grow(pool) != 0) {
+		free(tile);
+		return 0;
+	}
+
+	pool_insert(pool, tile);
+	return tile;
+}
+
+static
+int
+pool_grow(PixedTilePool *pool)
+{
+	PixedPooledTile **slots = pool->slots;
+	uint32_t capacity = pool->capacity, i = 0;
+
+	pool->slots = calloc((size_t)capacity * 2, sizeof(PixedPooledTile *));
+	if (!pool->slots) {
+		pool->slots = slots;
+		return -1;
+	}
+
+	pool->capacity = capacity * 2;
+	pool->length = 0;
+
+	for (; i < capacity; i++) {
+		if (slots[i])
+			pool_insert(pool, slots[i]);
+	}
+
+	free(slots);
+	return 0;
+}
+
+static
+void
+pool_insert(PixedTilePool *pool, PixedPooledTile *tile)
+{
+	uint32_t mask = pool->capacity - 1, slot = (uint32_t)tile->hash & mask;
+	while (pool->slots[slot])
+		slot = (slot + 1) & mask;
+
+	pool->slots[slot] = tile;
+	pool->length++;
+}
+
+/* Empties slot, moving later tiles of the probe sequence back so lookups still find them */
+static
+void
+pool_remove(PixedTilePool *pool, uint32_t slot)
+{
+	uint32_t mask = pool->capacity - 1, hole = slot, next = (slot + 1) & mask;
+
+	pool->slots[hole] = 0;
+
+	for (; pool->slots[next]; next = (next + 1) & mask) {
+		uint32_t home = (uint32_t)pool->slots[next]->hash & mask;
+
+		// Tiles whose home is after the hole have to stay where they are
+		if (((next - home) & mask) < ((next - hole) & mask))
+			continue;
+
+		pool->slots[hole] = pool->slots[next];
+		pool->slots[next] = 0;
+		hole = next;
+	}
+
+	pool->length--;
+}
+
+/* FNV-1a over whole pixels, four independent lanes so the multiplies overlap */
+static
+uint64_t
+tile_hash(const uint32_t *pixels)
+{
+	uint64_t lanes[4] = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL, 0x9ce484222325cbf2ULL, 0x2325cbf29ce48422ULL };
+	uint32_t i = 0, lane = 0;
+
+	for (; i < PIXED_TILE_PIXELS; i += 4) {
+		for (lane = 0; lane < 4; lane++)
+			lanes[lane] = (lanes[lane] ^ pixels[i + lane]) * 0x100000001b3ULL;
+	}
+
+	uint64_t hash = lanes[0];
+	for (lane = 1; lane < 4; lane++)
+		hash = (hash ^ (lanes[lane] >> 29) ^ lanes[lane]) * 0x100000001b3ULL;
+
+	return hash ^ (hash >> 32);
+}
+
+static
+int
+tile_blank(const uint32_t *pixels)
+{
+	uint32_t bits = 0, i = 0;
+	for (; i < PIXED_TILE_PIXELS; i++)
+		bits |= pixels[i];
+
+	return bits == 0;
+}
+
+/* Pools every private tile of document, ones cleared back to transparent become empty again */
+static
+int
+share_tiles(PixedTilePool *pool, PixedDocument *document)
+{
+	size_t i = 0, tiles_length = (size_t)document->tiles_x * document->tiles_y;
+	PixedTile tile;
+
+	if (document->storage != PIXED_STORAGE_TILED)
+		return -1;
+
+	if (!document->pooled) {
+		document->pooled = calloc(tiles_length, sizeof(uint8_t));
+		if (!document->pooled)
+			return -1;
+	}
+
+	document->pool = pool;
+
+	for (; i < tiles_length; i++) {
+		if (document->pooled[i])
+			continue;
+
+		if (pixed_document_get_tile(document, i % document->tiles_x, i / document->tiles_x, 0, &tile) != 0 || tile.empty)
+			continue;
+
+		if (tile_blank(tile.pixels)) {
+			pixed_document_clear_tile(document, i);
+			continue;
+		}
+
+		uint32_t *pixels = pool_intern(pool, tile.pixels);
+		if (!pixels)
+			return -1;
+
+		document->tiles[i] = pixels;
+		document->pooled[i] = 1;
+	}
+
+	return 0;
+}
+
+static
+int
+frames_insert(PixedAnimation *animation, uint32_t index, PixedDocument *document, uint32_t duration)
+{
+	PixedFrame *frames = realloc(animation->frames, sizeof(PixedFrame) * (animation->frames_length + 1));
+	if (!frames)
+		return -1;
+
+	animation->frames = frames;
+
+	memmove(frames + index + 1, frames + index, sizeof(PixedFrame) * (animation->frames_length - index));
+	frames[index].pixels = document;
+	frames[index].duration = duration;
+	animation->frames_length++;
+
+	document->pool = animation->pool;
+	return 0;
+}
+
+static
+void
+encode_tiles(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedTileEncodeJob *job = ctx;
+	uint32_t *table = malloc(sizeof(uint32_t) * PIXED_CODEC_TABLE_SIZE);
+	uint32_t i = begin;
+
+	for (; table && i < end; i++) {
+		// Worst case is a one pixel literal between every two pixel match
+		unsigned char *data = malloc(PIXED_TILE_PIXELS * (sizeof(uint32_t) + 2) + 16);
+		if (!data)
+			continue;
+
+		const unsigned char *pixels = (const unsigned char *)job->tiles[i]->pixels;
+		size_t size = pixed_codec_encode(pixels, PIXED_TILE_PIXELS, sizeof(uint32_t), PIXED_TILE_SIZE, table, data);
+		uint32_t flags = 0;
+
+		if (size >= PIXED_TILE_BYTES) {
+			size = PIXED_TILE_BYTES;
+			flags = PIXED_TILE_STORED;
+			memcpy(data, pixels, size);
+		}
+
+		unsigned char *shrunk = realloc(data, size);
+
+		job->encoded[i].data = shrunk ? shrunk : data;
+		job->encoded[i].size = size;
+		job->encoded[i].flags = flags;
+	}
+
+	free(table);
+}
+
+static
+void
+decode_tiles(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedTileDecodeJob *job = ctx;
+	const unsigned char *data = job->data;
+	uint32_t frames_length = parse_uint32_big_endian(data + 20), i = begin;
+	size_t index_offset = PIXED_ANIMATION_HEADER_SIZE + sizeof(uint32_t) * (size_t)frames_length;
+
+	for (; i < end; i++) {
+		const unsigned char *entry = data + index_offset + (size_t)i * PIXED_ANIMATION_INDEX_SIZE;
+		uint64_t offset = ((uint64_t)parse_uint32_big_endian(entry) << 32) | parse_uint32_big_endian(entry + 4);
+		uint32_t size = parse_uint32_big_endian(entry + 8);
+		uint32_t flags = parse_uint32_big_endian(entry + 12);
+
+		if (offset > job->length || size > job->length - offset)
+			continue;
+
+		PixedPooledTile *tile = malloc(sizeof(PixedPooledTile));
+		if (!tile)
+			continue;
+
+		int result = -1;
+		if (flags & PIXED_TILE_STORED) {
+			if (size == PIXED_TILE_BYTES) {
+				memcpy(tile->pixels, data + offset, size);
+				result = 0;
+			}
+		} else {
+			result = pixed_codec_decode(data + offset, size, (unsigned char *)tile->pixels, PIXED_TILE_PIXELS, sizeof(uint32_t));
+		}
+
+		if (result != 0) {
+			free(tile);
+			continue;
+		}
+
+		tile->hash = tile_hash(tile->pixels);
+		tile->refs = 0;
+		job->tiles[i] = tile;
+	}
+}
@@ -0,0 +1,705 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * Undo history of a document. An operation keeps every PIXED_TILE_SIZE square
+ * tile it writes to as it was before the first write, in the storage
+ * representation of the document, and the whole palette if it changes it.
+ * Undo and redo swap those tiles with the document, so both cost as much as
+ * the tiles the operation touched, whatever the size of the canvas or the
+ * length of the history.
+ */
+
+typedef struct {
+	uint32_t       index;      // row major tile index
+	uint32_t       size;       // bytes at data
+	unsigned char *data;       // 0 for an untouched tile of a tiled document
+	int            compressed;
+} PixedHistoryTile;
+
+typedef struct {
+	PixedHistoryTile *tiles;
+	uint32_t          length, capacity;
+	uint32_t         *palette;  // PIXED_PALETTE_MAX entries, 0 when the palette didn't change
+	uint32_t          palette_length;
+	size_t            size;     // bytes held by the entry
+	int               compressed;
+} PixedHistoryEntry;
+
+struct PixedHistory {
+	PixedDocument     *document;
+	PixedHistoryEntry *entries;  // oldest first
+	uint32_t           length, capacity;
+	uint32_t           position; // entries below it can be undone, the rest redone
+	int64_t            saved;    // position of the saved document, -1 when out of reach
+	size_t             size, budget;
+
+	PixedHistoryEntry  open;     // operation between begin and end
+	int                recording;
+	int                failed;   // the open operation lost tiles
+	uint32_t          *stamps;   // per tile, serial of the last operation that kept it
+	uint32_t           serial;
+
+	uint32_t           width, height; // shape of the document the entries belong to
+	PixedStorage       storage;
+
+	uint32_t          *table;    // codec match table
+	unsigned char     *scratch;  // one decompressed tile
+	PixedPool          raw;      // data of tiles that aren't compressed, one full tile each
+};
+
+/* Raw tiles taken from the pool at once, 256 KiB */
+#define HISTORY_RAW_PER_BLOCK 16
+
+static int            history_reshape(PixedHistory *);
+static void           history_trim(PixedHistory *);
+static void           history_drop(PixedHistory *, uint32_t);
+static void           history_keep(PixedHistory *, uint32_t);
+static void           entry_free(PixedHistory *, PixedHistoryEntry *);
+static int            entry_swap(PixedHistory *, PixedHistoryEntry *);
+static void           entry_compress(PixedHistory *, PixedHistoryEntry *);
+static void           tile_bounds(PixedDocument *, uint32_t, uint32_t *, uint32_t *, uint32_t *, uint32_t *);
+static unsigned char *tile_pixels(PixedDocument *, uint32_t, int, size_t *);
+static int            tile_read(PixedHistory *, uint32_t, PixedHistoryTile *);
+static int            tile_write(PixedHistory *, PixedHistoryTile *);
+static int            tile_contains(PixedHistory *, uint32_t, uint32_t);
+
+/*
+ * Attaches a history to document, every write between pixed_history_begin
+ * and pixed_history_end becomes one undoable operation. Once the entries
+ * take more than budget bytes the oldest are compressed, then dropped.
+ */
+PixedHistory *
+pixed_history_new(PixedDocument *document, size_t budget)
+{
+	PixedHistory *history = calloc(1, sizeof(PixedHistory));
+	if (!history)
+		return 0;
+
+	history->document = document;
+	history->budget = budget;
+	history->table = malloc(sizeof(uint32_t) * PIXED_CODEC_TABLE_SIZE);
+	history->scratch = malloc(sizeof(uint32_t) * PIXED_TILE_PIXELS);
+
+	if (!history->table || !history->scratch || history_reshape(history) != 0) {
+		pixed_history_free(history);
+		return 0;
+	}
+
+	// The document as it is now is the saved one
+	history->saved = 0;
+	document->history = history;
+
+	return history;
+}
+
+void
+pixed_history_free(PixedHistory *history)
+{
+	if (!history)
+		return;
+
+	pixed_history_clear(history);
+
+	if (history->document->history == history)
+		history->document->history = 0;
+
+	free(history->entries);
+	free(history->stamps);
+	free(history->table);
+	free(history->scratch);
+	pixed_pool_free(&history->raw);
+	free(history);
+}
+
+/* Hands the history to document, which took over the pixels of the old one */
+void
+pixed_history_move(PixedHistory *history, PixedDocument *document)
+{
+	if (history->document->history == history)
+		history->document->history = 0;
+
+	history->document = document;
+	document->history = history;
+}
+
+/* Starts an operation, writes until pixed_history_end are undone together */
+void
+pixed_history_begin(PixedHistory *history)
+{
+	if (history->recording)
+		return;
+
+	history->failed = history_reshape(history) != 0;
+	history->recording = 1;
+
+	if (++history->serial == 0) {
+		memset(history->stamps, 0, sizeof(uint32_t) * history->document->tiles_x * history->document->tiles_y);
+		history->serial = 1;
+	}
+}
+
+/* Ends the operation, operations that didn't write anything are not kept */
+void
+pixed_history_end(PixedHistory *history)
+{
+	if (!history->recording)
+		return;
+
+	PixedHistoryEntry entry = history->open;
+
+	history->recording = 0;
+	memset(&history->open, 0, sizeof(PixedHistoryEntry));
+
+	if (history->failed) {
+		// Undoing past an operation that wasn't kept whole would mix states
+		entry_free(history, &entry);
+		pixed_history_clear(history);
+		history->saved = -1;
+		return;
+	}
+
+	if (entry.length == 0 && !entry.palette)
+		return;
+
+	// A new operation takes the place of everything that could be redone
+	while (history->length > history->position)
+		history_drop(history, history->length - 1);
+
+	if (history->length == history->capacity) {
+		uint32_t capacity = history->capacity ? history->capacity * 2 : 64;
+		PixedHistoryEntry *entries = realloc(history->entries, sizeof(PixedHistoryEntry) * capacity);
+
+		if (!entries) {
+			entry_free(history, &entry);
+			pixed_history_clear(history);
+			history->saved = -1;
+			return;
+		}
+
+		history->entries = entries;
+		history->capacity = capacity;
+	}
+
+	history->entries[history->length++] = entry;
+	history->position = history->length;
+	history->size += entry.size;
+
+	history_trim(history);
+}
+
+/* Returns 0 when an operation was undone, -1 when there was none or one is open */
+int
+pixed_history_undo(PixedHistory *history)
+{
+	if (history->recording || history_reshape(history) != 0 || history->position == 0)
+		return -1;
+
+	if (entry_swap(history, &history->entries[history->position - 1]) != 0) {
+		pixed_history_clear(history);
+		history->saved = -1;
+		return -1;
+	}
+
+	history->position--;
+	history_trim(history);
+	return 0;
+}
+
+int
+pixed_history_redo(PixedHistory *history)
+{
+	if (history->recording || history_reshape(history) != 0 || history->position == history->length)
+		return -1;
+
+	if (entry_swap(history, &history->entries[history->position]) != 0) {
+		pixed_history_clear(history);
+		history->saved = -1;
+		return -1;
+	}
+
+	history->position++;
+	history_trim(history);
+	return 0;
+}
+
+/* Forgets every operation, an open one starts over from the current pixels */
+void
+pixed_history_clear(PixedHistory *history)
+{
+	uint32_t i = 0;
+	for (; i < history->length; i++)
+		entry_free(history, &history->entries[i]);
+
+	if (history->recording) {
+		entry_free(history, &history->open);
+		history->failed = 0;
+
+		if (++history->serial == 0) {
+			memset(history->stamps, 0, sizeof(uint32_t) * history->document->tiles_x * history->document->tiles_y);
+			history->serial = 1;
+		}
+	}
+
+	history->saved = history->saved == (int64_t)history->position ? 0 : -1;
+	history->length = 0;
+	history->position = 0;
+	history->size = 0;
+}
+
+/* The document was written to its file, it is unmodified from here */
+void
+pixed_history_mark_saved(PixedHistory *history)
+{
+	history->saved = history->position;
+}
+
+/* Returns 1 when the document differs from the last saved one */
+int
+pixed_history_modified(PixedHistory *history)
+{
+	PixedDocument *document = history->document;
+
+	if (document->width != history->width || document->height != history->height || document->storage != history->storage)
+		return 1;
+
+	return history->saved != (int64_t)history->position;
+}
+
+/* Bytes held by kept operations */
+size_t
+pixed_history_size(PixedHistory *history)
+{
+	return history->size;
+}
+
+/*
+ * Keeps the tiles under the rectangle at x, y for the open operation, tiles
+ * it already kept are skipped. Writers call it before they change pixels.
+ */
+void
+pixed_history_capture(PixedHistory *history, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	PixedDocument *document = history->document;
+
+	if (!history->recording || history->failed || x >= document->width || y >= document->height || width == 0 || height == 0)
+		return;
+
+	uint32_t tile_x0 = x / PIXED_TILE_SIZE, tile_y = y / PIXED_TILE_SIZE;
+	uint32_t tile_x1 = (uint32_t)((PIXED_MIN((uint64_t)x + width, document->width) - 1) / PIXED_TILE_SIZE);
+	uint32_t tile_y1 = (uint32_t)((PIXED_MIN((uint64_t)y + height, document->height) - 1) / PIXED_TILE_SIZE);
+
+	for (; tile_y <= tile_y1; tile_y++) {
+		uint32_t tile_x = tile_x0;
+
+		for (; tile_x <= tile_x1; tile_x++) {
+			uint32_t index = tile_y * document->tiles_x + tile_x;
+
+			if (history->stamps[index] != history->serial)
+				history_keep(history, index);
+		}
+	}
+}
+
+void
+pixed_history_capture_palette(PixedHistory *history)
+{
+	PixedDocument *document = history->document;
+
+	if (!history->recording || history->failed || history->open.palette)
+		return;
+
+	history->open.palette = malloc(sizeof(uint32_t) * PIXED_PALETTE_MAX);
+	if (!history->open.palette) {
+		history->failed = 1;
+		return;
+	}
+
+	memcpy(history->open.palette, document->palette, sizeof(uint32_t) * document->palette_length);
+	history->open.palette_length = document->palette_length;
+	history->open.size += sizeof(uint32_t) * PIXED_PALETTE_MAX;
+}
+
+/* Keeps every tile holding a pixel of color, for writers that only know afterwards */
+void
+pixed_history_capture_color(PixedHistory *history, uint32_t color)
+{
+	PixedDocument *document = history->document;
+
+	if (!history->recording || history->failed)
+		return;
+
+	// Indices are matched for indexed documents, canvas words for the others
+	uint32_t value = pixed_canvas_color(color);
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		int index = pixed_document_palette_index(document, color);
+		if (index < 0)
+			return;
+
+		value = (uint32_t)index;
+	}
+
+	uint32_t index = 0, tiles_length = document->tiles_x * document->tiles_y;
+	for (; index < tiles_length; index++) {
+		if (history->stamps[index] != history->serial && tile_contains(history, index, value))
+			history_keep(history, index);
+	}
+}
+
+/* Drops the entries when the document was resized or changed storage, they no longer fit */
+static
+int
+history_reshape(PixedHistory *history)
+{
+	PixedDocument *document = history->document;
+
+	if (history->stamps && document->width == history->width && document->height == history->height &&
+		document->storage == history->storage)
+		return 0;
+
+	uint32_t *stamps = calloc((size_t)document->tiles_x * document->tiles_y + 1, sizeof(uint32_t));
+	if (!stamps)
+		return -1;
+
+	pixed_history_clear(history);
+	free(history->stamps);
+
+	// Every tile went back to the pool, the new ones may have another size
+	size_t element = document->storage == PIXED_STORAGE_INDEXED ? sizeof(uint8_t) : sizeof(uint32_t);
+	pixed_pool_free(&history->raw);
+	pixed_pool_init(&history->raw, element * PIXED_TILE_PIXELS, HISTORY_RAW_PER_BLOCK);
+
+	history->stamps = stamps;
+	history->serial = 0;
+	history->width = document->width;
+	history->height = document->height;
+	history->storage = document->storage;
+
+	// The document changed in a way no entry recorded
+	history->saved = -1;
+	return 0;
+}
+
+/*
+ * Brings the history under its budget, compressing the oldest entries first
+ * and dropping them after. The entry next to the current position stays.
+ */
+static
+void
+history_trim(PixedHistory *history)
+{
+	uint32_t i = 0;
+
+	for (; i < history->length && history->size > history->budget; i++) {
+		if (!history->entries[i].compressed)
+			entry_compress(history, &history->entries[i]);
+	}
+
+	while (history->size > history->budget && history->length > 1) {
+		// Redo entries only go once there is nothing left to undo
+		history_drop(history, history->position > 0 ? 0 : history->length - 1);
+	}
+}
+
+/* Drops the oldest or the newest entry */
+static
+void
+history_drop(PixedHistory *history, uint32_t i)
+{
+	history->size -= history->entries[i].size;
+	entry_free(history, &history->entries[i]);
+
+	if (i == 0) {
+		memmove(history->entries, history->entries + 1, sizeof(PixedHistoryEntry) * (history->length - 1));
+
+		history->position--;
+		if (history->saved >= 0)
+			history->saved--;
+	} else if (history->saved > (int64_t)i) {
+		history->saved = -1;
+	}
+
+	history->length--;
+}
+
+static
+void
+history_keep(PixedHistory *history, uint32_t index)
+{
+	PixedHistoryEntry *entry = &history->open;
+
+	history->stamps[index] = history->serial;
+
+	if (entry->length == entry->capacity) {
+		uint32_t capacity = entry->capacity ? entry->capacity * 2 : 16;
+		PixedHistoryTile *tiles = realloc(entry->tiles, sizeof(PixedHistoryTile) * capacity);
+
+		if (!tiles) {
+			history->failed = 1;
+			return;
+		}
+
+		entry->size += sizeof(PixedHistoryTile) * (capacity - entry->capacity);
+		entry->tiles = tiles;
+		entry->capacity = capacity;
+	}
+
+	PixedHistoryTile *tile = &entry->tiles[entry->length];
+	if (tile_read(history, index, tile) != 0) {
+		history->failed = 1;
+		return;
+	}
+
+	entry->size += tile->size;
+	entry->length++;
+}
+
+static
+void
+entry_free(PixedHistory *history, PixedHistoryEntry *entry)
+{
+	uint32_t i = 0;
+	for (; i < entry->length; i++) {
+		if (entry->tiles[i].compressed)
+			free(entry->tiles[i].data);
+		else
+			pixed_pool_release(&history->raw, entry->tiles[i].data);
+	}
+
+	free(entry->tiles);
+	free(entry->palette);
+	memset(entry, 0, sizeof(PixedHistoryEntry));
+}
+
+/* Exchanges the kept tiles and palette with the ones of the document */
+static
+int
+entry_swap(PixedHistory *history, PixedHistoryEntry *entry)
+{
+	PixedDocument *document = history->document;
+	size_t size = entry->size;
+	uint32_t i = 0;
+
+	for (; i < entry->length; i++) {
+		PixedHistoryTile *kept = &entry->tiles[i], current;
+
+		if (tile_read(history, kept->index, &current) != 0)
+			return -1;
+
+		if (tile_write(history, kept) != 0) {
+			pixed_pool_release(&history->raw, current.data);
+			return -1;
+		}
+
+		entry->size = entry->size - kept->size + current.size;
+		if (kept->compressed)
+			free(kept->data);
+		else
+			pixed_pool_release(&history->raw, kept->data);
+
+		*kept = current;
+	}
+
+	if (entry->palette) {
+		uint32_t palette[PIXED_PALETTE_MAX], palette_length = document->palette_length;
+		memcpy(palette, document->palette, sizeof(uint32_t) * palette_length);
+
+		memcpy(document->palette, entry->palette, sizeof(uint32_t) * entry->palette_length);
+		document->palette_length = entry->palette_length;
+
+		memcpy(entry->palette, palette, sizeof(uint32_t) * palette_length);
+		entry->palette_length = palette_length;
+
+		pixed_document_mark_dirty(document, 0, 0, document->width, document->height);
+	}
+
+	// Swapped in tiles are raw until the budget asks for them again
+	entry->compressed = 0;
+	history->size = history->size - size + entry->size;
+	return 0;
+}
+
+static
+void
+entry_compress(PixedHistory *history, PixedHistoryEntry *entry)
+{
+	size_t element = history->storage == PIXED_STORAGE_INDEXED ? sizeof(uint8_t) : sizeof(uint32_t);
+	size_t before = entry->size;
+	uint32_t i = 0;
+
+	for (; i < entry->length; i++) {
+		PixedHistoryTile *tile = &entry->tiles[i];
+		uint32_t x, y, width, height;
+
+		if (!tile->data || tile->compressed)
+			continue;
+
+		tile_bounds(history->document, tile->index, &x, &y, &width, &height);
+
+		// Worst case is a one pixel literal between every two pixel match
+		size_t length = (size_t)width * height;
+		unsigned char *data = malloc(length * (element + 2) + 16);
+		if (!data)
+			return;
+
+		size_t size = pixed_codec_encode(tile->data, length, element, width, history->table, data);
+		if (size >= tile->size) {
+			free(data);
+			continue;
+		}
+
+		unsigned char *shrunk = realloc(data, size);
+
+		pixed_pool_release(&history->raw, tile->data);
+		entry->size = entry->size - tile->size + size;
+		tile->data = shrunk ? shrunk : data;
+		tile->size = size;
+		tile->compressed = 1;
+	}
+
+	entry->compressed = 1;
+	history->size = history->size - before + entry->size;
+}
+
+/* Pixel rectangle of the tile at index, clipped against the document */
+static
+void
+tile_bounds(PixedDocument *document, uint32_t index, uint32_t *x, uint32_t *y, uint32_t *width, uint32_t *height)
+{
+	*x = (index % document->tiles_x) * PIXED_TILE_SIZE;
+	*y = (index / document->tiles_x) * PIXED_TILE_SIZE;
+	*width = PIXED_MIN(PIXED_TILE_SIZE, document->width - *x);
+	*height = PIXED_MIN(PIXED_TILE_SIZE, document->height - *y);
+}
+
+/*
+ * First pixel of the tile at index in storage and the bytes between its rows.
+ * Returns 0 for an untouched tile of a tiled document unless writable is set.
+ */
+static
+unsigned char *
+tile_pixels(PixedDocument *document, uint32_t index, int writable, size_t *stride)
+{
+	uint32_t tile_x = index % document->tiles_x, tile_y = index / document->tiles_x;
+
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		*stride = document->width;
+		return document->indices + (size_t)tile_y * PIXED_TILE_SIZE * document->width + (size_t)tile_x * PIXED_TILE_SIZE;
+	}
+
+	PixedTile tile;
+	if (pixed_document_get_tile(document, tile_x, tile_y, writable, &tile) != 0 || tile.empty)
+		return 0;
+
+	*stride = sizeof(uint32_t) * tile.stride;
+	return (unsigned char *)tile.pixels;
+}
+
+/* Copies the tile at index out of the document */
+static
+int
+tile_read(PixedHistory *history, uint32_t index, PixedHistoryTile *tile)
+{
+	PixedDocument *document = history->document;
+	size_t element = document->storage == PIXED_STORAGE_INDEXED ? sizeof(uint8_t) : sizeof(uint32_t);
+	size_t stride = 0;
+	uint32_t x, y, width, height, row = 0;
+
+	tile->index = index;
+	tile->size = 0;
+	tile->data = 0;
+	tile->compressed = 0;
+
+	const unsigned char *pixels = tile_pixels(document, index, 0, &stride);
+	if (!pixels)
+		return 0;
+
+	tile_bounds(document, index, &x, &y, &width, &height);
+
+	tile->data = pixed_pool_alloc(&history->raw);
+	if (!tile->data)
+		return -1;
+
+	for (; row < height; row++)
+		memcpy(tile->data + element * width * row, pixels + stride * row, element * width);
+
+	tile->size = element * width * height;
+	return 0;
+}
+
+/* Copies a kept tile back into the document */
+static
+int
+tile_write(PixedHistory *history, PixedHistoryTile *tile)
+{
+	PixedDocument *document = history->document;
+	size_t element = document->storage == PIXED_STORAGE_INDEXED ? sizeof(uint8_t) : sizeof(uint32_t);
+	size_t stride = 0;
+	uint32_t x, y, width, height, row = 0;
+
+	tile_bounds(document, tile->index, &x, &y, &width, &height);
+	pixed_document_mark_dirty(document, x, y, width, height);
+
+	if (document->colors)
+		pixed_color_index_capture(document->colors, x, y, width, height);
+
+	if (!tile->data) {
+		pixed_document_clear_tile(document, tile->index);
+		return 0;
+	}
+
+	const unsigned char *data = tile->data;
+	if (tile->compressed) {
+		if (pixed_codec_decode(tile->data, tile->size, history->scratch, (size_t)width * height, element) != 0)
+			return -1;
+
+		data = history->scratch;
+	}
+
+	unsigned char *pixels = tile_pixels(document, tile->index, 1, &stride);
+	if (!pixels)
+		return -1;
+
+	for (; row < height; row++)
+		memcpy(pixels + stride * row, data + element * width * row, element * width);
+
+	return 0;
+}
+
+/* Returns 1 when the tile at index holds value, a palette index or a canvas word */
+static
+int
+tile_contains(PixedHistory *history, uint32_t index, uint32_t value)
+{
+	PixedDocument *document = history->document;
+	size_t stride = 0;
+	uint32_t x, y, width, height, row = 0, column = 0;
+
+	const unsigned char *pixels = tile_pixels(document, index, 0, &stride);
+	if (!pixels)
+		return value == 0;
+
+	tile_bounds(document, index, &x, &y, &width, &height);
+
+	for (; row < height; row++) {
+		const unsigned char *line = pixels + stride * row;
+
+		if (document->storage == PIXED_STORAGE_INDEXED) {
+			if (memchr(line, (int)value, width))
+				return 1;
+
+			continue;
+		}
+
+		for (column = 0; column < width; column++) {
+			if (((const uint32_t *)line)[column] == value)
+				return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,1145 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <zlib.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * PNG and netpbm import and export. Both stream: files are read and written
+ * a band of rows at a time, nothing but the document holds the whole image.
+ */
+#define PNG_SIGNATURE      "\x89PNG\r\n\x1a\n"
+#define PNG_BUFFER_SIZE    (64 * 1024) // compressed bytes read at a time
+#define PNG_CHUNK_BYTES    (1024 * 1024) // filtered bytes per independent deflate stream
+#define PNG_PALETTE_BANDS  64
+#define PNG_MAX_DIMENSION  (1 << 24)
+
+#define PNG_GRAY       0
+#define PNG_RGB        2
+#define PNG_PALETTE    3
+#define PNG_GRAY_ALPHA 4
+#define PNG_RGBA       6
+
+#define IMAGE_BAND_ROWS 64
+
+typedef struct {
+	FILE          *file;
+	uint32_t       crc;
+	unsigned char  type[4];
+	uint32_t       remaining; // data bytes of the current chunk not read yet
+} PixedPngReader;
+
+typedef struct {
+	uint32_t width, height;
+	uint8_t  depth, color;
+	uint32_t channels;
+	size_t   stride;   // bytes of a filtered row, without the filter byte
+	uint32_t palette[256];
+	uint32_t palette_length;
+	int      has_key;  // single transparent color of gray and RGB images
+	uint16_t key[3];
+} PixedPngInfo;
+
+/* Open addressing over canvas values, twice the palette so probes stay short */
+typedef struct {
+	uint32_t keys[PIXED_PALETTE_MAX * 2];
+	int16_t  values[PIXED_PALETTE_MAX * 2];
+	uint32_t colors[PIXED_PALETTE_MAX];
+	uint32_t length;   // above PIXED_PALETTE_MAX once a color didn't fit
+} PixedPngPalette;
+
+typedef struct {
+	unsigned char *data;
+	size_t         size, capacity;
+	size_t         raw_size; // filtered bytes the stream holds
+	uLong          adler;
+	int            failed;
+} PixedPngChunk;
+
+typedef struct {
+	PixedDocument   *document;
+	PixedPngPalette *lookup;   // palette of documents that aren't indexed but fit one
+	PixedPngPalette *bands;    // colors of every band while collecting the palette
+	uint32_t         palette[PIXED_PALETTE_MAX];
+	uint32_t         palette_length;
+	uint8_t          depth, color;
+	size_t           stride;   // bytes of a row without the filter byte
+	uint32_t         bpp;      // bytes of a pixel, at least one, filters look this far back
+	uint32_t         chunk_rows;
+	uint32_t         chunks_length;
+	uint32_t         wave_length;
+	uint32_t         first_chunk; // of the wave being deflated
+	PixedPngChunk   *chunks;   // one per chunk of a wave
+	uLong            adler;    // of every filtered byte before the wave
+} PixedPngEncoder;
+
+static int  png_write_chunk(FILE *, const char *, const unsigned char *, uint32_t);
+static int  png_write_palette(FILE *, const uint32_t *, uint32_t);
+static int  png_collect_palette(PixedPngEncoder *);
+static void png_collect_palette_rows(void *, uint32_t, uint32_t);
+static int  png_palette_add(PixedPngPalette *, uint32_t);
+static int  png_palette_find(const PixedPngPalette *, uint32_t);
+static void png_deflate_chunks(void *, uint32_t, uint32_t);
+static const unsigned char *png_raw_row(PixedPngEncoder *, uint32_t, uint32_t *);
+static const unsigned char *png_filter_row(PixedPngEncoder *, const unsigned char *, const unsigned char *, unsigned char *);
+static size_t png_filter(int, const unsigned char *, const unsigned char *, size_t, uint32_t, unsigned char *, size_t);
+static int  png_paeth(int, int, int);
+static int  png_next_chunk(PixedPngReader *);
+static int  png_read(PixedPngReader *, unsigned char *, uint32_t);
+static int  png_end_chunk(PixedPngReader *);
+static int  png_read_info(PixedPngReader *, PixedPngInfo *);
+static void png_unfilter(unsigned char *, const unsigned char *, size_t, uint32_t, int);
+static void png_expand_row(const PixedPngInfo *, const unsigned char *, uint32_t *);
+static const uint32_t *image_rows(PixedDocument *, uint32_t, uint32_t, uint32_t *);
+static int  ppm_read_number(FILE *, uint32_t *);
+
+/*
+ * Writes 8 bit RGBA, or a palette PNG when the document has at most 256
+ * colors. Rows are filtered and deflated in parallel, PNG_CHUNK_BYTES of
+ * filtered rows per independent deflate stream, one wave of chunks per
+ * thread at a time.
+ */
+int
+pixed_document_write_png(PixedDocument *document, char *file_name)
+{
+	if (!document)
+		return -1;
+
+	PixedPngEncoder encoder;
+	memset(&encoder, 0, sizeof(PixedPngEncoder));
+	encoder.document = document;
+
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		encoder.palette_length = document->palette_length;
+		memcpy(encoder.palette, document->palette, sizeof(uint32_t) * document->palette_length);
+	} else {
+		encoder.lookup = malloc(sizeof(PixedPngPalette));
+		if (!encoder.lookup)
+			return -1;
+
+		if (png_collect_palette(&encoder) != 0) {
+			free(encoder.lookup);
+			encoder.lookup = 0;
+		}
+	}
+
+	int indexed = document->storage == PIXED_STORAGE_INDEXED || encoder.lookup;
+	uint32_t depth = 8;
+
+	if (indexed) {
+		depth = encoder.palette_length <= 2 ? 1 : encoder.palette_length <= 4 ? 2 : encoder.palette_length <= 16 ? 4 : 8;
+		encoder.color = PNG_PALETTE;
+		encoder.depth = depth;
+		encoder.stride = ((size_t)document->width * depth + 7) / 8;
+		encoder.bpp = 1;
+	} else {
+		encoder.color = PNG_RGBA;
+		encoder.depth = 8;
+		encoder.stride = (size_t)document->width * 4;
+		encoder.bpp = 4;
+	}
+
+	// Chunks are at least a row, waves one chunk per thread
+	encoder.chunk_rows = PIXED_MAX(PNG_CHUNK_BYTES / (encoder.stride + 1), 1);
+	encoder.chunks_length = (document->height + encoder.chunk_rows - 1) / encoder.chunk_rows;
+	encoder.wave_length = PIXED_MIN((uint32_t)pixed_thread_count(), encoder.chunks_length);
+	encoder.chunks = calloc(encoder.wave_length, sizeof(PixedPngChunk));
+	encoder.adler = adler32(0, 0, 0);
+
+	FILE *file = fopen(file_name, "wb");
+	int result = -1;
+
+	if (!file || !encoder.chunks)
+		goto cleanup;
+
+	unsigned char header[13];
+	store_uint32_big_endian(header, document->width);
+	store_uint32_big_endian(header + 4, document->height);
+	header[8] = encoder.depth;
+	header[9] = encoder.color;
+	header[10] = 0;
+	header[11] = 0;
+	header[12] = 0;
+
+	if (fwrite(PNG_SIGNATURE, 1, 8, file) != 8 || png_write_chunk(file, "IHDR", header, 13) != 0)
+		goto cleanup;
+
+	if (indexed && png_write_palette(file, encoder.palette, encoder.palette_length) != 0)
+		goto cleanup;
+
+	// zlib header for a 32K window and default compression
+	unsigned char stream_bytes[4] = { 0x78, 0x9c };
+	if (png_write_chunk(file, "IDAT", stream_bytes, 2) != 0)
+		goto cleanup;
+
+	uint32_t first = 0, c = 0;
+	for (; first < encoder.chunks_length; first += encoder.wave_length) {
+		encoder.first_chunk = first;
+		uint32_t wave = PIXED_MIN(encoder.wave_length, encoder.chunks_length - first);
+
+		pixed_parallel_rows(wave, PIXED_PARALLEL_MIN_PIXELS, png_deflate_chunks, &encoder);
+
+		// Streams are concatenated in order, their checksums combined
+		for (c = 0; c < wave; c++) {
+			PixedPngChunk *chunk = &encoder.chunks[c];
+			if (chunk->failed || png_write_chunk(file, "IDAT", chunk->data, chunk->size) != 0)
+				goto cleanup;
+
+			encoder.adler = adler32_combine(encoder.adler, chunk->adler, chunk->raw_size);
+		}
+	}
+
+	store_uint32_big_endian(stream_bytes, (uint32_t)encoder.adler);
+	if (png_write_chunk(file, "IDAT", stream_bytes, 4) != 0 || png_write_chunk(file, "IEND", 0, 0) != 0)
+		goto cleanup;
+
+	result = 0;
+
+cleanup:
+	for (c = 0; encoder.chunks && c < encoder.wave_length; c++)
+		free(encoder.chunks[c].data);
+
+	free(encoder.chunks);
+	free(encoder.lookup);
+
+	if (file && fclose(file) != 0)
+		result = -1;
+
+	return result;
+}
+
+/*
+ * Reads non-interlaced PNGs of every color type, palette and gray images of
+ * any bit depth. 16 bit channels keep their high byte.
+ */
+PixedDocument *
+pixed_document_read_png(const char *file_name)
+{
+	PixedPngReader reader;
+	PixedPngInfo info;
+
+	reader.file = fopen(file_name, "rb");
+	if (!reader.file)
+		return 0;
+
+	PixedDocument *document = 0;
+	unsigned char *rows[2] = { 0, 0 };
+	unsigned char *input = malloc(PNG_BUFFER_SIZE);
+	int inflating = 0;
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(z_stream));
+
+	if (!input || png_read_info(&reader, &info) != 0)
+		goto cleanup;
+
+	document = pixed_document_new(file_name, info.width, info.height);
+	rows[0] = calloc(info.stride + 1, 1);
+	rows[1] = calloc(info.stride + 1, 1);
+
+	if (!document || !rows[0] || !rows[1] || inflateInit(&stream) != Z_OK)
+		goto failed;
+
+	inflating = 1;
+
+	// png_read_info stopped at the first IDAT, rows are inflated one at a time
+	uint32_t y = 0;
+	int status = Z_OK;
+
+	for (; y < info.height; y++) {
+		unsigned char *current = rows[y & 1], *previous = rows[(y + 1) & 1];
+
+		stream.next_out = current;
+		stream.avail_out = info.stride + 1;
+
+		while (stream.avail_out > 0) {
+			if (status == Z_STREAM_END)
+				goto failed;
+
+			if (stream.avail_in == 0) {
+				// Image data may be split over any number of IDAT chunks
+				while (reader.remaining == 0) {
+					if (png_end_chunk(&reader) != 0 || png_next_chunk(&reader) != 0 ||
+						memcmp(reader.type, "IDAT", 4) != 0)
+						goto failed;
+				}
+
+				uint32_t length = PIXED_MIN(reader.remaining, PNG_BUFFER_SIZE);
+				if (png_read(&reader, input, length) != 0)
+					goto failed;
+
+				stream.next_in = input;
+				stream.avail_in = length;
+			}
+
+			status = inflate(&stream, Z_NO_FLUSH);
+			if (status != Z_OK && status != Z_STREAM_END)
+				goto failed;
+		}
+
+		if (current[0] > 4)
+			goto failed;
+
+		png_unfilter(current + 1, y > 0 ? previous + 1 : 0, info.stride,
+			(info.channels * info.depth + 7) / 8, current[0]);
+		png_expand_row(&info, current + 1, document->canvas + (size_t)y * info.width);
+	}
+
+	goto cleanup;
+
+failed:
+	if (document)
+		pixed_document_free(document);
+
+	document = 0;
+cleanup:
+	if (inflating)
+		inflateEnd(&stream);
+
+	free(rows[0]);
+	free(rows[1]);
+	free(input);
+	fclose(reader.file);
+	return document;
+}
+
+/* Binary RGB, alpha is dropped */
+int
+pixed_document_write_ppm(PixedDocument *document, char *file_name)
+{
+	if (!document)
+		return -1;
+
+	FILE *file = fopen(file_name, "wb");
+	if (!file)
+		return -1;
+
+	unsigned char *row = malloc((size_t)document->width * 3);
+	uint32_t *band = document->storage == PIXED_STORAGE_FLAT ? 0 :
+		malloc(sizeof(uint32_t) * (size_t)document->width * IMAGE_BAND_ROWS);
+	int result = -1;
+
+	if (!row || (document->storage != PIXED_STORAGE_FLAT && !band))
+		goto cleanup;
+
+	if (fprintf(file, "P6\n%u %u\n255\n", document->width, document->height) < 0)
+		goto cleanup;
+
+	uint32_t y = 0, i = 0, x = 0;
+	for (; y < document->height; y += IMAGE_BAND_ROWS) {
+		uint32_t rows = PIXED_MIN(IMAGE_BAND_ROWS, document->height - y);
+		const uint32_t *pixels = image_rows(document, y, rows, band);
+
+		for (i = 0; i < rows; i++) {
+			const unsigned char *src = (const unsigned char *)(pixels + (size_t)i * document->width);
+			for (x = 0; x < document->width; x++)
+				memcpy(row + x * 3, src + x * 4, 3);
+
+			if (fwrite(row, 3, document->width, file) != document->width)
+				goto cleanup;
+		}
+	}
+
+	result = 0;
+
+cleanup:
+	free(row);
+	free(band);
+
+	if (fclose(file) != 0)
+		result = -1;
+
+	return result;
+}
+
+/* Binary PPM (P6) and 8 bit RGB or RGB_ALPHA PAM (P7) */
+PixedDocument *
+pixed_document_read_ppm(const char *file_name)
+{
+	FILE *file = fopen(file_name, "rb");
+	if (!file)
+		return 0;
+
+	PixedDocument *document = 0;
+	unsigned char *row = 0;
+	uint32_t width = 0, height = 0, max = 0, channels = 3;
+	char magic[3] = { 0, 0, 0 };
+
+	if (fread(magic, 1, 2, file) != 2)
+		goto cleanup;
+
+	if (strcmp(magic, "P6") == 0) {
+		if (ppm_read_number(file, &width) != 0 || ppm_read_number(file, &height) != 0 ||
+			ppm_read_number(file, &max) != 0)
+			goto cleanup;
+	} else if (strcmp(magic, "P7") == 0) {
+		char line[128], key[16], value[32];
+		channels = 0;
+
+		while (fgets(line, sizeof(line), file) && strncmp(line, "ENDHDR", 6) != 0) {
+			if (sscanf(line, "%15s %31s", key, value) != 2)
+				continue;
+
+			if (strcmp(key, "WIDTH") == 0)
+				width = (uint32_t)strtoul(value, 0, 10);
+			else if (strcmp(key, "HEIGHT") == 0)
+				height = (uint32_t)strtoul(value, 0, 10);
+			else if (strcmp(key, "DEPTH") == 0)
+				channels = (uint32_t)strtoul(value, 0, 10);
+			else if (strcmp(key, "MAXVAL") == 0)
+				max = (uint32_t)strtoul(value, 0, 10);
+		}
+
+		if (channels != 3 && channels != 4)
+			goto cleanup;
+	} else {
+		goto cleanup;
+	}
+
+	if (max != 255 || width == 0 || height == 0 || width > PNG_MAX_DIMENSION || height > PNG_MAX_DIMENSION)
+		goto cleanup;
+
+	document = pixed_document_new(file_name, width, height);
+	row = malloc((size_t)width * channels);
+	if (!document || !row)
+		goto failed;
+
+	uint32_t y = 0, x = 0;
+	for (; y < height; y++) {
+		if (fread(row, channels, width, file) != width)
+			goto failed;
+
+		unsigned char *dst = (unsigned char *)(document->canvas + (size_t)y * width);
+		for (x = 0; x < width; x++) {
+			memcpy(dst + x * 4, row + x * channels, 3);
+			dst[x * 4 + 3] = channels == 4 ? row[x * channels + 3] : 0xff;
+		}
+	}
+
+	goto cleanup;
+
+failed:
+	if (document)
+		pixed_document_free(document);
+
+	document = 0;
+cleanup:
+	free(row);
+	fclose(file);
+	return document;
+}
+
+/* Rows [y, y + rows) in canvas order, copied into band unless the document is flat */
+static
+const uint32_t *
+image_rows(PixedDocument *document, uint32_t y, uint32_t rows, uint32_t *band)
+{
+	if (document->storage == PIXED_STORAGE_FLAT)
+		return document->canvas + (size_t)y * document->width;
+
+	pixed_document_copy_rows(document, y, rows, band);
+	return band;
+}
+
+static
+int
+png_write_chunk(FILE *file, const char *type, const unsigned char *data, uint32_t length)
+{
+	unsigned char bytes[8];
+	store_uint32_big_endian(bytes, length);
+	memcpy(bytes + 4, type, 4);
+
+	uLong crc = crc32(crc32(0, 0, 0), bytes + 4, 4);
+	if (length > 0)
+		crc = crc32(crc, data, length);
+
+	if (fwrite(bytes, 1, 8, file) != 8 || (length > 0 && fwrite(data, 1, length, file) != length))
+		return -1;
+
+	store_uint32_big_endian(bytes, (uint32_t)crc);
+	return fwrite(bytes, 1, 4, file) == 4 ? 0 : -1;
+}
+
+/* PLTE and, when an entry isn't opaque, tRNS. Transparent entries come first */
+static
+int
+png_write_palette(FILE *file, const uint32_t *palette, uint32_t palette_length)
+{
+	unsigned char rgb[PIXED_PALETTE_MAX * 3], alpha[PIXED_PALETTE_MAX];
+	uint32_t i = 0, transparent = 0;
+
+	for (; i < palette_length; i++) {
+		const unsigned char *entry = (const unsigned char *)&palette[i];
+		memcpy(rgb + i * 3, entry, 3);
+
+		alpha[i] = entry[3];
+		if (entry[3] != 0xff)
+			transparent = i + 1;
+	}
+
+	if (png_write_chunk(file, "PLTE", rgb, palette_length * 3) != 0)
+		return -1;
+
+	return transparent > 0 ? png_write_chunk(file, "tRNS", alpha, transparent) : 0;
+}
+
+/*
+ * Looks for at most PIXED_PALETTE_MAX colors, every band of rows in parallel.
+ * On success lookup maps them to the palette, transparent colors first.
+ */
+static
+int
+png_collect_palette(PixedPngEncoder *encoder)
+{
+	PixedDocument *document = encoder->document;
+	uint32_t bands = PIXED_MIN(PNG_PALETTE_BANDS, document->height), b = 0, i = 0;
+
+	encoder->bands = malloc(sizeof(PixedPngPalette) * bands);
+	if (!encoder->bands)
+		return -1;
+
+	pixed_parallel_rows(bands, document->width * (document->height / bands), png_collect_palette_rows, encoder);
+
+	PixedPngPalette *merged = encoder->lookup;
+	memset(merged->values, 0xff, sizeof(merged->values));
+	merged->length = 0;
+
+	for (; b < bands; b++) {
+		PixedPngPalette *band = &encoder->bands[b];
+		for (i = 0; band->length <= PIXED_PALETTE_MAX && i < band->length; i++) {
+			if (png_palette_add(merged, band->colors[i]) < 0)
+				break;
+		}
+
+		if (band->length > PIXED_PALETTE_MAX || i < band->length) {
+			free(encoder->bands);
+			encoder->bands = 0;
+			return -1;
+		}
+	}
+
+	free(encoder->bands);
+	encoder->bands = 0;
+
+	// tRNS only has to reach the last transparent entry
+	int pass = 0;
+	for (; pass < 2; pass++) {
+		for (i = 0; i < merged->length; i++) {
+			int opaque = ((const unsigned char *)&merged->colors[i])[3] == 0xff;
+			if (opaque == pass)
+				encoder->palette[encoder->palette_length++] = merged->colors[i];
+		}
+	}
+
+	memset(merged->values, 0xff, sizeof(merged->values));
+	merged->length = 0;
+
+	for (i = 0; i < encoder->palette_length; i++)
+		png_palette_add(merged, encoder->palette[i]);
+
+	return 0;
+}
+
+static
+void
+png_collect_palette_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedPngEncoder *encoder = ctx;
+	PixedDocument *document = encoder->document;
+	uint32_t bands = PIXED_MIN(PNG_PALETTE_BANDS, document->height);
+	uint32_t *row = document->storage == PIXED_STORAGE_FLAT ? 0 : malloc(sizeof(uint32_t) * document->width);
+	uint32_t b = begin, y = 0, x = 0;
+
+	for (; b < end; b++) {
+		PixedPngPalette *band = &encoder->bands[b];
+		memset(band->values, 0xff, sizeof(band->values));
+		band->length = 0;
+
+		if (document->storage != PIXED_STORAGE_FLAT && !row) {
+			band->length = PIXED_PALETTE_MAX + 1;
+			continue;
+		}
+
+		uint32_t y0 = (uint32_t)(((uint64_t)document->height * b) / bands);
+		uint32_t y1 = (uint32_t)(((uint64_t)document->height * (b + 1)) / bands);
+
+		for (y = y0; y < y1 && band->length <= PIXED_PALETTE_MAX; y++) {
+			const uint32_t *pixels = document->canvas + (size_t)y * document->width;
+			if (row) {
+				pixed_document_copy_rows(document, y, 1, row);
+				pixels = row;
+			}
+
+			// Pixel art is mostly runs, skip the lookup for them
+			for (x = 0; x < document->width; x++) {
+				if (x > 0 && pixels[x] == pixels[x - 1])
+					continue;
+
+				if (png_palette_add(band, pixels[x]) < 0) {
+					band->length = PIXED_PALETTE_MAX + 1;
+					break;
+				}
+			}
+		}
+	}
+
+	free(row);
+}
+
+/* Index of color, added if it isn't there yet. -1 when the palette is full */
+static
+int
+png_palette_add(PixedPngPalette *palette, uint32_t color)
+{
+	uint32_t slot = (color * 2654435761u) >> 23;
+	while (palette->values[slot] >= 0 && palette->keys[slot] != color)
+		slot = (slot + 1) & (PIXED_PALETTE_MAX * 2 - 1);
+
+	if (palette->values[slot] < 0) {
+		if (palette->length >= PIXED_PALETTE_MAX)
+			return -1;
+
+		palette->keys[slot] = color;
+		palette->values[slot] = palette->length;
+		palette->colors[palette->length++] = color;
+	}
+
+	return palette->values[slot];
+}
+
+static
+int
+png_palette_find(const PixedPngPalette *palette, uint32_t color)
+{
+	uint32_t slot = (color * 2654435761u) >> 23;
+	while (palette->values[slot] >= 0 && palette->keys[slot] != color)
+		slot = (slot + 1) & (PIXED_PALETTE_MAX * 2 - 1);
+
+	return palette->values[slot];
+}
+
+/*
+ * Filters and deflates chunks [begin, end) of the wave, each into a raw
+ * deflate stream of its own. All but the last chunk of the image end in a
+ * sync flush so the streams can simply be concatenated.
+ */
+static
+void
+png_deflate_chunks(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedPngEncoder *encoder = ctx;
+	PixedDocument *document = encoder->document;
+	size_t stride = encoder->stride;
+
+	// Two rows of scratch so the previous raw row survives the next one
+	uint32_t *scratch = malloc(sizeof(uint32_t) * document->width * 2);
+	unsigned char *zero = calloc(stride, 1);
+	unsigned char *candidates = malloc((stride + 1) * 5);
+	uint32_t c = begin, y = 0;
+
+	for (; c < end; c++) {
+		PixedPngChunk *chunk = &encoder->chunks[c];
+		uint32_t index = encoder->first_chunk + c;
+		uint32_t y0 = index * encoder->chunk_rows;
+		uint32_t y1 = PIXED_MIN(y0 + encoder->chunk_rows, document->height);
+
+		chunk->failed = 1;
+		chunk->size = 0;
+		chunk->raw_size = (size_t)(y1 - y0) * (stride + 1);
+		chunk->adler = adler32(0, 0, 0);
+
+		if (!scratch || !zero || !candidates)
+			continue;
+
+		z_stream stream;
+		memset(&stream, 0, sizeof(z_stream));
+
+		int strategy = encoder->color == PNG_PALETTE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+			continue;
+
+		// A sync flush adds an empty stored block on top of the bound
+		size_t bound = deflateBound(&stream, chunk->raw_size) + 16;
+		if (chunk->capacity < bound) {
+			free(chunk->data);
+			chunk->data = malloc(bound);
+			chunk->capacity = chunk->data ? bound : 0;
+		}
+
+		if (!chunk->data) {
+			deflateEnd(&stream);
+			continue;
+		}
+
+		stream.next_out = chunk->data;
+		stream.avail_out = chunk->capacity;
+
+		const unsigned char *previous = y0 > 0 ? png_raw_row(encoder, y0 - 1, scratch + ((y0 - 1) & 1) * document->width) : zero;
+		int last = index == encoder->chunks_length - 1, status = Z_OK;
+
+		for (y = y0; y < y1 && status == Z_OK; y++) {
+			const unsigned char *raw = png_raw_row(encoder, y, scratch + (y & 1) * document->width);
+			const unsigned char *filtered = png_filter_row(encoder, raw, previous, candidates);
+
+			chunk->adler = adler32(chunk->adler, filtered, stride + 1);
+
+			stream.next_in = (unsigned char *)filtered;
+			stream.avail_in = stride + 1;
+			status = deflate(&stream, y + 1 < y1 ? Z_NO_FLUSH : (last ? Z_FINISH : Z_SYNC_FLUSH));
+
+			if (stream.avail_in > 0)
+				status = Z_BUF_ERROR;
+
+			previous = raw;
+		}
+
+		if (status == (last ? Z_STREAM_END : Z_OK)) {
+			chunk->size = chunk->capacity - stream.avail_out;
+			chunk->failed = 0;
+		}
+
+		deflateEnd(&stream);
+	}
+
+	free(scratch);
+	free(zero);
+	free(candidates);
+}
+
+/* Unfiltered bytes of row y, in scratch unless they can be used in place */
+static
+const unsigned char *
+png_raw_row(PixedPngEncoder *encoder, uint32_t y, uint32_t *scratch)
+{
+	PixedDocument *document = encoder->document;
+	uint32_t x = 0, width = document->width;
+
+	if (encoder->color == PNG_RGBA) {
+		if (document->storage == PIXED_STORAGE_FLAT)
+			return (const unsigned char *)(document->canvas + (size_t)y * width);
+
+		pixed_document_copy_rows(document, y, 1, scratch);
+		return (const unsigned char *)scratch;
+	}
+
+	unsigned char *indices = (unsigned char *)scratch;
+	const unsigned char *source = indices;
+
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		source = document->indices + (size_t)y * width;
+		if (encoder->depth == 8)
+			return source;
+	} else {
+		const uint32_t *pixels = document->canvas + (size_t)y * width;
+		if (document->storage != PIXED_STORAGE_FLAT) {
+			pixed_document_copy_rows(document, y, 1, scratch);
+			pixels = scratch;
+		}
+
+		// Mapped in place, indices never get ahead of the pixels they replace
+		uint32_t color = pixels[0];
+		int index = png_palette_find(encoder->lookup, color);
+
+		for (x = 0; x < width; x++) {
+			if (pixels[x] != color) {
+				color = pixels[x];
+				index = png_palette_find(encoder->lookup, color);
+			}
+
+			indices[x] = index;
+		}
+
+		if (encoder->depth == 8)
+			return indices;
+	}
+
+	// Packs pixels_per_byte indices into every byte, again in place
+	uint32_t depth = encoder->depth, pixels_per_byte = 8 / depth;
+	size_t i = 0;
+
+	for (; i < encoder->stride; i++) {
+		unsigned char packed = 0;
+		uint32_t p = 0;
+
+		for (; p < pixels_per_byte; p++) {
+			x = i * pixels_per_byte + p;
+			if (x < width)
+				packed |= source[x] << (8 - depth * (p + 1));
+		}
+
+		indices[i] = packed;
+	}
+
+	return indices;
+}
+
+/*
+ * Picks the filter with the smallest sum of absolute differences, like
+ * libpng does. Palette rows too, atlases repeat rows that Up turns to zeros.
+ */
+static
+const unsigned char *
+png_filter_row(PixedPngEncoder *encoder, const unsigned char *raw, const unsigned char *previous, unsigned char *candidates)
+{
+	size_t stride = encoder->stride, best_sum = SIZE_MAX;
+	int filter = 0, best = 0;
+
+	for (; filter < 5; filter++) {
+		unsigned char *out = candidates + filter * (stride + 1);
+		size_t sum = png_filter(filter, raw, previous, stride, encoder->bpp, out + 1, best_sum);
+
+		out[0] = filter;
+		if (sum < best_sum) {
+			best_sum = sum;
+			best = filter;
+		}
+	}
+
+	return candidates + best * (stride + 1);
+}
+
+/*
+ * Filters a row into out, giving up once the sum reaches limit. Returns the
+ * sum. The first pixel has no left neighbour, the rest of the row goes in
+ * blocks without branches so the loops vectorize.
+ */
+static
+size_t
+png_filter(int filter, const unsigned char *raw, const unsigned char *previous, size_t length, uint32_t bpp,
+	unsigned char *out, size_t limit)
+{
+	size_t i = 0, block = 0, end = 0, sum = 0;
+	bpp = PIXED_MIN(bpp, length);
+
+#define PNG_FILTER_LOOP(FIRST, PREDICTOR) \
+	for (i = 0; i < bpp; i++) { \
+		out[i] = raw[i] - (FIRST); \
+		sum += (signed char)out[i] < 0 ? -(signed char)out[i] : out[i]; \
+	} \
+	for (block = bpp; block < length && sum < limit; block = end) { \
+		end = PIXED_MIN(block + 256, length); \
+		for (i = block; i < end; i++) { \
+			out[i] = raw[i] - (PREDICTOR); \
+			sum += (signed char)out[i] < 0 ? -(signed char)out[i] : out[i]; \
+		} \
+	}
+
+	switch (filter) {
+	case 0:
+		PNG_FILTER_LOOP(0, 0)
+		break;
+
+	case 1:
+		PNG_FILTER_LOOP(0, raw[i - bpp])
+		break;
+
+	case 2:
+		PNG_FILTER_LOOP(previous[i], previous[i])
+		break;
+
+	case 3:
+		PNG_FILTER_LOOP(previous[i] / 2, (raw[i - bpp] + previous[i]) / 2)
+		break;
+
+	default:
+		PNG_FILTER_LOOP(previous[i], png_paeth(raw[i - bpp], previous[i], previous[i - bpp]))
+		break;
+	}
+
+#undef PNG_FILTER_LOOP
+
+	return sum;
+}
+
+/* Reads length and type of the next chunk, its data is left to png_read */
+static
+int
+png_next_chunk(PixedPngReader *reader)
+{
+	unsigned char bytes[8];
+	if (fread(bytes, 1, 8, reader->file) != 8)
+		return -1;
+
+	reader->remaining = parse_uint32_big_endian(bytes);
+	if (reader->remaining > INT32_MAX)
+		return -1;
+
+	memcpy(reader->type, bytes + 4, 4);
+	reader->crc = crc32(crc32(0, 0, 0), reader->type, 4);
+	return 0;
+}
+
+static
+int
+png_read(PixedPngReader *reader, unsigned char *data, uint32_t length)
+{
+	if (length > reader->remaining || fread(data, 1, length, reader->file) != length)
+		return -1;
+
+	reader->crc = crc32(reader->crc, data, length);
+	reader->remaining -= length;
+	return 0;
+}
+
+/* Skips what is left of the chunk and checks its CRC */
+static
+int
+png_end_chunk(PixedPngReader *reader)
+{
+	unsigned char bytes[256];
+
+	while (reader->remaining > 0) {
+		if (png_read(reader, bytes, PIXED_MIN(reader->remaining, sizeof(bytes))) != 0)
+			return -1;
+	}
+
+	if (fread(bytes, 1, 4, reader->file) != 4)
+		return -1;
+
+	return parse_uint32_big_endian(bytes) == (uint32_t)reader->crc ? 0 : -1;
+}
+
+/* Reads the chunks up to the first IDAT, the reader is left at its data */
+static
+int
+png_read_info(PixedPngReader *reader, PixedPngInfo *info)
+{
+	unsigned char bytes[768];
+	uint32_t i = 0;
+
+	if (fread(bytes, 1, 8, reader->file) != 8 || memcmp(bytes, PNG_SIGNATURE, 8) != 0)
+		return -1;
+
+	if (png_next_chunk(reader) != 0 || memcmp(reader->type, "IHDR", 4) != 0 || reader->remaining != 13 ||
+		png_read(reader, bytes, 13) != 0 || png_end_chunk(reader) != 0)
+		return -1;
+
+	info->width = parse_uint32_big_endian(bytes);
+	info->height = parse_uint32_big_endian(bytes + 4);
+	info->depth = bytes[8];
+	info->color = bytes[9];
+	info->palette_length = 0;
+	info->has_key = 0;
+
+	// Compression, filter method and interlace all have to be 0
+	if (bytes[10] != 0 || bytes[11] != 0 || bytes[12] != 0)
+		return -1;
+
+	if (info->width == 0 || info->height == 0 || info->width > PNG_MAX_DIMENSION || info->height > PNG_MAX_DIMENSION)
+		return -1;
+
+	switch (info->color) {
+	case PNG_GRAY:       info->channels = 1; break;
+	case PNG_RGB:        info->channels = 3; break;
+	case PNG_PALETTE:    info->channels = 1; break;
+	case PNG_GRAY_ALPHA: info->channels = 2; break;
+	case PNG_RGBA:       info->channels = 4; break;
+	default:             return -1;
+	}
+
+	int low_depth = info->depth == 1 || info->depth == 2 || info->depth == 4;
+	if (info->depth != 8 && info->depth != 16 && !(low_depth && (info->color == PNG_GRAY || info->color == PNG_PALETTE)))
+		return -1;
+
+	if (info->color == PNG_PALETTE && info->depth == 16)
+		return -1;
+
+	info->stride = ((size_t)info->width * info->channels * info->depth + 7) / 8;
+
+	while (png_next_chunk(reader) == 0) {
+		if (memcmp(reader->type, "IDAT", 4) == 0)
+			return info->color == PNG_PALETTE && info->palette_length == 0 ? -1 : 0;
+
+		if (memcmp(reader->type, "PLTE", 4) == 0 && info->color == PNG_PALETTE) {
+			uint32_t length = reader->remaining;
+			if (length % 3 != 0 || length > 768 || png_read(reader, bytes, length) != 0)
+				return -1;
+
+			// Entries are opaque until a tRNS chunk says otherwise
+			info->palette_length = length / 3;
+			for (i = 0; i < info->palette_length; i++) {
+				unsigned char *entry = (unsigned char *)&info->palette[i];
+				memcpy(entry, bytes + i * 3, 3);
+				entry[3] = 0xff;
+			}
+		} else if (memcmp(reader->type, "tRNS", 4) == 0) {
+			uint32_t length = reader->remaining;
+			if (length > 256 || png_read(reader, bytes, length) != 0)
+				return -1;
+
+			if (info->color == PNG_PALETTE) {
+				for (i = 0; i < length && i < info->palette_length; i++)
+					((unsigned char *)&info->palette[i])[3] = bytes[i];
+			} else if (info->color == PNG_GRAY && length == 2) {
+				info->has_key = 1;
+				info->key[0] = info->key[1] = info->key[2] = (bytes[0] << 8) | bytes[1];
+			} else if (info->color == PNG_RGB && length == 6) {
+				info->has_key = 1;
+				for (i = 0; i < 3; i++)
+					info->key[i] = (bytes[i * 2] << 8) | bytes[i * 2 + 1];
+			}
+		} else if (memcmp(reader->type, "IEND", 4) == 0) {
+			return -1;
+		}
+
+		if (png_end_chunk(reader) != 0)
+			return -1;
+	}
+
+	return -1;
+}
+
+/* Reverses the filter of row in place, previous is 0 for the first row */
+static
+void
+png_unfilter(unsigned char *row, const unsigned char *previous, size_t length, uint32_t bpp, int filter)
+{
+	size_t i = 0;
+
+	switch (filter) {
+	case 1:
+		for (i = bpp; i < length; i++)
+			row[i] += row[i - bpp];
+		break;
+
+	case 2:
+		for (i = 0; previous && i < length; i++)
+			row[i] += previous[i];
+		break;
+
+	case 3:
+		for (i = 0; i < length; i++) {
+			uint32_t left = i >= bpp ? row[i - bpp] : 0;
+			uint32_t up = previous ? previous[i] : 0;
+			row[i] += (left + up) / 2;
+		}
+		break;
+
+	case 4:
+		for (i = 0; i < length; i++) {
+			int left = i >= bpp ? row[i - bpp] : 0;
+			int up = previous ? previous[i] : 0;
+			int corner = previous && i >= bpp ? previous[i - bpp] : 0;
+
+			row[i] += png_paeth(left, up, corner);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* Converts an unfiltered row to canvas words */
+static
+void
+png_expand_row(const PixedPngInfo *info, const unsigned char *row, uint32_t *dst)
+{
+	uint32_t x = 0, c = 0;
+
+	if (info->depth < 8) {
+		uint32_t mask = (1 << info->depth) - 1;
+
+		for (x = 0; x < info->width; x++) {
+			uint32_t bit = x * info->depth;
+			uint32_t value = (row[bit / 8] >> (8 - info->depth - bit % 8)) & mask;
+
+			if (info->color == PNG_PALETTE) {
+				dst[x] = value < info->palette_length ? info->palette[value] : 0;
+				continue;
+			}
+
+			uint32_t gray = value * 255 / mask;
+			uint32_t alpha = info->has_key && value == info->key[0] ? 0 : 0xff;
+			dst[x] = pixed_canvas_color(pixed_color_rgba(gray, gray, gray, alpha));
+		}
+
+		return;
+	}
+
+	uint32_t bytes = info->depth / 8;
+	uint32_t samples[4];
+
+	for (x = 0; x < info->width; x++) {
+		const unsigned char *pixel = row + (size_t)x * info->channels * bytes;
+		unsigned char *out = (unsigned char *)(dst + x);
+		int keyed = info->has_key;
+
+		// Colors keep the high byte of 16 bit samples, the key compares all of it
+		for (c = 0; c < info->channels; c++) {
+			samples[c] = pixel[c * bytes];
+			if (keyed && c < 3 && (bytes == 2 ? (pixel[c * 2] << 8) | pixel[c * 2 + 1] : pixel[c]) != info->key[c])
+				keyed = 0;
+		}
+
+		switch (info->color) {
+		case PNG_PALETTE:
+			dst[x] = samples[0] < info->palette_length ? info->palette[samples[0]] : 0;
+			break;
+
+		case PNG_GRAY:
+		case PNG_GRAY_ALPHA:
+			out[0] = out[1] = out[2] = samples[0];
+			out[3] = info->color == PNG_GRAY_ALPHA ? samples[1] : (keyed ? 0 : 0xff);
+			break;
+
+		default:
+			out[0] = samples[0];
+			out[1] = samples[1];
+			out[2] = samples[2];
+			out[3] = info->color == PNG_RGBA ? samples[3] : (keyed ? 0 : 0xff);
+			break;
+		}
+	}
+}
+
+/* Next decimal number of a netpbm header, comments are skipped */
+static
+int
+ppm_read_number(FILE *file, uint32_t *number)
+{
+	int c = fgetc(file);
+
+	while (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#') {
+		if (c == '#') {
+			while (c != '\n' && c != EOF)
+				c = fgetc(file);
+		}
+
+		c = fgetc(file);
+	}
+
+	if (c < '0' || c > '9')
+		return -1;
+
+	uint64_t value = 0;
+	for (; c >= '0' && c <= '9'; c = fgetc(file)) {
+		value = value * 10 + (c - '0');
+		if (value > UINT32_MAX)
+			return -1;
+	}
+
+	// A single whitespace ends the number, the raster follows the last one
+	if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+		return -1;
+
+	*number = (uint32_t)value;
+	return 0;
+}
+
+/* Of left, up and corner the one closest to left + up - corner */
+static
+int
+png_paeth(int left, int up, int corner)
+{
+	int p = left + up - corner;
+	int pa = abs(p - left), pb = abs(p - up), pc = abs(p - corner);
+
+	return pa <= pb && pa <= pc ? left : (pb <= pc ? up : corner);
+}
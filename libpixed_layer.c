@@ -0,0 +1,468 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * Layered documents keep their pixels in layers, each one a document of its
+ * own with any storage, and the composite of the visible ones in the flat
+ * canvas of the document. Writers draw into layers, pixed_document_composite
+ * brings the canvas up to date with the tiles they marked dirty.
+ *
+ * Blending works on premultiplied RGBA8 one PIXED_TILE_SIZE square block at
+ * a time, so the block stays in cache while every layer goes over it.
+ */
+
+typedef struct {
+	PixedDocument *document;
+	uint32_t       tile_x0, tile_x1; // inclusive tile columns
+	uint32_t       tile_y0;
+} PixedCompositeJob;
+
+static void layers_changed(PixedDocument *);
+static void composite_rows(void *, uint32_t, uint32_t);
+static void composite_tile(PixedDocument *, uint32_t, uint32_t);
+static void blend_row(uint32_t *, const uint32_t *, uint32_t, uint32_t, PixedBlendMode);
+static void blend_pixel(unsigned char *, const unsigned char *, uint32_t, PixedBlendMode);
+static void unpremultiply_row(uint32_t *, const uint32_t *, uint32_t);
+
+/* Rounded x / 255 for x up to 255 * 255 */
+#define DIV255(X) (((X) + 128 + (((X) + 128) >> 8)) >> 8)
+
+/*
+ * Puts a transparent tiled layer on top and returns its index. The first one
+ * turns the document into a layered one, its pixels and undo history become
+ * the bottom layer.
+ */
+int
+pixed_document_add_layer(PixedDocument *document)
+{
+	if (document->layers_length == 0) {
+		document->layers = malloc(sizeof(PixedLayer));
+		if (!document->layers)
+			return -1;
+
+		PixedDocument *pixels = pixed_document_take_pixels(document);
+		if (!pixels) {
+			free(document->layers);
+			document->layers = 0;
+			return -1;
+		}
+
+		if (document->history)
+			pixed_history_move(document->history, pixels);
+
+		document->layers[0].pixels = pixels;
+		document->layers[0].opacity = 255;
+		document->layers[0].visible = 1;
+		document->layers[0].blend = PIXED_BLEND_NORMAL;
+		document->layers_length = 1;
+
+		pixed_document_mark_dirty(pixels, 0, 0, pixels->width, pixels->height);
+	}
+
+	PixedLayer *layers = realloc(document->layers, sizeof(PixedLayer) * (document->layers_length + 1));
+	if (!layers)
+		return -1;
+
+	document->layers = layers;
+
+	PixedDocument *pixels = pixed_document_new_tiled("layer", document->width, document->height);
+	if (!pixels)
+		return -1;
+
+	PixedLayer *layer = &document->layers[document->layers_length];
+	layer->pixels = pixels;
+	layer->opacity = 255;
+	layer->visible = 1;
+	layer->blend = PIXED_BLEND_NORMAL;
+
+	return document->layers_length++;
+}
+
+/* The last layer of a document can't be removed */
+int
+pixed_document_remove_layer(PixedDocument *document, uint32_t index)
+{
+	if (index >= document->layers_length || document->layers_length == 1)
+		return -1;
+
+	pixed_document_free(document->layers[index].pixels);
+	memmove(document->layers + index, document->layers + index + 1,
+		sizeof(PixedLayer) * (document->layers_length - index - 1));
+	document->layers_length--;
+
+	layers_changed(document);
+	return 0;
+}
+
+/* Moves the layer at from to index to, the layers in between shift over */
+int
+pixed_document_move_layer(PixedDocument *document, uint32_t from, uint32_t to)
+{
+	if (from >= document->layers_length || to >= document->layers_length)
+		return -1;
+
+	if (from == to)
+		return 0;
+
+	PixedLayer layer = document->layers[from];
+	if (from < to)
+		memmove(document->layers + from, document->layers + from + 1, sizeof(PixedLayer) * (to - from));
+	else
+		memmove(document->layers + to + 1, document->layers + to, sizeof(PixedLayer) * (from - to));
+
+	document->layers[to] = layer;
+
+	layers_changed(document);
+	return 0;
+}
+
+int
+pixed_document_set_layer(PixedDocument *document, uint32_t index, uint8_t opacity, int visible, PixedBlendMode blend)
+{
+	if (index >= document->layers_length || blend > PIXED_BLEND_SCREEN)
+		return -1;
+
+	PixedLayer *layer = &document->layers[index];
+	if (layer->opacity == opacity && layer->visible == visible && layer->blend == blend)
+		return 0;
+
+	layer->opacity = opacity;
+	layer->visible = visible;
+	layer->blend = blend;
+
+	pixed_document_mark_dirty(layer->pixels, 0, 0, layer->pixels->width, layer->pixels->height);
+	return 0;
+}
+
+/*
+ * Composites the tiles under the pixels layers changed since the last call
+ * into the canvas and marks them dirty there. Layers have to stay as large
+ * as the document, resize the document to resize them all.
+ */
+int
+pixed_document_composite(PixedDocument *document)
+{
+	uint32_t x0 = UINT32_MAX, y0 = UINT32_MAX, x1 = 0, y1 = 0, i = 0;
+	PixedRect rect;
+
+	for (; i < document->layers_length; i++) {
+		PixedDocument *pixels = document->layers[i].pixels;
+
+		if (pixels->width != document->width || pixels->height != document->height)
+			return -1;
+
+		if (!pixed_document_take_dirty(pixels, &rect))
+			continue;
+
+		x0 = PIXED_MIN(x0, rect.x);
+		y0 = PIXED_MIN(y0, rect.y);
+		x1 = PIXED_MAX(x1, rect.x + rect.width);
+		y1 = PIXED_MAX(y1, rect.y + rect.height);
+	}
+
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+
+	PixedCompositeJob job;
+	job.document = document;
+	job.tile_x0 = x0 / PIXED_TILE_SIZE;
+	job.tile_x1 = (x1 - 1) / PIXED_TILE_SIZE;
+	job.tile_y0 = y0 / PIXED_TILE_SIZE;
+
+	uint32_t tile_rows = (y1 - 1) / PIXED_TILE_SIZE - job.tile_y0 + 1;
+	uint64_t row_work = (uint64_t)(job.tile_x1 - job.tile_x0 + 1) * PIXED_TILE_PIXELS * document->layers_length;
+
+	if (document->colors) {
+		pixed_color_index_capture(document->colors, job.tile_x0 * PIXED_TILE_SIZE, job.tile_y0 * PIXED_TILE_SIZE,
+			(job.tile_x1 - job.tile_x0 + 1) * PIXED_TILE_SIZE, tile_rows * PIXED_TILE_SIZE);
+	}
+
+	pixed_parallel_rows(tile_rows, (uint32_t)PIXED_MIN(row_work, UINT32_MAX), composite_rows, &job);
+
+	pixed_document_mark_dirty(document, job.tile_x0 * PIXED_TILE_SIZE, job.tile_y0 * PIXED_TILE_SIZE,
+		(job.tile_x1 - job.tile_x0 + 1) * PIXED_TILE_SIZE, tile_rows * PIXED_TILE_SIZE);
+	return 0;
+}
+
+/* Every pixel may look different after layers were reordered or removed */
+static
+void
+layers_changed(PixedDocument *document)
+{
+	PixedDocument *pixels = document->layers[0].pixels;
+	pixed_document_mark_dirty(pixels, 0, 0, pixels->width, pixels->height);
+}
+
+static
+void
+composite_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedCompositeJob *job = ctx;
+	uint32_t tile_y = job->tile_y0 + begin, tile_x = 0;
+
+	for (; tile_y < job->tile_y0 + end; tile_y++) {
+		for (tile_x = job->tile_x0; tile_x <= job->tile_x1; tile_x++)
+			composite_tile(job->document, tile_x, tile_y);
+	}
+}
+
+static
+void
+composite_tile(PixedDocument *document, uint32_t tile_x, uint32_t tile_y)
+{
+	uint32_t block[PIXED_TILE_PIXELS], line[PIXED_TILE_SIZE];
+	uint32_t x = tile_x * PIXED_TILE_SIZE, y = tile_y * PIXED_TILE_SIZE;
+	uint32_t width = PIXED_MIN(PIXED_TILE_SIZE, document->width - x);
+	uint32_t height = PIXED_MIN(PIXED_TILE_SIZE, document->height - y);
+	uint32_t i = 0, row = 0, column = 0;
+
+	memset(block, 0, sizeof(uint32_t) * width * height);
+
+	for (; i < document->layers_length; i++) {
+		PixedLayer *layer = &document->layers[i];
+		PixedDocument *pixels = layer->pixels;
+
+		if (!layer->visible || layer->opacity == 0)
+			continue;
+
+		if (pixels->storage == PIXED_STORAGE_INDEXED) {
+			for (row = 0; row < height; row++) {
+				const uint8_t *indices = pixels->indices + (size_t)(y + row) * pixels->width + x;
+
+				for (column = 0; column < width; column++)
+					line[column] = pixels->palette[indices[column]];
+
+				blend_row(block + row * width, line, width, layer->opacity, layer->blend);
+			}
+
+			continue;
+		}
+
+		// Untouched tiles are transparent and change nothing in any blend mode
+		PixedTile tile;
+		if (pixed_document_get_tile(pixels, tile_x, tile_y, 0, &tile) != 0 || tile.empty)
+			continue;
+
+		for (row = 0; row < height; row++)
+			blend_row(block + row * width, tile.pixels + (size_t)row * tile.stride, width, layer->opacity, layer->blend);
+	}
+
+	for (row = 0; row < height; row++)
+		unpremultiply_row(document->canvas + (size_t)(y + row) * document->width + x, block + row * width, width);
+}
+
+/*
+ * Blends straight alpha src, scaled by opacity, over premultiplied dst:
+ *
+ *   normal    s + d * (1 - sa)
+ *   multiply  s * d + s * (1 - da) + d * (1 - sa)
+ *   add       s + d
+ *   screen    s + d - s * d
+ *
+ * with every channel of s premultiplied and clamped to 1.
+ */
+static
+void
+blend_row(uint32_t *dst, const uint32_t *src, uint32_t length, uint32_t opacity, PixedBlendMode blend)
+{
+	uint32_t i = 0;
+
+#if defined(PIXED_SIMD_SSE2)
+	__m128i zero = _mm_setzero_si128(), c255 = _mm_set1_epi16(255), c128 = _mm_set1_epi16(128);
+	__m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	__m128i alpha_bytes = _mm_set1_epi32((int)pixed_canvas_color(0x000000ff));
+	__m128i scale = _mm_set1_epi16((short)opacity);
+
+	for (; i + 4 <= length; i += 4) {
+		__m128i s8 = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i alpha8 = _mm_and_si128(s8, alpha_bytes);
+
+		// Transparent pixels leave dst alone, opaque ones replace it in normal mode
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(alpha8, zero)) == 0xffff)
+			continue;
+
+		if (blend == PIXED_BLEND_NORMAL && opacity == 255 &&
+			_mm_movemask_epi8(_mm_cmpeq_epi8(alpha8, alpha_bytes)) == 0xffff) {
+			_mm_storeu_si128((__m128i *)(dst + i), s8);
+			continue;
+		}
+
+		__m128i d8 = _mm_loadu_si128((const __m128i *)(dst + i)), halves[2];
+		int h = 0;
+
+		for (; h < 2; h++) {
+			__m128i s = h ? _mm_unpackhi_epi8(s8, zero) : _mm_unpacklo_epi8(s8, zero);
+			__m128i d = h ? _mm_unpackhi_epi8(d8, zero) : _mm_unpacklo_epi8(d8, zero);
+			__m128i t, out;
+
+			// k = sa * opacity, s = rgb * k with k as its alpha
+			__m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+			t = _mm_add_epi16(_mm_mullo_epi16(sa, scale), c128);
+			__m128i k = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+			s = _mm_or_si128(_mm_and_si128(alpha_lanes, c255), _mm_andnot_si128(alpha_lanes, s));
+			t = _mm_add_epi16(_mm_mullo_epi16(s, k), c128);
+			s = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+			__m128i inverse_sa = _mm_sub_epi16(c255, k);
+			t = _mm_add_epi16(_mm_mullo_epi16(d, inverse_sa), c128);
+			__m128i d_over = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+			t = _mm_add_epi16(_mm_mullo_epi16(s, d), c128);
+			__m128i product = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+			switch (blend) {
+			case PIXED_BLEND_MULTIPLY: {
+				__m128i inverse_da = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(d, 0xff), 0xff));
+				t = _mm_add_epi16(_mm_mullo_epi16(s, inverse_da), c128);
+				__m128i s_over = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+				out = _mm_adds_epu16(_mm_adds_epu16(product, s_over), d_over);
+				break;
+			}
+
+			case PIXED_BLEND_ADD:
+				out = _mm_adds_epu16(s, d);
+				break;
+
+			case PIXED_BLEND_SCREEN:
+				out = _mm_sub_epi16(_mm_add_epi16(s, d), product);
+				break;
+
+			default:
+				out = _mm_add_epi16(s, d_over);
+				break;
+			}
+
+			halves[h] = out;
+		}
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(halves[0], halves[1]));
+	}
+#elif defined(PIXED_SIMD_NEON)
+	uint16x8_t c255 = vdupq_n_u16(255), c128 = vdupq_n_u16(128);
+	uint8x8_t scale = vdup_n_u8((uint8_t)opacity);
+
+	for (; i + 8 <= length; i += 8) {
+		uint8x8x4_t s8 = vld4_u8((const uint8_t *)(src + i));
+		uint8x8x4_t d8 = vld4_u8((const uint8_t *)(dst + i)), out8;
+		uint16x8_t t, s[4];
+		int c = 0;
+
+		if (vget_lane_u64(vreinterpret_u64_u8(s8.val[3]), 0) == 0)
+			continue;
+
+		t = vaddq_u16(vmull_u8(s8.val[3], scale), c128);
+		s[3] = vshrq_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+
+		for (c = 0; c < 3; c++) {
+			t = vaddq_u16(vmulq_u16(vmovl_u8(s8.val[c]), s[3]), c128);
+			s[c] = vshrq_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+		}
+
+		uint16x8_t inverse_sa = vsubq_u16(c255, s[3]);
+		uint16x8_t inverse_da = vsubq_u16(c255, vmovl_u8(d8.val[3]));
+
+		for (c = 0; c < 4; c++) {
+			uint16x8_t d = vmovl_u8(d8.val[c]), out;
+
+			t = vaddq_u16(vmulq_u16(d, inverse_sa), c128);
+			uint16x8_t d_over = vshrq_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+
+			t = vaddq_u16(vmulq_u16(s[c], d), c128);
+			uint16x8_t product = vshrq_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+
+			switch (blend) {
+			case PIXED_BLEND_MULTIPLY:
+				t = vaddq_u16(vmulq_u16(s[c], inverse_da), c128);
+				out = vqaddq_u16(vqaddq_u16(product, vshrq_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8)), d_over);
+				break;
+
+			case PIXED_BLEND_ADD:
+				out = vqaddq_u16(s[c], d);
+				break;
+
+			case PIXED_BLEND_SCREEN:
+				out = vsubq_u16(vaddq_u16(s[c], d), product);
+				break;
+
+			default:
+				out = vaddq_u16(s[c], d_over);
+				break;
+			}
+
+			out8.val[c] = vqmovn_u16(out);
+		}
+
+		vst4_u8((uint8_t *)(dst + i), out8);
+	}
+#endif
+
+	for (; i < length; i++)
+		blend_pixel((unsigned char *)(dst + i), (const unsigned char *)(src + i), opacity, blend);
+}
+
+/* One pixel of blend_row, bytes in canvas (R, G, B, A) order */
+static
+void
+blend_pixel(unsigned char *dst, const unsigned char *src, uint32_t opacity, PixedBlendMode blend)
+{
+	uint32_t k = DIV255(src[3] * opacity), c = 0;
+	if (k == 0)
+		return;
+
+	uint32_t s[4] = { DIV255(src[0] * k), DIV255(src[1] * k), DIV255(src[2] * k), k };
+	uint32_t da = dst[3];
+
+	for (; c < 4; c++) {
+		uint32_t d = dst[c], out = 0;
+
+		switch (blend) {
+		case PIXED_BLEND_MULTIPLY:
+			out = DIV255(s[c] * d) + DIV255(s[c] * (255 - da)) + DIV255(d * (255 - k));
+			break;
+
+		case PIXED_BLEND_ADD:
+			out = s[c] + d;
+			break;
+
+		case PIXED_BLEND_SCREEN:
+			out = s[c] + d - DIV255(s[c] * d);
+			break;
+
+		default:
+			out = s[c] + DIV255(d * (255 - k));
+			break;
+		}
+
+		dst[c] = out > 255 ? 255 : out;
+	}
+}
+
+/* Premultiplied block back to the straight alpha of the canvas */
+static
+void
+unpremultiply_row(uint32_t *dst, const uint32_t *src, uint32_t length)
+{
+	uint32_t i = 0, c = 0;
+
+	for (; i < length; i++) {
+		const unsigned char *s = (const unsigned char *)(src + i);
+		unsigned char *d = (unsigned char *)(dst + i);
+		uint32_t a = s[3];
+
+		if (a == 255 || a == 0) {
+			dst[i] = src[i];
+			continue;
+		}
+
+		for (c = 0; c < 3; c++)
+			d[c] = PIXED_MIN(255, (s[c] * 255 + a / 2) / a);
+
+		d[3] = a;
+	}
+}
@@ -0,0 +1,93 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+typedef struct {
+	PixedRowJob job;
+	void       *ctx;
+	uint32_t    begin;
+	uint32_t    end;
+} PixedRowChunk;
+
+static void *pixed_parallel_run(void *);
+
+static int thread_count = 0;
+
+int
+pixed_thread_count()
+{
+	if (thread_count > 0)
+		return thread_count;
+
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	if (online < 1)
+		return 1;
+
+	return PIXED_MIN(online, PIXED_PARALLEL_MAX_THREADS);
+}
+
+/* 0 goes back to one thread per online core */
+void
+pixed_set_thread_count(int count)
+{
+	thread_count = PIXED_MIN(PIXED_MAX(count, 0), PIXED_PARALLEL_MAX_THREADS);
+}
+
+/*
+ * Splits rows into one contiguous chunk per thread and runs job over them,
+ * the calling thread takes the first chunk. Small jobs run inline.
+ */
+void
+pixed_parallel_rows(uint32_t rows, uint32_t row_pixels, PixedRowJob job, void *ctx)
+{
+	uint32_t threads = pixed_thread_count();
+
+	if ((uint64_t)rows * row_pixels < PIXED_PARALLEL_MIN_PIXELS)
+		threads = 1;
+
+	threads = PIXED_MIN(threads, rows);
+	if (threads <= 1) {
+		job(ctx, 0, rows);
+		return;
+	}
+
+	pthread_t handles[PIXED_PARALLEL_MAX_THREADS];
+	PixedRowChunk chunks[PIXED_PARALLEL_MAX_THREADS];
+	int started[PIXED_PARALLEL_MAX_THREADS];
+	uint32_t i = 0;
+
+	for (; i < threads; i++) {
+		chunks[i].job = job;
+		chunks[i].ctx = ctx;
+		chunks[i].begin = (uint32_t)(((uint64_t)rows * i) / threads);
+		chunks[i].end = (uint32_t)(((uint64_t)rows * (i + 1)) / threads);
+
+		// Run the chunk here if no thread could be spawned for it
+		started[i] = i > 0 && pthread_create(&handles[i], 0, pixed_parallel_run, &chunks[i]) == 0;
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (!started[i])
+			job(ctx, chunks[i].begin, chunks[i].end);
+	}
+
+	for (i = 1; i < threads; i++) {
+		if (started[i])
+			pthread_join(handles[i], 0);
+	}
+}
+
+static
+void *
+pixed_parallel_run(void *arg)
+{
+	PixedRowChunk *chunk = arg;
+	chunk->job(chunk->ctx, chunk->begin, chunk->end);
+
+	return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef LIBPIXED_PRIVATE_H
+#define LIBPIXED_PRIVATE_H
+
+/*
+ * Helpers shared between libpixed translation units, not part of the public
+ * API. Include after libpixed.h.
+ */
+#include <sys/uio.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PIXED_SIMD_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PIXED_SIMD_NEON 1
+#endif
+
+#define PIXED_MIN(A, B) ((A) < (B) ? (A) : (B))
+#define PIXED_MAX(A, B) ((A) > (B) ? (A) : (B))
+
+/* Compressed (v2) files: "PiXd", a zero width, then the version */
+#define PIXED_VERSION_COMPRESSED 2
+#define PIXED_VERSION_INDEXED    3
+#define PIXED_VERSION_LAYERED    4
+#define PIXED_VERSION_ANIMATION  5
+
+/* RLZ codec of compressed files, over 1 byte indices or 4 byte pixels */
+#define PIXED_CODEC_TABLE_BITS 12
+#define PIXED_CODEC_TABLE_SIZE (1 << PIXED_CODEC_TABLE_BITS) // match table entries the encoder needs
+
+#define PIXED_WRITE_CHUNK   (64 * 1024 * 1024)
+#define PIXED_WRITE_MAX_IOV 16
+
+/* Rows smaller than this many pixels in total are not worth a thread */
+#define PIXED_PARALLEL_MIN_PIXELS (256 * 256)
+#define PIXED_PARALLEL_MAX_THREADS 64
+
+/* Cells of the 4x4 ordered dither matrix */
+#define PIXED_DITHER_CELLS 16
+
+/* Processes rows [begin, end) */
+typedef void (*PixedRowJob)(void *, uint32_t, uint32_t);
+
+void pixed_parallel_rows(uint32_t, uint32_t, PixedRowJob, void *);
+
+void pixed_document_release_canvas(PixedDocument *);
+void pixed_document_replace_canvas(PixedDocument *, uint32_t *, uint32_t, uint32_t);
+void pixed_document_copy_rows(PixedDocument *, uint32_t, uint32_t, uint32_t *);
+void pixed_document_modify(PixedDocument *, uint32_t, uint32_t, uint32_t, uint32_t);
+int  pixed_document_clip_area(PixedDocument *, const PixedRect *, PixedRect *);
+void pixed_document_clear_tile(PixedDocument *, uint32_t);
+PixedDocument *pixed_document_take_pixels(PixedDocument *);
+uint32_t *pixed_document_unshare_tile(PixedDocument *, uint32_t);
+
+void pixed_tile_pool_release(PixedTilePool *, uint32_t *);
+
+void pixed_dither_offsets(uint32_t, int *);
+
+void pixed_color_index_replace(PixedColorIndex *, uint32_t, uint32_t);
+void pixed_color_index_invalidate(PixedColorIndex *);
+
+void pixed_history_move(PixedHistory *, PixedDocument *);
+void pixed_history_capture_palette(PixedHistory *);
+void pixed_history_capture_color(PixedHistory *, uint32_t);
+
+size_t pixed_codec_encode(const unsigned char *, size_t, size_t, uint32_t, uint32_t *, unsigned char *);
+int    pixed_codec_decode(const unsigned char *, size_t, unsigned char *, size_t, size_t);
+
+PixedDocument *pixed_document_decode(const char *, const unsigned char *, size_t, uint32_t, uint32_t);
+
+uint32_t parse_uint32_big_endian(const unsigned char *);
+void     store_uint32_big_endian(unsigned char *, uint32_t);
+int      write_vector(int, struct iovec *, int);
+int      open_replacement(const char *, char **);
+int      finish_replacement(int, char *, const char *, int);
+
+#endif
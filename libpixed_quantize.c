@@ -0,0 +1,1017 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+/*
+ * Color reduction to a palette of at most PIXED_PALETTE_MAX colors. Pixels
+ * are first counted into bins of 5 bits of r, g and b and 2 of alpha, so
+ * median cut and k-means run over the bins a photo fills instead of its
+ * pixels. Distances are taken in Oklab premultiplied by alpha, every fully
+ * transparent pixel is the same color there. Mapping a pixel looks its bin
+ * up in a table filled with the nearest palette color on first use.
+ */
+
+#define QUANTIZE_BINS       (1 << 17) // keys of a bin
+#define QUANTIZE_ITERATIONS 8         // k-means rounds at most
+
+typedef struct {
+	uint64_t count;
+	uint64_t sums[4]; // of r, g, b and a
+} PixedQuantizeCell;
+
+typedef struct {
+	float    lab[4]; // premultiplied Oklab and alpha of the mean color
+	uint64_t count;
+	uint32_t key;
+	uint32_t cluster; // palette color it went to
+	float    order;   // coordinate the median cut sorts by
+} PixedQuantizeBin;
+
+typedef struct {
+	uint32_t begin, end; // bins of the box
+	double   error;      // squared distance of its pixels to their mean
+	int      axis;       // of the largest spread
+} PixedQuantizeBox;
+
+typedef struct {
+	float    lab[4];
+	uint32_t index; // into palette
+} PixedQuantizeEntry;
+
+typedef struct {
+	PixedDocument      *document;
+	PixedRect           area;
+
+	PixedQuantizeCell  *cells;   // QUANTIZE_BINS, the histogram of area
+	PixedQuantizeBin   *bins;    // cells holding pixels
+	uint32_t            bins_length;
+	pthread_mutex_t     lock;    // guards cells and failed while counting
+	int                 failed;
+
+	uint32_t            keys[4][256]; // key bits of a value of r, g, b and a
+	uint8_t             values[4][32]; // value a part of a key stands for
+	float               linear[256];   // sRGB to linear
+
+	uint32_t            palette[PIXED_PALETTE_MAX]; // canvas order, most used first
+	uint64_t            counts[PIXED_PALETTE_MAX];
+	uint32_t            palette_length;
+	PixedQuantizeEntry  sorted[PIXED_PALETTE_MAX];  // palette or centroids by lightness
+	uint32_t            sorted_length;
+
+	uint16_t           *lookup; // QUANTIZE_BINS, palette index + 1 of a key, 0 until needed
+	PixedDither         dither;
+	uint8_t             dithered[PIXED_DITHER_CELLS][256]; // channel values with the offset of a cell added
+} PixedQuantizer;
+
+typedef struct {
+	PixedQuantizer *quantizer;
+	uint32_t        changes; // bins that went to another cluster
+} PixedQuantizeJob;
+
+static PixedQuantizer *quantize_new(PixedDocument *, const PixedRect *, PixedQuantizeMethod, uint32_t);
+static void     quantize_free(PixedQuantizer *);
+static void     quantize_count_rows(void *, uint32_t, uint32_t);
+static void     quantize_count(PixedQuantizer *, PixedQuantizeCell *, const uint32_t *, uint32_t);
+static void     quantize_add(PixedQuantizer *, PixedQuantizeCell *, uint32_t, uint64_t);
+static int      quantize_bins(PixedQuantizer *);
+static int      quantize_median_cut(PixedQuantizer *, uint32_t);
+static void     quantize_measure(PixedQuantizer *, PixedQuantizeBox *);
+static int      quantize_compare_order(const void *, const void *);
+static void     quantize_kmeans(PixedQuantizer *);
+static void     quantize_assign_rows(void *, uint32_t, uint32_t);
+static void     quantize_centroids(PixedQuantizer *);
+static void     quantize_palette(PixedQuantizer *);
+static int      quantize_compare_counts(const void *, const void *);
+static void     quantize_sort(PixedQuantizer *);
+static int      quantize_compare_lightness(const void *, const void *);
+static void     quantize_prefill_rows(void *, uint32_t, uint32_t);
+static uint32_t quantize_key(const PixedQuantizer *, uint32_t);
+static void     quantize_lab(const PixedQuantizer *, uint32_t, float *);
+static uint32_t quantize_nearest(const PixedQuantizer *, const float *);
+static uint32_t quantize_lookup(PixedQuantizer *, uint32_t);
+static void     quantize_map_rows(void *, uint32_t, uint32_t);
+static void     quantize_row(PixedQuantizer *, const uint32_t *, uint8_t *, uint32_t, uint32_t, uint32_t);
+static void     quantize_diffuse_row(PixedQuantizer *, const uint32_t *, uint8_t *, uint32_t, int32_t *, int32_t *, int);
+static void     quantize_read_row(PixedDocument *, uint32_t, uint32_t, uint32_t, uint32_t *);
+static int      quantize_write_row(PixedQuantizer *, uint32_t, const uint8_t *, int16_t *);
+
+/*
+ * Puts the at most length colors the pixels of area reduce to into palette,
+ * most used first. Returns how many there are, -1 on failure.
+ */
+int
+pixed_document_quantize_palette(PixedDocument *document, const PixedRect *area, PixedQuantizeMethod method, uint32_t *palette, uint32_t length)
+{
+	PixedRect clipped;
+	if (!pixed_document_clip_area(document, area, &clipped))
+		return 0;
+
+	PixedQuantizer *quantizer = quantize_new(document, &clipped, method, length);
+	if (!quantizer)
+		return -1;
+
+	uint32_t i = 0;
+	for (; i < quantizer->palette_length; i++)
+		palette[i] = pixed_canvas_color(quantizer->palette[i]);
+
+	int result = (int)quantizer->palette_length;
+	quantize_free(quantizer);
+	return result;
+}
+
+/*
+ * Reduces the pixels of area to at most length colors. Indexed documents
+ * quantized as a whole get the new colors as their palette, otherwise the
+ * new colors are added to it.
+ */
+int
+pixed_document_quantize(PixedDocument *document, const PixedRect *area, PixedQuantizeMethod method, uint32_t length, PixedDither dither)
+{
+	PixedRect clipped;
+	if (!pixed_document_clip_area(document, area, &clipped))
+		return 0;
+
+	PixedQuantizer *quantizer = quantize_new(document, &clipped, method, length);
+	if (!quantizer)
+		return -1;
+
+	int offsets[PIXED_DITHER_CELLS];
+	uint32_t i = 0, value = 0, y = 0;
+
+	quantizer->dither = dither;
+	pixed_dither_offsets(quantizer->palette_length, offsets);
+
+	for (; i < PIXED_DITHER_CELLS; i++) {
+		for (value = 0; value < 256; value++)
+			quantizer->dithered[i][value] = (uint8_t)PIXED_MIN(PIXED_MAX((int)value + offsets[i], 0), 255);
+	}
+	pixed_document_modify(document, clipped.x, clipped.y, clipped.width, clipped.height);
+
+	// Rows of flat documents are independent unless errors diffuse down
+	if (document->storage == PIXED_STORAGE_FLAT && dither != PIXED_DITHER_FLOYD_STEINBERG) {
+		pixed_parallel_rows(clipped.height, clipped.width, quantize_map_rows, quantizer);
+
+		int failed = quantizer->failed;
+		quantize_free(quantizer);
+		return failed ? -1 : 0;
+	}
+
+	int whole = document->storage == PIXED_STORAGE_INDEXED &&
+		clipped.width == document->width && clipped.height == document->height;
+
+	uint32_t *row = malloc(sizeof(uint32_t) * clipped.width);
+	uint8_t *chosen = malloc(clipped.width);
+	int32_t *errors = calloc((size_t)(clipped.width + 2) * 6, sizeof(int32_t));
+	int16_t map[PIXED_PALETTE_MAX];
+	int result = row && chosen && errors ? 0 : -1;
+
+	// The new palette replaces the old one once every row was read through it
+	for (i = 0; i < PIXED_PALETTE_MAX; i++)
+		map[i] = whole && i < quantizer->palette_length ? (int16_t)i : -1;
+
+	for (y = 0; result == 0 && y < clipped.height; y++) {
+		int32_t *current = errors + (y & 1) * (clipped.width + 2) * 3;
+		int32_t *next = errors + (~y & 1) * (clipped.width + 2) * 3;
+
+		quantize_read_row(document, clipped.x, clipped.y + y, clipped.width, row);
+
+		if (dither == PIXED_DITHER_FLOYD_STEINBERG)
+			quantize_diffuse_row(quantizer, row, chosen, clipped.width, current, next, y & 1);
+		else
+			quantize_row(quantizer, row, chosen, clipped.width, clipped.x, clipped.y + y);
+
+		result = quantize_write_row(quantizer, clipped.y + y, chosen, map);
+	}
+
+	for (i = 0; result == 0 && whole && i < quantizer->palette_length; i++)
+		result = pixed_document_set_palette_color(document, i, pixed_canvas_color(quantizer->palette[i]));
+
+	if (result == 0 && whole && document->palette_length > quantizer->palette_length) {
+		if (document->history)
+			pixed_history_capture_palette(document->history);
+
+		document->palette_length = quantizer->palette_length;
+	}
+
+	free(row);
+	free(chosen);
+	free(errors);
+	quantize_free(quantizer);
+	return result;
+}
+
+/* Counts the pixels of area and picks the palette, 0 on failure */
+static
+PixedQuantizer *
+quantize_new(PixedDocument *document, const PixedRect *area, PixedQuantizeMethod method, uint32_t length)
+{
+	if (length == 0 || length > PIXED_PALETTE_MAX)
+		return 0;
+
+	PixedQuantizer *quantizer = calloc(1, sizeof(PixedQuantizer));
+	if (!quantizer)
+		return 0;
+
+	quantizer->document = document;
+	quantizer->area = *area;
+	quantizer->cells = calloc(QUANTIZE_BINS, sizeof(PixedQuantizeCell));
+	quantizer->lookup = calloc(QUANTIZE_BINS, sizeof(uint16_t));
+	pthread_mutex_init(&quantizer->lock, 0);
+
+	if (!quantizer->cells || !quantizer->lookup) {
+		quantize_free(quantizer);
+		return 0;
+	}
+
+	// Keys round to the nearest step, so 0 and 255 stand for themselves
+	uint32_t value = 0, channel = 0;
+	for (; value < 256; value++) {
+		float srgb = value / 255.0f;
+		quantizer->linear[value] = srgb <= 0.04045f ? srgb / 12.92f : powf((srgb + 0.055f) / 1.055f, 2.4f);
+
+		for (channel = 0; channel < 3; channel++)
+			quantizer->keys[channel][value] = ((value * 31 + 127) / 255) << (12 - channel * 5);
+		quantizer->keys[3][value] = (value * 3 + 127) / 255;
+	}
+
+	for (value = 0; value < 32; value++) {
+		for (channel = 0; channel < 3; channel++)
+			quantizer->values[channel][value] = (uint8_t)((value * 255 + 15) / 31);
+		quantizer->values[3][value] = (uint8_t)PIXED_MIN(value * 85, 255);
+	}
+
+	// Palettes are counted by entry, everything else by pixel
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		uint64_t counts[PIXED_PALETTE_MAX];
+		uint32_t x = 0, y = 0, i = 0;
+		memset(counts, 0, sizeof(counts));
+
+		for (y = area->y; y < area->y + area->height; y++) {
+			const uint8_t *indices = document->indices + (size_t)y * document->width;
+			for (x = area->x; x < area->x + area->width; x++)
+				counts[indices[x]]++;
+		}
+
+		for (; i < document->palette_length; i++)
+			quantize_add(quantizer, quantizer->cells, document->palette[i], counts[i]);
+	} else {
+		uint32_t rows = area->height;
+		if (document->storage == PIXED_STORAGE_TILED)
+			rows = (area->y + area->height - 1) / PIXED_TILE_SIZE - area->y / PIXED_TILE_SIZE + 1;
+
+		pixed_parallel_rows(rows, area->width * (area->height / rows), quantize_count_rows, quantizer);
+	}
+
+	// Only indices past the end of the palette leave nothing to count
+	if (quantizer->failed || quantize_bins(quantizer) != 0 || quantizer->bins_length == 0 ||
+		quantize_median_cut(quantizer, length) != 0) {
+		quantize_free(quantizer);
+		return 0;
+	}
+
+	if (method == PIXED_QUANTIZE_KMEANS)
+		quantize_kmeans(quantizer);
+
+	quantize_palette(quantizer);
+
+	// Pixels of the histogram look up their bins, fill those ahead of time
+	pixed_parallel_rows(quantizer->bins_length, quantizer->palette_length, quantize_prefill_rows, quantizer);
+	return quantizer;
+}
+
+static
+void
+quantize_free(PixedQuantizer *quantizer)
+{
+	pthread_mutex_destroy(&quantizer->lock);
+	free(quantizer->cells);
+	free(quantizer->bins);
+	free(quantizer->lookup);
+	free(quantizer);
+}
+
+/* Counts rows [begin, end) of the area, rows of tiles for tiled documents, and adds them to the histogram */
+static
+void
+quantize_count_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedQuantizer *quantizer = ctx;
+	PixedDocument *document = quantizer->document;
+	PixedRect *area = &quantizer->area;
+	uint32_t y = begin, i = 0;
+
+	PixedQuantizeCell *cells = calloc(QUANTIZE_BINS, sizeof(PixedQuantizeCell));
+	if (!cells) {
+		pthread_mutex_lock(&quantizer->lock);
+		quantizer->failed = 1;
+		pthread_mutex_unlock(&quantizer->lock);
+		return;
+	}
+
+	for (; y < end; y++) {
+		if (document->storage == PIXED_STORAGE_FLAT) {
+			quantize_count(quantizer, cells, document->canvas + (size_t)(area->y + y) * document->width + area->x, area->width);
+			continue;
+		}
+
+		uint32_t tile_y = area->y / PIXED_TILE_SIZE + y, tile_x = area->x / PIXED_TILE_SIZE, row = 0;
+		for (; tile_x <= (area->x + area->width - 1) / PIXED_TILE_SIZE; tile_x++) {
+			PixedTile tile;
+			if (pixed_document_get_tile(document, tile_x, tile_y, 0, &tile) != 0)
+				continue;
+
+			uint32_t x0 = PIXED_MAX(area->x, tile.x), x1 = PIXED_MIN(area->x + area->width, tile.x + tile.width);
+			uint32_t y0 = PIXED_MAX(area->y, tile.y), y1 = PIXED_MIN(area->y + area->height, tile.y + tile.height);
+
+			if (tile.empty) {
+				quantize_add(quantizer, cells, 0, (uint64_t)(x1 - x0) * (y1 - y0));
+				continue;
+			}
+
+			for (row = y0; row < y1; row++)
+				quantize_count(quantizer, cells, tile.pixels + (size_t)(row - tile.y) * tile.stride + (x0 - tile.x), x1 - x0);
+		}
+	}
+
+	pthread_mutex_lock(&quantizer->lock);
+	for (i = 0; i < QUANTIZE_BINS; i++) {
+		if (cells[i].count == 0)
+			continue;
+
+		quantizer->cells[i].count += cells[i].count;
+		quantizer->cells[i].sums[0] += cells[i].sums[0];
+		quantizer->cells[i].sums[1] += cells[i].sums[1];
+		quantizer->cells[i].sums[2] += cells[i].sums[2];
+		quantizer->cells[i].sums[3] += cells[i].sums[3];
+	}
+	pthread_mutex_unlock(&quantizer->lock);
+
+	free(cells);
+}
+
+/* Runs of one color, the common case of pixel art, are added at once */
+static
+void
+quantize_count(PixedQuantizer *quantizer, PixedQuantizeCell *cells, const uint32_t *pixels, uint32_t length)
+{
+	uint32_t i = 0;
+
+	while (i < length) {
+		uint32_t color = pixels[i], run = 1;
+		while (i + run < length && pixels[i + run] == color)
+			run++;
+
+		quantize_add(quantizer, cells, color, run);
+		i += run;
+	}
+}
+
+static
+void
+quantize_add(PixedQuantizer *quantizer, PixedQuantizeCell *cells, uint32_t color, uint64_t count)
+{
+	const unsigned char *bytes = (const unsigned char *)&color;
+	PixedQuantizeCell *cell = &cells[quantize_key(quantizer, color)];
+
+	cell->count += count;
+	cell->sums[0] += bytes[0] * count;
+	cell->sums[1] += bytes[1] * count;
+	cell->sums[2] += bytes[2] * count;
+	cell->sums[3] += bytes[3] * count;
+}
+
+/* Collects the cells holding pixels, with the Oklab of their mean color */
+static
+int
+quantize_bins(PixedQuantizer *quantizer)
+{
+	uint32_t key = 0, length = 0;
+
+	for (; key < QUANTIZE_BINS; key++)
+		length += quantizer->cells[key].count > 0;
+
+	quantizer->bins = malloc(sizeof(PixedQuantizeBin) * PIXED_MAX(length, 1));
+	if (!quantizer->bins)
+		return -1;
+
+	for (key = 0; key < QUANTIZE_BINS; key++) {
+		PixedQuantizeCell *cell = &quantizer->cells[key];
+		if (cell->count == 0)
+			continue;
+
+		uint32_t color = 0, channel = 0;
+		unsigned char *bytes = (unsigned char *)&color;
+		for (; channel < 4; channel++)
+			bytes[channel] = (unsigned char)((cell->sums[channel] + cell->count / 2) / cell->count);
+
+		PixedQuantizeBin *bin = &quantizer->bins[quantizer->bins_length++];
+		quantize_lab(quantizer, color, bin->lab);
+		bin->count = cell->count;
+		bin->key = key;
+		bin->cluster = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Splits the box with the largest error at the weighted median of its
+ * widest axis until there are length boxes, or no box holds two colors.
+ * Bins of box i go to cluster i.
+ */
+static
+int
+quantize_median_cut(PixedQuantizer *quantizer, uint32_t length)
+{
+	PixedQuantizeBox *boxes = malloc(sizeof(PixedQuantizeBox) * length);
+	if (!boxes)
+		return -1;
+
+	uint32_t boxes_length = 1, i = 0;
+	boxes[0].begin = 0;
+	boxes[0].end = quantizer->bins_length;
+	quantize_measure(quantizer, &boxes[0]);
+
+	while (boxes_length < length) {
+		PixedQuantizeBox *box = 0;
+		for (i = 0; i < boxes_length; i++) {
+			if (boxes[i].error > 0 && (!box || boxes[i].error > box->error))
+				box = &boxes[i];
+		}
+
+		if (!box)
+			break;
+
+		PixedQuantizeBin *bins = quantizer->bins + box->begin;
+		uint32_t count = box->end - box->begin;
+		uint64_t total = 0, half = 0;
+
+		for (i = 0; i < count; i++) {
+			bins[i].order = bins[i].lab[box->axis];
+			total += bins[i].count;
+		}
+
+		qsort(bins, count, sizeof(PixedQuantizeBin), quantize_compare_order);
+
+		// Both halves keep at least one bin
+		for (i = 0; i < count - 1 && (half + bins[i].count) * 2 <= total; i++)
+			half += bins[i].count;
+
+		PixedQuantizeBox *split = &boxes[boxes_length++];
+		split->begin = box->begin + PIXED_MAX(i, 1);
+		split->end = box->end;
+		box->end = split->begin;
+
+		quantize_measure(quantizer, box);
+		quantize_measure(quantizer, split);
+	}
+
+	for (i = 0; i < boxes_length; i++) {
+		uint32_t bin = boxes[i].begin;
+		for (; bin < boxes[i].end; bin++)
+			quantizer->bins[bin].cluster = i;
+	}
+
+	quantizer->sorted_length = boxes_length;
+	free(boxes);
+
+	quantize_centroids(quantizer);
+	return 0;
+}
+
+static
+void
+quantize_measure(PixedQuantizer *quantizer, PixedQuantizeBox *box)
+{
+	double sums[4] = { 0, 0, 0, 0 }, squares[4] = { 0, 0, 0, 0 }, total = 0, widest = -1;
+	uint32_t i = box->begin, axis = 0;
+
+	for (; i < box->end; i++) {
+		const PixedQuantizeBin *bin = &quantizer->bins[i];
+		double weight = (double)bin->count;
+
+		total += weight;
+		for (axis = 0; axis < 4; axis++) {
+			sums[axis] += weight * bin->lab[axis];
+			squares[axis] += weight * bin->lab[axis] * bin->lab[axis];
+		}
+	}
+
+	box->error = 0;
+	box->axis = 0;
+
+	if (box->end - box->begin < 2)
+		return;
+
+	for (axis = 0; axis < 4; axis++) {
+		double spread = squares[axis] - sums[axis] * sums[axis] / total;
+
+		box->error += PIXED_MAX(spread, 0);
+		if (spread > widest) {
+			widest = spread;
+			box->axis = (int)axis;
+		}
+	}
+}
+
+static
+int
+quantize_compare_order(const void *a, const void *b)
+{
+	const PixedQuantizeBin *x = a, *y = b;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* Moves every bin to its nearest centroid until none moves, or for QUANTIZE_ITERATIONS rounds */
+static
+void
+quantize_kmeans(PixedQuantizer *quantizer)
+{
+	uint32_t iteration = 0;
+
+	for (; iteration < QUANTIZE_ITERATIONS; iteration++) {
+		PixedQuantizeJob job;
+		job.quantizer = quantizer;
+		job.changes = 0;
+
+		pixed_parallel_rows(quantizer->bins_length, quantizer->sorted_length, quantize_assign_rows, &job);
+		if (job.changes == 0)
+			break;
+
+		quantize_centroids(quantizer);
+	}
+}
+
+static
+void
+quantize_assign_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedQuantizeJob *job = ctx;
+	PixedQuantizer *quantizer = job->quantizer;
+	uint32_t i = begin, changes = 0;
+
+	for (; i < end; i++) {
+		PixedQuantizeBin *bin = &quantizer->bins[i];
+		uint32_t cluster = quantize_nearest(quantizer, bin->lab);
+
+		changes += cluster != bin->cluster;
+		bin->cluster = cluster;
+	}
+
+	__atomic_add_fetch(&job->changes, changes, __ATOMIC_RELAXED);
+}
+
+/* Sorted entries become the weighted means of their clusters, empty ones stay */
+static
+void
+quantize_centroids(PixedQuantizer *quantizer)
+{
+	double sums[PIXED_PALETTE_MAX][4], totals[PIXED_PALETTE_MAX];
+	PixedQuantizeEntry centroids[PIXED_PALETTE_MAX];
+	uint32_t i = 0, axis = 0;
+
+	memset(sums, 0, sizeof(sums));
+	memset(totals, 0, sizeof(totals));
+
+	for (i = 0; i < quantizer->sorted_length; i++)
+		centroids[quantizer->sorted[i].index] = quantizer->sorted[i];
+
+	for (i = 0; i < quantizer->bins_length; i++) {
+		const PixedQuantizeBin *bin = &quantizer->bins[i];
+
+		totals[bin->cluster] += (double)bin->count;
+		for (axis = 0; axis < 4; axis++)
+			sums[bin->cluster][axis] += (double)bin->count * bin->lab[axis];
+	}
+
+	for (i = 0; i < quantizer->sorted_length; i++) {
+		PixedQuantizeEntry *entry = &quantizer->sorted[i];
+
+		entry->index = i;
+		for (axis = 0; axis < 4; axis++)
+			entry->lab[axis] = totals[i] > 0 ? (float)(sums[i][axis] / totals[i]) : centroids[i].lab[axis];
+	}
+
+	quantize_sort(quantizer);
+}
+
+/*
+ * The mean colors of the clusters become the palette, most used first, and
+ * the lightness order searched when mapping pixels
+ */
+static
+void
+quantize_palette(PixedQuantizer *quantizer)
+{
+	uint64_t sums[PIXED_PALETTE_MAX][5];
+	uint32_t i = 0, channel = 0;
+
+	memset(sums, 0, sizeof(sums));
+
+	for (i = 0; i < quantizer->bins_length; i++) {
+		const PixedQuantizeCell *cell = &quantizer->cells[quantizer->bins[i].key];
+		uint64_t *sum = sums[quantizer->bins[i].cluster];
+
+		for (channel = 0; channel < 4; channel++)
+			sum[channel] += cell->sums[channel];
+		sum[4] += cell->count;
+	}
+
+	uint64_t entries[PIXED_PALETTE_MAX][2];
+	uint32_t length = 0;
+
+	for (i = 0; i < quantizer->sorted_length; i++) {
+		if (sums[i][4] == 0)
+			continue;
+
+		uint32_t color = 0;
+		unsigned char *bytes = (unsigned char *)&color;
+		for (channel = 0; channel < 4; channel++)
+			bytes[channel] = (unsigned char)((sums[i][channel] + sums[i][4] / 2) / sums[i][4]);
+
+		// Transparent is transparent black, whatever color was under it
+		if (bytes[3] == 0)
+			color = 0;
+
+		entries[length][0] = sums[i][4];
+		entries[length][1] = color;
+		length++;
+	}
+
+	qsort(entries, length, sizeof(entries[0]), quantize_compare_counts);
+
+	for (i = 0; i < length; i++) {
+		quantizer->counts[i] = entries[i][0];
+		quantizer->palette[i] = (uint32_t)entries[i][1];
+		quantizer->sorted[i].index = i;
+		quantize_lab(quantizer, quantizer->palette[i], quantizer->sorted[i].lab);
+	}
+
+	quantizer->palette_length = length;
+	quantizer->sorted_length = length;
+	quantize_sort(quantizer);
+}
+
+/* Most pixels first, colors break ties */
+static
+int
+quantize_compare_counts(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	if (x[0] != y[0])
+		return x[0] > y[0] ? -1 : 1;
+
+	return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+static
+void
+quantize_sort(PixedQuantizer *quantizer)
+{
+	qsort(quantizer->sorted, quantizer->sorted_length, sizeof(PixedQuantizeEntry), quantize_compare_lightness);
+}
+
+static
+int
+quantize_compare_lightness(const void *a, const void *b)
+{
+	const PixedQuantizeEntry *x = a, *y = b;
+	return x->lab[0] < y->lab[0] ? -1 : x->lab[0] > y->lab[0];
+}
+
+static
+void
+quantize_prefill_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedQuantizer *quantizer = ctx;
+	uint32_t i = begin;
+
+	for (; i < end; i++) {
+		const PixedQuantizeBin *bin = &quantizer->bins[i];
+		quantizer->lookup[bin->key] = (uint16_t)(quantize_nearest(quantizer, bin->lab) + 1);
+	}
+}
+
+static
+uint32_t
+quantize_key(const PixedQuantizer *quantizer, uint32_t color)
+{
+	const unsigned char *bytes = (const unsigned char *)&color;
+
+	return quantizer->keys[0][bytes[0]] | quantizer->keys[1][bytes[1]] |
+		quantizer->keys[2][bytes[2]] | quantizer->keys[3][bytes[3]];
+}
+
+/* Oklab of color, canvas order, premultiplied by alpha which is the fourth coordinate */
+static
+void
+quantize_lab(const PixedQuantizer *quantizer, uint32_t color, float *lab)
+{
+	const unsigned char *bytes = (const unsigned char *)&color;
+	float r = quantizer->linear[bytes[0]], g = quantizer->linear[bytes[1]], b = quantizer->linear[bytes[2]];
+	float alpha = bytes[3] / 255.0f;
+
+	float l = cbrtf(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+	float m = cbrtf(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+	float s = cbrtf(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+
+	lab[0] = (0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s) * alpha;
+	lab[1] = (1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s) * alpha;
+	lab[2] = (0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s) * alpha;
+	lab[3] = alpha;
+}
+
+/*
+ * Index of the sorted entry nearest to lab. The search walks out from the
+ * lightness of lab both ways and stops a way once lightness alone is
+ * further than the best so far.
+ */
+static
+uint32_t
+quantize_nearest(const PixedQuantizer *quantizer, const float *lab)
+{
+	const PixedQuantizeEntry *sorted = quantizer->sorted;
+	uint32_t low = 0, high = quantizer->sorted_length, best = sorted[0].index;
+	float best_distance = INFINITY;
+
+	while (low < high) {
+		uint32_t middle = (low + high) / 2;
+		if (sorted[middle].lab[0] < lab[0])
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	int up = (int)low, down = (int)low - 1, length = (int)quantizer->sorted_length;
+	while (up < length || down >= 0) {
+		int i = 0;
+		for (; i < 2; i++) {
+			int *at = i == 0 ? &up : &down;
+			if (*at < 0 || *at >= length)
+				continue;
+
+			const float *candidate = sorted[*at].lab;
+			float d0 = candidate[0] - lab[0], d1 = candidate[1] - lab[1];
+			float d2 = candidate[2] - lab[2], d3 = candidate[3] - lab[3];
+
+			if (d0 * d0 >= best_distance) {
+				*at = i == 0 ? length : -1;
+				continue;
+			}
+
+			float distance = d0 * d0 + d1 * d1 + d2 * d2 + d3 * d3;
+			if (distance < best_distance) {
+				best_distance = distance;
+				best = sorted[*at].index;
+			}
+
+			*at += i == 0 ? 1 : -1;
+		}
+	}
+
+	return best;
+}
+
+/* Palette index of the bin of key, its nearest is found on first use from any row job */
+static
+uint32_t
+quantize_lookup(PixedQuantizer *quantizer, uint32_t key)
+{
+	uint16_t found = __atomic_load_n(&quantizer->lookup[key], __ATOMIC_RELAXED);
+
+	if (found == 0) {
+		uint32_t center = 0, channel = 0;
+		unsigned char *bytes = (unsigned char *)&center;
+		float lab[4];
+
+		bytes[0] = quantizer->values[0][(key >> 12) & 31];
+		bytes[1] = quantizer->values[1][(key >> 7) & 31];
+		bytes[2] = quantizer->values[2][(key >> 2) & 31];
+		bytes[3] = quantizer->values[3][key & 3];
+
+		// Bins of the histogram were filled with their mean, the rest uses its center
+		for (; channel < 4 && bytes[3] == 0; channel++)
+			bytes[channel] = 0;
+
+		quantize_lab(quantizer, center, lab);
+		found = (uint16_t)(quantize_nearest(quantizer, lab) + 1);
+		__atomic_store_n(&quantizer->lookup[key], found, __ATOMIC_RELAXED);
+	}
+
+	return found - 1;
+}
+
+/* Rows [begin, end) of the area of a flat document */
+static
+void
+quantize_map_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedQuantizer *quantizer = ctx;
+	PixedDocument *document = quantizer->document;
+	PixedRect *area = &quantizer->area;
+	uint32_t y = begin;
+
+	uint8_t *chosen = malloc(area->width);
+	if (!chosen) {
+		pthread_mutex_lock(&quantizer->lock);
+		quantizer->failed = 1;
+		pthread_mutex_unlock(&quantizer->lock);
+		return;
+	}
+
+	for (; y < end; y++) {
+		quantize_row(quantizer, document->canvas + (size_t)(area->y + y) * document->width + area->x,
+			chosen, area->width, area->x, area->y + y);
+		quantize_write_row(quantizer, area->y + y, chosen, 0);
+	}
+
+	free(chosen);
+}
+
+/* Palette indices of length pixels starting at column x of row y, without dither or with the ordered one */
+static
+void
+quantize_row(PixedQuantizer *quantizer, const uint32_t *pixels, uint8_t *chosen, uint32_t length, uint32_t x, uint32_t y)
+{
+	uint32_t i = 0;
+
+	if (quantizer->dither == PIXED_DITHER_NONE) {
+		uint32_t last = pixels[0], index = quantize_lookup(quantizer, quantize_key(quantizer, last));
+
+		for (; i < length; i++) {
+			if (pixels[i] != last) {
+				last = pixels[i];
+				index = quantize_lookup(quantizer, quantize_key(quantizer, last));
+			}
+
+			chosen[i] = (uint8_t)index;
+		}
+
+		return;
+	}
+
+	for (; i < length; i++) {
+		const unsigned char *bytes = (const unsigned char *)&pixels[i];
+		const uint8_t *dithered = quantizer->dithered[(y & 3) * 4 + ((x + i) & 3)];
+
+		uint32_t key = quantizer->keys[0][dithered[bytes[0]]] | quantizer->keys[1][dithered[bytes[1]]] |
+			quantizer->keys[2][dithered[bytes[2]]] | quantizer->keys[3][bytes[3]];
+		chosen[i] = (uint8_t)quantize_lookup(quantizer, key);
+	}
+}
+
+/*
+ * Floyd-Steinberg over one row, right to left when reverse is set. errors
+ * holds what the row above pushed onto this one and next gets what this
+ * one pushes down, both sixteenths of r, g and b with a pixel of margin.
+ * Transparent pixels push nothing.
+ */
+static
+void
+quantize_diffuse_row(PixedQuantizer *quantizer, const uint32_t *pixels, uint8_t *chosen, uint32_t length, int32_t *errors, int32_t *next, int reverse)
+{
+	int step = reverse ? -1 : 1, channel = 0;
+	int32_t ahead[3] = { 0, 0, 0 }; // pushed onto the next pixel of the row, kept out of memory
+	uint32_t n = 0;
+
+	memset(next, 0, sizeof(int32_t) * (length + 2) * 3);
+
+	for (; n < length; n++) {
+		uint32_t i = reverse ? length - 1 - n : n;
+		const unsigned char *bytes = (const unsigned char *)&pixels[i];
+		int32_t *error = errors + (i + 1) * 3, *below = next + (i + 1) * 3;
+
+		if (bytes[3] == 0) {
+			chosen[i] = (uint8_t)quantize_lookup(quantizer, quantize_key(quantizer, pixels[i]));
+			ahead[0] = ahead[1] = ahead[2] = 0;
+			continue;
+		}
+
+		int values[3];
+		for (channel = 0; channel < 3; channel++)
+			values[channel] = PIXED_MIN(PIXED_MAX(bytes[channel] + (error[channel] + ahead[channel]) / 16, 0), 255);
+
+		uint32_t index = quantize_lookup(quantizer, quantizer->keys[0][values[0]] | quantizer->keys[1][values[1]] |
+			quantizer->keys[2][values[2]] | quantizer->keys[3][bytes[3]]);
+		const unsigned char *out = (const unsigned char *)&quantizer->palette[index];
+		chosen[i] = (uint8_t)index;
+
+		for (channel = 0; channel < 3; channel++) {
+			int32_t delta = values[channel] - out[channel];
+
+			ahead[channel] = delta * 7;
+			below[-step * 3 + channel] += delta * 3;
+			below[channel] += delta * 5;
+			below[step * 3 + channel] += delta;
+		}
+	}
+}
+
+/* Colors of width pixels starting at x, y */
+static
+void
+quantize_read_row(PixedDocument *document, uint32_t x, uint32_t y, uint32_t width, uint32_t *row)
+{
+	uint32_t i = 0;
+
+	if (document->storage == PIXED_STORAGE_FLAT) {
+		memcpy(row, document->canvas + (size_t)y * document->width + x, sizeof(uint32_t) * width);
+		return;
+	}
+
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		const uint8_t *indices = document->indices + (size_t)y * document->width + x;
+		for (; i < width; i++)
+			row[i] = document->palette[indices[i]];
+		return;
+	}
+
+	uint32_t tile_x = x / PIXED_TILE_SIZE;
+	for (; tile_x <= (x + width - 1) / PIXED_TILE_SIZE; tile_x++) {
+		PixedTile tile;
+		if (pixed_document_get_tile(document, tile_x, y / PIXED_TILE_SIZE, 0, &tile) != 0)
+			continue;
+
+		uint32_t x0 = PIXED_MAX(x, tile.x), x1 = PIXED_MIN(x + width, tile.x + tile.width);
+		if (tile.empty)
+			memset(row + (x0 - x), 0, sizeof(uint32_t) * (x1 - x0));
+		else
+			memcpy(row + (x0 - x), tile.pixels + (size_t)(y - tile.y) * tile.stride + (x0 - tile.x), sizeof(uint32_t) * (x1 - x0));
+	}
+}
+
+/*
+ * Writes the palette colors chosen for row y of the area. Indexed documents
+ * go through map from palette colors to their entries, -1 until one is
+ * found or added.
+ */
+static
+int
+quantize_write_row(PixedQuantizer *quantizer, uint32_t y, const uint8_t *chosen, int16_t *map)
+{
+	PixedDocument *document = quantizer->document;
+	PixedRect *area = &quantizer->area;
+	uint32_t i = 0;
+
+	if (document->storage == PIXED_STORAGE_FLAT) {
+		uint32_t *pixels = document->canvas + (size_t)y * document->width + area->x;
+		for (; i < area->width; i++)
+			pixels[i] = quantizer->palette[chosen[i]];
+		return 0;
+	}
+
+	if (document->storage == PIXED_STORAGE_INDEXED) {
+		uint8_t *indices = document->indices + (size_t)y * document->width + area->x;
+
+		for (; i < area->width; i++) {
+			int16_t *index = &map[chosen[i]];
+
+			if (*index < 0) {
+				uint32_t color = pixed_canvas_color(quantizer->palette[chosen[i]]);
+
+				int found = pixed_document_palette_index(document, color);
+				if (found < 0) {
+					found = document->palette_length;
+					if (pixed_document_set_palette_color(document, found, color) != 0)
+						return -1;
+				}
+
+				*index = (int16_t)found;
+			}
+
+			indices[i] = (uint8_t)*index;
+		}
+
+		return 0;
+	}
+
+	// Empty tiles stay empty while they stay transparent
+	uint32_t tile_x = area->x / PIXED_TILE_SIZE;
+	for (; tile_x <= (area->x + area->width - 1) / PIXED_TILE_SIZE; tile_x++) {
+		PixedTile tile;
+		if (pixed_document_get_tile(document, tile_x, y / PIXED_TILE_SIZE, 0, &tile) != 0)
+			continue;
+
+		uint32_t x0 = PIXED_MAX(area->x, tile.x), x1 = PIXED_MIN(area->x + area->width, tile.x + tile.width), x = x0;
+		while (tile.empty && x < x1 && quantizer->palette[chosen[x - area->x]] == 0)
+			x++;
+
+		if (x == x1)
+			continue;
+
+		if (pixed_document_get_tile(document, tile_x, y / PIXED_TILE_SIZE, 1, &tile) != 0)
+			return -1;
+
+		uint32_t *pixels = tile.pixels + (size_t)(y - tile.y) * tile.stride;
+		for (x = x0; x < x1; x++)
+			pixels[x - tile.x] = quantizer->palette[chosen[x - area->x]];
+	}
+
+	return 0;
+}
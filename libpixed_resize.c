@@ -0,0 +1,538 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libpixed.h"
+#include "libpixed_private.h"
+
+#define RESIZE_BOX_ROWS 66051 // rows of 255 * 255 that add up within 32 bits
+
+typedef struct {
+	uint32_t         width, height;
+	int32_t          offset_x, offset_y; // where the old canvas lands, when not scaling
+	int              scale;
+	PixedScaleFilter filter;
+} PixedResize;
+
+typedef struct {
+	PixedDocument  *document; // flattened into dst by flatten_rows
+	const uint32_t *src;
+	uint32_t       *dst;
+	uint32_t        src_width, src_height;
+	uint32_t        dst_width, dst_height;
+	uint32_t       *x_map;    // source column of every destination column
+	uint32_t       *x_weight; // bilinear only, 8 bit fraction of x_map
+	int32_t         offset_x, offset_y;
+	pthread_mutex_t lock;     // guards failed
+	int             failed;   // set by rows that couldn't get their scratch memory
+} PixedResizeJob;
+
+static void flatten_rows(void *, uint32_t, uint32_t);
+static void resize_canvas_rows(void *, uint32_t, uint32_t);
+static void scale_nearest_rows(void *, uint32_t, uint32_t);
+static void scale_box_rows(void *, uint32_t, uint32_t);
+static void scale_bilinear_rows(void *, uint32_t, uint32_t);
+static void accumulate_weighted_row(uint32_t *, const uint32_t *, uint32_t);
+static int  resize_document(PixedDocument *, const PixedResize *);
+static int  resize_layers(PixedDocument *, const PixedResize *);
+static int  resized_canvas(PixedDocument *, const PixedResize *, uint32_t **);
+static int  scale_canvas(PixedResizeJob *, PixedScaleFilter);
+static void swap_canvas(PixedDocument *, uint32_t *, uint32_t, uint32_t);
+
+/*
+ * Crops or extends the canvas, keeping the pixels at anchor in place.
+ * Pixels outside of the old canvas become transparent.
+ */
+int
+pixed_document_resize(PixedDocument *document, int width, int height, PixedAnchor anchor)
+{
+	if (!document || width <= 0 || height <= 0)
+		return -1;
+
+	// Skip unnecessary process
+	if (document->width == (uint32_t)width && document->height == (uint32_t)height)
+		return 0;
+
+	// Columns 0, 1, 2 of the anchor grid keep left, center and right in place
+	PixedResize resize;
+	resize.width = width;
+	resize.height = height;
+	resize.offset_x = (((int64_t)width - document->width) * (anchor % 3)) / 2;
+	resize.offset_y = (((int64_t)height - document->height) * (anchor / 3)) / 2;
+	resize.scale = 0;
+
+	return resize_document(document, &resize);
+}
+
+/* Keeps the width x height pixels at x, y, the part outside the canvas becomes transparent */
+int
+pixed_document_crop(PixedDocument *document, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	if (!document || width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX ||
+		x > INT32_MAX || y > INT32_MAX)
+		return -1;
+
+	if (x == 0 && y == 0 && document->width == width && document->height == height)
+		return 0;
+
+	PixedResize resize;
+	resize.width = width;
+	resize.height = height;
+	resize.offset_x = -(int32_t)x;
+	resize.offset_y = -(int32_t)y;
+	resize.scale = 0;
+
+	return resize_document(document, &resize);
+}
+
+int
+pixed_document_scale(PixedDocument *document, int width, int height, PixedScaleFilter filter)
+{
+	if (!document || width <= 0 || height <= 0)
+		return -1;
+
+	if (document->width == (uint32_t)width && document->height == (uint32_t)height)
+		return 0;
+
+	if (filter != PIXED_SCALE_NEAREST && filter != PIXED_SCALE_BOX && filter != PIXED_SCALE_BILINEAR)
+		return -1;
+
+	PixedResize resize;
+	resize.width = width;
+	resize.height = height;
+	resize.scale = 1;
+	resize.filter = filter;
+
+	return resize_document(document, &resize);
+}
+
+/* Nothing changes unless the new canvas of the document, or of every layer, could be built */
+static
+int
+resize_document(PixedDocument *document, const PixedResize *resize)
+{
+	if (document->layers_length > 0)
+		return resize_layers(document, resize);
+
+	uint32_t *canvas = 0;
+	if (resized_canvas(document, resize, &canvas) != 0)
+		return -1;
+
+	swap_canvas(document, canvas, resize->width, resize->height);
+	return 0;
+}
+
+/* Layers are resized on their own, the canvas only holds their composite */
+static
+int
+resize_layers(PixedDocument *document, const PixedResize *resize)
+{
+	uint32_t i = 0, length = document->layers_length;
+
+	uint32_t **canvases = calloc(length, sizeof(uint32_t *));
+	uint32_t *composite = calloc((size_t)resize->width * resize->height, sizeof(uint32_t));
+	if (!canvases || !composite)
+		goto failed;
+
+	for (i = 0; i < length; i++) {
+		if (resized_canvas(document->layers[i].pixels, resize, &canvases[i]) != 0)
+			goto failed;
+	}
+
+	for (i = 0; i < length; i++)
+		swap_canvas(document->layers[i].pixels, canvases[i], resize->width, resize->height);
+
+	free(canvases);
+	pixed_document_replace_canvas(document, composite, resize->width, resize->height);
+
+	PixedDocument *pixels = document->layers[0].pixels;
+	pixed_document_mark_dirty(pixels, 0, 0, pixels->width, pixels->height);
+
+	return pixed_document_composite(document);
+
+failed:
+	if (canvases) {
+		for (i = 0; i < length; i++)
+			free(canvases[i]);
+	}
+
+	free(canvases);
+	free(composite);
+	return -1;
+}
+
+/* Builds the resized pixels of a single canvas document into a new flat canvas, leaving it untouched */
+static
+int
+resized_canvas(PixedDocument *document, const PixedResize *resize, uint32_t **result)
+{
+	PixedResizeJob job;
+	job.document = document;
+	job.src = document->canvas;
+	job.src_width = document->width;
+	job.src_height = document->height;
+	job.dst_width = resize->width;
+	job.dst_height = resize->height;
+	job.offset_x = resize->offset_x;
+	job.offset_y = resize->offset_y;
+	job.failed = 0;
+
+	// Tiles and indices are read through a flat copy
+	uint32_t *flat = 0;
+	if (document->storage != PIXED_STORAGE_FLAT) {
+		flat = malloc(sizeof(uint32_t) * (size_t)document->width * document->height);
+		if (!flat)
+			return -1;
+
+		job.dst = flat;
+		pixed_parallel_rows(document->height, document->width, flatten_rows, &job);
+		job.src = flat;
+	}
+
+	int status = 0;
+	if (resize->scale) {
+		job.dst = malloc(sizeof(uint32_t) * (size_t)resize->width * resize->height);
+		status = job.dst ? scale_canvas(&job, resize->filter) : -1;
+	} else {
+		job.dst = calloc((size_t)resize->width * resize->height, sizeof(uint32_t));
+		if (job.dst)
+			pixed_parallel_rows(resize->height, resize->width, resize_canvas_rows, &job);
+		else
+			status = -1;
+	}
+
+	free(flat);
+
+	if (status != 0) {
+		free(job.dst);
+		return -1;
+	}
+
+	*result = job.dst;
+	return 0;
+}
+
+static
+int
+scale_canvas(PixedResizeJob *job, PixedScaleFilter filter)
+{
+	uint32_t x = 0, width = job->dst_width;
+	uint32_t *x_map = malloc(sizeof(uint32_t) * ((size_t)width + 1));
+	uint32_t *x_weight = malloc(sizeof(uint32_t) * width);
+
+	if (!x_map || !x_weight) {
+		free(x_map);
+		free(x_weight);
+		return -1;
+	}
+
+	job->x_map = x_map;
+	job->x_weight = x_weight;
+
+	PixedRowJob rows = 0;
+
+	switch (filter) {
+	case PIXED_SCALE_NEAREST:
+		// Sample at pixel centers so integer factors replicate exactly
+		for (x = 0; x < width; x++)
+			x_map[x] = ((2 * (uint64_t)x + 1) * job->src_width) / (2 * (uint64_t)width);
+
+		rows = scale_nearest_rows;
+		break;
+
+	case PIXED_SCALE_BOX:
+		// x_map holds the first source column of every box, plus the end
+		for (x = 0; x <= width; x++)
+			x_map[x] = ((uint64_t)x * job->src_width) / width;
+
+		rows = scale_box_rows;
+		break;
+
+	default:
+		for (x = 0; x < width; x++) {
+			// 24.8 fixed point source position of the pixel center
+			int64_t position = (((2 * (int64_t)x + 1) * job->src_width * 256) / (2 * (int64_t)width)) - 128;
+			position = PIXED_MAX(position, 0);
+
+			x_map[x] = PIXED_MIN((uint32_t)(position >> 8), job->src_width - 1);
+			x_weight[x] = x_map[x] == job->src_width - 1 ? 0 : (uint32_t)(position & 0xff);
+		}
+
+		rows = scale_bilinear_rows;
+		break;
+	}
+
+	pthread_mutex_init(&job->lock, 0);
+	pixed_parallel_rows(job->dst_height, width, rows, job);
+	pthread_mutex_destroy(&job->lock);
+
+	free(x_map);
+	free(x_weight);
+
+	return job->failed ? -1 : 0;
+}
+
+/*
+ * Puts the resized canvas in place of the document's own and goes back to the
+ * storage it had. Filtered colors may not fit a palette anymore and tiles may
+ * not be allocated, those documents stay flat with the same pixels.
+ */
+static
+void
+swap_canvas(PixedDocument *document, uint32_t *canvas, uint32_t width, uint32_t height)
+{
+	PixedStorage storage = document->storage;
+
+	pixed_document_replace_canvas(document, canvas, width, height);
+	pixed_document_set_storage(document, storage);
+}
+
+static
+void
+flatten_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedResizeJob *job = ctx;
+	pixed_document_copy_rows(job->document, begin, end - begin, job->dst + (size_t)begin * job->document->width);
+}
+
+static
+void
+resize_canvas_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedResizeJob *job = ctx;
+
+	int64_t src_x = PIXED_MAX(-(int64_t)job->offset_x, 0);
+	int64_t dst_x = PIXED_MAX((int64_t)job->offset_x, 0);
+	int64_t span = PIXED_MIN((int64_t)job->src_width - src_x, (int64_t)job->dst_width - dst_x);
+
+	if (span <= 0)
+		return;
+
+	uint32_t y = begin;
+	for (; y < end; y++) {
+		int64_t src_y = (int64_t)y - job->offset_y;
+		if (src_y < 0 || src_y >= job->src_height)
+			continue;
+
+		memcpy(job->dst + (size_t)y * job->dst_width + dst_x,
+			job->src + (size_t)src_y * job->src_width + src_x,
+			sizeof(uint32_t) * span);
+	}
+}
+
+static
+void
+scale_nearest_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedResizeJob *job = ctx;
+	uint32_t previous_src_y = UINT32_MAX;
+	uint32_t x = 0, y = begin;
+
+	for (; y < end; y++) {
+		uint32_t src_y = ((2 * (uint64_t)y + 1) * job->src_height) / (2 * (uint64_t)job->dst_height);
+		uint32_t *dst = job->dst + (size_t)y * job->dst_width;
+
+		// Upscaled rows repeat, copy the one we already built
+		if (src_y == previous_src_y) {
+			memcpy(dst, dst - job->dst_width, sizeof(uint32_t) * job->dst_width);
+			continue;
+		}
+
+		const uint32_t *src = job->src + (size_t)src_y * job->src_width;
+		for (x = 0; x < job->dst_width; x++)
+			dst[x] = src[job->x_map[x]];
+
+		previous_src_y = src_y;
+	}
+}
+
+/*
+ * Averages every source pixel under the destination pixel. Colors are
+ * weighted by alpha so transparent pixels don't bleed into the result.
+ */
+static
+void
+scale_box_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedResizeJob *job = ctx;
+	size_t columns = (size_t)4 * job->src_width, i = 0;
+
+	// R * A, G * A, B * A, A sums of every source column. Boxes taller than
+	// RESIZE_BOX_ROWS move them over to 64 bit totals before they could wrap
+	int tall = job->src_height / job->dst_height + 1 > RESIZE_BOX_ROWS;
+	uint32_t *sums = malloc(sizeof(uint32_t) * columns);
+	uint64_t *totals = tall ? malloc(sizeof(uint64_t) * columns) : 0;
+
+	if (!sums || (tall && !totals)) {
+		free(sums);
+		free(totals);
+
+		pthread_mutex_lock(&job->lock);
+		job->failed = 1;
+		pthread_mutex_unlock(&job->lock);
+		return;
+	}
+
+	uint32_t x = 0, y = begin, sy = 0, sx = 0;
+	for (; y < end; y++) {
+		uint32_t y0 = ((uint64_t)y * job->src_height) / job->dst_height;
+		uint32_t y1 = ((uint64_t)(y + 1) * job->src_height) / job->dst_height;
+		y1 = PIXED_MAX(y1, y0 + 1);
+
+		memset(sums, 0, sizeof(uint32_t) * columns);
+		if (totals)
+			memset(totals, 0, sizeof(uint64_t) * columns);
+
+		for (sy = y0; sy < y1; sy++) {
+			accumulate_weighted_row(sums, job->src + (size_t)sy * job->src_width, job->src_width);
+
+			if (totals && ((sy - y0) % RESIZE_BOX_ROWS == RESIZE_BOX_ROWS - 1 || sy == y1 - 1)) {
+				for (i = 0; i < columns; i++) {
+					totals[i] += sums[i];
+					sums[i] = 0;
+				}
+			}
+		}
+
+		unsigned char *dst = (unsigned char *)(job->dst + (size_t)y * job->dst_width);
+		for (x = 0; x < job->dst_width; x++) {
+			uint32_t x0 = job->x_map[x];
+			uint32_t x1 = PIXED_MAX(job->x_map[x + 1], x0 + 1);
+			uint64_t r = 0, g = 0, b = 0, a = 0;
+
+			for (sx = x0; sx < x1; sx++) {
+				r += totals ? totals[sx * 4 + 0] : sums[sx * 4 + 0];
+				g += totals ? totals[sx * 4 + 1] : sums[sx * 4 + 1];
+				b += totals ? totals[sx * 4 + 2] : sums[sx * 4 + 2];
+				a += totals ? totals[sx * 4 + 3] : sums[sx * 4 + 3];
+			}
+
+			uint64_t count = (uint64_t)(x1 - x0) * (y1 - y0);
+			dst[x * 4 + 0] = a ? (r + a / 2) / a : 0;
+			dst[x * 4 + 1] = a ? (g + a / 2) / a : 0;
+			dst[x * 4 + 2] = a ? (b + a / 2) / a : 0;
+			dst[x * 4 + 3] = (a + count / 2) / count;
+		}
+	}
+
+	free(sums);
+	free(totals);
+}
+
+/* Adds R * A, G * A, B * A and A of every pixel in row to sums */
+static
+void
+accumulate_weighted_row(uint32_t *sums, const uint32_t *row, uint32_t width)
+{
+	const unsigned char *bytes = (const unsigned char *)row;
+	uint32_t x = 0;
+
+#if defined(PIXED_SIMD_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rgb_mask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i alpha_one = _mm_set_epi16(1, 0, 0, 0, 1, 0, 0, 0);
+
+	for (; x + 4 <= width; x += 4) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)(bytes + x * 4));
+		__m128i halves[2];
+		int h = 0;
+
+		halves[0] = _mm_unpacklo_epi8(pixels, zero);
+		halves[1] = _mm_unpackhi_epi8(pixels, zero);
+
+		for (h = 0; h < 2; h++) {
+			// Multiply R, G, B by A and A by one
+			__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(halves[h], 0xff), 0xff);
+			alpha = _mm_or_si128(_mm_and_si128(alpha, rgb_mask), alpha_one);
+
+			__m128i weighted = _mm_mullo_epi16(halves[h], alpha);
+			__m128i *acc = (__m128i *)(sums + (x + h * 2) * 4);
+
+			_mm_storeu_si128(acc, _mm_add_epi32(_mm_loadu_si128(acc), _mm_unpacklo_epi16(weighted, zero)));
+			_mm_storeu_si128(acc + 1, _mm_add_epi32(_mm_loadu_si128(acc + 1), _mm_unpackhi_epi16(weighted, zero)));
+		}
+	}
+#elif defined(PIXED_SIMD_NEON)
+	for (; x + 4 <= width; x += 4) {
+		uint8x16_t pixels = vld1q_u8(bytes + x * 4);
+		uint16x8_t halves[2];
+		int h = 0;
+
+		halves[0] = vmovl_u8(vget_low_u8(pixels));
+		halves[1] = vmovl_u8(vget_high_u8(pixels));
+
+		for (h = 0; h < 2; h++) {
+			uint16_t lanes[8];
+			vst1q_u16(lanes, halves[h]);
+
+			const uint16_t weights[8] = { lanes[3], lanes[3], lanes[3], 1, lanes[7], lanes[7], lanes[7], 1 };
+			uint16x8_t weighted = vmulq_u16(halves[h], vld1q_u16(weights));
+			uint32_t *acc = sums + (x + h * 2) * 4;
+
+			vst1q_u32(acc, vaddq_u32(vld1q_u32(acc), vmovl_u16(vget_low_u16(weighted))));
+			vst1q_u32(acc + 4, vaddq_u32(vld1q_u32(acc + 4), vmovl_u16(vget_high_u16(weighted))));
+		}
+	}
+#endif
+
+	for (; x < width; x++) {
+		uint32_t a = bytes[x * 4 + 3];
+
+		sums[x * 4 + 0] += bytes[x * 4 + 0] * a;
+		sums[x * 4 + 1] += bytes[x * 4 + 1] * a;
+		sums[x * 4 + 2] += bytes[x * 4 + 2] * a;
+		sums[x * 4 + 3] += a;
+	}
+}
+
+static
+void
+scale_bilinear_rows(void *ctx, uint32_t begin, uint32_t end)
+{
+	PixedResizeJob *job = ctx;
+	uint32_t x = 0, y = begin, c = 0;
+
+	for (; y < end; y++) {
+		int64_t position = (((2 * (int64_t)y + 1) * job->src_height * 256) / (2 * (int64_t)job->dst_height)) - 128;
+		position = PIXED_MAX(position, 0);
+
+		uint32_t y0 = PIXED_MIN((uint32_t)(position >> 8), job->src_height - 1);
+		uint32_t y1 = PIXED_MIN(y0 + 1, job->src_height - 1);
+		uint32_t fy = y0 == y1 ? 0 : (uint32_t)(position & 0xff);
+
+		const unsigned char *row0 = (const unsigned char *)(job->src + (size_t)y0 * job->src_width);
+		const unsigned char *row1 = (const unsigned char *)(job->src + (size_t)y1 * job->src_width);
+		unsigned char *dst = (unsigned char *)(job->dst + (size_t)y * job->dst_width);
+
+		for (x = 0; x < job->dst_width; x++) {
+			uint32_t x0 = job->x_map[x];
+			uint32_t x1 = PIXED_MIN(x0 + 1, job->src_width - 1);
+			uint32_t fx = job->x_weight[x];
+
+			const unsigned char *taps[4] = { row0 + x0 * 4, row0 + x1 * 4, row1 + x0 * 4, row1 + x1 * 4 };
+			uint32_t weights[4] = {
+				(256 - fx) * (256 - fy), fx * (256 - fy),
+				(256 - fx) * fy, fx * fy
+			};
+
+			// Weights add up to 65536, colors are weighted by alpha as well
+			uint64_t sums[3] = { 0, 0, 0 }, alpha = 0;
+			int t = 0;
+			for (; t < 4; t++) {
+				uint64_t weight = (uint64_t)weights[t] * taps[t][3];
+				for (c = 0; c < 3; c++)
+					sums[c] += weight * taps[t][c];
+
+				alpha += weight;
+			}
+
+			for (c = 0; c < 3; c++)
+				dst[x * 4 + c] = alpha ? (sums[c] + alpha / 2) / alpha : 0;
+
+			dst[x * 4 + 3] = (alpha + 32768) >> 16;
+		}
+	}
+}
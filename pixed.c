@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -10,72 +11,76 @@
 
 #include "libpixed.h"
 #include "libglutil.h"
+#include "pixed_input.h"
+#include "pixed_trace.h"
 #include "shaders.h"
 
 /*
  * Definitions
  */
-#define FLOAT_PER_PIXEL_VERTEX 6
-
 #define PIXEL_UNIFORM_PAN      "pan"
 #define PIXEL_UNIFORM_ZOOM     "zoom"
 #define PIXEL_UNIFORM_VIEWPORT "viewport"
 
+#define CANVAS_UNIFORM_SIZE    "canvasSize"
+#define CANVAS_UNIFORM_CANVAS  "canvas"
+#define CANVAS_UNIFORM_PALETTE "palette"
+#define CANVAS_UNIFORM_INDEXED "indexed"
+#define CANVAS_UNIFORM_SELECTION "selection"
+
+#define HUD_UNIFORM_FRAME_TIMES "frameTimes"
+#define HUD_UNIFORM_NEWEST      "newest"
+
+#define RENDERER_POINTS  0 // one geometry shader quad per pixel
+#define RENDERER_TEXTURE 1 // canvas texture on a single quad
+
+#define TIMER_UPLOAD 0 // GL_TIME_ELAPSED queries of a frame
+#define TIMER_RENDER 1
+#define TIMER_MAX    2
+#define TIMER_FRAMES 4 // frames a query may lag behind before its result is waited for
+
 #define TOOL_IDLE  0
 #define TOOL_PAN   1
 #define TOOL_BRUSH 2
-#define TOOL_MAX   (TOOL_BRUSH + 1)
+#define TOOL_FILL  3
+#define TOOL_SELECT 4
+#define TOOL_MAX   (TOOL_SELECT + 1)
+
+#define EDITOR_HISTORY_BUDGET (256 * 1024 * 1024) // bytes of undo history per document
+#define EDITOR_FRAME_ARENA    (1024 * 1024)       // first block of the per frame scratch
+#define EDITOR_TRACE_FILE     "pixed-trace.json"  // F12 writes the trace here unless --trace names a file
+#define EDITOR_BENCH_BUILDS   5                   // vbo or texture rebuilds --bench times
 
 /*
  * Forward declarations
  */
 typedef struct {
-	GLuint document_vao;
-	GLuint document_vbo;
-	GLuint pixel_shader;
+	int           renderer;
+	GLuint        document_vao;
+	GLuint        document_vbo;      // points renderer
+	GLuint        document_texture;  // texture renderer, rgba or palette indices
+	GLuint        palette_texture;
+	GLuint        pixel_shader;      // program drawing the document
+
+	uint32_t      upload_width;      // document the vbo or texture was allocated for
+	uint32_t      upload_height;
+	PixedStorage  upload_storage;
+
+	GLuint        hud_shader;        // frame time bars, F3 toggles them
+	GLuint        hud_vao;
+	GLuint        hud_texture;       // TRACE_FRAMES rg32f texels, frame and gpu milliseconds
+	bool          hud;
+
+	GLuint        timer_queries[TIMER_FRAMES][TIMER_MAX];
+	double        timer_starts[TIMER_FRAMES][TIMER_MAX]; // when the query began, 0 unless its result is pending
+	uint32_t      timer_frames[TIMER_FRAMES];            // trace frame of each slot
 } GraphicsContext;
 
-typedef struct _key_event {
-	int key;
-	int scancode;
-	int action;
-	int mode;
-
-	struct _key_event *next;
-} KeyboardEvent;
-
-typedef enum {
-	MOUSE_DOWN,
-	MOUSE_UP,
-	MOUSE_MOVE,
-	MOUSE_SCROLL
-} MouseEventAction;
-
-typedef struct _mouse_event {
-	MouseEventAction action;
-
-	int button;
-	int mods;
-	int x;
-	int y;
-
-	struct _mouse_event *next;
-} MouseEvent;
-
-typedef struct {
-	KeyboardEvent *keyboard_buffer_head;
-	KeyboardEvent *keyboard_buffer_last;
-
-	MouseEvent    *mouse_buffer_head;
-	MouseEvent    *mouse_buffer_last;
-
-	bool           listen_mousemove;
-} InputSystem;
-
 typedef struct _tool {
 	int   id;
 	void *state;
 	bool  wants_destroy;
+	bool  every_move; // receives every MOUSE_MOVE instead of the latest of a burst
 
 	bool  (*initialize)(struct _tool *);
 	bool  (*on_key_down)(struct _tool *, KeyboardEvent *);
@@ -87,13 +92,45 @@ typedef struct _tool {
 	bool  (*destroy)(struct _tool *);
 } Tool;
 
+typedef struct {
+	PixedRect      rect;     // selected pixels of the target, nothing is selected while width is 0
+	uint8_t       *mask;     // one byte per pixel of rect, 0 when all of rect is selected
+	PixedDocument *floating; // lifted or pasted pixels blended over the target at x, y until anchored
+	PixedDocument *under;    // target pixels floating covers, put back before it moves
+	int            x, y;     // top left of floating, may hang over the edges
+} EditorSelection;
+
 typedef struct {
 	PixedDocument   *document;
+	PixedAnimation  *animation; // frames of the document, 0 when it isn't animated
+	uint32_t         frame;    // frame of the animation the document is
+	uint32_t         layer;    // layer the tools draw into, when the document has layers
+	bool             layers_changed; // layers or frames were added or changed since the document was set
+	bool             modified; // shown in the window title
 	GraphicsContext *graphics;
+	PixedArena       frame_arena; // scratch of the frame being drawn, reset once it is presented
+	PixedPool        tool_states; // ToolState of the active tool
 	Tool            *active_tool;  
+	uint32_t         color;    // Color of painting tools
+	EditorSelection  selection;
+	PixedDocument   *clipboard; // last copied pixels, 0 until something is copied
 	float            zoom;     // Size of a pixel in pixels
 	float            pan_x;
 	float            pan_y;
+
+	double           input_time;    // oldest event applied since the last frame, 0 if none
+	bool             report_latency;
+	double           latency_sum;   // event to presented frame, in seconds
+	double           latency_max;
+	uint32_t         latency_frames;
+	double           latency_reported;
+	uint64_t         heap_reported; // blocks arenas and pools took from the heap at the last report
+
+	const char      *trace_file;
+	char             hud_text[160]; // stats of the last second in the window title while the HUD is shown
+	double           hud_reported;
+	uint32_t         hud_frame;     // trace frame and totals at hud_reported
+	uint64_t         hud_totals[TRACE_COUNTER_MAX];
 } PixedEditor;
 
 typedef struct {
@@ -104,19 +141,68 @@ typedef struct {
 	bool  mouse_dragging;
 } ToolPanState;
 
+typedef struct {
+	uint32_t size;     // brush is size x size pixels
+	int      last_x;   // canvas position of the previous sample
+	int      last_y;
+	bool     painting;
+} ToolBrushState;
+
+typedef struct {
+	PixedFillStack stack; // kept between fills to reuse its memory
+} ToolFillState;
+
+typedef struct {
+	int  start_x;   // canvas position the drag started at
+	int  start_y;
+	int  grab_x;    // pointer position relative to the floating pixels
+	int  grab_y;
+	bool selecting; // dragging out a rectangle
+	bool moving;    // dragging the floating pixels
+} ToolSelectState;
+
+typedef union {
+	ToolPanState    pan;
+	ToolBrushState  brush;
+	ToolFillState   fill;
+	ToolSelectState select;
+} ToolState; // element of the tool state pool, one tool is active at a time
+
 PixedEditor      *pixed_editor_new(void);
 void              pixed_editor_free(void);
 void              pixed_editor_set_document(PixedDocument *);
+void              pixed_editor_set_animation(PixedAnimation *);
+PixedDocument    *pixed_editor_target(void);
+void              pixed_editor_attach_history(PixedDocument *);
+void              pixed_editor_attach_color_index(PixedDocument *);
+bool              pixed_editor_document_modified(void);
+void              pixed_editor_add_layer(void);
+void              pixed_editor_select_layer(int);
+void              pixed_editor_set_layer(bool, PixedBlendMode);
+void              pixed_editor_duplicate_frame(void);
+void              pixed_editor_select_frame(int);
+void              pixed_editor_select(int, int, int, int, const uint8_t *, uint32_t);
+void              pixed_editor_select_color(uint32_t);
+bool              pixed_editor_float(PixedDocument *, int, int);
+bool              pixed_editor_lift(void);
+void              pixed_editor_move_floating(int, int);
+void              pixed_editor_anchor(void);
+void              pixed_editor_copy(void);
+void              pixed_editor_paste(void);
+void              pixed_editor_delete_selection(void);
 void              pixed_editor_dispatch_tool(void);
-
-void              input_system_initialize(void);
-KeyboardEvent    *input_system_peek_keyboard_event(void);
-MouseEvent       *input_system_peek_mouse_event(void);
-void              input_system_push_keyboard_event(int, int, int, int);
-void              input_system_push_mouse_event(MouseEventAction, int, int, int, int);
-void              input_system_consume_keyboard_event(void);
-void              input_system_consume_mouse_event(void);
-void              input_system_destroy(void);
+void              pixed_editor_dispatch_key(KeyboardEvent *);
+void              pixed_editor_dispatch_mouse(MouseEvent *);
+void              pixed_editor_switch_tool(Tool *);
+void              pixed_editor_begin_operation(void);
+void              pixed_editor_end_operation(void);
+void              pixed_editor_undo(void);
+void              pixed_editor_redo(void);
+void              pixed_editor_applied_event(double);
+void              pixed_editor_frame_presented(void);
+void              pixed_editor_update_title(void);
+void              pixed_editor_update_hud(void);
+void              pixed_editor_write_trace(void);
 
 bool              tool_pan_initialize(Tool *);
 bool              tool_pan_on_key_up(Tool *, KeyboardEvent *);
@@ -125,9 +211,46 @@ bool              tool_pan_on_mouse_move(Tool *, MouseEvent *);
 bool              tool_pan_on_mouse_up(Tool *, MouseEvent *);  
 bool              tool_pan_destroy(Tool *);
 
-void              graphics_init(void);
+bool              tool_brush_initialize(Tool *);
+bool              tool_brush_on_key_down(Tool *, KeyboardEvent *);
+bool              tool_brush_on_mouse_down(Tool *, MouseEvent *);
+bool              tool_brush_on_mouse_move(Tool *, MouseEvent *);
+bool              tool_brush_on_mouse_up(Tool *, MouseEvent *);
+bool              tool_brush_destroy(Tool *);
+
+bool              tool_fill_initialize(Tool *);
+bool              tool_fill_on_key_down(Tool *, KeyboardEvent *);
+bool              tool_fill_on_mouse_down(Tool *, MouseEvent *);
+bool              tool_fill_destroy(Tool *);
+
+bool              tool_select_initialize(Tool *);
+bool              tool_select_on_key_down(Tool *, KeyboardEvent *);
+bool              tool_select_on_key_repeat(Tool *, KeyboardEvent *);
+bool              tool_select_on_mouse_down(Tool *, MouseEvent *);
+bool              tool_select_on_mouse_move(Tool *, MouseEvent *);
+bool              tool_select_on_mouse_up(Tool *, MouseEvent *);
+bool              tool_select_destroy(Tool *);
+bool              tool_select_nudge(int);
+
+void              editor_canvas_position(int, int, int *, int *);
+
+void              graphics_init(int);
+void              graphics_fill_pixels(uint32_t *, PixedDocument *, PixedRect *);
+void              graphics_allocate_document(void);
+void              graphics_upload_points(PixedRect *);
+void              graphics_upload_texture(PixedRect *);
+void              graphics_upload_document(void);
 void              graphics_render(void);
+void              graphics_render_hud(void);
+void              graphics_timer_begin(int);
+void              graphics_timer_end(void);
+void              graphics_collect_timer(uint32_t, int, bool);
+void              graphics_collect_timers(void);
+int               graphics_compare_samples(const void *, const void *);
+void              graphics_benchmark_report(const char *, double *, int, const char *);
+void              graphics_benchmark(int, const char *);
 void              graphics_center_document(void);
+void              graphics_update_selection(void);
 void              graphics_log_cb(GLenum, GLenum, GLuint, GLenum, GLsizei, const GLchar*, const void*);
 
 GLFWwindow       *window_create(int, int);
@@ -141,12 +264,14 @@ void              window_mouse_btn_cb(GLFWwindow *, int, int, int);
  */
 GLFWwindow *window;
 PixedEditor *editor;
-InputSystem *input_system;
 
-/* id, state, wants_destroy, initialize, on_key_down, on_key_up, on_key_repeat, on_mouse_down, on_mouse_up, on_mouse_move, destroy */
+/* id, state, wants_destroy, every_move, initialize, on_key_down, on_key_up, on_key_repeat, on_mouse_down, on_mouse_up, on_mouse_move, destroy */
 static Tool tool_lookup[TOOL_MAX] = {
-	{ TOOL_IDLE, 0, false, 0, 0, 0, 0, 0, 0, 0, 0 },
-	{ TOOL_PAN, 0, false, tool_pan_initialize, 0, tool_pan_on_key_up, 0, tool_pan_on_mouse_down, tool_pan_on_mouse_up, tool_pan_on_mouse_move, tool_pan_destroy }
+	{ TOOL_IDLE, 0, false, false, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ TOOL_PAN, 0, false, false, tool_pan_initialize, 0, tool_pan_on_key_up, 0, tool_pan_on_mouse_down, tool_pan_on_mouse_up, tool_pan_on_mouse_move, tool_pan_destroy },
+	{ TOOL_BRUSH, 0, false, true, tool_brush_initialize, tool_brush_on_key_down, 0, 0, tool_brush_on_mouse_down, tool_brush_on_mouse_up, tool_brush_on_mouse_move, tool_brush_destroy },
+	{ TOOL_FILL, 0, false, false, tool_fill_initialize, tool_fill_on_key_down, 0, 0, tool_fill_on_mouse_down, 0, 0, tool_fill_destroy },
+	{ TOOL_SELECT, 0, false, false, tool_select_initialize, tool_select_on_key_down, 0, tool_select_on_key_repeat, tool_select_on_mouse_down, tool_select_on_mouse_up, tool_select_on_mouse_move, tool_select_destroy }
 };
 
 /*
@@ -157,11 +282,38 @@ pixed_editor_new()
 {
 	PixedEditor * editor = malloc(sizeof(PixedEditor));
 	editor->document = 0;
+	editor->animation = 0;
+	editor->frame = 0;
+	editor->layer = 0;
+	editor->layers_changed = false;
+	editor->modified = false;
 	editor->active_tool = &tool_lookup[TOOL_IDLE];
 	editor->graphics = malloc(sizeof(GraphicsContext));
+	editor->color = 0x000000ff;
+	memset(&editor->selection, 0, sizeof(EditorSelection));
+	editor->clipboard = 0;
+	editor->graphics->renderer = RENDERER_TEXTURE;
+	editor->graphics->upload_width = 0;
+	editor->graphics->upload_height = 0;
+	editor->graphics->upload_storage = PIXED_STORAGE_FLAT;
+	editor->graphics->hud = false;
+	pixed_arena_init(&editor->frame_arena, EDITOR_FRAME_ARENA);
+	pixed_pool_init(&editor->tool_states, sizeof(ToolState), 1);
 	editor->zoom = 10.0f;
 	editor->pan_x = 0;
 	editor->pan_y = 0;
+	editor->input_time = 0;
+	editor->report_latency = false;
+	editor->latency_sum = 0;
+	editor->latency_max = 0;
+	editor->latency_frames = 0;
+	editor->latency_reported = 0;
+	editor->heap_reported = 0;
+	editor->trace_file = EDITOR_TRACE_FILE;
+	editor->hud_text[0] = '\0';
+	editor->hud_reported = 0;
+	editor->hud_frame = 0;
+	memset(editor->hud_totals, 0, sizeof(editor->hud_totals));
 
 	return editor;
 }
@@ -169,461 +321,1919 @@ pixed_editor_new()
 void
 pixed_editor_free()
 {
-	pixed_document_free(editor->document);
+	if (editor->animation)
+		pixed_animation_free(editor->animation);
+	else
+		pixed_document_free(editor->document);
+
+	if (editor->selection.floating) {
+		pixed_document_free(editor->selection.floating);
+		pixed_document_free(editor->selection.under);
+	}
+
+	if (editor->clipboard)
+		pixed_document_free(editor->clipboard);
+
+	free(editor->selection.mask);
+	pixed_arena_free(&editor->frame_arena);
+	pixed_pool_free(&editor->tool_states);
+	free(editor->graphics);
 	free(editor);
 }
 
 void
 pixed_editor_set_document(PixedDocument *document)
 {
-	// TODO: Check for already opened document and ask if there are unsaved changes!
+	if (editor->document && pixed_editor_document_modified())
+		fprintf(stderr, "WARNING: Unsaved changes to the previous document are lost!\n");
+
+	editor->document = document;
+	editor->layer = 0;
+	editor->layers_changed = false;
+
+	uint32_t i = 0;
+	for (; i < document->layers_length; i++) {
+		pixed_editor_attach_history(document->layers[i].pixels);
+		pixed_editor_attach_color_index(document->layers[i].pixels);
+	}
+
+	if (document->layers_length == 0) {
+		pixed_editor_attach_history(document);
+		pixed_editor_attach_color_index(document);
+	}
+}
+
+/* Edits the first frame of animation, the editor owns it from then on */
+void
+pixed_editor_set_animation(PixedAnimation *animation)
+{
+	pixed_editor_set_document(animation->frames[0].pixels);
+
+	editor->animation = animation;
+	editor->frame = 0;
+}
+
+/* The document tools draw into, the active layer of layered documents */
+PixedDocument *
+pixed_editor_target()
+{
+	PixedDocument *document = editor->document;
+	return document->layers_length > 0 ? document->layers[editor->layer].pixels : document;
+}
+
+/* Every layer keeps its own undo history, it goes with the layer */
+void
+pixed_editor_attach_history(PixedDocument *document)
+{
+	if (document->history)
+		return;
+
+	if (!pixed_history_new(document, EDITOR_HISTORY_BUDGET))
+		fprintf(stderr, "WARNING: Allocating the undo history failed, edits can't be undone!\n");
+}
+
+/* Like the history, every layer and frame counts its own colors */
+void
+pixed_editor_attach_color_index(PixedDocument *document)
+{
+	if (document->colors)
+		return;
+
+	if (!pixed_color_index_new(document, 1))
+		fprintf(stderr, "WARNING: Allocating the color index failed!\n");
+}
+
+bool
+pixed_editor_document_modified()
+{
+	PixedDocument *document = editor->document;
+	uint32_t i = 0;
+
+	if (editor->layers_changed)
+		return true;
+
+	// Every frame keeps its own history like layers do
+	for (; editor->animation && i < editor->animation->frames_length; i++) {
+		PixedHistory *history = editor->animation->frames[i].pixels->history;
+		if (history && pixed_history_modified(history))
+			return true;
+	}
+
+	for (i = 0; i < document->layers_length; i++) {
+		PixedHistory *history = document->layers[i].pixels->history;
+		if (history && pixed_history_modified(history))
+			return true;
+	}
+
+	return document->history && pixed_history_modified(document->history);
+}
+
+/* Puts a transparent layer above every other one and draws into it */
+void
+pixed_editor_add_layer()
+{
+	// Frames share tiles with each other, they can't have layers
+	if (editor->animation)
+		return;
+
+	int index = pixed_document_add_layer(editor->document);
+	if (index < 0) {
+		fprintf(stderr, "WARNING: Adding a layer failed!\n");
+		return;
+	}
+
+	pixed_editor_attach_history(editor->document->layers[index].pixels);
+	pixed_editor_attach_color_index(editor->document->layers[index].pixels);
+
+	editor->layer = index;
+	editor->layers_changed = true;
+	printf("layer %d of %u\n", index + 1, editor->document->layers_length);
+}
+
+void
+pixed_editor_select_layer(int step)
+{
+	PixedDocument *document = editor->document;
+	int layer = (int)editor->layer + step;
+
+	if (layer < 0 || layer >= (int)document->layers_length)
+		return;
+
+	editor->layer = layer;
+	printf("layer %d of %u\n", layer + 1, document->layers_length);
+}
+
+/* Changes visibility and blend mode of the active layer, keeping its opacity */
+void
+pixed_editor_set_layer(bool visible, PixedBlendMode blend)
+{
+	PixedDocument *document = editor->document;
+	if (document->layers_length == 0)
+		return;
+
+	PixedLayer *layer = &document->layers[editor->layer];
+	if (pixed_document_set_layer(document, editor->layer, layer->opacity, visible, blend) == 0)
+		editor->layers_changed = true;
+}
+
+/*
+ * Inserts a copy of the current frame after it and switches to the copy. A
+ * document that isn't animated yet becomes the first frame of an animation.
+ */
+void
+pixed_editor_duplicate_frame()
+{
+	PixedDocument *document = editor->document;
+
+	if (!editor->animation) {
+		if (document->layers_length > 0)
+			return;
+
+		PixedAnimation *animation = pixed_animation_new(document->name, document->width, document->height);
+		if (!animation || pixed_animation_insert_frame(animation, 0, document, 100) != 0) {
+			fprintf(stderr, "WARNING: Animating the document failed!\n");
+			if (animation)
+				pixed_animation_free(animation);
+			return;
+		}
+
+		editor->animation = animation;
+		editor->frame = 0;
+	}
+
+	int index = pixed_animation_duplicate_frame(editor->animation, editor->frame);
+	if (index < 0) {
+		fprintf(stderr, "WARNING: Duplicating the frame failed!\n");
+		return;
+	}
+
+	editor->layers_changed = true;
+	pixed_editor_select_frame(index - (int)editor->frame);
+}
+
+void
+pixed_editor_select_frame(int step)
+{
+	PixedAnimation *animation = editor->animation;
+	if (!animation)
+		return;
+
+	int frame = (int)editor->frame + step;
+	if (frame < 0 || frame >= (int)animation->frames_length)
+		return;
+
+	// Tiles the last frame wrote to are shared again with identical ones
+	pixed_animation_share_tiles(animation);
+
+	PixedDocument *document = animation->frames[frame].pixels;
+	pixed_editor_attach_history(document);
+	pixed_editor_attach_color_index(document);
+	pixed_document_mark_dirty(document, 0, 0, document->width, document->height);
+
 	editor->document = document;
+	editor->frame = frame;
+	printf("frame %d of %u\n", frame + 1, animation->frames_length);
+}
+
+/*
+ * Selects the part of the width x height rectangle at x, y inside the target,
+ * mask (stride bytes a row, 0 selects all of it) is copied. An empty
+ * rectangle selects nothing.
+ */
+void
+pixed_editor_select(int x, int y, int width, int height, const uint8_t *mask, uint32_t stride)
+{
+	EditorSelection *selection = &editor->selection;
+	PixedDocument *target = pixed_editor_target();
+	int x0 = x < 0 ? 0 : x, x1 = x + width > (int)target->width ? (int)target->width : x + width;
+	int y0 = y < 0 ? 0 : y, y1 = y + height > (int)target->height ? (int)target->height : y + height;
+	uint32_t row = 0;
+
+	free(selection->mask);
+	selection->mask = 0;
+	memset(&selection->rect, 0, sizeof(PixedRect));
+
+	if (x0 < x1 && y0 < y1) {
+		selection->rect.x = x0;
+		selection->rect.y = y0;
+		selection->rect.width = x1 - x0;
+		selection->rect.height = y1 - y0;
+	}
+
+	if (mask && selection->rect.width > 0) {
+		selection->mask = malloc((size_t)selection->rect.width * selection->rect.height);
+		if (!selection->mask) {
+			fprintf(stderr, "WARNING: Allocating the selection mask failed!\n");
+			selection->rect.width = 0;
+		}
+
+		for (; selection->mask && row < selection->rect.height; row++) {
+			memcpy(selection->mask + (size_t)row * selection->rect.width,
+				mask + (size_t)(y0 - y + row) * stride + (x0 - x), selection->rect.width);
+		}
+	}
+
+	graphics_update_selection();
+}
+
+/* Selects every pixel of the target that is color */
+void
+pixed_editor_select_color(uint32_t color)
+{
+	PixedDocument *target = pixed_editor_target();
+	uint32_t x = 0, y = 0, x0 = target->width, y0 = target->height, x1 = 0, y1 = 0;
+
+	uint8_t *mask = malloc((size_t)target->width * target->height);
+	if (!mask || !target->colors || pixed_color_index_select(target->colors, color, mask) != 0) {
+		fprintf(stderr, "WARNING: Selecting by color failed!\n");
+		free(mask);
+		return;
+	}
+
+	trace_begin("select color");
+
+	for (y = 0; y < target->height; y++) {
+		const uint8_t *row = mask + (size_t)y * target->width;
+
+		for (x = 0; x < target->width && !row[x]; x++)
+			;
+
+		if (x == target->width)
+			continue;
+
+		x0 = x < x0 ? x : x0;
+		y0 = y < y0 ? y : y0;
+		y1 = y + 1;
+
+		for (x = target->width; !row[x - 1]; x--)
+			;
+
+		x1 = x > x1 ? x : x1;
+	}
+
+	trace_end();
+
+	if (x0 < x1)
+		pixed_editor_select(x0, y0, x1 - x0, y1 - y0, mask + (size_t)y0 * target->width + x0, target->width);
+	else
+		pixed_editor_select(0, 0, 0, 0, 0, 0);
+
+	free(mask);
+}
+
+/*
+ * Blends floating over the target at x, y and keeps it moving until it is
+ * anchored. Called inside the operation the target changes in, which ends
+ * here if floating can't be taken.
+ */
+bool
+pixed_editor_float(PixedDocument *floating, int x, int y)
+{
+	EditorSelection *selection = &editor->selection;
+	PixedDocument *target = pixed_editor_target();
+
+	PixedDocument *under = pixed_document_new("under", floating->width, floating->height);
+	if (!under) {
+		fprintf(stderr, "WARNING: Allocating the floating selection failed!\n");
+		pixed_document_free(floating);
+		pixed_editor_end_operation();
+		return false;
+	}
+
+	selection->floating = floating;
+	selection->under = under;
+	selection->x = x;
+	selection->y = y;
+
+	if (pixed_document_blit(under, -x, -y, target, 0, 0, PIXED_BLIT_COPY) != 0 ||
+		pixed_document_blit(target, x, y, floating, 0, 0, PIXED_BLIT_OVER) != 0)
+		fprintf(stderr, "WARNING: Blending the floating selection failed!\n");
+
+	graphics_update_selection();
+	return true;
+}
+
+/* Cuts the selected pixels out of the target and floats them where they were */
+bool
+pixed_editor_lift()
+{
+	EditorSelection *selection = &editor->selection;
+	PixedDocument *target = pixed_editor_target();
+
+	if (selection->floating)
+		return true;
+
+	if (selection->rect.width == 0)
+		return false;
+
+	PixedDocument *floating = pixed_document_copy_area(target, &selection->rect, selection->mask);
+	if (!floating) {
+		fprintf(stderr, "WARNING: Copying the selection failed!\n");
+		return false;
+	}
+
+	// Lifting, moving and anchoring are undone at once
+	pixed_editor_begin_operation();
+	pixed_document_clear_area(target, &selection->rect, selection->mask);
+
+	return pixed_editor_float(floating, selection->rect.x, selection->rect.y);
+}
+
+/*
+ * Puts back the pixels the floating ones covered, keeps the ones at x, y and
+ * blends the floating pixels over them. Only the two rectangles change.
+ */
+void
+pixed_editor_move_floating(int x, int y)
+{
+	EditorSelection *selection = &editor->selection;
+	PixedDocument *target = pixed_editor_target(), *floating = selection->floating;
+
+	if (!floating || (x == selection->x && y == selection->y))
+		return;
+
+	trace_begin("move selection");
+	int failed = pixed_document_blit(target, selection->x, selection->y, selection->under, 0, 0, PIXED_BLIT_COPY) != 0;
+	failed = pixed_document_blit(selection->under, -x, -y, target, 0, 0, PIXED_BLIT_COPY) != 0 || failed;
+	failed = pixed_document_blit(target, x, y, floating, 0, 0, PIXED_BLIT_OVER) != 0 || failed;
+	trace_end();
+	trace_count(TRACE_COUNTER_PIXELS, (uint64_t)floating->width * floating->height * 2);
+
+	if (failed)
+		fprintf(stderr, "WARNING: Moving the floating selection failed!\n");
+
+	selection->x = x;
+	selection->y = y;
+	graphics_update_selection();
+}
+
+/* Leaves the floating pixels where they are, they stay selected */
+void
+pixed_editor_anchor()
+{
+	EditorSelection *selection = &editor->selection;
+	PixedDocument *floating = selection->floating;
+	uint8_t *mask = selection->mask;
+
+	if (!floating)
+		return;
+
+	pixed_editor_end_operation();
+
+	pixed_document_free(selection->under);
+	selection->floating = 0;
+	selection->under = 0;
+	selection->mask = 0;
+
+	pixed_editor_select(selection->x, selection->y, floating->width, floating->height, mask, floating->width);
+
+	free(mask);
+	pixed_document_free(floating);
+}
+
+/* The floating pixels or the selected ones of the target go to the clipboard */
+void
+pixed_editor_copy()
+{
+	EditorSelection *selection = &editor->selection;
+	PixedDocument *copy = 0;
+
+	if (selection->floating)
+		copy = pixed_document_copy_area(selection->floating, 0, 0);
+	else if (selection->rect.width > 0)
+		copy = pixed_document_copy_area(pixed_editor_target(), &selection->rect, selection->mask);
+	else
+		return;
+
+	if (!copy) {
+		fprintf(stderr, "WARNING: Copying the selection failed!\n");
+		return;
+	}
+
+	if (editor->clipboard)
+		pixed_document_free(editor->clipboard);
+
+	editor->clipboard = copy;
+}
+
+/* Floats the clipboard over the selection, or the top left of the window without one */
+void
+pixed_editor_paste()
+{
+	EditorSelection *selection = &editor->selection;
+	int x = 0, y = 0;
+
+	if (!editor->clipboard)
+		return;
+
+	pixed_editor_anchor();
+
+	PixedDocument *floating = pixed_document_copy_area(editor->clipboard, 0, 0);
+	if (!floating) {
+		fprintf(stderr, "WARNING: Copying the clipboard failed!\n");
+		return;
+	}
+
+	if (selection->rect.width > 0) {
+		x = selection->rect.x;
+		y = selection->rect.y;
+	} else {
+		editor_canvas_position(0, 0, &x, &y);
+		x = x < 0 ? 0 : x;
+		y = y < 0 ? 0 : y;
+	}
+
+	// Pasted pixels are all selected
+	free(selection->mask);
+	selection->mask = 0;
+
+	pixed_editor_begin_operation();
+	pixed_editor_float(floating, x, y);
+}
+
+/* Clears the selected pixels, floating ones are dropped */
+void
+pixed_editor_delete_selection()
+{
+	EditorSelection *selection = &editor->selection;
+	PixedDocument *target = pixed_editor_target();
+
+	if (selection->floating) {
+		if (pixed_document_blit(target, selection->x, selection->y, selection->under, 0, 0, PIXED_BLIT_COPY) != 0)
+			fprintf(stderr, "WARNING: Dropping the floating selection failed!\n");
+
+		pixed_editor_end_operation();
+
+		pixed_document_free(selection->floating);
+		pixed_document_free(selection->under);
+		selection->floating = 0;
+		selection->under = 0;
+	} else if (selection->rect.width > 0) {
+		pixed_editor_begin_operation();
+		pixed_document_clear_area(target, &selection->rect, selection->mask);
+		pixed_editor_end_operation();
+	}
+
+	pixed_editor_select(0, 0, 0, 0, 0, 0);
 }
 
+/*
+ * Drains both input queues, in the order the events happened. Bursts of
+ * moves collapse into the latest one unless the tool asks for every move.
+ */
 void
 pixed_editor_dispatch_tool()
 {
-	KeyboardEvent *key_e = input_system_peek_keyboard_event();
-	MouseEvent *mouse_e = input_system_peek_mouse_event();
+	for (;;) {
+		KeyboardEvent *key_e = input_system_peek_keyboard_event();
+		MouseEvent *mouse_e = input_system_peek_mouse_event();
+
+		if (!key_e && !mouse_e)
+			break;
+
+		if (key_e && (!mouse_e || key_e->time <= mouse_e->time)) {
+			pixed_editor_applied_event(key_e->time);
+			pixed_editor_dispatch_key(key_e);
+			input_system_consume_keyboard_event();
+			trace_count(TRACE_COUNTER_EVENTS, 1);
+		} else {
+			MouseEvent *next_e = input_system_peek_mouse_event_at(1);
+			bool superseded = mouse_e->action == MOUSE_MOVE && !editor->active_tool->every_move &&
+				next_e && next_e->action == MOUSE_MOVE && (!key_e || next_e->time <= key_e->time);
+
+			pixed_editor_applied_event(mouse_e->time);
+			if (!superseded) {
+				pixed_editor_dispatch_mouse(mouse_e);
+				trace_count(TRACE_COUNTER_EVENTS, 1);
+			}
+
+			input_system_consume_mouse_event();
+		}
+
+		// Check if tool needs to be destroyed
+		Tool *active_tool = editor->active_tool;
+		if (active_tool != &tool_lookup[TOOL_IDLE] && active_tool->wants_destroy) {
+			if (active_tool->destroy)
+				active_tool->destroy(active_tool);
+
+			editor->active_tool = &tool_lookup[TOOL_IDLE];
+			input_system->listen_mousemove = false;
+		}
+	}
+
+	// Unsaved changes show up in the title
+	bool modified = pixed_editor_document_modified();
+	if (modified != editor->modified) {
+		editor->modified = modified;
+		pixed_editor_update_title();
+	}
+}
+
+void
+pixed_editor_dispatch_key(KeyboardEvent *key_e)
+{
 	Tool *active_tool = editor->active_tool;
-	Tool *new_tool = 0;
+	bool input_used = false;
+
+	// Instrumentation keys work in every tool
+	if (key_e->action == GLFW_PRESS && key_e->key == GLFW_KEY_F3) {
+		editor->graphics->hud = !editor->graphics->hud;
+		editor->hud_text[0] = '\0';
+		pixed_editor_update_title();
+		return;
+	}
 
-	// Handle key event
-	if (key_e) {
-		bool input_used = false;
+	if (key_e->action == GLFW_PRESS && key_e->key == GLFW_KEY_F12) {
+		pixed_editor_write_trace();
+		return;
+	}
 
-		switch (key_e->action) {
-		case GLFW_PRESS:
-			if (active_tool->on_key_down)
-				input_used = active_tool->on_key_down(active_tool, key_e);
-			break;
+	switch (key_e->action) {
+	case GLFW_PRESS:
+		if (active_tool->on_key_down)
+			input_used = active_tool->on_key_down(active_tool, key_e);
+		break;
+
+	case GLFW_RELEASE:
+		if (active_tool->on_key_up)
+			input_used = active_tool->on_key_up(active_tool, key_e);
+		break;
+
+	case GLFW_REPEAT:
+		if (active_tool->on_key_repeat)
+			input_used = active_tool->on_key_repeat(active_tool, key_e);
+		break;
+
+	default:
+		break;
+	}
+
+	// Undo and redo work in every tool
+	if (!input_used && key_e->action != GLFW_RELEASE && (key_e->mode & (GLFW_MOD_CONTROL | GLFW_MOD_SUPER))) {
+		if (key_e->key == GLFW_KEY_Z && !(key_e->mode & GLFW_MOD_SHIFT)) {
+			pixed_editor_undo();
+			return;
+		}
+
+		if (key_e->key == GLFW_KEY_Y || key_e->key == GLFW_KEY_Z) {
+			pixed_editor_redo();
+			return;
+		}
+	}
+
+	if (!input_used && active_tool == &tool_lookup[TOOL_IDLE] && key_e->action == GLFW_PRESS) {
+		// Key presses in idle tool may activate other tools
+		switch (key_e->key) {
+		// Pan tool
+		case GLFW_KEY_SPACE:
+			pixed_editor_switch_tool(&tool_lookup[TOOL_PAN]);
+			break;
+
+		// Brush tool
+		case GLFW_KEY_B:
+			pixed_editor_switch_tool(&tool_lookup[TOOL_BRUSH]);
+			break;
+
+		// Fill tool
+		case GLFW_KEY_G:
+			pixed_editor_switch_tool(&tool_lookup[TOOL_FILL]);
+			break;
+
+		// Select tool, copy and paste
+		case GLFW_KEY_S:
+			pixed_editor_switch_tool(&tool_lookup[TOOL_SELECT]);
+			break;
+
+		// Layers, tools draw into the active one
+		case GLFW_KEY_L:
+			pixed_editor_add_layer();
+			break;
+
+		case GLFW_KEY_UP:
+			pixed_editor_select_layer(1);
+			break;
+
+		case GLFW_KEY_DOWN:
+			pixed_editor_select_layer(-1);
+			break;
+
+		case GLFW_KEY_H:
+			if (editor->document->layers_length > 0) {
+				PixedLayer *layer = &editor->document->layers[editor->layer];
+				pixed_editor_set_layer(!layer->visible, layer->blend);
+			}
+			break;
+
+		case GLFW_KEY_M:
+			if (editor->document->layers_length > 0) {
+				PixedLayer *layer = &editor->document->layers[editor->layer];
+				pixed_editor_set_layer(layer->visible, (PixedBlendMode)((layer->blend + 1) % (PIXED_BLEND_SCREEN + 1)));
+			}
+			break;
+
+		// Frames, identical tiles are shared between them
+		case GLFW_KEY_N:
+			pixed_editor_duplicate_frame();
+			break;
+
+		case GLFW_KEY_LEFT:
+			pixed_editor_select_frame(-1);
+			break;
+
+		case GLFW_KEY_RIGHT:
+			pixed_editor_select_frame(1);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+void
+pixed_editor_dispatch_mouse(MouseEvent *mouse_e)
+{
+	Tool *active_tool = editor->active_tool;
+
+	switch (mouse_e->action) {
+	case MOUSE_MOVE:
+		if (active_tool->on_mouse_move) 
+			active_tool->on_mouse_move(active_tool, mouse_e);
+		break;
+
+	case MOUSE_DOWN:
+		if (active_tool->on_mouse_down)
+			active_tool->on_mouse_down(active_tool, mouse_e);
+		break;
+
+	case MOUSE_UP:
+		if (active_tool->on_mouse_up)
+			active_tool->on_mouse_up(active_tool, mouse_e);
+		break;
+
+	case MOUSE_SCROLL:
+	default:
+		break;
+	}
+}
+
+void
+pixed_editor_switch_tool(Tool *new_tool)
+{
+	Tool *active_tool = editor->active_tool;
+
+	if (active_tool->destroy)
+		active_tool->destroy(active_tool);
+
+	if (new_tool->initialize) {
+		if (!new_tool->initialize(new_tool))
+			editor->active_tool = &tool_lookup[TOOL_IDLE];
+		else
+			editor->active_tool = new_tool;
+	} else {
+		editor->active_tool = new_tool;
+	}
+
+	if (editor->active_tool->on_mouse_move)
+		input_system->listen_mousemove = true;
+}
+
+/* Edits between begin and end are undone together */
+void
+pixed_editor_begin_operation()
+{
+	PixedHistory *history = pixed_editor_target()->history;
+	if (history)
+		pixed_history_begin(history);
+}
+
+void
+pixed_editor_end_operation()
+{
+	PixedHistory *history = pixed_editor_target()->history;
+	if (history)
+		pixed_history_end(history);
+}
+
+/* Does nothing while a tool is in the middle of an operation, like a stroke */
+void
+pixed_editor_undo()
+{
+	PixedHistory *history = pixed_editor_target()->history;
+	if (!history)
+		return;
+
+	trace_begin("undo");
+	pixed_history_undo(history);
+	trace_end();
+}
+
+void
+pixed_editor_redo()
+{
+	PixedHistory *history = pixed_editor_target()->history;
+	if (!history)
+		return;
+
+	trace_begin("redo");
+	pixed_history_redo(history);
+	trace_end();
+}
+
+/* Remembers the oldest event that the next frame will show */
+void
+pixed_editor_applied_event(double time)
+{
+	if (editor->input_time == 0 || time < editor->input_time)
+		editor->input_time = time;
+}
+
+/*
+ * Call after the frame is swapped, reports latencies and the heap blocks taken
+ * by arenas and pools once a second with --latency
+ */
+void
+pixed_editor_frame_presented()
+{
+	double now = input_system_now();
+
+	pixed_arena_reset(&editor->frame_arena);
+	graphics_collect_timers();
+	trace_frame();
+
+	if (editor->graphics->hud && now - editor->hud_reported >= 1.0)
+		pixed_editor_update_hud();
+
+	if (editor->input_time != 0) {
+		double latency = now - editor->input_time;
+
+		editor->latency_sum += latency;
+		editor->latency_max = latency > editor->latency_max ? latency : editor->latency_max;
+		editor->latency_frames++;
+		editor->input_time = 0;
+	}
+
+	if (!editor->report_latency || now - editor->latency_reported < 1.0)
+		return;
+
+	if (editor->latency_frames > 0) {
+		printf("input latency: avg %.2f ms, max %.2f ms over %u frames\n",
+			editor->latency_sum * 1000.0 / editor->latency_frames, editor->latency_max * 1000.0,
+			editor->latency_frames);
+	}
+
+	PixedAllocStats stats;
+	pixed_alloc_stats(&stats);
+
+	if (stats.heap_allocations != editor->heap_reported) {
+		printf("heap: %llu blocks taken, %.1f MiB held by arenas and pools\n",
+			(unsigned long long)(stats.heap_allocations - editor->heap_reported), stats.heap_bytes / (1024.0 * 1024.0));
+		editor->heap_reported = stats.heap_allocations;
+	}
+
+	editor->latency_sum = 0;
+	editor->latency_max = 0;
+	editor->latency_frames = 0;
+	editor->latency_reported = now;
+}
+
+void
+pixed_editor_update_title()
+{
+	char title[sizeof(editor->hud_text) + 16];
+
+	snprintf(title, sizeof(title), "Pixed%s%s%s", editor->modified ? " *" : "",
+		editor->hud_text[0] ? " | " : "", editor->hud_text);
+	glfwSetWindowTitle(window, title);
+}
+
+/* Puts the frame times and counters of the frames since the last call in the window title */
+void
+pixed_editor_update_hud()
+{
+	double now = input_system_now();
+	uint32_t frames = trace_system->frame - editor->hud_frame, i = 0;
+	uint64_t totals[TRACE_COUNTER_MAX];
+	float sum = 0, max = 0, gpu = 0;
+
+	for (; i < frames && i < TRACE_FRAMES; i++) {
+		float *times = trace_system->frame_times[(trace_system->frame - 1 - i) & (TRACE_FRAMES - 1)];
+
+		sum += times[0];
+		gpu += times[1];
+		max = times[0] > max ? times[0] : max;
+	}
+
+	for (i = 0; i < TRACE_COUNTER_MAX; i++)
+		totals[i] = trace_system->totals[i] - editor->hud_totals[i];
+
+	if (frames > 0) {
+		uint32_t timed = frames < TRACE_FRAMES ? frames : TRACE_FRAMES;
+
+		snprintf(editor->hud_text, sizeof(editor->hud_text),
+			"%u fps, frame %.1f ms max %.1f, gpu %.2f ms | %llu events, %llu px, %.1f KiB uploaded | %u colors",
+			frames, sum / timed, max, gpu / timed, (unsigned long long)totals[TRACE_COUNTER_EVENTS],
+			(unsigned long long)totals[TRACE_COUNTER_PIXELS], totals[TRACE_COUNTER_UPLOADED] / 1024.0,
+			pixed_color_index_length(pixed_editor_target()->colors));
+		pixed_editor_update_title();
+	}
+
+	editor->hud_reported = now;
+	editor->hud_frame = trace_system->frame;
+	memcpy(editor->hud_totals, trace_system->totals, sizeof(editor->hud_totals));
+}
+
+void
+pixed_editor_write_trace()
+{
+	if (trace_system_write(editor->trace_file) != 0) {
+		fprintf(stderr, "ERROR: Writing trace to %s failed\n", editor->trace_file);
+		return;
+	}
+
+	printf("trace of the last %llu events written to %s\n",
+		(unsigned long long)(trace_system->written < TRACE_CAPACITY ? trace_system->written : TRACE_CAPACITY),
+		editor->trace_file);
+}
+
+bool
+tool_pan_initialize(Tool *pan)
+{
+	ToolPanState *state = pixed_pool_alloc(&editor->tool_states);
+	if (!state) {
+		perror("ERROR: Pan tool initialization failed");
+		return false;
+	}
+
+	GLFWcursor *cursor = glfwCreateStandardCursor(GLFW_HAND_CURSOR);
+	glfwSetCursor(window, cursor);
+
+	state->start_x = 0;
+	state->start_y = 0;
+	state->editor_start_x = editor->pan_x;
+	state->editor_start_y = editor->pan_y;
+	state->mouse_dragging = false;
+
+	pan->state = state;
+	pan->wants_destroy = false;
+
+	return true;
+}
+
+bool
+tool_pan_on_key_up(Tool *pan, KeyboardEvent *key_e)
+{
+	if (key_e->key == GLFW_KEY_SPACE) {
+		pan->wants_destroy = true;
+		return true;
+	}
+
+	return false;
+}
+
+bool
+tool_pan_on_mouse_down(Tool *pan, MouseEvent *mouse_e)
+{
+	/* Pan tool only checks for left mouse button */
+	if (mouse_e->button != GLFW_MOUSE_BUTTON_LEFT)
+		return false;
+
+	ToolPanState *state = (ToolPanState *)pan->state;
+	if (!state) {
+		printf("ERROR: Pan tool expecting state but got null!\n");
+		return false;
+	}
+
+	state->start_x = mouse_e->x;
+	state->start_y = mouse_e->y;
+	state->editor_start_x = editor->pan_x;
+	state->editor_start_y = editor->pan_y;
+	state->mouse_dragging = true;
+
+	return true;
+}
+
+bool
+tool_pan_on_mouse_move(Tool *pan, MouseEvent *mouse_e)
+{
+	ToolPanState *state = (ToolPanState *)pan->state;
+	if (!state) {
+		printf("ERROR: Pan tool expecting state but got null!\n");
+		return false;
+	}
+
+	/* If mouse button is not down do nothing */
+	if (state->mouse_dragging == false)
+		return false;
+
+	float pan_x, pan_y;
+	pan_x = state->editor_start_x + (mouse_e->x - state->start_x);
+	pan_y = state->editor_start_y + (mouse_e->y - state->start_y);
+
+	editor->pan_x = pan_x;
+	editor->pan_y = pan_y;
+
+	glUseProgram(editor->graphics->pixel_shader);
+	glutil_shader_uniform2f(editor->graphics->pixel_shader, PIXEL_UNIFORM_PAN, pan_x, pan_y);
+	glUseProgram(0);
+
+	return true;
+}
+
+bool
+tool_pan_on_mouse_up(Tool *pan, MouseEvent *mouse_e)
+{
+	if (mouse_e->button != GLFW_MOUSE_BUTTON_LEFT)
+		return false;
+
+	ToolPanState *state = (ToolPanState *)pan->state;
+	if (!state) {
+		printf("ERROR: Pan tool expecting state but got null!\n");
+		return false;
+	}
+
+	state->mouse_dragging = false;
+	return true;
+}
+
+
+bool
+tool_pan_destroy(Tool *pan)
+{
+	ToolPanState *state = (ToolPanState *)pan->state;
+	if (!state) {
+		printf("ERROR: Pan tool destroy failed because state is null!\n");
+		return false;
+	}
+
+	pixed_pool_release(&editor->tool_states, state);
+	pan->state = 0;
+
+	glfwSetCursor(window, NULL);
+
+	return true;
+}
+
+bool
+tool_brush_initialize(Tool *brush)
+{
+	ToolBrushState *state = pixed_pool_alloc(&editor->tool_states);
+	if (!state) {
+		perror("ERROR: Brush tool initialization failed");
+		return false;
+	}
+
+	GLFWcursor *cursor = glfwCreateStandardCursor(GLFW_CROSSHAIR_CURSOR);
+	glfwSetCursor(window, cursor);
+
+	state->size = 1;
+	state->last_x = 0;
+	state->last_y = 0;
+	state->painting = false;
+
+	brush->state = state;
+	brush->wants_destroy = false;
+
+	return true;
+}
+
+/* B or escape puts the brush away, [ and ] change its size */
+bool
+tool_brush_on_key_down(Tool *brush, KeyboardEvent *key_e)
+{
+	ToolBrushState *state = (ToolBrushState *)brush->state;
+
+	switch (key_e->key) {
+	case GLFW_KEY_B:
+	case GLFW_KEY_ESCAPE:
+		brush->wants_destroy = true;
+		return true;
+
+	case GLFW_KEY_LEFT_BRACKET:
+		if (state->size > 1)
+			state->size--;
+		return true;
+
+	case GLFW_KEY_RIGHT_BRACKET:
+		if (state->size < 256)
+			state->size++;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+bool
+tool_brush_on_mouse_down(Tool *brush, MouseEvent *mouse_e)
+{
+	if (mouse_e->button != GLFW_MOUSE_BUTTON_LEFT)
+		return false;
+
+	ToolBrushState *state = (ToolBrushState *)brush->state;
+	if (!state) {
+		printf("ERROR: Brush tool expecting state but got null!\n");
+		return false;
+	}
+
+	PixedRect touched;
+	editor_canvas_position(mouse_e->x, mouse_e->y, &state->last_x, &state->last_y);
+
+	// The whole stroke is undone at once
+	pixed_editor_begin_operation();
+	trace_begin("brush");
+	pixed_document_draw_line(pixed_editor_target(), state->last_x, state->last_y, state->last_x, state->last_y,
+		state->size, editor->color, &touched);
+	trace_end();
+	trace_count(TRACE_COUNTER_PIXELS, (uint64_t)touched.width * touched.height);
+
+	state->painting = true;
+	return true;
+}
+
+/* Connects every sample to the previous one, the tool gets every move */
+bool
+tool_brush_on_mouse_move(Tool *brush, MouseEvent *mouse_e)
+{
+	ToolBrushState *state = (ToolBrushState *)brush->state;
+	if (!state) {
+		printf("ERROR: Brush tool expecting state but got null!\n");
+		return false;
+	}
+
+	if (state->painting == false)
+		return false;
+
+	PixedRect touched;
+	int x, y;
+
+	editor_canvas_position(mouse_e->x, mouse_e->y, &x, &y);
+	if (x == state->last_x && y == state->last_y)
+		return true;
+
+	trace_begin("brush");
+	pixed_document_draw_line(pixed_editor_target(), state->last_x, state->last_y, x, y, state->size, editor->color, &touched);
+	trace_end();
+	trace_count(TRACE_COUNTER_PIXELS, (uint64_t)touched.width * touched.height);
+
+	state->last_x = x;
+	state->last_y = y;
+	return true;
+}
+
+bool
+tool_brush_on_mouse_up(Tool *brush, MouseEvent *mouse_e)
+{
+	if (mouse_e->button != GLFW_MOUSE_BUTTON_LEFT)
+		return false;
+
+	ToolBrushState *state = (ToolBrushState *)brush->state;
+	if (!state) {
+		printf("ERROR: Brush tool expecting state but got null!\n");
+		return false;
+	}
+
+	if (state->painting)
+		pixed_editor_end_operation();
+
+	state->painting = false;
+	return true;
+}
+
+bool
+tool_brush_destroy(Tool *brush)
+{
+	ToolBrushState *state = (ToolBrushState *)brush->state;
+	if (!state) {
+		printf("ERROR: Brush tool destroy failed because state is null!\n");
+		return false;
+	}
+
+	if (state->painting)
+		pixed_editor_end_operation();
+
+	pixed_pool_release(&editor->tool_states, state);
+	brush->state = 0;
+
+	glfwSetCursor(window, NULL);
+
+	return true;
+}
+
+bool
+tool_fill_initialize(Tool *fill)
+{
+	ToolFillState *state = pixed_pool_alloc(&editor->tool_states);
+	if (!state) {
+		perror("ERROR: Fill tool initialization failed");
+		return false;
+	}
+
+	memset(state, 0, sizeof(ToolFillState));
+
+	GLFWcursor *cursor = glfwCreateStandardCursor(GLFW_CROSSHAIR_CURSOR);
+	glfwSetCursor(window, cursor);
+
+	fill->state = state;
+	fill->wants_destroy = false;
+
+	return true;
+}
+
+bool
+tool_fill_on_key_down(Tool *fill, KeyboardEvent *key_e)
+{
+	if (key_e->key == GLFW_KEY_G || key_e->key == GLFW_KEY_ESCAPE) {
+		fill->wants_destroy = true;
+		return true;
+	}
+
+	return false;
+}
+
+/* Fills the region under the cursor, with shift every pixel of its color */
+bool
+tool_fill_on_mouse_down(Tool *fill, MouseEvent *mouse_e)
+{
+	if (mouse_e->button != GLFW_MOUSE_BUTTON_LEFT)
+		return false;
+
+	ToolFillState *state = (ToolFillState *)fill->state;
+	if (!state) {
+		printf("ERROR: Fill tool expecting state but got null!\n");
+		return false;
+	}
+
+	PixedDocument *document = pixed_editor_target();
+	PixedRect touched;
+	int x, y;
+
+	editor_canvas_position(mouse_e->x, mouse_e->y, &x, &y);
+	if (x < 0 || y < 0 || x >= document->width || y >= document->height)
+		return false;
+
+	pixed_editor_begin_operation();
+	trace_begin("fill");
+
+	if (mouse_e->mods & GLFW_MOD_SHIFT) {
+		pixed_document_replace_color(document, pixed_document_read_pixel(document, x, y), editor->color);
+		touched.width = document->width;
+		touched.height = document->height;
+	} else {
+		pixed_document_flood_fill(document, x, y, editor->color, &state->stack, &touched);
+	}
+
+	trace_end();
+	trace_count(TRACE_COUNTER_PIXELS, (uint64_t)touched.width * touched.height);
+	pixed_editor_end_operation();
+
+	return true;
+}
+
+bool
+tool_fill_destroy(Tool *fill)
+{
+	ToolFillState *state = (ToolFillState *)fill->state;
+	if (!state) {
+		printf("ERROR: Fill tool destroy failed because state is null!\n");
+		return false;
+	}
+
+	pixed_fill_stack_free(&state->stack);
+	pixed_pool_release(&editor->tool_states, state);
+	fill->state = 0;
+
+	glfwSetCursor(window, NULL);
+
+	return true;
+}
+
+bool
+tool_select_initialize(Tool *select)
+{
+	ToolSelectState *state = pixed_pool_alloc(&editor->tool_states);
+	if (!state) {
+		perror("ERROR: Select tool initialization failed");
+		return false;
+	}
+
+	memset(state, 0, sizeof(ToolSelectState));
+
+	GLFWcursor *cursor = glfwCreateStandardCursor(GLFW_CROSSHAIR_CURSOR);
+	glfwSetCursor(window, cursor);
+
+	select->state = state;
+	select->wants_destroy = false;
+
+	return true;
+}
+
+/*
+ * S or escape puts the tool away, enter anchors the floating pixels. Ctrl+A,
+ * C, X and V select all, copy, cut and paste, delete clears the selection
+ * and the arrow keys move it a pixel.
+ */
+bool
+tool_select_on_key_down(Tool *select, KeyboardEvent *key_e)
+{
+	PixedDocument *target = pixed_editor_target();
+	bool command = (key_e->mode & (GLFW_MOD_CONTROL | GLFW_MOD_SUPER)) != 0;
+
+	switch (key_e->key) {
+	case GLFW_KEY_S:
+	case GLFW_KEY_ESCAPE:
+		select->wants_destroy = true;
+		return true;
+
+	case GLFW_KEY_ENTER:
+	case GLFW_KEY_KP_ENTER:
+		pixed_editor_anchor();
+		return true;
+
+	case GLFW_KEY_DELETE:
+	case GLFW_KEY_BACKSPACE:
+		pixed_editor_delete_selection();
+		return true;
+
+	case GLFW_KEY_A:
+		if (!command)
+			return false;
+
+		pixed_editor_anchor();
+		pixed_editor_select(0, 0, target->width, target->height, 0, 0);
+		return true;
+
+	case GLFW_KEY_C:
+	case GLFW_KEY_X:
+		if (!command)
+			return false;
+
+		pixed_editor_copy();
+		if (key_e->key == GLFW_KEY_X)
+			pixed_editor_delete_selection();
+		return true;
+
+	case GLFW_KEY_V:
+		if (!command)
+			return false;
+
+		pixed_editor_paste();
+		return true;
+
+	default:
+		return tool_select_nudge(key_e->key);
+	}
+}
+
+bool
+tool_select_on_key_repeat(Tool *select, KeyboardEvent *key_e)
+{
+	return tool_select_nudge(key_e->key);
+}
+
+/* Lifts the selection and moves it a pixel in the direction of an arrow key */
+bool
+tool_select_nudge(int key)
+{
+	EditorSelection *selection = &editor->selection;
+	int dx = key == GLFW_KEY_LEFT ? -1 : key == GLFW_KEY_RIGHT ? 1 : 0;
+	int dy = key == GLFW_KEY_UP ? -1 : key == GLFW_KEY_DOWN ? 1 : 0;
+
+	if ((dx == 0 && dy == 0) || !pixed_editor_lift())
+		return false;
+
+	pixed_editor_move_floating(selection->x + dx, selection->y + dy);
+	return true;
+}
+
+/*
+ * Dragging inside the selection moves it, anywhere else selects a rectangle.
+ * With shift every pixel of the color under the cursor is selected.
+ */
+bool
+tool_select_on_mouse_down(Tool *select, MouseEvent *mouse_e)
+{
+	if (mouse_e->button != GLFW_MOUSE_BUTTON_LEFT)
+		return false;
+
+	ToolSelectState *state = (ToolSelectState *)select->state;
+	if (!state) {
+		printf("ERROR: Select tool expecting state but got null!\n");
+		return false;
+	}
+
+	EditorSelection *selection = &editor->selection;
+	PixedDocument *target = pixed_editor_target();
+	int x, y;
+
+	editor_canvas_position(mouse_e->x, mouse_e->y, &x, &y);
+
+	if (mouse_e->mods & GLFW_MOD_SHIFT) {
+		pixed_editor_anchor();
+		if (x >= 0 && y >= 0 && x < (int)target->width && y < (int)target->height)
+			pixed_editor_select_color(pixed_document_read_pixel(target, x, y));
+		return true;
+	}
+
+	bool inside = selection->floating ?
+		x >= selection->x && y >= selection->y &&
+		x < selection->x + (int)selection->floating->width && y < selection->y + (int)selection->floating->height :
+		x >= (int)selection->rect.x && y >= (int)selection->rect.y &&
+		x < (int)(selection->rect.x + selection->rect.width) && y < (int)(selection->rect.y + selection->rect.height);
+
+	if (inside && pixed_editor_lift()) {
+		state->grab_x = x - selection->x;
+		state->grab_y = y - selection->y;
+		state->moving = true;
+		return true;
+	}
+
+	pixed_editor_anchor();
+	pixed_editor_select(0, 0, 0, 0, 0, 0);
+
+	state->start_x = x;
+	state->start_y = y;
+	state->selecting = true;
+	return true;
+}
+
+bool
+tool_select_on_mouse_move(Tool *select, MouseEvent *mouse_e)
+{
+	ToolSelectState *state = (ToolSelectState *)select->state;
+	if (!state) {
+		printf("ERROR: Select tool expecting state but got null!\n");
+		return false;
+	}
+
+	int x, y;
+	editor_canvas_position(mouse_e->x, mouse_e->y, &x, &y);
+
+	if (state->moving) {
+		pixed_editor_move_floating(x - state->grab_x, y - state->grab_y);
+		return true;
+	}
+
+	if (!state->selecting)
+		return false;
+
+	// Both corners are selected
+	int x0 = x < state->start_x ? x : state->start_x, y0 = y < state->start_y ? y : state->start_y;
+	pixed_editor_select(x0, y0, abs(x - state->start_x) + 1, abs(y - state->start_y) + 1, 0, 0);
+	return true;
+}
+
+bool
+tool_select_on_mouse_up(Tool *select, MouseEvent *mouse_e)
+{
+	if (mouse_e->button != GLFW_MOUSE_BUTTON_LEFT)
+		return false;
+
+	ToolSelectState *state = (ToolSelectState *)select->state;
+	if (!state) {
+		printf("ERROR: Select tool expecting state but got null!\n");
+		return false;
+	}
+
+	state->selecting = false;
+	state->moving = false;
+	return true;
+}
+
+/* Floating pixels are anchored, the selection stays for the next time */
+bool
+tool_select_destroy(Tool *select)
+{
+	ToolSelectState *state = (ToolSelectState *)select->state;
+	if (!state) {
+		printf("ERROR: Select tool destroy failed because state is null!\n");
+		return false;
+	}
+
+	pixed_editor_anchor();
+
+	pixed_pool_release(&editor->tool_states, state);
+	select->state = 0;
+
+	glfwSetCursor(window, NULL);
+
+	return true;
+}
+
+/* Window coordinates to the canvas pixel under them, may be outside of the canvas */
+void
+editor_canvas_position(int x, int y, int *canvas_x, int *canvas_y)
+{
+	*canvas_x = (int)floorf((x - editor->pan_x) / editor->zoom);
+	*canvas_y = (int)floorf((y - editor->pan_y) / editor->zoom);
+}
+
+void
+graphics_init(int renderer)
+{
+	GraphicsContext *ctx = editor->graphics;
+	ctx->renderer = renderer;
+
+	if (renderer == RENDERER_TEXTURE) {
+		GLuint canvas_vert = glutil_shader_compile(shader_canvas_vert, GL_VERTEX_SHADER);
+		GLuint canvas_frag = glutil_shader_compile(shader_canvas_frag, GL_FRAGMENT_SHADER);
+
+		ctx->pixel_shader = glutil_shader_compile_prog2(canvas_vert, canvas_frag);
+	} else {
+		GLuint pixel_vert = glutil_shader_compile(shader_pixel_vert, GL_VERTEX_SHADER);
+		GLuint pixel_geom = glutil_shader_compile(shader_pixel_geom, GL_GEOMETRY_SHADER);
+		GLuint pixel_frag = glutil_shader_compile(shader_pixel_frag, GL_FRAGMENT_SHADER);
+
+		ctx->pixel_shader = glutil_shader_compile_prog3(pixel_vert, pixel_frag, pixel_geom);
+	}
+
+	glUseProgram(ctx->pixel_shader);
+	glutil_shader_uniform1f(ctx->pixel_shader, PIXEL_UNIFORM_ZOOM, editor->zoom);
+	glutil_shader_uniform2f(ctx->pixel_shader, PIXEL_UNIFORM_PAN, editor->pan_x, editor->pan_y);
+	glutil_shader_uniform2f(ctx->pixel_shader, PIXEL_UNIFORM_VIEWPORT, 800.0f, 800.0f);
+	glUseProgram(0);
 
-		case GLFW_RELEASE:
-			if (active_tool->on_key_up)
-				input_used = active_tool->on_key_up(active_tool, key_e);
-			break;
+	glGenVertexArrays(1, &ctx->document_vao);
 
-		case GLFW_REPEAT:
-			if (active_tool->on_key_repeat)
-				input_used = active_tool->on_key_repeat(active_tool, key_e);
-			break;
+	if (renderer == RENDERER_TEXTURE) {
+		/* The quad is generated from gl_VertexID, the vao stays empty */
+		glGenTextures(1, &ctx->document_texture);
+		glGenTextures(1, &ctx->palette_texture);
 
-		default:
-			break;
-		}
+		glUseProgram(ctx->pixel_shader);
+		glutil_shader_uniform1i(ctx->pixel_shader, CANVAS_UNIFORM_CANVAS, 0);
+		glutil_shader_uniform1i(ctx->pixel_shader, CANVAS_UNIFORM_PALETTE, 1);
+		glUseProgram(0);
+	} else {
+		glGenBuffers(1, &ctx->document_vbo);
 
-		if (!input_used && active_tool == &tool_lookup[TOOL_IDLE] && key_e->action == GLFW_PRESS) {
-			// Key presses in idle tool may activate other tools
-			switch (key_e->key) {
-			// Pan tool
-			case GLFW_KEY_SPACE:
-				new_tool = &tool_lookup[TOOL_PAN];
-				break;
+		glBindVertexArray(ctx->document_vao);
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, ctx->document_vbo);
 
-			default:
-				break;
-			}
+			glEnableVertexAttribArray(0);
 
-			if (new_tool) {
-				if (active_tool->destroy)
-					active_tool->destroy(active_tool);
-
-				if (new_tool->initialize) {
-					if (!new_tool->initialize(new_tool))
-						editor->active_tool = &tool_lookup[TOOL_IDLE];
-					else
-						editor->active_tool = new_tool;
-				} else {
-					editor->active_tool = new_tool;
-				}
-
-				if (editor->active_tool->on_mouse_move)
-					input_system->listen_mousemove = true;
-			}
+			/* Canvas words are r, g, b, a bytes, positions come from gl_VertexID */
+			glVertexAttribPointer(0, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(uint32_t), (GLvoid*)0);
 		}
-		
-		input_system_consume_keyboard_event();
+		glBindVertexArray(0);
 	}
 
-	if (new_tool == 0 && mouse_e != 0) {
-		switch (mouse_e->action) {
-		case MOUSE_MOVE:
-			if (active_tool->on_mouse_move) 
-				active_tool->on_mouse_move(active_tool, mouse_e);
-			break;
+	// HUD bars come from gl_VertexID and the frame times texture
+	GLuint hud_vert = glutil_shader_compile(shader_hud_vert, GL_VERTEX_SHADER);
+	GLuint hud_frag = glutil_shader_compile(shader_hud_frag, GL_FRAGMENT_SHADER);
 
-		case MOUSE_DOWN:
-			if (active_tool->on_mouse_down)
-				active_tool->on_mouse_down(active_tool, mouse_e);
-			break;
+	ctx->hud_shader = glutil_shader_compile_prog2(hud_vert, hud_frag);
+	glGenVertexArrays(1, &ctx->hud_vao);
+	glGenTextures(1, &ctx->hud_texture);
 
-		case MOUSE_UP:
-			if (active_tool->on_mouse_up)
-				active_tool->on_mouse_up(active_tool, mouse_e);
-			break;
+	glBindTexture(GL_TEXTURE_2D, ctx->hud_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, TRACE_FRAMES, 1, 0, GL_RG, GL_FLOAT, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
 
-		case MOUSE_SCROLL:
-		default:
-			break;
-		}
-		
-		input_system_consume_mouse_event();
-	}
+	glUseProgram(ctx->hud_shader);
+	glutil_shader_uniform1i(ctx->hud_shader, HUD_UNIFORM_FRAME_TIMES, 0);
+	glutil_shader_uniform2f(ctx->hud_shader, PIXEL_UNIFORM_VIEWPORT, 800.0f, 800.0f);
+	glUseProgram(0);
 
-	// Check if tool needs to be destroyed
-	if (new_tool == 0 && active_tool != &tool_lookup[TOOL_IDLE] && active_tool->wants_destroy) {
-		if (active_tool->destroy)
-			active_tool->destroy(active_tool);
+	glGenQueries(TIMER_FRAMES * TIMER_MAX, &ctx->timer_queries[0][0]);
+	memset(ctx->timer_starts, 0, sizeof(ctx->timer_starts));
+	memset(ctx->timer_frames, 0, sizeof(ctx->timer_frames));
 
-		editor->active_tool = &tool_lookup[TOOL_IDLE];
-		input_system->listen_mousemove = false;
-	}
+	graphics_upload_document();
 }
 
+/* Copies rect of a tiled or indexed document into buffer, in canvas order */
 void
-input_system_initialize()
+graphics_fill_pixels(uint32_t *buffer, PixedDocument *document, PixedRect *rect)
 {
-	input_system = malloc(sizeof(InputSystem));
+	uint32_t row = 0, col = 0;
 
-	input_system->listen_mousemove = false;
-	input_system->keyboard_buffer_head = 0;
-	input_system->keyboard_buffer_last = 0;
-	input_system->mouse_buffer_head = 0;
-	input_system->mouse_buffer_last = 0;
+	for (row = rect->y; row < rect->y + rect->height; row++) {
+		for (col = rect->x; col < rect->x + rect->width; col++)
+			*buffer++ = pixed_canvas_color(pixed_document_read_pixel(document, col, row));
+	}
 }
 
-inline
-KeyboardEvent *
-input_system_peek_keyboard_event(void)
+/* (Re)allocates the vbo or texture for the current document, contents undefined */
+void
+graphics_allocate_document()
 {
-	return input_system->keyboard_buffer_head;
-}
+	GraphicsContext *ctx = editor->graphics;
+	PixedDocument *document = editor->document;
 
-inline
-MouseEvent *
-input_system_peek_mouse_event(void)
-{
-	return input_system->mouse_buffer_head;
-}
+	glUseProgram(ctx->pixel_shader);
+	glutil_shader_uniform2f(ctx->pixel_shader, CANVAS_UNIFORM_SIZE, document->width, document->height);
+	glUseProgram(0);
 
-void
-input_system_push_keyboard_event(int key, int scancode, int action, int mode)
-{
-	KeyboardEvent *key_e = malloc(sizeof(KeyboardEvent));
-	if (!key_e) {
-		perror("ERROR: Allocating key event failed");
+	if (ctx->renderer == RENDERER_POINTS) {
+		glBindBuffer(GL_ARRAY_BUFFER, ctx->document_vbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(uint32_t) * document->width * document->height, 0, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
 		return;
 	}
 
-	key_e->key = key;
-	key_e->scancode = scancode;
-	key_e->action = action;
-	key_e->mode = mode;
-	key_e->next = 0;
-
-	if (input_system->keyboard_buffer_head == 0) {
-		input_system->keyboard_buffer_head = key_e;
-	} else {
-		input_system->keyboard_buffer_last->next = key_e;
-	}
+	int indexed = document->storage == PIXED_STORAGE_INDEXED;
 
-	input_system->keyboard_buffer_last = key_e;
-}
+	glBindTexture(GL_TEXTURE_2D, ctx->document_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, indexed ? GL_R8 : GL_RGBA8, document->width, document->height, 0,
+		indexed ? GL_RED : GL_RGBA, GL_UNSIGNED_BYTE, 0);
 
-void 
-input_system_push_mouse_event(MouseEventAction action, int x, int y, int button, int mods)
-{
-	MouseEvent *mouse_e = malloc(sizeof(MouseEvent));
-	if (!mouse_e) {
-		perror("ERROR: Allocating key event failed");
-		return;
+	if (indexed) {
+		glBindTexture(GL_TEXTURE_2D, ctx->palette_texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, PIXED_PALETTE_MAX, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
 	}
 
-	mouse_e->action = action;
-	mouse_e->x = x;
-	mouse_e->y = y;
-	mouse_e->button = button;
-	mouse_e->mods = mods;
-	mouse_e->next = 0;
+	glBindTexture(GL_TEXTURE_2D, 0);
 
-	if (input_system->mouse_buffer_head == 0)
-		input_system->mouse_buffer_head = mouse_e;
-	else
-		input_system->mouse_buffer_last->next = mouse_e;
-
-	input_system->mouse_buffer_last = mouse_e;
+	glUseProgram(ctx->pixel_shader);
+	glutil_shader_uniform1i(ctx->pixel_shader, CANVAS_UNIFORM_INDEXED, indexed);
+	glUseProgram(0);
 }
 
+/* The vbo is a copy of the canvas, flat documents are uploaded without staging */
 void
-input_system_consume_keyboard_event()
+graphics_upload_points(PixedRect *rect)
 {
-	KeyboardEvent **head = &input_system->keyboard_buffer_head;
-	KeyboardEvent **last = &input_system->keyboard_buffer_last;
+	GraphicsContext *ctx = editor->graphics;
+	PixedDocument *document = editor->document;
 
-	KeyboardEvent *current = *head;
+	const uint32_t *pixels = document->canvas + (size_t)rect->y * document->width + rect->x;
+	size_t stride = document->width;
 
-	if (current == 0) {
-		printf("WARNING: Trying to consume empty keyboard buffer!\n");
-		return;
+	if (document->storage != PIXED_STORAGE_FLAT) {
+		uint32_t *buffer = pixed_arena_alloc(&editor->frame_arena, sizeof(uint32_t) * rect->width * rect->height);
+		if (!buffer) {
+			pixed_document_mark_dirty(document, rect->x, rect->y, rect->width, rect->height);
+			return;
+		}
+
+		graphics_fill_pixels(buffer, document, rect);
+
+		pixels = buffer;
+		stride = rect->width;
 	}
 
-	if (current && current->next){
-		*head = current->next;
+	size_t vbo_offset = (size_t)rect->y * document->width + rect->x;
+	trace_count(TRACE_COUNTER_UPLOADED, sizeof(uint32_t) * rect->width * rect->height);
+
+	glBindBuffer(GL_ARRAY_BUFFER, ctx->document_vbo);
+
+	// Full width rows are contiguous in the vbo too
+	if (rect->width == document->width) {
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(uint32_t) * vbo_offset, sizeof(uint32_t) * rect->width * rect->height, pixels);
 	} else {
-		*head = 0;
-		*last = 0;
+		uint32_t row = 0;
+		for (; row < rect->height; row++) {
+			glBufferSubData(GL_ARRAY_BUFFER,
+				sizeof(uint32_t) * (vbo_offset + (size_t)row * document->width),
+				sizeof(uint32_t) * rect->width, pixels + row * stride);
+		}
 	}
 
-	free(current);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
+/*
+ * Flat canvases are already rgba bytes and indexed ones r8 indices, both are
+ * uploaded straight from the document. Tiled documents go through staging.
+ */
 void
-input_system_consume_mouse_event()
+graphics_upload_texture(PixedRect *rect)
 {
-	MouseEvent **head = &input_system->mouse_buffer_head;
-	MouseEvent **last = &input_system->mouse_buffer_last;
+	GraphicsContext *ctx = editor->graphics;
+	PixedDocument *document = editor->document;
 
-	MouseEvent *current = *head;
+	const void *pixels = 0;
+	GLint row_length = document->width;
+	GLenum format = GL_RGBA;
+	size_t element = sizeof(uint32_t);
+
+	if (document->storage == PIXED_STORAGE_FLAT) {
+		pixels = document->canvas + (size_t)rect->y * document->width + rect->x;
+	} else if (document->storage == PIXED_STORAGE_INDEXED) {
+		pixels = document->indices + (size_t)rect->y * document->width + rect->x;
+		format = GL_RED;
+		element = sizeof(uint8_t);
+
+		glBindTexture(GL_TEXTURE_2D, ctx->palette_texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, document->palette_length, 1, GL_RGBA, GL_UNSIGNED_BYTE, document->palette);
+		trace_count(TRACE_COUNTER_UPLOADED, sizeof(uint32_t) * document->palette_length);
+	} else {
+		uint32_t *buffer = pixed_arena_alloc(&editor->frame_arena, sizeof(uint32_t) * rect->width * rect->height);
+		if (!buffer) {
+			pixed_document_mark_dirty(document, rect->x, rect->y, rect->width, rect->height);
+			return;
+		}
 
-	if (current == 0) {
-		printf("WARNING: Trying to consume empty mouse buffer!\n");
-		return;
-	}
+		graphics_fill_pixels(buffer, document, rect);
 
-	if (current && current->next) {
-		*head = current->next;
-	} else {
-		*head = 0;
-		*last = 0;
+		pixels = buffer;
+		row_length = rect->width;
 	}
 
-	free(current);
+	glBindTexture(GL_TEXTURE_2D, ctx->document_texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, rect->x, rect->y, rect->width, rect->height, format, GL_UNSIGNED_BYTE, pixels);
+	trace_count(TRACE_COUNTER_UPLOADED, element * rect->width * rect->height);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+/*
+ * Uploads the pixels changed since the last frame. Only a resized document
+ * reallocates the vbo or texture, every other edit costs as much as its
+ * dirty rectangle.
+ */
 void
-input_system_destroy()
+graphics_upload_document()
 {
-	// Free keyboard buffer
-	KeyboardEvent *key_tmp = 0;
-	KeyboardEvent *key_e = input_system->keyboard_buffer_head;
-	
-	while (key_e != 0) {
-		key_tmp = key_e->next;
-		free(key_e);
-		key_e = key_tmp;
-	}
+	GraphicsContext *ctx = editor->graphics;
+	PixedDocument *document = editor->document;
+	PixedRect rect;
+
+	// Layers changed since the last frame are composited into the canvas first
+	trace_begin("composite");
+	pixed_document_composite(document);
+	trace_end();
 
-	input_system->keyboard_buffer_head = 0;
-	input_system->keyboard_buffer_last = 0;
+	if (document->width != ctx->upload_width || document->height != ctx->upload_height ||
+		(document->storage == PIXED_STORAGE_INDEXED) != (ctx->upload_storage == PIXED_STORAGE_INDEXED)) {
+		graphics_allocate_document();
 
-	// Free mouse buffer
-	MouseEvent *mouse_tmp = 0;
-	MouseEvent *mouse_e = input_system->mouse_buffer_head;
+		ctx->upload_width = document->width;
+		ctx->upload_height = document->height;
+		ctx->upload_storage = document->storage;
 
-	while (mouse_e != 0) {
-		mouse_tmp = mouse_e->next;
-		free(mouse_e);
-		mouse_e = mouse_tmp;
+		pixed_document_mark_dirty(document, 0, 0, document->width, document->height);
 	}
 
-	input_system->mouse_buffer_head = 0;
-	input_system->mouse_buffer_last = 0;
+	if (!pixed_document_take_dirty(document, &rect))
+		return;
+
+	trace_begin("upload");
+	graphics_timer_begin(TIMER_UPLOAD);
+
+	if (ctx->renderer == RENDERER_TEXTURE)
+		graphics_upload_texture(&rect);
+	else
+		graphics_upload_points(&rect);
+
+	graphics_timer_end();
+	trace_end();
 }
 
-bool
-tool_pan_initialize(Tool *pan)
+void
+graphics_render()
 {
-	ToolPanState *state = malloc(sizeof(ToolPanState));
-	if (!state) {
-		perror("ERROR: Pan tool initialization failed");
-		return false;
-	}
+	GraphicsContext *ctx = editor->graphics;
 
-	GLFWcursor *cursor = glfwCreateStandardCursor(GLFW_HAND_CURSOR);
-	glfwSetCursor(window, cursor);
+	trace_begin("render");
+	graphics_timer_begin(TIMER_RENDER);
 
-	state->start_x = 0;
-	state->start_y = 0;
-	state->editor_start_x = editor->pan_x;
-	state->editor_start_y = editor->pan_y;
-	state->mouse_dragging = false;
+	glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	pan->state = state;
-	pan->wants_destroy = false;
+	glUseProgram(ctx->pixel_shader);
+	glBindVertexArray(ctx->document_vao);
 
-	return true;
+	if (ctx->renderer == RENDERER_TEXTURE) {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, ctx->document_texture);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, ctx->palette_texture);
+		glActiveTexture(GL_TEXTURE0);
+
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	} else {
+		glDrawArrays(GL_POINTS, 0, editor->document->width * editor->document->height);
+	}
+
+	glBindVertexArray(0);
+	glUseProgram(0);
+
+	if (ctx->hud)
+		graphics_render_hud();
+
+	graphics_timer_end();
+	trace_end();
 }
 
-bool
-tool_pan_on_key_up(Tool *pan, KeyboardEvent *key_e)
+/* Bars of the last TRACE_FRAMES frame times in the bottom left corner, gpu time at their foot */
+void
+graphics_render_hud()
 {
-	if (key_e->key == GLFW_KEY_SPACE) {
-		pan->wants_destroy = true;
-		return true;
-	}
+	GraphicsContext *ctx = editor->graphics;
 
-	return false;
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, ctx->hud_texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TRACE_FRAMES, 1, GL_RG, GL_FLOAT, trace_system->frame_times);
+
+	glUseProgram(ctx->hud_shader);
+	glutil_shader_uniform1i(ctx->hud_shader, HUD_UNIFORM_NEWEST, (trace_system->frame - 1) & (TRACE_FRAMES - 1));
+
+	glDisable(GL_DEPTH_TEST);
+	glBindVertexArray(ctx->hud_vao);
+	glDrawArrays(GL_TRIANGLES, 0, TRACE_FRAMES * 6);
+	glBindVertexArray(0);
+	glEnable(GL_DEPTH_TEST);
+
+	glUseProgram(0);
+	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
-bool
-tool_pan_on_mouse_down(Tool *pan, MouseEvent *mouse_e)
+/* Times the GL commands until graphics_timer_end, one timer runs at a time */
+void
+graphics_timer_begin(int timer)
 {
-	/* Pan tool only checks for left mouse button */
-	if (mouse_e->button != GLFW_MOUSE_BUTTON_LEFT)
-		return false;
+	GraphicsContext *ctx = editor->graphics;
+	uint32_t slot = trace_system->frame % TIMER_FRAMES;
+	int i = 0;
 
-	ToolPanState *state = (ToolPanState *)pan->state;
-	if (!state) {
-		printf("ERROR: Pan tool expecting state but got null!\n");
-		return false;
+	// The GPU is TIMER_FRAMES behind, wait for the results the slot still holds
+	if (ctx->timer_frames[slot] != trace_system->frame) {
+		for (; i < TIMER_MAX; i++)
+			graphics_collect_timer(slot, i, true);
+
+		ctx->timer_frames[slot] = trace_system->frame;
 	}
 
-	state->start_x = mouse_e->x;
-	state->start_y = mouse_e->y;
-	state->editor_start_x = editor->pan_x;
-	state->editor_start_y = editor->pan_y;
-	state->mouse_dragging = true;
+	ctx->timer_starts[slot][timer] = input_system_now();
+	glBeginQuery(GL_TIME_ELAPSED, ctx->timer_queries[slot][timer]);
+}
 
-	return true;
+void
+graphics_timer_end()
+{
+	glEndQuery(GL_TIME_ELAPSED);
 }
 
-bool
-tool_pan_on_mouse_move(Tool *pan, MouseEvent *mouse_e)
+/* Hands the result of a pending timer query to the trace, waits for it with wait */
+void
+graphics_collect_timer(uint32_t slot, int timer, bool wait)
 {
-	ToolPanState *state = (ToolPanState *)pan->state;
-	if (!state) {
-		printf("ERROR: Pan tool expecting state but got null!\n");
-		return false;
-	}
+	static const char *names[TIMER_MAX] = { "gpu upload", "gpu render" };
+	GraphicsContext *ctx = editor->graphics;
 
-	/* If mouse button is not down do nothing */
-	if (state->mouse_dragging == false)
-		return false;
+	if (ctx->timer_starts[slot][timer] == 0)
+		return;
 
-	float pan_x, pan_y;
-	pan_x = state->editor_start_x + (mouse_e->x - state->start_x);
-	pan_y = state->editor_start_y + (mouse_e->y - state->start_y);
+	GLuint query = ctx->timer_queries[slot][timer];
+	GLuint available = GL_TRUE;
+	GLuint64 elapsed = 0;
 
-	editor->pan_x = pan_x;
-	editor->pan_y = pan_y;
+	if (!wait)
+		glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
 
-	glUseProgram(editor->graphics->pixel_shader);
-	glutil_shader_uniform2f(editor->graphics->pixel_shader, PIXEL_UNIFORM_PAN, pan_x, pan_y);
-	glUseProgram(0);
+	if (!available)
+		return;
 
-	return true;
+	glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+	trace_gpu(names[timer], ctx->timer_frames[slot], ctx->timer_starts[slot][timer], elapsed / 1e9);
+	ctx->timer_starts[slot][timer] = 0;
 }
 
-bool
-tool_pan_on_mouse_up(Tool *pan, MouseEvent *mouse_e)
+/* Collects every finished timer query without waiting */
+void
+graphics_collect_timers()
 {
-	if (mouse_e->button != GLFW_MOUSE_BUTTON_LEFT)
-		return false;
+	uint32_t slot = 0;
+	int timer = 0;
 
-	ToolPanState *state = (ToolPanState *)pan->state;
-	if (!state) {
-		printf("ERROR: Pan tool expecting state but got null!\n");
-		return false;
+	for (; slot < TIMER_FRAMES; slot++) {
+		for (timer = 0; timer < TIMER_MAX; timer++)
+			graphics_collect_timer(slot, timer, false);
 	}
-
-	state->mouse_dragging = false;
-	return true;
 }
 
+int
+graphics_compare_samples(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
 
-bool
-tool_pan_destroy(Tool *pan)
+/* Prints median and p99 of samples in seconds, appending them to save as pixed_bench does */
+void
+graphics_benchmark_report(const char *name, double *samples, int count, const char *save)
 {
-	ToolPanState *state = (ToolPanState *)pan->state;
-	if (!state) {
-		printf("ERROR: Pan tool destroy failed because state is null!\n");
-		return false;
-	}
+	PixedDocument *document = editor->document;
 
-	free(state);
-	pan->state = 0;
+	qsort(samples, count, sizeof(double), graphics_compare_samples);
 
-	glfwSetCursor(window, NULL);
+	double median = count & 1 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+	double p99 = samples[(count * 99 + 99) / 100 - 1];
 
-	return true;
+	printf("%s %ux%u: median %.3f ms p99 %.3f ms min %.3f ms over %d runs\n",
+		name, document->width, document->height, median * 1000.0, p99 * 1000.0, samples[0] * 1000.0, count);
+
+	if (!save)
+		return;
+
+	FILE *file = fopen(save, "a");
+	if (!file) {
+		fprintf(stderr, "Failed to open %s!\n", save);
+		return;
+	}
+
+	// Sizes are square in the suite, the width names them
+	fprintf(file, "{\"bench\":\"%s\",\"size\":%u,\"samples\":%d,\"median_ms\":%.6f,\"p99_ms\":%.6f,\"min_ms\":%.6f}\n",
+		name, document->width, count, median * 1000.0, p99 * 1000.0, samples[0] * 1000.0);
+	fclose(file);
 }
 
+/*
+ * Times building the vbo or texture from scratch EDITOR_BENCH_BUILDS times,
+ * then frames one by one, each synchronised with glFinish
+ */
 void
-graphics_init()
+graphics_benchmark(int frames, const char *save)
 {
-	GLuint pixel_vert = glutil_shader_compile(shader_pixel_vert, GL_VERTEX_SHADER);
-	GLuint pixel_geom = glutil_shader_compile(shader_pixel_geom, GL_GEOMETRY_SHADER);
-	GLuint pixel_frag = glutil_shader_compile(shader_pixel_frag, GL_FRAGMENT_SHADER);
-
 	GraphicsContext *ctx = editor->graphics;
-	PixedDocument *document = editor->document;
+	bool texture = ctx->renderer == RENDERER_TEXTURE;
 
-	ctx->pixel_shader = glutil_shader_compile_prog3(pixel_vert, pixel_frag, pixel_geom);
+	double *samples = malloc(sizeof(double) * (frames > EDITOR_BENCH_BUILDS ? frames : EDITOR_BENCH_BUILDS));
+	if (!samples) {
+		fprintf(stderr, "Failed to allocate benchmark samples!\n");
+		return;
+	}
 
-	glUseProgram(ctx->pixel_shader);
-	glutil_shader_uniform1f(ctx->pixel_shader, PIXEL_UNIFORM_ZOOM, editor->zoom);
-	glutil_shader_uniform2f(ctx->pixel_shader, PIXEL_UNIFORM_PAN, editor->pan_x, editor->pan_y);
-	glutil_shader_uniform2f(ctx->pixel_shader, PIXEL_UNIFORM_VIEWPORT, 800.0f, 800.0f);
-	glUseProgram(0);
+	int i = 0;
+	for (; i < EDITOR_BENCH_BUILDS; i++) {
+		double start = glfwGetTime();
 
-	glGenVertexArrays(1, &ctx->document_vao);
-	glGenBuffers(1, &ctx->document_vbo);
+		// Forgetting the uploaded size reallocates and fills it all again
+		ctx->upload_width = 0;
+		graphics_upload_document();
+		glFinish();
 
-	glBindVertexArray(ctx->document_vao);
-	{
-		/* TODO: Make this dynamic allocation to keep it in graphics context */
-		size_t buffer_len = (document->width * document->height) * FLOAT_PER_PIXEL_VERTEX;
-		GLfloat *buffer = malloc(sizeof(GLfloat) * buffer_len);
-
-		uint32_t pixel_color = 0;
-		int row = 0, col = 0, offset = 0;
-		for (row = 0; row < document->height; row++) {
-			for (col = 0; col < document->width; col++) {
-				offset = ((row * document->width) + col) * 6;
-
-				/* Position data */
-				buffer[offset + 0] = (float)col;
-				buffer[offset + 1] = (float)row;
-
-				/* Color data */
-				pixel_color = pixed_document_get_pixel(document, col, row);
-				float red = ((float)pixed_color_r(pixel_color) / 255.0f);
-				float green = ((float)pixed_color_g(pixel_color) / 255.0f);
-				float blue = ((float)pixed_color_b(pixel_color) / 255.0f);
-				float alpha = ((float)pixed_color_a(pixel_color) / 255.0f);
-
-				buffer[offset + 2] = red;
-				buffer[offset + 3] = green;
-				buffer[offset + 4] = blue;
-				buffer[offset + 5] = alpha;
-			}
-		}
+		samples[i] = glfwGetTime() - start;
+		pixed_editor_frame_presented();
+	}
 
-		glBindBuffer(GL_ARRAY_BUFFER, ctx->document_vbo);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * buffer_len, buffer, GL_STATIC_DRAW);
+	graphics_benchmark_report(texture ? "texture_build" : "vbo_build", samples, EDITOR_BENCH_BUILDS, save);
 
-		glEnableVertexAttribArray(0);
-		glEnableVertexAttribArray(1);
+	for (i = 0; i < frames; i++) {
+		double start = glfwGetTime();
 
-		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(sizeof(GLfloat) * 2));
+		graphics_render();
+		glfwSwapBuffers(window);
+		glFinish();
 
-		free(buffer);
+		samples[i] = glfwGetTime() - start;
+		pixed_editor_frame_presented();
 	}
-	glBindVertexArray(0);
-}
-
-void
-graphics_render()
-{
-	glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	glUseProgram(editor->graphics->pixel_shader);
-	glBindVertexArray(editor->graphics->document_vao);
-	glDrawArrays(GL_POINTS, 0, editor->document->width *editor->document->height);
-	glBindVertexArray(0);
-	glUseProgram(0);
+	graphics_benchmark_report(texture ? "frame_texture" : "frame_points", samples, frames, save);
+	free(samples);
 }
 
 void          
@@ -640,6 +2250,29 @@ graphics_center_document()
 	glUseProgram(0);
 }
 
+/* Outlines the floating pixels, or the selection while nothing floats. Only the texture renderer draws it */
+void
+graphics_update_selection()
+{
+	GraphicsContext *ctx = editor->graphics;
+	EditorSelection *selection = &editor->selection;
+
+	if (ctx->renderer != RENDERER_TEXTURE)
+		return;
+
+	glUseProgram(ctx->pixel_shader);
+
+	if (selection->floating) {
+		glutil_shader_uniform4f(ctx->pixel_shader, CANVAS_UNIFORM_SELECTION, selection->x, selection->y,
+			selection->floating->width, selection->floating->height);
+	} else {
+		glutil_shader_uniform4f(ctx->pixel_shader, CANVAS_UNIFORM_SELECTION, selection->rect.x, selection->rect.y,
+			selection->rect.width, selection->rect.height);
+	}
+
+	glUseProgram(0);
+}
+
 GLFWwindow *
 window_create(int width, int height)
 {
@@ -654,7 +2287,7 @@ window_create(int width, int height)
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
 
-	window = glfwCreateWindow(width, height, "Snake", NULL, NULL);
+	window = glfwCreateWindow(width, height, "Pixed", NULL, NULL);
 	if (window == NULL)
 	{
 		fprintf(stderr, "Failed to create GLFW window!\n");
@@ -735,32 +2368,121 @@ window_mouse_btn_cb(GLFWwindow *window, int button, int action, int mods)
 
 int main(int argvc, char **argv)
 {
+	int renderer = RENDERER_TEXTURE;
+	int bench_frames = 0;
+	const char *bench_save = 0;
+	uint32_t new_width = 0, new_height = 0;
+	bool report_latency = false;
+	const char *file_name = 0;
+	const char *trace_file = 0;
+
+	int i = 1;
+	for (; i < argvc; i++) {
+		if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argvc) {
+			i++;
+			if (strcmp(argv[i], "points") == 0) {
+				renderer = RENDERER_POINTS;
+			} else if (strcmp(argv[i], "texture") == 0) {
+				renderer = RENDERER_TEXTURE;
+			} else {
+				fprintf(stderr, "Unknown renderer %s, expected points or texture\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if (strcmp(argv[i], "--latency") == 0) {
+			report_latency = true;
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argvc) {
+			trace_file = argv[++i];
+		} else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argvc) {
+			bench_frames = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--bench-save") == 0 && i + 1 < argvc) {
+			bench_save = argv[++i];
+		} else if (strcmp(argv[i], "--new") == 0 && i + 1 < argvc) {
+			if (sscanf(argv[++i], "%ux%u", &new_width, &new_height) != 2 || new_width == 0 || new_height == 0) {
+				fprintf(stderr, "Unknown size %s, expected WIDTHxHEIGHT\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if (argv[i][0] != '-' && !file_name) {
+			file_name = argv[i];
+		} else {
+			fprintf(stderr, "usage: %s [--renderer points|texture] [--bench frames] [--bench-save results.json] [--new WxH] [--latency] [--trace file.json] [file.pixd]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
 	window = window_create(800, 800);
 
 	input_system_initialize();
+	trace_system_initialize();
 
 	editor = pixed_editor_new();
+	editor->report_latency = report_latency;
+	if (trace_file)
+		editor->trace_file = trace_file;
+
+	PixedDocument *document = 0;
+	PixedAnimation *animation = 0;
+	if (file_name) {
+		document = pixed_document_map_file(file_name);
+		if (!document)
+			animation = pixed_animation_read_file(file_name);
+
+		if (!document && !animation) {
+			fprintf(stderr, "Failed to open %s!\n", file_name);
+			glfwTerminate();
+			return EXIT_FAILURE;
+		}
+	} else if (new_width > 0) {
+		document = pixed_document_new("Untitled", new_width, new_height);
+		if (!document) {
+			fprintf(stderr, "Failed to create a %ux%u document!\n", new_width, new_height);
+			glfwTerminate();
+			return EXIT_FAILURE;
+		}
+	} else {
+		document = pixed_document_new("Untitled", 16, 16);
+		pixed_document_set_pixel(document, 0, 0, 0xff0000ff);
+	}
 
-	PixedDocument *document = pixed_document_new("Untitled", 16, 16);
-	pixed_editor_set_document(document);
-
-	pixed_document_set_pixel(editor->document, 0, 0, 0xff0000ff);
+	if (animation)
+		pixed_editor_set_animation(animation);
+	else
+		pixed_editor_set_document(document);
 
-	graphics_init();
+	graphics_init(renderer);
 	graphics_center_document();
 
+	if (bench_frames > 0) {
+		graphics_benchmark(bench_frames, bench_save);
+		glfwSetWindowShouldClose(window, GL_TRUE);
+	}
+
 	while(!glfwWindowShouldClose(window))
 	{
+		trace_begin("poll events");
 		glfwPollEvents();
+		trace_end();
 
+		trace_begin("dispatch");
 		pixed_editor_dispatch_tool();
+		trace_end();
+
+		graphics_upload_document();
 		graphics_render();
 
+		trace_begin("swap");
 		glfwSwapBuffers(window);
+		trace_end();
+
+		pixed_editor_frame_presented();
 	}
 
+	// --trace keeps the last frames of every session
+	if (trace_file)
+		pixed_editor_write_trace();
+
 	pixed_editor_free();
 	input_system_destroy();
+	trace_system_destroy();
 
 	glfwTerminate();
 	return 0;
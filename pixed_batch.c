@@ -0,0 +1,518 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "libpixed.h"
+
+/*
+ * Headless conversion of many files at once, links nothing but libpixed so
+ * it runs on build machines without a display or GPU. Every worker thread
+ * takes the next file, loads it, crops, scales and recolors it, and writes
+ * it out in the requested format.
+ */
+#define BATCH_MAX_RECOLORS 64
+
+typedef enum {
+	BATCH_PIXD,
+	BATCH_PNG,
+	BATCH_PPM
+} BatchFormat;
+
+typedef struct {
+	uint32_t from, to;
+} BatchRecolor;
+
+typedef struct {
+	BatchFormat      format;
+	int              compress;   // compressed PiXd, ignored by other formats
+	const char      *output_dir; // 0 writes next to the input
+	int              crop;
+	uint32_t         crop_x, crop_y, crop_width, crop_height;
+	uint32_t         scale_width, scale_height;
+	uint32_t         scale_factor; // used when scale_width is 0
+	PixedScaleFilter filter;
+	BatchRecolor     recolors[BATCH_MAX_RECOLORS];
+	uint32_t         recolors_length;
+	int              levels;
+	PixedColorLut    lut;
+	int              hsl;
+	float            hue, saturation, lightness;
+	uint32_t         palette[PIXED_PALETTE_MAX];
+	uint32_t         palette_length; // 0 keeps the colors
+	uint32_t         quantize;       // colors to reduce to, 0 keeps them
+	PixedQuantizeMethod method;
+	PixedDither      dither;
+} BatchOptions;
+
+typedef struct {
+	char          **files;
+	size_t          files_length;
+	BatchOptions   *options;
+
+	pthread_mutex_t lock;      // guards everything below
+	size_t          next;      // next file a worker takes
+	size_t          converted;
+	size_t          failed;
+	uint64_t        bytes_read;
+	uint64_t        bytes_written;
+} Batch;
+
+double         batch_now(void);
+PixedDocument *batch_load(const char *);
+char          *batch_output_path(BatchOptions *, const char *);
+int            batch_convert(BatchOptions *, const char *, uint64_t *, uint64_t *);
+void          *batch_worker(void *);
+int            batch_add_file(Batch *, size_t *, const char *);
+int            batch_parse_options(BatchOptions *, int, char **, int *);
+void           batch_usage(const char *);
+
+/*
+ * Function implementations
+ */
+double
+batch_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/* Picks the reader by the magic at the start of the file */
+PixedDocument *
+batch_load(const char *file_name)
+{
+	unsigned char magic[8];
+	FILE *file = fopen(file_name, "rb");
+	if (!file)
+		return 0;
+
+	size_t length = fread(magic, 1, sizeof(magic), file);
+	fclose(file);
+
+	if (length >= 4 && memcmp(magic, "PiXd", 4) == 0)
+		return pixed_document_map_file(file_name);
+
+	if (length == 8 && memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0)
+		return pixed_document_read_png(file_name);
+
+	if (length >= 2 && magic[0] == 'P' && (magic[1] == '6' || magic[1] == '7'))
+		return pixed_document_read_ppm(file_name);
+
+	return 0;
+}
+
+/* Input base name with the extension of the output format, in output_dir if given */
+char *
+batch_output_path(BatchOptions *options, const char *input)
+{
+	static const char *extensions[] = { ".pixd", ".png", ".ppm" };
+
+	const char *base = strrchr(input, '/');
+	base = base ? base + 1 : input;
+
+	const char *dot = strrchr(base, '.');
+	size_t base_length = dot && dot != base ? (size_t)(dot - base) : strlen(base);
+
+	const char *dir = options->output_dir;
+	size_t dir_length = dir ? strlen(dir) : (size_t)(base - input);
+
+	char *path = malloc(dir_length + base_length + 8);
+	if (!path)
+		return 0;
+
+	memcpy(path, dir ? dir : input, dir_length);
+	if (dir && dir_length > 0 && dir[dir_length - 1] != '/')
+		path[dir_length++] = '/';
+
+	memcpy(path + dir_length, base, base_length);
+	strcpy(path + dir_length + base_length, extensions[options->format]);
+	return path;
+}
+
+int
+batch_convert(BatchOptions *options, const char *input, uint64_t *bytes_read, uint64_t *bytes_written)
+{
+	struct stat input_stat, output_stat;
+	if (stat(input, &input_stat) != 0) {
+		fprintf(stderr, "%s: can't be read\n", input);
+		return -1;
+	}
+
+	char *output = batch_output_path(options, input);
+	if (!output)
+		return -1;
+
+	// Mapped inputs are read while the output is written, they can't be the same file
+	if (stat(output, &output_stat) == 0 && output_stat.st_dev == input_stat.st_dev &&
+		output_stat.st_ino == input_stat.st_ino) {
+		fprintf(stderr, "%s: output would overwrite the input\n", input);
+		free(output);
+		return -1;
+	}
+
+	PixedDocument *document = batch_load(input);
+	if (!document) {
+		fprintf(stderr, "%s: not a PiXd, PNG or PPM image\n", input);
+		free(output);
+		return -1;
+	}
+
+	int result = 0;
+	if (options->crop && pixed_document_crop(document, options->crop_x, options->crop_y,
+		options->crop_width, options->crop_height) != 0)
+		result = -1;
+
+	if (result == 0 && (options->scale_width > 0 || options->scale_factor > 1)) {
+		uint64_t width = options->scale_width, height = options->scale_height;
+		if (width == 0) {
+			width = (uint64_t)document->width * options->scale_factor;
+			height = (uint64_t)document->height * options->scale_factor;
+		}
+
+		if (width > INT32_MAX || height > INT32_MAX ||
+			pixed_document_scale(document, (int)width, (int)height, options->filter) != 0)
+			result = -1;
+	}
+
+	uint32_t i = 0;
+	for (; result == 0 && i < options->recolors_length; i++)
+		result = pixed_document_replace_color(document, options->recolors[i].from, options->recolors[i].to);
+
+	if (result == 0 && options->levels)
+		result = pixed_document_apply_lut(document, 0, &options->lut);
+
+	if (result == 0 && options->hsl)
+		result = pixed_document_adjust_hsl(document, 0, options->hue, options->saturation, options->lightness);
+
+	if (result == 0 && options->palette_length > 0)
+		result = pixed_document_map_palette(document, 0, options->palette, options->palette_length, options->dither != PIXED_DITHER_NONE);
+
+	if (result == 0 && options->quantize > 0)
+		result = pixed_document_quantize(document, 0, options->method, options->quantize, options->dither);
+
+	if (result == 0) {
+		switch (options->format) {
+		case BATCH_PIXD:
+			result = options->compress ? pixed_document_write_file_compressed(document, output) :
+				pixed_document_write_file(document, output);
+			break;
+
+		case BATCH_PNG:
+			result = pixed_document_write_png(document, output);
+			break;
+
+		case BATCH_PPM:
+			result = pixed_document_write_ppm(document, output);
+			break;
+		}
+	}
+
+	if (result != 0) {
+		fprintf(stderr, "%s: converting to %s failed\n", input, output);
+	} else if (stat(output, &output_stat) == 0) {
+		*bytes_read += input_stat.st_size;
+		*bytes_written += output_stat.st_size;
+	}
+
+	pixed_document_free(document);
+	free(output);
+	return result;
+}
+
+void *
+batch_worker(void *arg)
+{
+	Batch *batch = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		size_t index = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (index >= batch->files_length)
+			break;
+
+		uint64_t bytes_read = 0, bytes_written = 0;
+		int result = batch_convert(batch->options, batch->files[index], &bytes_read, &bytes_written);
+
+		pthread_mutex_lock(&batch->lock);
+		if (result == 0)
+			batch->converted++;
+		else
+			batch->failed++;
+
+		batch->bytes_read += bytes_read;
+		batch->bytes_written += bytes_written;
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	return 0;
+}
+
+int
+batch_add_file(Batch *batch, size_t *capacity, const char *file_name)
+{
+	if (batch->files_length == *capacity) {
+		size_t grown = *capacity ? *capacity * 2 : 256;
+		char **files = realloc(batch->files, sizeof(char *) * grown);
+		if (!files)
+			return -1;
+
+		batch->files = files;
+		*capacity = grown;
+	}
+
+	batch->files[batch->files_length] = malloc(strlen(file_name) + 1);
+	if (!batch->files[batch->files_length])
+		return -1;
+
+	strcpy(batch->files[batch->files_length++], file_name);
+	return 0;
+}
+
+/* Parses options up to the first file name, *first is set to its index */
+int
+batch_parse_options(BatchOptions *options, int argc, char **argv, int *first)
+{
+	int i = 1;
+	for (; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : 0;
+
+		if (arg[0] != '-' || strcmp(arg, "-") == 0)
+			break;
+
+		if (strcmp(arg, "--compress") == 0 || strcmp(arg, "-z") == 0) {
+			options->compress = 1;
+			continue;
+		}
+
+		if (strcmp(arg, "--dither") == 0) {
+			options->dither = PIXED_DITHER_ORDERED;
+			continue;
+		}
+
+		if (strcmp(arg, "--diffuse") == 0) {
+			options->dither = PIXED_DITHER_FLOYD_STEINBERG;
+			continue;
+		}
+
+		if (!value)
+			return -1;
+
+		if (strcmp(arg, "--format") == 0 || strcmp(arg, "-f") == 0) {
+			if (strcmp(value, "pixd") == 0)
+				options->format = BATCH_PIXD;
+			else if (strcmp(value, "png") == 0)
+				options->format = BATCH_PNG;
+			else if (strcmp(value, "ppm") == 0)
+				options->format = BATCH_PPM;
+			else
+				return -1;
+		} else if (strcmp(arg, "--output") == 0 || strcmp(arg, "-o") == 0) {
+			options->output_dir = value;
+		} else if (strcmp(arg, "--jobs") == 0 || strcmp(arg, "-j") == 0) {
+			pixed_set_thread_count(atoi(value));
+		} else if (strcmp(arg, "--crop") == 0) {
+			options->crop = 1;
+			if (sscanf(value, "%u,%u,%ux%u", &options->crop_x, &options->crop_y,
+				&options->crop_width, &options->crop_height) != 4)
+				return -1;
+		} else if (strcmp(arg, "--scale") == 0) {
+			char suffix = 0;
+
+			// WxH scales to a size, Nx by an integer factor
+			if (sscanf(value, "%ux%u", &options->scale_width, &options->scale_height) == 2) {
+				if (options->scale_width == 0 || options->scale_height == 0)
+					return -1;
+			} else if (sscanf(value, "%u%c", &options->scale_factor, &suffix) == 2 && suffix == 'x') {
+				options->scale_width = 0;
+				if (options->scale_factor == 0)
+					return -1;
+			} else {
+				return -1;
+			}
+		} else if (strcmp(arg, "--filter") == 0) {
+			if (strcmp(value, "nearest") == 0)
+				options->filter = PIXED_SCALE_NEAREST;
+			else if (strcmp(value, "box") == 0)
+				options->filter = PIXED_SCALE_BOX;
+			else if (strcmp(value, "bilinear") == 0)
+				options->filter = PIXED_SCALE_BILINEAR;
+			else
+				return -1;
+		} else if (strcmp(arg, "--recolor") == 0) {
+			BatchRecolor *recolor = &options->recolors[options->recolors_length];
+			char *end = 0;
+
+			// RRGGBBAA=RRGGBBAA, applied in the order given
+			if (options->recolors_length == BATCH_MAX_RECOLORS)
+				return -1;
+
+			recolor->from = (uint32_t)strtoul(value, &end, 16);
+			if (*end != '=')
+				return -1;
+
+			recolor->to = (uint32_t)strtoul(end + 1, &end, 16);
+			if (*end != 0)
+				return -1;
+
+			options->recolors_length++;
+		} else if (strcmp(arg, "--levels") == 0) {
+			unsigned black = 0, white = 0;
+			float gamma = 1.0f;
+
+			if (sscanf(value, "%u,%u,%f", &black, &white, &gamma) < 2 || black >= white || white > 255 || gamma <= 0)
+				return -1;
+
+			options->levels = 1;
+			pixed_color_lut_levels(&options->lut, (uint8_t)black, (uint8_t)white, gamma);
+		} else if (strcmp(arg, "--hsl") == 0) {
+			options->hsl = 1;
+			if (sscanf(value, "%f,%f,%f", &options->hue, &options->saturation, &options->lightness) != 3)
+				return -1;
+		} else if (strcmp(arg, "--palette") == 0) {
+			const char *color = value;
+			char *end = 0;
+
+			// RRGGBBAA,RRGGBBAA,...
+			for (options->palette_length = 0; *color; color = *end ? end + 1 : end) {
+				if (options->palette_length == PIXED_PALETTE_MAX)
+					return -1;
+
+				options->palette[options->palette_length++] = (uint32_t)strtoul(color, &end, 16);
+				if (end == color || (*end != ',' && *end != 0))
+					return -1;
+			}
+		} else if (strcmp(arg, "--quantize") == 0) {
+			char method[16] = "";
+
+			if (sscanf(value, "%u,%15s", &options->quantize, method) < 1 || options->quantize == 0 ||
+				options->quantize > PIXED_PALETTE_MAX)
+				return -1;
+
+			if (strcmp(method, "kmeans") == 0)
+				options->method = PIXED_QUANTIZE_KMEANS;
+			else if (method[0] != 0 && strcmp(method, "median") != 0)
+				return -1;
+		} else {
+			return -1;
+		}
+
+		i++;
+	}
+
+	*first = i;
+	return 0;
+}
+
+void
+batch_usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s -f pixd|png|ppm [options] file... | -\n"
+		"  -o, --output DIR        write into DIR instead of next to the input\n"
+		"  -j, --jobs N            worker threads, one per core by default\n"
+		"  -z, --compress          write compressed PiXd files\n"
+		"      --crop X,Y,WxH      keep the WxH pixels at X,Y\n"
+		"      --scale WxH|Nx      scale to a size or by an integer factor\n"
+		"      --filter nearest|box|bilinear\n"
+		"      --recolor RRGGBBAA=RRGGBBAA\n"
+		"      --levels B,W[,G]    black and white points and gamma of r, g and b\n"
+		"      --hsl H,S,L         rotate hue by H degrees, add -1 to 1 to the others\n"
+		"      --palette RRGGBBAA,...\n"
+		"      --quantize N[,median|kmeans]\n"
+		"                          reduce to the N colors picked by median cut or k-means\n"
+		"      --dither            ordered dither to the --palette or --quantize colors\n"
+		"      --diffuse           Floyd-Steinberg dither to the --quantize colors\n"
+		"  -                       read file names from stdin, one per line\n",
+		name);
+}
+
+int
+main(int argc, char **argv)
+{
+	BatchOptions options;
+	memset(&options, 0, sizeof(BatchOptions));
+	options.format = (BatchFormat)-1;
+	options.filter = PIXED_SCALE_NEAREST;
+
+	int first = 0;
+	if (batch_parse_options(&options, argc, argv, &first) != 0 || first >= argc || options.format == (BatchFormat)-1) {
+		batch_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	Batch batch;
+	memset(&batch, 0, sizeof(Batch));
+	batch.options = &options;
+
+	size_t capacity = 0;
+	int i = first;
+	for (; i < argc; i++) {
+		if (strcmp(argv[i], "-") != 0) {
+			if (batch_add_file(&batch, &capacity, argv[i]) != 0)
+				return EXIT_FAILURE;
+
+			continue;
+		}
+
+		char line[4096];
+		while (fgets(line, sizeof(line), stdin)) {
+			line[strcspn(line, "\r\n")] = 0;
+			if (line[0] && batch_add_file(&batch, &capacity, line) != 0)
+				return EXIT_FAILURE;
+		}
+	}
+
+	// Files are spread over the workers, each file is converted on one thread
+	size_t workers = pixed_thread_count();
+	if (workers > batch.files_length)
+		workers = batch.files_length > 0 ? batch.files_length : 1;
+
+	if (workers > 1)
+		pixed_set_thread_count(1);
+
+	pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+	if (!threads || pthread_mutex_init(&batch.lock, 0) != 0)
+		return EXIT_FAILURE;
+
+	double start = batch_now();
+	size_t started = 0, w = 0;
+
+	for (; started < workers; started++) {
+		if (started > 0 && pthread_create(&threads[started], 0, batch_worker, &batch) != 0)
+			break;
+	}
+
+	// The main thread is the first worker
+	batch_worker(&batch);
+	for (w = 1; w < started; w++)
+		pthread_join(threads[w], 0);
+
+	double seconds = batch_now() - start;
+	if (seconds <= 0)
+		seconds = 1e-9;
+
+	printf("%zu files converted, %zu failed in %.3f s with %zu threads | %.1f files/s | "
+		"read %.1f MB/s, written %.1f MB/s\n",
+		batch.converted, batch.failed, seconds, started, batch.converted / seconds,
+		batch.bytes_read / seconds / 1e6, batch.bytes_written / seconds / 1e6);
+
+	pthread_mutex_destroy(&batch.lock);
+	free(threads);
+
+	size_t f = 0;
+	for (; f < batch.files_length; f++)
+		free(batch.files[f]);
+
+	free(batch.files);
+	return batch.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,2547 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "libpixed.h"
+#include "pixed_input.h"
+#include "pixed_trace.h"
+
+#define BENCH_REPEAT 5
+
+/* Suite harness, every case is run untimed BENCH_WARMUP times first */
+#define BENCH_WARMUP      2
+#define BENCH_SAMPLES     15   // timed runs, fewer once BENCH_BUDGET seconds went into them
+#define BENCH_MIN_SAMPLES 3
+#define BENCH_MAX_SAMPLES 1000
+#define BENCH_BUDGET      5.0
+#define BENCH_REGRESSION  1.10 // median over the baseline one by this factor fails compare
+
+/* Mouse events queued between two frames */
+#define BENCH_INPUT_BURST 64
+
+/* Scratch allocations of one frame, up to 4 KiB each */
+#define BENCH_ARENA_ALLOCS 1024
+
+typedef PixedDocument *(*BenchLoader)(const char *);
+
+/* One timed run of a suite case */
+typedef void (*BenchCase)(void *);
+
+typedef struct {
+	int         warmup;
+	int         samples;
+	int         json;    // results as JSON lines on stdout
+	const char *save;    // file the JSON lines are appended to, 0 for none
+} BenchHarness;
+
+typedef struct {
+	char   name[64];
+	uint32_t size;
+	double median, p99; // milliseconds
+} BenchResult;
+
+typedef struct {
+	uint32_t       size;
+	PixedDocument *document;
+	char          *path;
+	uint32_t       runs;
+	volatile uint64_t sink;
+} BenchSuite;
+
+double bench_now(void);
+char  *bench_temp_path(const char *, uint32_t);
+double bench_load_once(BenchLoader, const char *, double *);
+void   bench_load(uint32_t);
+void   bench_write(uint32_t);
+PixedDocument *bench_document(uint32_t, uint32_t);
+int    bench_check_nearest(uint32_t, uint32_t, uint32_t, uint32_t);
+void   bench_scale(uint32_t);
+void   bench_compress(uint32_t);
+void   bench_input(uint32_t);
+int    bench_check_line(PixedStorage, int, int, int, int, uint32_t);
+void   bench_brush(uint32_t);
+int    bench_check_fill(PixedStorage, uint32_t);
+void   bench_fill(uint32_t);
+int    bench_check_history(PixedStorage, size_t);
+void   bench_history(uint32_t);
+uint32_t bench_blend_reference(PixedDocument *, uint32_t, uint32_t);
+int    bench_check_layers(uint32_t);
+void   bench_layers(uint32_t);
+int    bench_check_frames(void);
+void   bench_frames(uint32_t);
+void   bench_png(uint32_t);
+void   bench_arena(uint32_t);
+void   bench_trace(uint32_t);
+int    bench_filter_apply(PixedDocument *, int, const PixedRect *);
+int    bench_check_filter(PixedStorage, int);
+void   bench_filter(uint32_t);
+int    bench_check_colors(PixedStorage);
+void   bench_colors(uint32_t);
+PixedDocument *bench_photo(uint32_t, uint32_t);
+int    bench_check_quantize(PixedStorage, PixedQuantizeMethod);
+void   bench_quantize(uint32_t);
+uint32_t bench_over_reference(uint32_t, uint32_t);
+int    bench_check_blit(PixedStorage, int);
+double bench_blit_time(PixedDocument *, int, int, PixedDocument *, const PixedRect *, PixedBlitMode);
+void   bench_blit(uint32_t);
+void  *bench_input_producer(void *);
+int    bench_compare_samples(const void *, const void *);
+void   bench_case(const char *, uint32_t, BenchCase, void *);
+void   bench_suite_new_free(void *);
+void   bench_suite_write_file(void *);
+void   bench_suite_read_file(void *);
+void   bench_suite_get_pixel(void *);
+void   bench_suite_set_pixel(void *);
+void   bench_suite_write_pixel(void *);
+void   bench_suite_resize(void *);
+void   bench_suite_input(void *);
+void   bench_suite(uint32_t);
+int    bench_read_results(const char *, BenchResult **, size_t *);
+int    bench_compare(const char *, const char *);
+
+/* The linked list event queue the ring buffers replaced, as a baseline */
+typedef struct _bench_list_event {
+	MouseEvent                event;
+	struct _bench_list_event *next;
+} BenchListEvent;
+
+typedef struct {
+	const char *name;
+	void      (*run)(uint32_t);
+} Bench;
+
+static uint32_t default_sizes[] = { 4096, 16384, 32768 };
+
+static BenchHarness harness = { BENCH_WARMUP, BENCH_SAMPLES, 0, 0 };
+
+static Bench benches[] = {
+	{ "load", bench_load },
+	{ "write", bench_write },
+	{ "scale", bench_scale },
+	{ "compress", bench_compress },
+	{ "input", bench_input },
+	{ "brush", bench_brush },
+	{ "fill", bench_fill },
+	{ "history", bench_history },
+	{ "layers", bench_layers },
+	{ "frames", bench_frames },
+	{ "png", bench_png },
+	{ "arena", bench_arena },
+	{ "trace", bench_trace },
+	{ "filter", bench_filter },
+	{ "colors", bench_colors },
+	{ "quantize", bench_quantize },
+	{ "blit", bench_blit },
+	{ "suite", bench_suite }
+};
+
+/*
+ * Function implementations
+ */
+double
+bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+char *
+bench_temp_path(const char *prefix, uint32_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	if (!dir)
+		dir = "/tmp";
+
+	size_t len = strlen(dir) + strlen(prefix) + 32;
+	char *path = malloc(len);
+	if (!path)
+		return 0;
+
+	snprintf(path, len, "%s/%s-%u.pixd", dir, prefix, size);
+	return path;
+}
+
+/* Returns time to open, touch_time receives time to open and read every pixel */
+double
+bench_load_once(BenchLoader loader, const char *path, double *touch_time)
+{
+	double start = bench_now();
+	PixedDocument *document = loader(path);
+	double opened = bench_now();
+
+	if (!document) {
+		fprintf(stderr, "ERROR: Loading %s failed\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	volatile uint32_t sum = 0;
+	size_t i = 0, pixels_length = (size_t)document->width * document->height;
+	for (; i < pixels_length; i += 1024)
+		sum += document->canvas[i];
+
+	*touch_time = bench_now() - start;
+
+	pixed_document_free(document);
+	return opened - start;
+}
+
+void
+bench_load(uint32_t size)
+{
+	char *path = bench_temp_path("pixed-bench-load", size);
+	if (!path)
+		return;
+
+	PixedDocument *document = pixed_document_new("bench", size, size);
+	if (!document) {
+		fprintf(stderr, "ERROR: Allocating %ux%u document failed\n", size, size);
+		free(path);
+		return;
+	}
+
+	uint32_t x = 0;
+	for (x = 0; x < size; x++)
+		pixed_document_set_pixel(document, x, x, 0xff0000ff);
+
+	if (pixed_document_write_file(document, path) != 0) {
+		fprintf(stderr, "ERROR: Writing %s failed\n", path);
+		pixed_document_free(document);
+		free(path);
+		return;
+	}
+	pixed_document_free(document);
+
+	double read_open = 0, read_touch = 0, map_open = 0, map_touch = 0, touch = 0;
+	int i = 0;
+	for (; i < BENCH_REPEAT; i++) {
+		read_open += bench_load_once(pixed_document_read_file, path, &touch);
+		read_touch += touch;
+		map_open += bench_load_once(pixed_document_map_file, path, &touch);
+		map_touch += touch;
+	}
+
+	printf("load %5ux%-5u read_file open %9.3f ms touch %9.3f ms | map_file open %9.3f ms touch %9.3f ms\n",
+		size, size,
+		read_open * 1000 / BENCH_REPEAT, read_touch * 1000 / BENCH_REPEAT,
+		map_open * 1000 / BENCH_REPEAT, map_touch * 1000 / BENCH_REPEAT);
+
+	remove(path);
+	free(path);
+}
+
+void
+bench_write(uint32_t size)
+{
+	char *path = bench_temp_path("pixed-bench-write", size);
+	if (!path)
+		return;
+
+	PixedDocument *document = pixed_document_new("bench", size, size);
+	if (!document) {
+		fprintf(stderr, "ERROR: Allocating %ux%u document failed\n", size, size);
+		free(path);
+		return;
+	}
+
+	// Touch the whole canvas so page faults don't count as write time
+	size_t i = 0, pixels_length = (size_t)size * size;
+	for (; i < pixels_length; i++)
+		document->canvas[i] = (uint32_t)i;
+
+	double elapsed = 0;
+	int n = 0;
+	for (; n < BENCH_REPEAT; n++) {
+		double start = bench_now();
+		if (pixed_document_write_file(document, path) != 0) {
+			fprintf(stderr, "ERROR: Writing %s failed\n", path);
+			break;
+		}
+		elapsed += bench_now() - start;
+		remove(path);
+	}
+
+	double bytes = (double)pixels_length * sizeof(uint32_t) + PIXED_HEADER_SIZE;
+	printf("write %5ux%-5u %9.3f ms %9.1f MB/s\n", size, size,
+		elapsed * 1000 / BENCH_REPEAT, (bytes * BENCH_REPEAT) / (elapsed * 1024 * 1024));
+
+	pixed_document_free(document);
+	free(path);
+}
+
+/* Document filled with 8x8 blocks of pseudo random colors, like pixel art */
+PixedDocument *
+bench_document(uint32_t width, uint32_t height)
+{
+	PixedDocument *document = pixed_document_new("bench", width, height);
+	if (!document) {
+		fprintf(stderr, "ERROR: Allocating %ux%u document failed\n", width, height);
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t x = 0, y = 0;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			uint32_t block = ((y / 8) * 7919) ^ ((x / 8) * 104729);
+			pixed_document_set_pixel(document, x, y, (block * 2654435761u) | 0x80);
+		}
+	}
+
+	return document;
+}
+
+/* Compares nearest neighbour output against pixel center sampling */
+int
+bench_check_nearest(uint32_t width, uint32_t height, uint32_t scaled_width, uint32_t scaled_height)
+{
+	PixedDocument *source = bench_document(width, height);
+	PixedDocument *scaled = bench_document(width, height);
+	uint32_t x = 0, y = 0;
+
+	pixed_document_scale(scaled, scaled_width, scaled_height, PIXED_SCALE_NEAREST);
+
+	for (y = 0; y < scaled_height; y++) {
+		for (x = 0; x < scaled_width; x++) {
+			uint32_t src_x = (uint32_t)(((2 * (uint64_t)x + 1) * width) / (2 * (uint64_t)scaled_width));
+			uint32_t src_y = (uint32_t)(((2 * (uint64_t)y + 1) * height) / (2 * (uint64_t)scaled_height));
+
+			// Integer upscales must replicate every pixel exactly
+			if (scaled_width % width == 0 && src_x != x / (scaled_width / width))
+				return -1;
+
+			if (pixed_document_get_pixel(scaled, x, y) != pixed_document_get_pixel(source, src_x, src_y))
+				return -1;
+		}
+	}
+
+	pixed_document_free(source);
+	pixed_document_free(scaled);
+	return 0;
+}
+
+void
+bench_scale(uint32_t size)
+{
+	if (bench_check_nearest(37, 23, 111, 69) != 0 ||
+		bench_check_nearest(64, 64, 32, 32) != 0 ||
+		bench_check_nearest(300, 200, 1000, 123) != 0) {
+		fprintf(stderr, "ERROR: Nearest neighbour scale is not exact\n");
+		exit(EXIT_FAILURE);
+	}
+
+	const char *names[] = { "nearest 1/2", "nearest 2x", "box 256", "bilinear 1/2", "resize 1/2" };
+	int op = 0;
+
+	for (; op < 5; op++) {
+		// Doubling a 16K canvas needs 4 GB for the result alone
+		if (op == 1 && size > 8192)
+			continue;
+
+		double elapsed = 0;
+		int n = 0;
+		for (; n < BENCH_REPEAT; n++) {
+			PixedDocument *document = bench_document(size, size);
+			double start = bench_now();
+
+			switch (op) {
+			case 0: pixed_document_scale(document, size / 2, size / 2, PIXED_SCALE_NEAREST); break;
+			case 1: pixed_document_scale(document, size * 2, size * 2, PIXED_SCALE_NEAREST); break;
+			case 2: pixed_document_scale(document, 256, 256, PIXED_SCALE_BOX); break;
+			case 3: pixed_document_scale(document, size / 2, size / 2, PIXED_SCALE_BILINEAR); break;
+			case 4: pixed_document_resize(document, size / 2, size / 2, PIXED_ANCHOR_CENTER); break;
+			}
+
+			elapsed += bench_now() - start;
+			pixed_document_free(document);
+		}
+
+		printf("scale %5ux%-5u %-12s %9.3f ms\n", size, size, names[op], elapsed * 1000 / BENCH_REPEAT);
+	}
+}
+
+void
+bench_compress(uint32_t size)
+{
+	char *raw_path = bench_temp_path("pixed-bench-raw", size);
+	char *compressed_path = bench_temp_path("pixed-bench-compressed", size);
+	if (!raw_path || !compressed_path)
+		exit(EXIT_FAILURE);
+
+	PixedDocument *document = bench_document(size, size);
+	double write_raw = 0, write_compressed = 0, read_raw = 0, read_compressed = 0, read_region = 0;
+	int n = 0;
+
+	for (; n < BENCH_REPEAT; n++) {
+		double start = bench_now();
+		pixed_document_write_file(document, raw_path);
+		write_raw += bench_now() - start;
+
+		start = bench_now();
+		if (pixed_document_write_file_compressed(document, compressed_path) != 0) {
+			fprintf(stderr, "ERROR: Writing %s failed\n", compressed_path);
+			exit(EXIT_FAILURE);
+		}
+		write_compressed += bench_now() - start;
+
+		start = bench_now();
+		PixedDocument *loaded = pixed_document_read_file(raw_path);
+		read_raw += bench_now() - start;
+		pixed_document_free(loaded);
+
+		start = bench_now();
+		loaded = pixed_document_read_file(compressed_path);
+		read_compressed += bench_now() - start;
+
+		if (!loaded || memcmp(loaded->canvas, document->canvas, sizeof(uint32_t) * (size_t)size * size) != 0) {
+			fprintf(stderr, "ERROR: Compressed round trip of %ux%u differs\n", size, size);
+			exit(EXIT_FAILURE);
+		}
+		pixed_document_free(loaded);
+
+		start = bench_now();
+		loaded = pixed_document_read_region(compressed_path, size / 2, 64);
+		read_region += bench_now() - start;
+		pixed_document_free(loaded);
+	}
+
+	struct stat raw_stat, compressed_stat;
+	stat(raw_path, &raw_stat);
+	stat(compressed_path, &compressed_stat);
+
+	printf("compress %5ux%-5u raw %10lld B compressed %10lld B (%.1fx)\n", size, size,
+		(long long)raw_stat.st_size, (long long)compressed_stat.st_size,
+		(double)raw_stat.st_size / compressed_stat.st_size);
+	printf("compress %5ux%-5u write raw %9.3f ms compressed %9.3f ms | read raw %9.3f ms compressed %9.3f ms region %9.3f ms\n",
+		size, size,
+		write_raw * 1000 / BENCH_REPEAT, write_compressed * 1000 / BENCH_REPEAT,
+		read_raw * 1000 / BENCH_REPEAT, read_compressed * 1000 / BENCH_REPEAT,
+		read_region * 1000 / BENCH_REPEAT);
+
+	remove(raw_path);
+	remove(compressed_path);
+	pixed_document_free(document);
+	free(raw_path);
+	free(compressed_path);
+}
+
+void *
+bench_input_producer(void *arg)
+{
+	uint64_t i = 0, events = *(uint64_t *)arg;
+
+	for (; i < events; i++)
+		input_system_push_mouse_event(MOUSE_MOVE, (int)i, 0, -1, -1);
+
+	// Ends the stream, retried until there is room behind the pending move
+	while (input_system_push_mouse_event(MOUSE_UP, (int)events, 0, 0, 0) != 0)
+		;
+
+	return 0;
+}
+
+/* Push and consume throughput of size * 1024 timestamped mouse events */
+void
+bench_input(uint32_t size)
+{
+	uint64_t events = (uint64_t)size * 1024, i = 0, j = 0;
+	BenchListEvent *head = 0, *last = 0;
+	volatile int sum = 0;
+
+	double start = bench_now();
+	for (i = 0; i < events; i += BENCH_INPUT_BURST) {
+		for (j = 0; j < BENCH_INPUT_BURST; j++) {
+			BenchListEvent *e = malloc(sizeof(BenchListEvent));
+			if (!e)
+				exit(EXIT_FAILURE);
+
+			e->event.action = MOUSE_MOVE;
+			e->event.x = (int)(i + j);
+			e->event.y = 0;
+			e->event.button = -1;
+			e->event.mods = -1;
+			e->event.time = input_system_now();
+			e->next = 0;
+
+			if (head == 0)
+				head = e;
+			else
+				last->next = e;
+
+			last = e;
+		}
+
+		while (head) {
+			BenchListEvent *e = head;
+			sum += e->event.x;
+
+			head = e->next;
+			if (!head)
+				last = 0;
+
+			free(e);
+		}
+	}
+	double list_time = bench_now() - start;
+
+	input_system_initialize();
+
+	start = bench_now();
+	for (i = 0; i < events; i += BENCH_INPUT_BURST) {
+		for (j = 0; j < BENCH_INPUT_BURST; j++)
+			input_system_push_mouse_event(MOUSE_MOVE, (int)(i + j), 0, -1, -1);
+
+		MouseEvent *e = 0;
+		while ((e = input_system_peek_mouse_event()) != 0) {
+			sum += e->x;
+			input_system_consume_mouse_event();
+		}
+	}
+	double ring_time = bench_now() - start;
+
+	// Producer thread against a consumer, moves must arrive in order
+	pthread_t producer;
+	uint64_t received = 0;
+	int last_x = -1;
+
+	start = bench_now();
+	if (pthread_create(&producer, 0, bench_input_producer, &events) != 0)
+		exit(EXIT_FAILURE);
+
+	for (;;) {
+		MouseEvent *e = input_system_peek_mouse_event();
+		if (!e)
+			continue;
+
+		if (e->x <= last_x) {
+			fprintf(stderr, "ERROR: Input events out of order, %d after %d\n", e->x, last_x);
+			exit(EXIT_FAILURE);
+		}
+
+		last_x = e->x;
+		received++;
+
+		MouseEventAction action = e->action;
+		input_system_consume_mouse_event();
+
+		if (action == MOUSE_UP)
+			break;
+	}
+
+	pthread_join(producer, 0);
+	double threaded_time = bench_now() - start;
+
+	if (last_x != (int)events) {
+		fprintf(stderr, "ERROR: Input stream lost its last event\n");
+		exit(EXIT_FAILURE);
+	}
+
+	input_system_destroy();
+
+	printf("input %9llu events list %8.1f M/s ring %8.1f M/s | threaded %8.1f M/s, %llu coalesced\n",
+		(unsigned long long)events, events / list_time / 1e6, events / ring_time / 1e6,
+		events / threaded_time / 1e6, (unsigned long long)(events + 1 - received));
+}
+
+/* Compares a stroke against stamping the brush at every Bresenham point */
+int
+bench_check_line(PixedStorage storage, int x0, int y0, int x1, int y1, uint32_t size)
+{
+	PixedDocument *stroke = pixed_document_new("stroke", 97, 61);
+	PixedDocument *stamped = pixed_document_new("stamped", 97, 61);
+	uint32_t color = 0x336699ff;
+	PixedRect touched;
+	int result = 0;
+
+	pixed_document_set_storage(stroke, storage);
+	pixed_document_draw_line(stroke, x0, y0, x1, y1, size, color, &touched);
+
+	int dx = abs(x1 - x0), dy = -abs(y1 - y0), error = dx + dy, x = x0, y = y0;
+	int64_t min_x = INT32_MAX, min_y = INT32_MAX, max_x = INT32_MIN, max_y = INT32_MIN;
+
+	for (;;) {
+		int i = 0, j = 0;
+		for (j = y - (int)(size - 1) / 2; j <= y + (int)size / 2; j++) {
+			for (i = x - (int)(size - 1) / 2; i <= x + (int)size / 2; i++) {
+				if (i < 0 || j < 0 || i >= 97 || j >= 61)
+					continue;
+
+				pixed_document_set_pixel(stamped, i, j, color);
+				min_x = i < min_x ? i : min_x;
+				min_y = j < min_y ? j : min_y;
+				max_x = i > max_x ? i : max_x;
+				max_y = j > max_y ? j : max_y;
+			}
+		}
+
+		if (x == x1 && y == y1)
+			break;
+
+		int error2 = 2 * error;
+		if (error2 >= dy) { error += dy; x += x1 > x0 ? 1 : -1; }
+		if (error2 <= dx) { error += dx; y += y1 > y0 ? 1 : -1; }
+	}
+
+	uint32_t x_ = 0, y_ = 0;
+	for (y_ = 0; y_ < 61; y_++) {
+		for (x_ = 0; x_ < 97; x_++) {
+			if (pixed_document_read_pixel(stroke, x_, y_) != pixed_document_get_pixel(stamped, x_, y_))
+				result = -1;
+		}
+	}
+
+	if (min_x > max_x ? touched.width != 0 :
+		touched.x != min_x || touched.y != min_y ||
+		touched.width != max_x - min_x + 1 || touched.height != max_y - min_y + 1)
+		result = -1;
+
+	pixed_document_free(stroke);
+	pixed_document_free(stamped);
+	return result;
+}
+
+/* A 1000 sample stroke, what one second of a 1000 Hz tablet delivers */
+void
+bench_brush(uint32_t size)
+{
+	int lines[][5] = {
+		{ 3, 4, 80, 50, 1 }, { 80, 50, 3, 4, 3 }, { -10, 30, 120, 31, 8 }, { 50, -20, 52, 90, 5 },
+		{ 10, 10, 10, 10, 4 }, { 90, 5, 5, 55, 2 }, { -50, -50, -10, -10, 6 }, { 0, 60, 96, 0, 16 }
+	};
+	int i = 0;
+	PixedStorage storage = PIXED_STORAGE_FLAT;
+
+	for (; storage <= PIXED_STORAGE_INDEXED; storage++) {
+		for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+			if (bench_check_line(storage, lines[i][0], lines[i][1], lines[i][2], lines[i][3], lines[i][4]) != 0) {
+				fprintf(stderr, "ERROR: Stroke %d on storage %d differs from stamping the brush\n", i, storage);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	uint32_t brushes[] = { 1, 8, 64 };
+	int b = 0;
+
+	for (; b < 3; b++) {
+		PixedDocument *document = pixed_document_new("bench", size, size);
+		if (!document) {
+			fprintf(stderr, "ERROR: Allocating %ux%u document failed\n", size, size);
+			exit(EXIT_FAILURE);
+		}
+
+		// Quick strokes move a few dozen pixels between samples
+		int x = size / 2, y = size / 2;
+		uint32_t seed = 12345;
+		double max = 0, total = 0;
+		PixedRect touched;
+
+		for (i = 0; i < 1000; i++) {
+			seed = seed * 1103515245 + 12345;
+			int next_x = x + (int)((seed >> 8) % 65) - 32;
+			int next_y = y + (int)((seed >> 20) % 65) - 32;
+
+			double start = bench_now();
+			pixed_document_draw_line(document, x, y, next_x, next_y, brushes[b], 0xff0000ff, &touched);
+			double elapsed = bench_now() - start;
+
+			total += elapsed;
+			max = elapsed > max ? elapsed : max;
+			x = next_x;
+			y = next_y;
+		}
+
+		printf("brush %5ux%-5u size %2u %9.3f us per sample, max %9.3f us\n",
+			size, size, brushes[b], total * 1e6 / 1000, max * 1e6);
+
+		pixed_document_free(document);
+	}
+}
+
+/* Compares flood fill against a breadth first fill on a maze of random walls */
+int
+bench_check_fill(PixedStorage storage, uint32_t seed)
+{
+	uint32_t width = 97, height = 61, x = 0, y = 0, i = 0;
+	PixedDocument *filled = pixed_document_new("filled", width, height);
+	PixedDocument *expected = pixed_document_new("expected", width, height);
+	uint32_t *queue = malloc(sizeof(uint32_t) * width * height);
+	int result = 0;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			seed = seed * 1103515245 + 12345;
+			uint32_t color = (seed >> 16) % 3 == 0 ? 0x202020ff : 0xffffffff;
+
+			pixed_document_set_pixel(filled, x, y, color);
+			pixed_document_set_pixel(expected, x, y, color);
+		}
+	}
+
+	uint32_t start_x = width / 2, start_y = height / 2, length = 0;
+	uint32_t target = pixed_document_get_pixel(expected, start_x, start_y), color = 0x00ff00ff;
+
+	queue[length++] = start_y * width + start_x;
+	pixed_document_set_pixel(expected, start_x, start_y, color);
+
+	for (i = 0; i < length; i++) {
+		int dx[] = { -1, 1, 0, 0 }, dy[] = { 0, 0, -1, 1 }, d = 0;
+
+		for (d = 0; d < 4; d++) {
+			int nx = (int)(queue[i] % width) + dx[d], ny = (int)(queue[i] / width) + dy[d];
+
+			if (nx < 0 || ny < 0 || nx >= width || ny >= height || pixed_document_get_pixel(expected, nx, ny) != target)
+				continue;
+
+			pixed_document_set_pixel(expected, nx, ny, color);
+			queue[length++] = ny * width + nx;
+		}
+	}
+
+	PixedFillStack stack = { 0, 0, 0 };
+	PixedRect touched;
+
+	pixed_document_set_storage(filled, storage);
+	if (pixed_document_flood_fill(filled, start_x, start_y, color, &stack, &touched) != 0)
+		result = -1;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			if (pixed_document_read_pixel(filled, x, y) != pixed_document_get_pixel(expected, x, y))
+				result = -1;
+		}
+	}
+
+	// Global replace must agree with replacing pixel by pixel
+	pixed_document_replace_color(filled, 0x202020ff, 0x0000ffff);
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			uint32_t pixel = pixed_document_get_pixel(expected, x, y);
+			if (pixed_document_read_pixel(filled, x, y) != (pixel == 0x202020ff ? 0x0000ffff : pixel))
+				result = -1;
+		}
+	}
+
+	pixed_fill_stack_free(&stack);
+	pixed_document_free(filled);
+	pixed_document_free(expected);
+	free(queue);
+	return result;
+}
+
+void
+bench_fill(uint32_t size)
+{
+	PixedStorage storage = PIXED_STORAGE_FLAT;
+	uint32_t seed = 1;
+
+	for (; storage <= PIXED_STORAGE_INDEXED; storage++) {
+		for (seed = 1; seed < 20; seed++) {
+			if (bench_check_fill(storage, seed) != 0) {
+				fprintf(stderr, "ERROR: Flood fill %u on storage %d differs from breadth first fill\n", seed, storage);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	PixedDocument *document = pixed_document_new("bench", size, size);
+	if (!document) {
+		fprintf(stderr, "ERROR: Allocating %ux%u document failed\n", size, size);
+		exit(EXIT_FAILURE);
+	}
+
+	// Single color region covering the whole canvas
+	size_t i = 0, pixels_length = (size_t)size * size;
+	for (; i < pixels_length; i++)
+		document->canvas[i] = pixed_canvas_color(0xffffffff);
+
+	PixedFillStack stack = { 0, 0, 0 };
+	PixedRect touched;
+	double fill = 0, replace = 0;
+	int n = 0;
+
+	for (; n < BENCH_REPEAT; n++) {
+		double start = bench_now();
+		pixed_document_flood_fill(document, size / 2, size / 2, 0x00ff00ff, &stack, &touched);
+		fill += bench_now() - start;
+
+		start = bench_now();
+		pixed_document_replace_color(document, 0x00ff00ff, 0xffffffff);
+		replace += bench_now() - start;
+	}
+
+	printf("fill %5ux%-5u flood %9.3f ms (%7.1f Mpx/s) | replace %9.3f ms (%7.1f Mpx/s), stack %zu seeds\n",
+		size, size,
+		fill * 1000 / BENCH_REPEAT, pixels_length * BENCH_REPEAT / fill / 1e6,
+		replace * 1000 / BENCH_REPEAT, pixels_length * BENCH_REPEAT / replace / 1e6,
+		stack.capacity);
+
+	pixed_fill_stack_free(&stack);
+	pixed_document_free(document);
+}
+
+#define BENCH_HISTORY_STEPS 24
+
+/*
+ * Runs strokes, fills and replaces, then walks the history back and forth
+ * comparing every step against a copy of the pixels taken after each one.
+ * A budget smaller than any operation keeps only the newest one.
+ */
+int
+bench_check_history(PixedStorage storage, size_t budget)
+{
+	uint32_t width = 150, height = 97, x = 0, y = 0, seed = 7;
+	size_t pixels_length = (size_t)width * height;
+	uint32_t *states = malloc(sizeof(uint32_t) * pixels_length * (BENCH_HISTORY_STEPS + 1));
+	PixedDocument *document = pixed_document_new("history", width, height);
+	PixedFillStack stack = { 0, 0, 0 };
+	PixedRect touched;
+	int result = 0, step = 0;
+
+	pixed_document_set_storage(document, storage);
+	PixedHistory *history = pixed_history_new(document, budget);
+
+	for (step = 0; step <= BENCH_HISTORY_STEPS; step++) {
+		if (step > 0) {
+			seed = seed * 1103515245 + 12345;
+			uint32_t color = pixed_color_rgba((seed >> 8) % 4 * 60, (seed >> 12) % 4 * 60, 0x80, 0xff);
+			int x0 = (seed >> 4) % width, y0 = (seed >> 16) % height;
+
+			// Fills and replaces that change nothing don't make an operation
+			if (pixed_document_read_pixel(document, x0, y0) == color)
+				color ^= 0x00000100;
+
+			pixed_history_begin(history);
+			if (step % 6 == 0)
+				pixed_document_replace_color(document, pixed_document_read_pixel(document, x0, y0), color);
+			else if (step % 3 == 0)
+				pixed_document_flood_fill(document, x0, y0, color, &stack, &touched);
+			else
+				pixed_document_draw_line(document, x0, y0, (int)((seed >> 20) % width), (int)((seed >> 24) % height), step % 9 + 1, color, &touched);
+			pixed_history_end(history);
+
+			if (step == BENCH_HISTORY_STEPS / 2)
+				pixed_history_mark_saved(history);
+		}
+
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++)
+				states[step * pixels_length + y * width + x] = pixed_document_read_pixel(document, x, y);
+		}
+	}
+
+	// Back to the oldest kept state and forward again
+	int undone = 0;
+	for (step = BENCH_HISTORY_STEPS; step > 0 && pixed_history_undo(history) == 0; step--, undone++) {
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				if (pixed_document_read_pixel(document, x, y) != states[(step - 1) * pixels_length + y * width + x])
+					result = -1;
+			}
+		}
+
+		if (pixed_history_modified(history) != (step - 1 != BENCH_HISTORY_STEPS / 2))
+			result = -1;
+	}
+
+	if (undone != (budget == SIZE_MAX ? BENCH_HISTORY_STEPS : 1))
+		result = -1;
+
+	for (; step < BENCH_HISTORY_STEPS && pixed_history_redo(history) == 0; step++) {
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				if (pixed_document_read_pixel(document, x, y) != states[(step + 1) * pixels_length + y * width + x])
+					result = -1;
+			}
+		}
+	}
+
+	if (step != BENCH_HISTORY_STEPS)
+		result = -1;
+
+	pixed_history_free(history);
+	pixed_fill_stack_free(&stack);
+	pixed_document_free(document);
+	free(states);
+	return result;
+}
+
+/* Thousands of strokes over a tiled canvas, then undo and redo under the budget */
+void
+bench_history(uint32_t size)
+{
+	PixedStorage storage = PIXED_STORAGE_FLAT;
+
+	for (; storage <= PIXED_STORAGE_INDEXED; storage++) {
+		if (bench_check_history(storage, SIZE_MAX) != 0 || bench_check_history(storage, 1) != 0) {
+			fprintf(stderr, "ERROR: History on storage %d doesn't bring back the pixels it kept\n", storage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	PixedDocument *document = pixed_document_new_tiled("bench", size, size);
+	PixedHistory *history = document ? pixed_history_new(document, 64 * 1024 * 1024) : 0;
+	if (!history) {
+		fprintf(stderr, "ERROR: Allocating %ux%u document failed\n", size, size);
+		exit(EXIT_FAILURE);
+	}
+
+	int x = size / 2, y = size / 2, i = 0, strokes = 5000, steps = 1000;
+	uint32_t seed = 12345;
+	double stroke = 0, undo = 0, redo = 0, undo_max = 0;
+	PixedRect touched;
+
+	for (i = 0; i < strokes; i++) {
+		double start = bench_now();
+		int sample = 0;
+
+		// Strokes of 16 quick samples wandering over the canvas
+		pixed_history_begin(history);
+		for (; sample < 16; sample++) {
+			seed = seed * 1103515245 + 12345;
+			int next_x = x + (int)((seed >> 8) % 65) - 32;
+			int next_y = y + (int)((seed >> 20) % 65) - 32;
+
+			pixed_document_draw_line(document, x, y, next_x, next_y, 8, 0xff0000ff + (i << 8), &touched);
+			x = next_x < 0 || next_x >= (int)size ? (int)size / 2 : next_x;
+			y = next_y < 0 || next_y >= (int)size ? (int)size / 2 : next_y;
+		}
+		pixed_history_end(history);
+
+		stroke += bench_now() - start;
+	}
+
+	for (i = 0; i < steps; i++) {
+		double start = bench_now();
+		pixed_history_undo(history);
+		double elapsed = bench_now() - start;
+
+		undo += elapsed;
+		undo_max = elapsed > undo_max ? elapsed : undo_max;
+	}
+
+	for (i = 0; i < steps; i++) {
+		double start = bench_now();
+		pixed_history_redo(history);
+		redo += bench_now() - start;
+	}
+
+	printf("history %5ux%-5u stroke %7.3f us | undo %7.3f us, max %7.3f us | redo %7.3f us | kept %6.1f MiB\n",
+		size, size, stroke * 1e6 / strokes, undo * 1e6 / steps, undo_max * 1e6, redo * 1e6 / steps,
+		pixed_history_size(history) / (1024.0 * 1024.0));
+
+	pixed_history_free(history);
+	pixed_document_free(document);
+}
+
+#define BENCH_DIV255(X) (((X) + 128 + (((X) + 128) >> 8)) >> 8)
+
+/* Composite of one pixel straight from the blend formulas, one channel at a time */
+uint32_t
+bench_blend_reference(PixedDocument *document, uint32_t x, uint32_t y)
+{
+	uint32_t out[4] = { 0, 0, 0, 0 }, i = 0, c = 0;
+
+	for (; i < document->layers_length; i++) {
+		PixedLayer *layer = &document->layers[i];
+		uint32_t color = pixed_document_read_pixel(layer->pixels, x, y);
+		uint32_t k = BENCH_DIV255((color & 0xff) * layer->opacity);
+
+		if (!layer->visible || k == 0)
+			continue;
+
+		uint32_t s[4] = {
+			BENCH_DIV255((color >> 24) * k), BENCH_DIV255(((color >> 16) & 0xff) * k),
+			BENCH_DIV255(((color >> 8) & 0xff) * k), k
+		};
+		uint32_t da = out[3];
+
+		for (c = 0; c < 4; c++) {
+			uint32_t d = out[c], value = 0;
+
+			if (layer->blend == PIXED_BLEND_MULTIPLY)
+				value = BENCH_DIV255(s[c] * d) + BENCH_DIV255(s[c] * (255 - da)) + BENCH_DIV255(d * (255 - k));
+			else if (layer->blend == PIXED_BLEND_ADD)
+				value = s[c] + d;
+			else if (layer->blend == PIXED_BLEND_SCREEN)
+				value = s[c] + d - BENCH_DIV255(s[c] * d);
+			else
+				value = s[c] + BENCH_DIV255(d * (255 - k));
+
+			out[c] = value > 255 ? 255 : value;
+		}
+	}
+
+	uint32_t a = out[3];
+	if (a != 0 && a != 255) {
+		for (c = 0; c < 3; c++)
+			out[c] = (out[c] * 255 + a / 2) / a > 255 ? 255 : (out[c] * 255 + a / 2) / a;
+	}
+
+	return pixed_color_rgba(out[0], out[1], out[2], a);
+}
+
+/*
+ * Composites random layers of every storage and blend mode, then again after
+ * a stroke on one of them, comparing the canvas against the reference.
+ */
+int
+bench_check_layers(uint32_t seed)
+{
+	uint32_t width = 150, height = 131, x = 0, y = 0, i = 0;
+	PixedDocument *document = pixed_document_new("layers", width, height);
+	PixedRect touched;
+	int result = 0, pass = 0;
+
+	for (i = 0; i < 5; i++) {
+		int index = i == 0 ? 0 : pixed_document_add_layer(document);
+		PixedDocument *pixels = i == 0 ? document : document->layers[index].pixels;
+
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				seed = seed * 1103515245 + 12345;
+
+				// Mostly transparent and opaque runs, as drawings are, and some of everything else
+				uint32_t alpha = (seed >> 28) < 6 ? 0 : (seed >> 28) < 12 ? 0xff : (seed >> 8) & 0xff;
+				uint32_t color = ((seed >> 12) & (i == 2 ? 0x0f0f0f : 0xffffff)) << 8 | alpha;
+
+				// The last layer stays empty outside a few tiles
+				if (i < 4 || (x < 64 && y >= 64))
+					pixed_document_write_pixel(pixels, x, y, i == 2 ? color & 0xf0f0f0ff : color);
+			}
+		}
+
+		if (i == 2)
+			pixed_document_set_storage(pixels, PIXED_STORAGE_INDEXED);
+
+		if (i > 0)
+			pixed_document_set_layer(document, i, i == 3 ? 0x80 : 0xff, 1, (PixedBlendMode)((i - 1) % 4));
+	}
+
+	pixed_document_set_layer(document, 4, 0xc0, 1, PIXED_BLEND_SCREEN);
+
+	for (; pass < 3; pass++) {
+		if (pass == 1)
+			pixed_document_draw_line(document->layers[3].pixels, 10, 20, 90, 70, 5, 0x40a0e0ff, &touched);
+		else if (pass == 2)
+			pixed_document_move_layer(document, 4, 1);
+
+		pixed_document_composite(document);
+
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				if (pixed_document_read_pixel(document, x, y) != bench_blend_reference(document, x, y))
+					result = -1;
+			}
+		}
+	}
+
+	pixed_document_free(document);
+	return result;
+}
+
+/*
+ * 16 tiled layers, each with a square of paint, composited whole and again
+ * after short strokes. The layers are kept in memory uncompressed, larger
+ * sizes are skipped.
+ */
+void
+bench_layers(uint32_t size)
+{
+	if (bench_check_layers(1) != 0 || bench_check_layers(99) != 0) {
+		fprintf(stderr, "ERROR: Composite doesn't match the blend formulas\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (size > 8192)
+		return;
+
+	PixedDocument *document = pixed_document_new_tiled("bench", size, size);
+	uint32_t paint = size / 4, i = 0, layers = 16, strokes = 1000;
+	PixedRect touched;
+
+	for (i = 0; document && i < layers; i++) {
+		int index = i == 0 ? 0 : pixed_document_add_layer(document);
+		if (index < 0)
+			break;
+
+		PixedDocument *pixels = document->layers_length > 0 ? document->layers[index].pixels : document;
+		uint32_t offset = i * (size - paint) / layers, y = 0;
+
+		for (; y < paint; y++)
+			pixed_document_fill_span(pixels, offset, offset + y, paint, pixed_color_rgba(i * 16, 0x80, (0xff - i * 16), 0x80 + i * 8));
+
+		pixed_document_set_layer(document, index, 0xff, 1, (PixedBlendMode)(i % 4));
+	}
+
+	if (!document || document->layers_length != layers) {
+		fprintf(stderr, "ERROR: Allocating %ux%u document with %u layers failed\n", size, size, layers);
+		exit(EXIT_FAILURE);
+	}
+
+	double full = 0, stroke = 0, stroke_max = 0;
+	int repeat = 0;
+
+	for (; repeat < BENCH_REPEAT; repeat++) {
+		pixed_document_set_layer(document, 0, repeat % 2 ? 0xff : 0xfe, 1, PIXED_BLEND_NORMAL);
+
+		double start = bench_now();
+		pixed_document_composite(document);
+		full += bench_now() - start;
+	}
+
+	uint32_t seed = 12345;
+	int x = size / 2, y = size / 2;
+
+	for (i = 0; i < strokes; i++) {
+		seed = seed * 1103515245 + 12345;
+		int next_x = x + (int)((seed >> 8) % 17) - 8;
+		int next_y = y + (int)((seed >> 20) % 17) - 8;
+
+		double start = bench_now();
+		pixed_document_draw_line(document->layers[layers / 2].pixels, x, y, next_x, next_y, 8, 0xff0000ff + (i << 8), &touched);
+		pixed_document_composite(document);
+		double elapsed = bench_now() - start;
+
+		stroke += elapsed;
+		stroke_max = elapsed > stroke_max ? elapsed : stroke_max;
+
+		x = next_x < 0 || next_x >= (int)size ? (int)size / 2 : next_x;
+		y = next_y < 0 || next_y >= (int)size ? (int)size / 2 : next_y;
+	}
+
+	printf("layers %5ux%-5u x%u full %8.2f ms (%6.0f Mpx/s) | stroke + composite %7.2f us, max %7.2f us\n",
+		size, size, layers, full * 1000 / BENCH_REPEAT, (double)size * size * BENCH_REPEAT / full / 1e6,
+		stroke * 1e6 / strokes, stroke_max * 1e6);
+
+	pixed_document_free(document);
+}
+
+#define BENCH_FRAMES 200
+
+/* Small dot drawn into frame i, a few pixels that move along a row */
+#define BENCH_FRAME_DOT(document, i, touched) \
+	pixed_document_draw_line((document), 4 + (i) % 90, 20 + (i) % 7, 4 + (i) % 90, 20 + (i) % 7, 3, 0xffff00ff, (touched))
+
+/*
+ * Duplicates and edits frames of a small animation, then checks every frame
+ * against a document drawn the same way and again after a write and read.
+ * Last, frames sharing tiles are edited one at a time.
+ */
+int
+bench_check_frames()
+{
+	uint32_t width = 150, height = 100, x = 0, y = 0, i = 0;
+	char *path = bench_temp_path("pixed-bench-frames", width);
+	PixedAnimation *animation = pixed_animation_new("frames", width, height);
+	PixedDocument *expected = bench_document(width, height);
+	PixedRect touched;
+	int result = 0, pass = 0;
+
+	if (!path || !animation || pixed_animation_insert_frame(animation, 0, bench_document(width, height), 100) != 0)
+		return -1;
+
+	for (i = 1; i < BENCH_FRAMES / 10; i++) {
+		int index = pixed_animation_duplicate_frame(animation, i - 1);
+		if (index < 0)
+			return -1;
+
+		BENCH_FRAME_DOT(animation->frames[index].pixels, i, &touched);
+		animation->frames[index].duration = i;
+	}
+
+	for (; pass < 2; pass++) {
+		pixed_document_free(expected);
+		expected = bench_document(width, height);
+
+		for (i = 0; i < animation->frames_length; i++) {
+			if (i > 0)
+				BENCH_FRAME_DOT(expected, i, &touched);
+
+			for (y = 0; y < height; y++) {
+				for (x = 0; x < width; x++) {
+					if (pixed_document_read_pixel(animation->frames[i].pixels, x, y) != pixed_document_read_pixel(expected, x, y))
+						result = -1;
+				}
+			}
+		}
+
+		// Second pass over the animation as written and read back
+		PixedAnimation *read = pixed_animation_write_file(animation, path) == 0 ? pixed_animation_read_file(path) : 0;
+		pixed_animation_free(animation);
+		animation = read;
+
+		if (!animation || animation->frames_length != BENCH_FRAMES / 10 || animation->frames[3].duration != 3) {
+			result = -1;
+			break;
+		}
+	}
+
+	// Recoloring and filtering a frame through shared tiles leaves the frame before it alone
+	if (animation && pixed_animation_share_tiles(animation) == 0) {
+		PixedDocument *first = animation->frames[0].pixels, *second = animation->frames[1].pixels;
+		uint32_t from = pixed_document_read_pixel(second, width - 1, height - 1);
+
+		pixed_document_free(expected);
+		expected = bench_document(width, height);
+
+		if (!pixed_color_index_new(second, 1) || pixed_document_replace_color(second, from, from ^ 0xffffff00) != 0 ||
+			pixed_document_read_pixel(second, width - 1, height - 1) != (from ^ 0xffffff00) ||
+			pixed_document_adjust_hsl(second, 0, 75, 0.2f, -0.1f) != 0)
+			result = -1;
+
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				if (pixed_document_read_pixel(first, x, y) != pixed_document_read_pixel(expected, x, y))
+					result = -1;
+			}
+		}
+	}
+
+	if (animation)
+		pixed_animation_free(animation);
+
+	pixed_document_free(expected);
+	remove(path);
+	free(path);
+	return result;
+}
+
+/*
+ * An animation of BENCH_FRAMES frames, each a duplicate of the previous one
+ * with a few pixels drawn. Memory and file size are compared to the frames
+ * as separate documents.
+ */
+void
+bench_frames(uint32_t size)
+{
+	if (bench_check_frames() != 0) {
+		fprintf(stderr, "ERROR: Frames don't keep their own pixels\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (size > 4096)
+		return;
+
+	char *path = bench_temp_path("pixed-bench-frames", size);
+	PixedAnimation *animation = pixed_animation_new("bench", size, size);
+	PixedRect touched;
+	uint32_t i = 0;
+
+	if (!path || !animation || pixed_animation_insert_frame(animation, 0, bench_document(size, size), 100) != 0) {
+		fprintf(stderr, "ERROR: Allocating %ux%u animation failed\n", size, size);
+		exit(EXIT_FAILURE);
+	}
+
+	double start = bench_now();
+	for (i = 1; i < BENCH_FRAMES; i++) {
+		int index = pixed_animation_duplicate_frame(animation, i - 1);
+		if (index < 0) {
+			fprintf(stderr, "ERROR: Duplicating frame %u failed\n", i - 1);
+			exit(EXIT_FAILURE);
+		}
+
+		BENCH_FRAME_DOT(animation->frames[index].pixels, i, &touched);
+	}
+	double duplicate = bench_now() - start;
+
+	start = bench_now();
+	pixed_animation_share_tiles(animation);
+	double share = bench_now() - start;
+
+	start = bench_now();
+	int written = pixed_animation_write_file(animation, path);
+	double write = bench_now() - start;
+
+	struct stat file_stat;
+	if (written != 0 || stat(path, &file_stat) != 0) {
+		fprintf(stderr, "ERROR: Writing %s failed\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	start = bench_now();
+	PixedAnimation *read = pixed_animation_read_file(path);
+	double read_time = bench_now() - start;
+
+	if (!read) {
+		fprintf(stderr, "ERROR: Reading %s failed\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	double frame_bytes = (double)size * size * sizeof(uint32_t);
+	printf("frames %5ux%-5u x%u duplicate + draw %7.3f ms | share %7.3f ms | memory %8.1f MiB (%5.2f frames) | "
+		"file %8.1f MiB | write %8.2f ms read %8.2f ms\n",
+		size, size, BENCH_FRAMES, duplicate * 1000 / (BENCH_FRAMES - 1), share * 1000,
+		pixed_animation_size(animation) / (1024.0 * 1024.0), pixed_animation_size(animation) / frame_bytes,
+		file_stat.st_size / (1024.0 * 1024.0), write * 1000, read_time * 1000);
+
+	pixed_animation_free(read);
+	pixed_animation_free(animation);
+	remove(path);
+	free(path);
+}
+
+/*
+ * PNG export of an atlas with 1, 2, 4... threads up to one per core, and of
+ * the same atlas in 16 colors, which goes out as a 4 bit palette PNG.
+ */
+void
+bench_png(uint32_t size)
+{
+	if (size > 16384)
+		return;
+
+	char *path = bench_temp_path("pixed-bench-png", size);
+	PixedDocument *documents[2] = { bench_document(size, size), pixed_document_new("bench", size, size) };
+	const char *names[2] = { "rgba", "16 colors" };
+	int threads = pixed_thread_count(), t = 1, d = 0;
+	size_t pixels_length = (size_t)size * size;
+
+	if (!path || !documents[1]) {
+		fprintf(stderr, "ERROR: Allocating %ux%u document failed\n", size, size);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t i = 0;
+	for (; i < pixels_length; i++)
+		documents[1]->canvas[i] = pixed_canvas_color((pixed_canvas_color(documents[0]->canvas[i]) & 0x03030000) | 0xff);
+
+	for (; d < 2; d++) {
+		for (t = 1; ; t = t * 2 < threads ? t * 2 : threads) {
+			pixed_set_thread_count(t);
+
+			double start = bench_now();
+			if (pixed_document_write_png(documents[d], path) != 0) {
+				fprintf(stderr, "ERROR: Writing %s failed\n", path);
+				exit(EXIT_FAILURE);
+			}
+			double write = bench_now() - start;
+
+			printf("png %5ux%-5u %-9s write %2d threads %9.3f ms %8.1f MB/s\n", size, size, names[d], t,
+				write * 1000, pixels_length * sizeof(uint32_t) / write / (1024 * 1024));
+
+			if (t == threads)
+				break;
+		}
+
+		pixed_set_thread_count(0);
+
+		struct stat file_stat;
+		stat(path, &file_stat);
+
+		double start = bench_now();
+		PixedDocument *loaded = pixed_document_read_png(path);
+		double read = bench_now() - start;
+
+		if (!loaded || memcmp(loaded->canvas, documents[d]->canvas, sizeof(uint32_t) * pixels_length) != 0) {
+			fprintf(stderr, "ERROR: PNG round trip of %ux%u %s differs\n", size, size, names[d]);
+			exit(EXIT_FAILURE);
+		}
+
+		printf("png %5ux%-5u %-9s file %10lld B (%.1fx) | read %9.3f ms\n", size, size, names[d],
+			(long long)file_stat.st_size, (double)(pixels_length * sizeof(uint32_t)) / file_stat.st_size,
+			read * 1000);
+
+		pixed_document_free(loaded);
+		pixed_document_free(documents[d]);
+	}
+
+	remove(path);
+	free(path);
+}
+
+/*
+ * size / 16 frames of scratch allocations through malloc and through an arena
+ * reset every frame, then the same count of fixed size elements through
+ * malloc and a pool. Past the first frame neither may take heap blocks.
+ */
+void
+bench_arena(uint32_t size)
+{
+	uint32_t frames = size >= 16 ? size / 16 : 1, frame = 0, i = 0, seed = 1;
+	uint32_t sizes[BENCH_ARENA_ALLOCS];
+	void *pointers[BENCH_ARENA_ALLOCS];
+	volatile unsigned char sink = 0;
+	PixedAllocStats warm, stats;
+
+	for (i = 0; i < BENCH_ARENA_ALLOCS; i++) {
+		seed = seed * 1103515245 + 12345;
+		sizes[i] = 16 + (seed >> 8) % 4081;
+	}
+
+	double start = bench_now();
+	for (frame = 0; frame < frames; frame++) {
+		for (i = 0; i < BENCH_ARENA_ALLOCS; i++) {
+			pointers[i] = malloc(sizes[i]);
+			if (!pointers[i])
+				exit(EXIT_FAILURE);
+
+			((unsigned char *)pointers[i])[0] = (unsigned char)i;
+		}
+
+		for (i = 0; i < BENCH_ARENA_ALLOCS; i++) {
+			sink += ((unsigned char *)pointers[i])[0];
+			free(pointers[i]);
+		}
+	}
+	double malloc_time = bench_now() - start;
+
+	PixedArena arena;
+	pixed_arena_init(&arena, 64 * 1024);
+
+	start = bench_now();
+	for (frame = 0; frame < frames; frame++) {
+		for (i = 0; i < BENCH_ARENA_ALLOCS; i++) {
+			pointers[i] = pixed_arena_alloc(&arena, sizes[i]);
+			if (!pointers[i])
+				exit(EXIT_FAILURE);
+
+			((unsigned char *)pointers[i])[0] = (unsigned char)i;
+		}
+
+		for (i = 0; i < BENCH_ARENA_ALLOCS; i++) {
+			if (((unsigned char *)pointers[i])[0] != (unsigned char)i) {
+				fprintf(stderr, "ERROR: Arena allocations overlap\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		pixed_arena_reset(&arena);
+		if (frame == 0)
+			pixed_alloc_stats(&warm);
+	}
+	double arena_time = bench_now() - start;
+
+	pixed_alloc_stats(&stats);
+	pixed_arena_free(&arena);
+
+	if (stats.heap_allocations != warm.heap_allocations) {
+		fprintf(stderr, "ERROR: Arena took %llu heap blocks after the first frame\n",
+			(unsigned long long)(stats.heap_allocations - warm.heap_allocations));
+		exit(EXIT_FAILURE);
+	}
+
+	start = bench_now();
+	for (frame = 0; frame < frames; frame++) {
+		for (i = 0; i < BENCH_ARENA_ALLOCS; i++) {
+			pointers[i] = malloc(sizeof(MouseEvent));
+			if (!pointers[i])
+				exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < BENCH_ARENA_ALLOCS; i++)
+			free(pointers[i]);
+	}
+	double event_malloc_time = bench_now() - start;
+
+	PixedPool pool;
+	pixed_pool_init(&pool, sizeof(MouseEvent), 256);
+
+	start = bench_now();
+	for (frame = 0; frame < frames; frame++) {
+		for (i = 0; i < BENCH_ARENA_ALLOCS; i++) {
+			pointers[i] = pixed_pool_alloc(&pool);
+			if (!pointers[i])
+				exit(EXIT_FAILURE);
+
+			((MouseEvent *)pointers[i])->x = (int)i;
+		}
+
+		for (i = 0; i < BENCH_ARENA_ALLOCS; i++) {
+			if (((MouseEvent *)pointers[i])->x != (int)i) {
+				fprintf(stderr, "ERROR: Pool elements overlap\n");
+				exit(EXIT_FAILURE);
+			}
+
+			pixed_pool_release(&pool, pointers[i]);
+		}
+
+		if (frame == 0)
+			pixed_alloc_stats(&warm);
+	}
+	double pool_time = bench_now() - start;
+
+	pixed_alloc_stats(&stats);
+	pixed_pool_free(&pool);
+
+	if (stats.heap_allocations != warm.heap_allocations) {
+		fprintf(stderr, "ERROR: Pool took %llu heap blocks after the first frame\n",
+			(unsigned long long)(stats.heap_allocations - warm.heap_allocations));
+		exit(EXIT_FAILURE);
+	}
+
+	double allocations = (double)frames * BENCH_ARENA_ALLOCS;
+	printf("arena %6u frames scratch malloc %8.1f M/s arena %8.1f M/s | events malloc %8.1f M/s pool %8.1f M/s\n",
+		frames, allocations / malloc_time / 1e6, allocations / arena_time / 1e6,
+		allocations / event_malloc_time / 1e6, allocations / pool_time / 1e6);
+}
+
+/*
+ * Cost of a trace scope and a counter over size * 1024 scopes in frames of
+ * 16, then the Chrome trace export of the full ring
+ */
+void
+bench_trace(uint32_t size)
+{
+	uint64_t scopes = (uint64_t)size * 1024, i = 0;
+
+	trace_system_initialize();
+
+	double start = bench_now();
+	for (; i < scopes; i++) {
+		trace_begin("bench");
+		trace_count(TRACE_COUNTER_PIXELS, 1);
+		trace_end();
+
+		if ((i & 15) == 15)
+			trace_frame();
+	}
+	double scope_time = bench_now() - start;
+
+	if (trace_system->totals[TRACE_COUNTER_PIXELS] != scopes || trace_system->depth != 0) {
+		fprintf(stderr, "ERROR: Trace lost scopes or counts\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char *path = bench_temp_path("pixed-bench-trace", size);
+	if (!path)
+		exit(EXIT_FAILURE);
+
+	start = bench_now();
+	if (trace_system_write(path) != 0) {
+		fprintf(stderr, "ERROR: Writing %s failed\n", path);
+		exit(EXIT_FAILURE);
+	}
+	double write_time = bench_now() - start;
+
+	struct stat file_stat;
+	stat(path, &file_stat);
+
+	printf("trace %9llu scopes %8.1f ns per scope | write %6u events %9.3f ms %10lld B\n",
+		(unsigned long long)scopes, scope_time * 1e9 / scopes, TRACE_CAPACITY, write_time * 1000,
+		(long long)file_stat.st_size);
+
+	remove(path);
+	free(path);
+	trace_system_destroy();
+}
+
+#define BENCH_FILTERS 5
+
+static const char *bench_filter_names[BENCH_FILTERS] = { "levels", "hsl", "remap", "palette", "dither" };
+
+/* Runs filter number filter of bench_filter_names over area */
+int
+bench_filter_apply(PixedDocument *document, int filter, const PixedRect *area)
+{
+	static const uint32_t from[4] = { 0x000000ff, 0xffffffff, 0x01020380, 0x03030380 };
+	static const uint32_t to[4] = { 0xff0000ff, 0x00ff00ff, 0x0000ff80, 0x00000000 };
+	static const uint32_t palette[8] = {
+		0x000000ff, 0xffffffff, 0xff0000ff, 0x00ff00ff, 0x0000ffff, 0xffff00ff, 0x00000000, 0x80808080
+	};
+
+	if (filter == 0) {
+		PixedColorLut lut;
+		pixed_color_lut_levels(&lut, 16, 235, 1.4f);
+		return pixed_document_apply_lut(document, area, &lut);
+	}
+
+	if (filter == 1)
+		return pixed_document_adjust_hsl(document, area, 75, 0.2f, -0.1f);
+
+	if (filter == 2)
+		return pixed_document_remap_colors(document, area, from, to, 4);
+
+	return pixed_document_map_palette(document, area, palette, 8, filter == 4);
+}
+
+/*
+ * Filters a rectangle of a document in storage at once, and a flat copy one
+ * pixel at a time, which has to come out the same
+ */
+int
+bench_check_filter(PixedStorage storage, int filter)
+{
+	uint32_t width = 150, height = 97, x = 0, y = 0, seed = 11;
+	PixedDocument *document = pixed_document_new("bench", width, height);
+	PixedDocument *reference = pixed_document_new("bench", width, height);
+	if (!document || !reference)
+		exit(EXIT_FAILURE);
+
+	// Runs of five colors, and random ones between them unless the palette has to fit
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			seed = seed * 1103515245 + 12345;
+
+			uint32_t color = ((x / 7) % 5) * 0x33221100 + 0xff;
+			if (x % 7 == 0)
+				color = storage == PIXED_STORAGE_INDEXED ? 0x80 : (seed >> 8) | 0x80;
+
+			pixed_document_set_pixel(document, x, y, color);
+			pixed_document_set_pixel(reference, x, y, color);
+		}
+	}
+
+	if (pixed_document_set_storage(document, storage) != 0)
+		exit(EXIT_FAILURE);
+
+	PixedRect area = { 9, 70, 200, 200 };
+	if (bench_filter_apply(document, filter, &area) != 0)
+		return -1;
+
+	for (y = area.y; y < height; y++) {
+		for (x = area.x; x < width; x++) {
+			PixedRect pixel = { x, y, 1, 1 };
+			bench_filter_apply(reference, filter, &pixel);
+		}
+	}
+
+	int differs = 0;
+	for (y = 0; y < height && !differs; y++) {
+		for (x = 0; x < width && !differs; x++)
+			differs = pixed_document_read_pixel(document, x, y) != pixed_document_get_pixel(reference, x, y);
+	}
+
+	pixed_document_free(document);
+	pixed_document_free(reference);
+	return differs ? -1 : 0;
+}
+
+/*
+ * Every filter over the whole of a document of random 8x8 blocks and of a
+ * sprite sheet of 16 colors, against a plain copy of the canvas
+ */
+void
+bench_filter(uint32_t size)
+{
+	PixedStorage storage = PIXED_STORAGE_FLAT;
+	int filter = 0, d = 0;
+
+	for (; storage <= PIXED_STORAGE_INDEXED; storage++) {
+		for (filter = 0; filter < BENCH_FILTERS; filter++) {
+			if (bench_check_filter(storage, filter) != 0) {
+				fprintf(stderr, "ERROR: Filter %s on storage %d differs from filtering pixel by pixel\n", bench_filter_names[filter], storage);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (size > 16384)
+		return;
+
+	PixedDocument *documents[2] = { bench_document(size, size), bench_document(size, size) };
+	const char *names[2] = { "rgba", "16 colors" };
+	size_t i = 0, pixels_length = (size_t)size * size, bytes = pixels_length * sizeof(uint32_t);
+
+	for (; i < pixels_length; i++)
+		documents[1]->canvas[i] = pixed_canvas_color((pixed_canvas_color(documents[1]->canvas[i]) & 0xc0c00000) | 0xff);
+
+	uint32_t *original = malloc(bytes);
+	if (!original) {
+		fprintf(stderr, "ERROR: Allocating %ux%u copy failed\n", size, size);
+		exit(EXIT_FAILURE);
+	}
+
+	// Fault the copy in, memcpy is timed as the bandwidth to compare against
+	memset(original, 0, bytes);
+
+	for (; d < 2; d++) {
+		double start = bench_now();
+		memcpy(original, documents[d]->canvas, bytes);
+		double copied = bench_now() - start;
+
+		printf("filter %5ux%-5u %-9s %-7s %9.3f ms %8.1f MB/s\n", size, size, names[d], "memcpy",
+			copied * 1000, bytes / copied / (1024 * 1024));
+
+		for (filter = 0; filter < BENCH_FILTERS; filter++) {
+			start = bench_now();
+			bench_filter_apply(documents[d], filter, 0);
+			double filtered = bench_now() - start;
+
+			printf("filter %5ux%-5u %-9s %-7s %9.3f ms %8.1f MB/s\n", size, size, names[d], bench_filter_names[filter],
+				filtered * 1000, bytes / filtered / (1024 * 1024));
+
+			memcpy(documents[d]->canvas, original, bytes);
+		}
+
+		pixed_document_free(documents[d]);
+	}
+
+	free(original);
+}
+
+/*
+ * Counts every color of a document by hand after each of a series of edits
+ * and undos, the index has to agree on all of them
+ */
+int
+bench_check_colors(PixedStorage storage)
+{
+	static const uint32_t palette[4] = { 0x000000ff, 0xff0000ff, 0x00ff00ff, 0x00000000 };
+	uint32_t width = 150, height = 97, x = 0, y = 0, seed = 7, step = 0, i = 0;
+	PixedDocument *document = pixed_document_new("bench", width, height);
+	if (!document || !pixed_history_new(document, 1 << 20) || !pixed_color_index_new(document, 1))
+		exit(EXIT_FAILURE);
+
+	if (pixed_document_set_storage(document, storage) != 0)
+		exit(EXIT_FAILURE);
+
+	uint8_t *mask = malloc((size_t)width * height);
+	if (!mask)
+		exit(EXIT_FAILURE);
+
+	int differs = 0;
+	for (step = 0; step < 40 && !differs; step++) {
+		seed = seed * 1103515245 + 12345;
+		uint32_t color = palette[(seed >> 8) & 3], other = palette[(seed >> 12) & 3];
+		PixedRect area = { (seed >> 4) % width, (seed >> 16) % height, 70, 40 };
+
+		pixed_history_begin(document->history);
+		if (step % 4 == 0)
+			pixed_document_replace_color(document, color, other);
+		else if (step % 4 == 1)
+			pixed_document_remap_colors(document, &area, &color, &other, 1);
+		else
+			pixed_document_fill_span(document, area.x, area.y, area.width, color);
+		pixed_history_end(document->history);
+
+		if (step % 5 == 4)
+			pixed_history_undo(document->history);
+
+		for (i = 0; i < 4 && !differs; i++) {
+			uint64_t count = 0;
+			for (y = 0; y < height; y++) {
+				for (x = 0; x < width; x++)
+					count += pixed_document_read_pixel(document, x, y) == palette[i];
+			}
+
+			differs = pixed_color_index_count(document->colors, palette[i]) != count;
+			if (!differs && count > 0 && pixed_color_index_select(document->colors, palette[i], mask) == 0) {
+				for (y = 0; y < height && !differs; y++) {
+					for (x = 0; x < width && !differs; x++)
+						differs = mask[y * width + x] != (pixed_document_read_pixel(document, x, y) == palette[i]);
+				}
+			}
+		}
+	}
+
+	free(mask);
+	pixed_document_free(document);
+	return differs ? -1 : 0;
+}
+
+/*
+ * Counting a whole document, counting again after a stroke touched a few of
+ * its tiles, and the queries a palette panel or a select by color make
+ */
+void
+bench_colors(uint32_t size)
+{
+	PixedStorage storage = PIXED_STORAGE_FLAT;
+	uint32_t i = 0, top[16];
+	uint64_t counts[16];
+
+	for (; storage <= PIXED_STORAGE_INDEXED; storage++) {
+		if (bench_check_colors(storage) != 0) {
+			fprintf(stderr, "ERROR: Color index on storage %d differs from counting by hand\n", storage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (size > 16384)
+		return;
+
+	PixedDocument *document = bench_document(size, size);
+	size_t pixels_length = (size_t)size * size;
+
+	// A sprite sheet of 16 colors
+	for (; i < pixels_length; i++)
+		document->canvas[i] = pixed_canvas_color((pixed_canvas_color(document->canvas[i]) & 0xc0c00000) | 0xff);
+
+	double start = bench_now();
+	if (!pixed_color_index_new(document, 1)) {
+		fprintf(stderr, "ERROR: Allocating color index failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t length = pixed_color_index_length(document->colors);
+	double built = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < 64; i++)
+		pixed_document_fill_span(document, i * 3 % size, (i * 37) % size, 32, 0xffffffff);
+	double stroked = bench_now() - start;
+
+	start = bench_now();
+	pixed_color_index_length(document->colors);
+	double updated = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < 1000; i++)
+		pixed_color_index_count(document->colors, 0xc0c000ff);
+	pixed_color_index_colors(document->colors, top, counts, 16);
+	double queried = bench_now() - start;
+
+	uint8_t *mask = malloc(pixels_length);
+	if (!mask) {
+		fprintf(stderr, "ERROR: Allocating %ux%u mask failed\n", size, size);
+		exit(EXIT_FAILURE);
+	}
+
+	start = bench_now();
+	pixed_color_index_select(document->colors, top[0], mask);
+	double selected = bench_now() - start;
+
+	printf("colors %5ux%-5u %3u colors | build %9.3f ms %8.1f MB/s | stroke %7.3f ms update %7.3f ms | 1000 counts %7.3f ms | select %8.3f ms\n",
+		size, size, length, built * 1000, pixels_length * sizeof(uint32_t) / built / (1024 * 1024),
+		stroked * 1000, updated * 1000, queried * 1000, selected * 1000);
+
+	free(mask);
+	pixed_document_free(document);
+}
+
+/* Document of smooth gradients with noise over them, with about as many colors as a photo */
+PixedDocument *
+bench_photo(uint32_t width, uint32_t height)
+{
+	PixedDocument *document = pixed_document_new("bench", width, height);
+	if (!document) {
+		fprintf(stderr, "ERROR: Allocating %ux%u document failed\n", width, height);
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t x = 0, y = 0, seed = 1;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			seed = seed * 1103515245 + 12345;
+
+			int noise = (int)((seed >> 16) & 15) - 8;
+			int channels[3] = {
+				(int)(127 + 120 * sinf(x * 0.003f + y * 0.001f)) + noise,
+				(int)(127 + 120 * sinf(y * 0.004f)) + noise,
+				(int)(127 + 120 * cosf((x + y) * 0.002f)) + noise
+			};
+
+			uint32_t color = 0xff, i = 0;
+			for (; i < 3; i++)
+				color |= (uint32_t)(channels[i] < 0 ? 0 : channels[i] > 255 ? 255 : channels[i]) << (24 - i * 8);
+
+			document->canvas[(size_t)y * width + x] = pixed_canvas_color(color);
+		}
+	}
+
+	return document;
+}
+
+/*
+ * Quantizing a sprite of 16 colors to 16 has to leave it as it is, and to 4
+ * has to leave at most 4 colors with every dither
+ */
+int
+bench_check_quantize(PixedStorage storage, PixedQuantizeMethod method)
+{
+	uint32_t width = 150, height = 97, x = 0, y = 0;
+	PixedDocument *document = pixed_document_new("bench", width, height);
+	PixedDocument *reference = pixed_document_new("bench", width, height);
+	if (!document || !reference)
+		exit(EXIT_FAILURE);
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			uint32_t shade = ((x / 5) ^ (y / 3)) % 16;
+			uint32_t color = shade == 0 ? 0 : (shade * 0x10305070u) | 0xff;
+
+			pixed_document_set_pixel(document, x, y, color);
+			pixed_document_set_pixel(reference, x, y, color);
+		}
+	}
+
+	if (pixed_document_set_storage(document, storage) != 0 || pixed_document_quantize(document, 0, method, 16, PIXED_DITHER_NONE) != 0)
+		return -1;
+
+	int differs = 0;
+	for (y = 0; y < height && !differs; y++) {
+		for (x = 0; x < width && !differs; x++)
+			differs = pixed_document_read_pixel(document, x, y) != pixed_document_get_pixel(reference, x, y);
+	}
+
+	PixedDither dither = PIXED_DITHER_NONE;
+	for (; dither <= PIXED_DITHER_FLOYD_STEINBERG && !differs; dither++) {
+		uint32_t colors[4], length = 0, i = 0;
+
+		pixed_document_free(document);
+		document = pixed_document_new("bench", width, height);
+		if (!document)
+			exit(EXIT_FAILURE);
+
+		memcpy(document->canvas, reference->canvas, sizeof(uint32_t) * width * height);
+		if (pixed_document_set_storage(document, storage) != 0 || pixed_document_quantize(document, 0, method, 4, dither) != 0)
+			return -1;
+
+		for (y = 0; y < height && !differs; y++) {
+			for (x = 0; x < width && !differs; x++) {
+				uint32_t color = pixed_document_read_pixel(document, x, y);
+				for (i = 0; i < length && colors[i] != color; i++);
+
+				if (i == length && length == 4)
+					differs = 1;
+				else if (i == length)
+					colors[length++] = color;
+			}
+		}
+	}
+
+	pixed_document_free(document);
+	pixed_document_free(reference);
+	return differs ? -1 : 0;
+}
+
+/*
+ * Picking 256 colors for a photo like document with both methods, and
+ * mapping it to them with every dither
+ */
+void
+bench_quantize(uint32_t size)
+{
+	static const char *methods[2] = { "median cut", "k-means" };
+	static const char *dithers[3] = { "none", "ordered", "floyd" };
+	PixedStorage storage = PIXED_STORAGE_FLAT;
+	PixedQuantizeMethod method = PIXED_QUANTIZE_MEDIAN_CUT;
+
+	for (; storage <= PIXED_STORAGE_INDEXED; storage++) {
+		for (method = PIXED_QUANTIZE_MEDIAN_CUT; method <= PIXED_QUANTIZE_KMEANS; method++) {
+			if (bench_check_quantize(storage, method) != 0) {
+				fprintf(stderr, "ERROR: Quantizing with %s on storage %d left other colors\n", methods[method], storage);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (size > 16384)
+		return;
+
+	PixedDocument *document = bench_photo(size, size);
+	size_t bytes = (size_t)size * size * sizeof(uint32_t);
+	uint32_t palette[PIXED_PALETTE_MAX];
+
+	uint32_t *original = malloc(bytes);
+	if (!original) {
+		fprintf(stderr, "ERROR: Allocating %ux%u copy failed\n", size, size);
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(original, document->canvas, bytes);
+
+	for (method = PIXED_QUANTIZE_MEDIAN_CUT; method <= PIXED_QUANTIZE_KMEANS; method++) {
+		double start = bench_now();
+		int length = pixed_document_quantize_palette(document, 0, method, palette, PIXED_PALETTE_MAX);
+		double picked = bench_now() - start;
+
+		printf("quantize %5ux%-5u %-10s palette %3d colors %9.3f ms |", size, size, methods[method], length, picked * 1000);
+
+		PixedDither dither = PIXED_DITHER_NONE;
+		for (; dither <= PIXED_DITHER_FLOYD_STEINBERG; dither++) {
+			start = bench_now();
+			pixed_document_quantize(document, 0, method, PIXED_PALETTE_MAX, dither);
+			double quantized = bench_now() - start;
+
+			printf(" %s %9.3f ms", dithers[dither], quantized * 1000);
+			memcpy(document->canvas, original, bytes);
+		}
+
+		printf("\n");
+	}
+
+	free(original);
+	pixed_document_free(document);
+}
+
+/* Straight alpha over of one pixel, the same rounding as the blitter */
+uint32_t
+bench_over_reference(uint32_t dst, uint32_t src)
+{
+	uint32_t sa = src & 0xff, da = dst & 0xff, out = 0, c = 0;
+	if (sa == 0)
+		return dst;
+
+	if (sa == 255 || da == 0)
+		return src;
+
+	uint32_t src_weight = sa * 255, dst_weight = da * (255 - sa), total = src_weight + dst_weight;
+
+	for (; c < 3; c++) {
+		uint32_t shift = 24 - c * 8;
+		out |= ((((src >> shift) & 0xff) * src_weight + ((dst >> shift) & 0xff) * dst_weight + total / 2) / total) << shift;
+	}
+
+	return out | (total + 127) / 255;
+}
+
+/*
+ * Random blits of random areas hanging over every edge, with and without a
+ * mask, checked against copying pixel by pixel. With same set the blits move
+ * pixels around one document, overlapping moves included. Copying out and
+ * clearing a masked area are checked last.
+ */
+int
+bench_check_blit(PixedStorage storage, int same)
+{
+	uint32_t width = 150, height = 97, src_width = same ? width : 90, src_height = same ? height : 70;
+	uint32_t x = 0, y = 0, i = 0, seed = 11, step = 0;
+	PixedStorage src_storage = same ? storage : (PixedStorage)((storage + 1) % 3);
+	int indexed = storage == PIXED_STORAGE_INDEXED || src_storage == PIXED_STORAGE_INDEXED, differs = 0;
+
+	PixedDocument *dst = pixed_document_new("bench", width, height);
+	PixedDocument *src = same ? dst : pixed_document_new("bench", src_width, src_height);
+	uint32_t *expected = malloc(sizeof(uint32_t) * width * height);
+	uint32_t *source = malloc(sizeof(uint32_t) * src_width * src_height);
+	uint8_t *mask = malloc(100 * 80);
+	if (!dst || !src || !expected || !source || !mask)
+		exit(EXIT_FAILURE);
+
+	for (step = 0; step < (same ? 1u : 2u); step++) {
+		PixedDocument *document = step ? src : dst;
+
+		for (y = 0; y < document->height; y++) {
+			for (x = 0; x < document->width; x++) {
+				seed = seed * 1103515245 + 12345;
+
+				// Mostly transparent and opaque runs, few enough colors for a palette when indexed
+				uint32_t alpha = (seed >> 28) < 5 ? 0 : (seed >> 28) < 12 ? 0xff : indexed ? 0x80 : (seed >> 8) & 0xff;
+				uint32_t color = indexed ? (((seed >> 12) & 0x030303) * 85) << 8 : ((seed >> 12) & 0xffffff) << 8;
+
+				pixed_document_set_pixel(document, x, y, alpha ? color | alpha : 0);
+			}
+		}
+	}
+
+	if (pixed_document_set_storage(dst, storage) != 0 || (!same && pixed_document_set_storage(src, src_storage) != 0))
+		return -1;
+
+	for (step = 0; step < 60 && !differs; step++) {
+		seed = seed * 1103515245 + 12345;
+		PixedRect area = { (seed >> 8) % src_width, (seed >> 16) % src_height, 1 + (seed >> 4) % 100, 1 + (seed >> 20) % 80 };
+
+		seed = seed * 1103515245 + 12345;
+		int bx = (int)((seed >> 8) % (width + 80)) - 60, by = (int)((seed >> 16) % (height + 60)) - 40;
+		PixedBlitMode mode = storage != PIXED_STORAGE_INDEXED && (step & 1) ? PIXED_BLIT_OVER : PIXED_BLIT_COPY;
+		uint8_t *selection = step % 3 == 0 ? mask : 0;
+
+		for (i = 0; i < area.width * area.height; i++)
+			mask[i] = ((i * 2654435761u ^ seed) >> 29) < 5;
+
+		for (y = 0; y < src_height; y++) {
+			for (x = 0; x < src_width; x++)
+				source[y * src_width + x] = pixed_document_read_pixel(src, x, y);
+		}
+
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++)
+				expected[y * width + x] = pixed_document_read_pixel(dst, x, y);
+		}
+
+		for (y = 0; y < area.height; y++) {
+			for (x = 0; x < area.width; x++) {
+				int64_t tx = (int64_t)bx + x, ty = (int64_t)by + y;
+				uint32_t sx = area.x + x, sy = area.y + y;
+
+				if (sx >= src_width || sy >= src_height || tx < 0 || ty < 0 || tx >= width || ty >= height)
+					continue;
+
+				if (selection && !selection[y * area.width + x])
+					continue;
+
+				uint32_t *e = &expected[ty * width + tx], s = source[sy * src_width + sx];
+				*e = mode == PIXED_BLIT_OVER ? bench_over_reference(*e, s) : s;
+			}
+		}
+
+		differs = pixed_document_blit(dst, bx, by, src, &area, selection, mode) != 0;
+
+		for (y = 0; y < height && !differs; y++) {
+			for (x = 0; x < width && !differs; x++)
+				differs = pixed_document_read_pixel(dst, x, y) != expected[y * width + x];
+		}
+	}
+
+	PixedRect area = { 20, 10, 100, 80 };
+	PixedDocument *copy = pixed_document_copy_area(dst, &area, mask);
+	if (!copy)
+		return -1;
+
+	for (y = 0; y < area.height && !differs; y++) {
+		for (x = 0; x < area.width && !differs; x++) {
+			uint32_t kept = mask[y * area.width + x] ? pixed_document_read_pixel(dst, area.x + x, area.y + y) : 0;
+			differs = pixed_document_get_pixel(copy, x, y) != kept;
+		}
+	}
+
+	differs = differs || pixed_document_clear_area(dst, &area, mask) != 0;
+
+	for (y = 0; y < area.height && !differs; y++) {
+		for (x = 0; x < area.width && !differs; x++) {
+			uint32_t kept = mask[y * area.width + x] ? 0 : expected[(area.y + y) * width + area.x + x];
+			differs = pixed_document_read_pixel(dst, area.x + x, area.y + y) != kept;
+		}
+	}
+
+	pixed_document_free(copy);
+	if (!same)
+		pixed_document_free(src);
+	pixed_document_free(dst);
+	free(expected);
+	free(source);
+	free(mask);
+	return differs ? -1 : 0;
+}
+
+#define BENCH_BLIT_ROUNDS 8
+
+/* Milliseconds one blit takes, on average */
+double
+bench_blit_time(PixedDocument *dst, int x, int y, PixedDocument *src, const PixedRect *area, PixedBlitMode mode)
+{
+	uint32_t i = 0;
+	double start = bench_now();
+
+	for (; i < BENCH_BLIT_ROUNDS; i++) {
+		if (pixed_document_blit(dst, x, y, src, area, 0, mode) != 0) {
+			fprintf(stderr, "ERROR: Blitting failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return (bench_now() - start) * 1000 / BENCH_BLIT_ROUNDS;
+}
+
+/*
+ * A size square sprite, a quarter of it transparent and some translucent,
+ * copied and blended into a canvas half as large again, moved around the
+ * canvas, and one step of dragging it as a floating selection: putting
+ * back the pixels it covered, keeping the ones it is going to cover and
+ * blending it over them.
+ */
+void
+bench_blit(uint32_t size)
+{
+	PixedStorage storage = PIXED_STORAGE_FLAT;
+	int same = 0;
+	size_t i = 0;
+
+	for (; storage <= PIXED_STORAGE_INDEXED; storage++) {
+		for (same = 0; same < 2; same++) {
+			if (bench_check_blit(storage, same) != 0) {
+				fprintf(stderr, "ERROR: Blit%s on storage %d differs from copying by hand\n", same ? " inside a document" : "", storage);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (size > 8192)
+		return;
+
+	PixedDocument *sprite = bench_document(size, size);
+	PixedDocument *canvas = bench_document(size + size / 2, size + size / 2);
+	PixedDocument *under = pixed_document_new("bench", size, size);
+	if (!under) {
+		fprintf(stderr, "ERROR: Allocating %ux%u document failed\n", size, size);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < (size_t)size * size; i++) {
+		uint32_t color = pixed_canvas_color(sprite->canvas[i]), shape = (color >> 8) & 3;
+		sprite->canvas[i] = pixed_canvas_color(shape == 0 ? 0 : (color & 0xffffff00) | (shape == 1 ? 0x80 : 0xff));
+	}
+
+	for (i = 0; i < (size_t)canvas->width * canvas->height; i++)
+		canvas->canvas[i] |= pixed_canvas_color(0xff);
+
+	double blended = bench_blit_time(canvas, 17, 9, sprite, 0, PIXED_BLIT_OVER);
+
+	PixedRect area = { 17, 9, size, size };
+	pixed_document_blit(under, 0, 0, canvas, &area, 0, PIXED_BLIT_COPY);
+
+	double start = bench_now();
+	for (i = 0; i < BENCH_BLIT_ROUNDS; i++) {
+		PixedRect to = { 18 + i, 10 + i, size, size };
+
+		pixed_document_blit(canvas, 17 + i, 9 + i, under, 0, 0, PIXED_BLIT_COPY);
+		pixed_document_blit(under, 0, 0, canvas, &to, 0, PIXED_BLIT_COPY);
+		pixed_document_blit(canvas, to.x, to.y, sprite, 0, 0, PIXED_BLIT_OVER);
+	}
+	double dragged = (bench_now() - start) * 1000 / BENCH_BLIT_ROUNDS;
+
+	PixedDocument *tiles = pixed_document_copy_area(canvas, 0, 0);
+	if (!tiles || pixed_document_set_storage(tiles, PIXED_STORAGE_TILED) != 0) {
+		fprintf(stderr, "ERROR: Tiling %ux%u document failed\n", canvas->width, canvas->height);
+		exit(EXIT_FAILURE);
+	}
+
+	double tiled = bench_blit_time(tiles, 17, 9, sprite, 0, PIXED_BLIT_OVER);
+
+	double copied = bench_blit_time(canvas, 17, 9, sprite, 0, PIXED_BLIT_COPY);
+	double moved = bench_blit_time(canvas, 20, 12, canvas, &area, PIXED_BLIT_COPY);
+	double sideways = bench_blit_time(canvas, 14, 12, canvas, &area, PIXED_BLIT_COPY);
+
+	printf("blit %5ux%-5u | copy %8.3f ms over %8.3f ms | move %8.3f ms sideways %8.3f ms | drag step %8.3f ms | tiled over %8.3f ms\n",
+		size, size, copied, blended, moved, sideways, dragged, tiled);
+
+	pixed_document_free(tiles);
+	pixed_document_free(under);
+	pixed_document_free(canvas);
+	pixed_document_free(sprite);
+}
+
+int
+bench_compare_samples(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Runs a suite case harness.warmup times, then times up to harness.samples
+ * runs and reports their median and 99th percentile
+ */
+void
+bench_case(const char *name, uint32_t size, BenchCase run, void *ctx)
+{
+	double samples[BENCH_MAX_SAMPLES], spent = 0;
+	int count = 0, i = 0;
+	int limit = harness.samples < BENCH_MAX_SAMPLES ? harness.samples : BENCH_MAX_SAMPLES;
+
+	for (; i < harness.warmup; i++)
+		run(ctx);
+
+	while (count < limit && (count < BENCH_MIN_SAMPLES || spent < BENCH_BUDGET)) {
+		double start = bench_now();
+		run(ctx);
+		samples[count] = bench_now() - start;
+		spent += samples[count++];
+	}
+
+	qsort(samples, count, sizeof(double), bench_compare_samples);
+
+	double median = count & 1 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+	double p99 = samples[(count * 99 + 99) / 100 - 1];
+	char line[256];
+
+	snprintf(line, sizeof(line), "{\"bench\":\"%s\",\"size\":%u,\"samples\":%d,\"median_ms\":%.6f,\"p99_ms\":%.6f,\"min_ms\":%.6f}",
+		name, size, count, median * 1000, p99 * 1000, samples[0] * 1000);
+
+	if (harness.json) {
+		printf("%s\n", line);
+	} else {
+		printf("suite %5ux%-5u %-18s median %10.3f ms p99 %10.3f ms min %10.3f ms over %d runs\n",
+			size, size, name, median * 1000, p99 * 1000, samples[0] * 1000, count);
+	}
+
+	fflush(stdout);
+
+	if (harness.save) {
+		FILE *file = fopen(harness.save, "a");
+		if (!file) {
+			fprintf(stderr, "ERROR: Opening %s failed\n", harness.save);
+			exit(EXIT_FAILURE);
+		}
+
+		fprintf(file, "%s\n", line);
+		fclose(file);
+	}
+}
+
+void
+bench_suite_new_free(void *ctx)
+{
+	BenchSuite *suite = ctx;
+
+	PixedDocument *document = pixed_document_new("bench", suite->size, suite->size);
+	if (!document)
+		exit(EXIT_FAILURE);
+
+	pixed_document_free(document);
+}
+
+void
+bench_suite_write_file(void *ctx)
+{
+	BenchSuite *suite = ctx;
+
+	if (pixed_document_write_file(suite->document, suite->path) != 0) {
+		fprintf(stderr, "ERROR: Writing %s failed\n", suite->path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void
+bench_suite_read_file(void *ctx)
+{
+	BenchSuite *suite = ctx;
+
+	PixedDocument *document = pixed_document_read_file(suite->path);
+	if (!document) {
+		fprintf(stderr, "ERROR: Reading %s failed\n", suite->path);
+		exit(EXIT_FAILURE);
+	}
+
+	suite->sink += document->canvas[(size_t)document->width * document->height - 1];
+	pixed_document_free(document);
+}
+
+/* Row major loops over every pixel through the flat canvas macros */
+void
+bench_suite_get_pixel(void *ctx)
+{
+	BenchSuite *suite = ctx;
+	PixedDocument *document = suite->document;
+	uint32_t x = 0, y = 0;
+	uint64_t sum = 0;
+
+	for (y = 0; y < document->height; y++) {
+		for (x = 0; x < document->width; x++)
+			sum += pixed_document_get_pixel(document, x, y);
+	}
+
+	suite->sink += sum;
+}
+
+void
+bench_suite_set_pixel(void *ctx)
+{
+	BenchSuite *suite = ctx;
+	PixedDocument *document = suite->document;
+	uint32_t x = 0, y = 0, color = 0x10203000 | (suite->runs++ & 0xff);
+
+	for (y = 0; y < document->height; y++) {
+		for (x = 0; x < document->width; x++)
+			pixed_document_set_pixel(document, x, y, color);
+	}
+}
+
+/* Through the storage agnostic call, into a tiled document */
+void
+bench_suite_write_pixel(void *ctx)
+{
+	BenchSuite *suite = ctx;
+	PixedDocument *document = suite->document;
+	uint32_t x = 0, y = 0, color = 0x10203000 | (suite->runs++ & 0xff);
+
+	for (y = 0; y < document->height; y++) {
+		for (x = 0; x < document->width; x++)
+			pixed_document_write_pixel(document, x, y, color);
+	}
+}
+
+/* Grows the document by 64 pixels around its center and shrinks it back on the next run */
+void
+bench_suite_resize(void *ctx)
+{
+	BenchSuite *suite = ctx;
+	int grow = (suite->runs++ & 1) == 0;
+	int size = (int)suite->size + (grow ? 64 : 0);
+
+	if (pixed_document_resize(suite->document, size, size, PIXED_ANCHOR_CENTER) != 0) {
+		fprintf(stderr, "ERROR: Resizing to %dx%d failed\n", size, size);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* size * 16 mouse moves through the input ring, a frame's burst at a time */
+void
+bench_suite_input(void *ctx)
+{
+	BenchSuite *suite = ctx;
+	uint64_t events = (uint64_t)suite->size * 16, i = 0, j = 0, sum = 0;
+
+	for (; i < events; i += BENCH_INPUT_BURST) {
+		for (j = 0; j < BENCH_INPUT_BURST; j++)
+			input_system_push_mouse_event(MOUSE_MOVE, (int)(i + j), 0, -1, -1);
+
+		MouseEvent *e = 0;
+		while ((e = input_system_peek_mouse_event()) != 0) {
+			sum += e->x;
+			input_system_consume_mouse_event();
+		}
+	}
+
+	suite->sink += sum;
+}
+
+/*
+ * The library and input paths the editor depends on, through the harness.
+ * Renderer frame times and the vbo build come from pixed --bench.
+ */
+void
+bench_suite(uint32_t size)
+{
+	if (size > 16384)
+		return;
+
+	BenchSuite suite;
+	memset(&suite, 0, sizeof(BenchSuite));
+	suite.size = size;
+	suite.path = bench_temp_path("pixed-bench-suite", size);
+	if (!suite.path)
+		exit(EXIT_FAILURE);
+
+	bench_case("new_free", size, bench_suite_new_free, &suite);
+
+	suite.document = bench_document(size, size);
+	bench_case("write_file", size, bench_suite_write_file, &suite);
+	bench_case("read_file", size, bench_suite_read_file, &suite);
+	bench_case("get_pixel", size, bench_suite_get_pixel, &suite);
+	bench_case("set_pixel", size, bench_suite_set_pixel, &suite);
+	bench_case("resize", size, bench_suite_resize, &suite);
+	pixed_document_free(suite.document);
+
+	suite.document = pixed_document_new_tiled("bench", size, size);
+	if (!suite.document)
+		exit(EXIT_FAILURE);
+
+	bench_case("write_pixel_tiled", size, bench_suite_write_pixel, &suite);
+	pixed_document_free(suite.document);
+
+	input_system_initialize();
+	bench_case("input", size, bench_suite_input, &suite);
+	input_system_destroy();
+
+	remove(suite.path);
+	free(suite.path);
+}
+
+/* Loads the JSON lines bench_case writes, other lines are skipped */
+int
+bench_read_results(const char *file_name, BenchResult **results, size_t *length)
+{
+	FILE *file = fopen(file_name, "r");
+	if (!file)
+		return -1;
+
+	char line[512];
+	size_t capacity = 0;
+	*results = 0;
+	*length = 0;
+
+	while (fgets(line, sizeof(line), file)) {
+		BenchResult result;
+		int samples = 0;
+
+		if (sscanf(line, "{\"bench\":\"%63[^\"]\",\"size\":%u,\"samples\":%d,\"median_ms\":%lf,\"p99_ms\":%lf",
+			result.name, &result.size, &samples, &result.median, &result.p99) != 5)
+			continue;
+
+		if (*length == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			BenchResult *grown = realloc(*results, sizeof(BenchResult) * capacity);
+			if (!grown) {
+				fclose(file);
+				return -1;
+			}
+
+			*results = grown;
+		}
+
+		(*results)[(*length)++] = result;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+/* Returns 1 when a median of current is BENCH_REGRESSION times its baseline one or more */
+int
+bench_compare(const char *baseline_name, const char *current_name)
+{
+	BenchResult *baseline = 0, *current = 0;
+	size_t baseline_length = 0, current_length = 0, i = 0, j = 0;
+	int regressions = 0;
+
+	if (bench_read_results(baseline_name, &baseline, &baseline_length) != 0 ||
+		bench_read_results(current_name, &current, &current_length) != 0) {
+		fprintf(stderr, "ERROR: Reading %s or %s failed\n", baseline_name, current_name);
+		free(baseline);
+		free(current);
+		return 2;
+	}
+
+	for (i = 0; i < current_length; i++) {
+		BenchResult *now = &current[i], *then = 0;
+
+		for (j = 0; j < baseline_length && !then; j++) {
+			if (baseline[j].size == now->size && strcmp(baseline[j].name, now->name) == 0)
+				then = &baseline[j];
+		}
+
+		if (!then) {
+			printf("compare %5ux%-5u %-18s median %10.3f ms, not in baseline\n", now->size, now->size, now->name, now->median);
+			continue;
+		}
+
+		int regressed = now->median >= then->median * BENCH_REGRESSION;
+		regressions += regressed;
+
+		printf("compare %5ux%-5u %-18s median %10.3f ms -> %10.3f ms (%+6.1f%%) p99 %10.3f ms -> %10.3f ms%s\n",
+			now->size, now->size, now->name, then->median, now->median,
+			then->median > 0 ? (now->median / then->median - 1) * 100 : 0,
+			then->p99, now->p99, regressed ? "  REGRESSION" : "");
+	}
+
+	printf("compare %zu results, %d regressions\n", current_length, regressions);
+
+	free(baseline);
+	free(current);
+	return regressions > 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	Bench *bench = 0;
+	int i = 0, sizes = 0;
+
+	if (argc == 4 && strcmp(argv[1], "compare") == 0)
+		return bench_compare(argv[2], argv[3]);
+
+	for (i = 0; argc > 1 && i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (strcmp(argv[1], benches[i].name) == 0)
+			bench = &benches[i];
+	}
+
+	if (!bench) {
+		fprintf(stderr, "usage: %s <bench> [--json] [--save results.json] [--warmup n] [--samples n] [size...]\n", argv[0]);
+		fprintf(stderr, "       %s compare baseline.json results.json\n", argv[0]);
+		for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+			fprintf(stderr, "  %s\n", benches[i].name);
+		return 1;
+	}
+
+	// Harness options apply to the suite, sizes can follow them
+	for (i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--json") == 0) {
+			harness.json = 1;
+		} else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+			harness.save = argv[++i];
+		} else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+			harness.warmup = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+			harness.samples = atoi(argv[++i]);
+		} else {
+			bench->run(strtoul(argv[i], 0, 10));
+			sizes++;
+		}
+	}
+
+	if (sizes == 0) {
+		for (i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]); i++)
+			bench->run(default_sizes[i]);
+	}
+
+	return 0;
+}
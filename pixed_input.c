@@ -0,0 +1,168 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pixed_input.h"
+
+#define INPUT_QUEUE_MASK (INPUT_QUEUE_CAPACITY - 1)
+
+/* Indices are published with release and read with acquire ordering */
+#define input_load(P)     __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define input_store(P, V) __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+
+static int input_system_queue_mouse_event(MouseEvent *);
+
+InputSystem *input_system;
+
+void
+input_system_initialize()
+{
+	input_system = calloc(1, sizeof(InputSystem));
+	if (!input_system) {
+		perror("ERROR: Allocating input system failed");
+		exit(EXIT_FAILURE);
+	}
+
+	input_system->listen_mousemove = false;
+	input_system->has_pending_move = false;
+}
+
+KeyboardEvent *
+input_system_peek_keyboard_event(void)
+{
+	uint32_t head = input_system->keyboard_head;
+	if (head == input_load(&input_system->keyboard_tail))
+		return 0;
+
+	return &input_system->keyboard_events[head & INPUT_QUEUE_MASK];
+}
+
+MouseEvent *
+input_system_peek_mouse_event(void)
+{
+	return input_system_peek_mouse_event_at(0);
+}
+
+/* Event index places behind the oldest one, 0 when fewer are queued */
+MouseEvent *
+input_system_peek_mouse_event_at(uint32_t index)
+{
+	uint32_t head = input_system->mouse_head;
+	if (input_load(&input_system->mouse_tail) - head <= index)
+		return 0;
+
+	return &input_system->mouse_events[(head + index) & INPUT_QUEUE_MASK];
+}
+
+/* Returns -1 when the event was dropped because the queue is full */
+int
+input_system_push_keyboard_event(int key, int scancode, int action, int mode)
+{
+	uint32_t tail = input_system->keyboard_tail;
+
+	if (tail - input_load(&input_system->keyboard_head) == INPUT_QUEUE_CAPACITY) {
+		input_system->dropped_events++;
+		return -1;
+	}
+
+	KeyboardEvent *key_e = &input_system->keyboard_events[tail & INPUT_QUEUE_MASK];
+	key_e->key = key;
+	key_e->scancode = scancode;
+	key_e->action = action;
+	key_e->mode = mode;
+	key_e->time = input_system_now();
+
+	input_store(&input_system->keyboard_tail, tail + 1);
+	return 0;
+}
+
+/* Returns -1 when the event was dropped, moves are never dropped but coalesced */
+int
+input_system_push_mouse_event(MouseEventAction action, int x, int y, int button, int mods)
+{
+	MouseEvent mouse_e;
+	mouse_e.action = action;
+	mouse_e.x = x;
+	mouse_e.y = y;
+	mouse_e.button = button;
+	mouse_e.mods = mods;
+	mouse_e.time = input_system_now();
+
+	// The pending move happened first and has to be queued first
+	if (input_system->has_pending_move) {
+		if (input_system_queue_mouse_event(&input_system->pending_move) == 0)
+			input_system->has_pending_move = false;
+	}
+
+	if (!input_system->has_pending_move && input_system_queue_mouse_event(&mouse_e) == 0)
+		return 0;
+
+	if (action == MOUSE_MOVE) {
+		input_system->pending_move = mouse_e;
+		input_system->has_pending_move = true;
+		return 0;
+	}
+
+	input_system->dropped_events++;
+	return -1;
+}
+
+void
+input_system_consume_keyboard_event()
+{
+	uint32_t head = input_system->keyboard_head;
+
+	if (head == input_load(&input_system->keyboard_tail)) {
+		printf("WARNING: Trying to consume empty keyboard buffer!\n");
+		return;
+	}
+
+	input_store(&input_system->keyboard_head, head + 1);
+}
+
+void
+input_system_consume_mouse_event()
+{
+	uint32_t head = input_system->mouse_head;
+
+	if (head == input_load(&input_system->mouse_tail)) {
+		printf("WARNING: Trying to consume empty mouse buffer!\n");
+		return;
+	}
+
+	input_store(&input_system->mouse_head, head + 1);
+}
+
+void
+input_system_destroy()
+{
+	free(input_system);
+	input_system = 0;
+}
+
+/* Seconds on a monotonic clock */
+double
+input_system_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static
+int
+input_system_queue_mouse_event(MouseEvent *mouse_e)
+{
+	uint32_t tail = input_system->mouse_tail;
+
+	if (tail - input_load(&input_system->mouse_head) == INPUT_QUEUE_CAPACITY)
+		return -1;
+
+	input_system->mouse_events[tail & INPUT_QUEUE_MASK] = *mouse_e;
+	input_store(&input_system->mouse_tail, tail + 1);
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef PIXED_INPUT_H
+#define PIXED_INPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Events per queue, must be a power of two */
+#define INPUT_QUEUE_CAPACITY 1024
+
+typedef struct {
+	int key;
+	int scancode;
+	int action;
+	int mode;
+
+	double time; // input_system_now() at push
+} KeyboardEvent;
+
+typedef enum {
+	MOUSE_DOWN,
+	MOUSE_UP,
+	MOUSE_MOVE,
+	MOUSE_SCROLL
+} MouseEventAction;
+
+typedef struct {
+	MouseEventAction action;
+
+	int button;
+	int mods;
+	int x;
+	int y;
+
+	double time; // input_system_now() at push
+} MouseEvent;
+
+/*
+ * Single producer (window callbacks) single consumer (tool dispatch) ring
+ * buffers. Heads are only written by the consumer and tails by the
+ * producer, the event arrays keep them on separate cache lines.
+ *
+ * Overflow: a mouse move arriving at a full queue replaces the pending move,
+ * which is queued ahead of the next event once there is room again. Every
+ * other event is dropped and counted.
+ */
+typedef struct {
+	uint32_t       keyboard_head;
+	uint32_t       mouse_head;
+
+	KeyboardEvent  keyboard_events[INPUT_QUEUE_CAPACITY];
+	MouseEvent     mouse_events[INPUT_QUEUE_CAPACITY];
+
+	uint32_t       keyboard_tail;
+	uint32_t       mouse_tail;
+	MouseEvent     pending_move;
+	bool           has_pending_move;
+	uint32_t       dropped_events;
+
+	bool           listen_mousemove;
+} InputSystem;
+
+extern InputSystem *input_system;
+
+void              input_system_initialize(void);
+KeyboardEvent    *input_system_peek_keyboard_event(void);
+MouseEvent       *input_system_peek_mouse_event(void);
+MouseEvent       *input_system_peek_mouse_event_at(uint32_t);
+int               input_system_push_keyboard_event(int, int, int, int);
+int               input_system_push_mouse_event(MouseEventAction, int, int, int, int);
+void              input_system_consume_keyboard_event(void);
+void              input_system_consume_mouse_event(void);
+void              input_system_destroy(void);
+double            input_system_now(void);
+
+#endif
@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pixed_trace.h"
+
+#define TRACE_MASK        (TRACE_CAPACITY - 1)
+#define TRACE_FRAMES_MASK (TRACE_FRAMES - 1)
+
+static double trace_now(void);
+static void   trace_record(const char *, TraceEventKind, TraceTrack, double, double);
+
+static const char *trace_counter_names[TRACE_COUNTER_MAX] = {
+	"events",
+	"pixels",
+	"uploaded bytes"
+};
+
+TraceSystem *trace_system;
+
+void
+trace_system_initialize()
+{
+	trace_system = calloc(1, sizeof(TraceSystem));
+	if (!trace_system) {
+		perror("ERROR: Allocating trace system failed");
+		exit(EXIT_FAILURE);
+	}
+
+	trace_system->epoch = trace_now();
+	trace_system->frame_start = trace_system->epoch;
+}
+
+void
+trace_system_destroy()
+{
+	free(trace_system);
+	trace_system = 0;
+}
+
+/* Opens a scope ended by the next trace_end, name must outlive the trace */
+void
+trace_begin(const char *name)
+{
+	uint32_t depth = trace_system->depth++;
+	if (depth >= TRACE_DEPTH)
+		return;
+
+	trace_system->scope_names[depth] = name;
+	trace_system->scope_starts[depth] = trace_now();
+}
+
+void
+trace_end()
+{
+	if (trace_system->depth == 0) {
+		printf("WARNING: Trace scope ended twice!\n");
+		return;
+	}
+
+	uint32_t depth = --trace_system->depth;
+	if (depth >= TRACE_DEPTH)
+		return;
+
+	double start = trace_system->scope_starts[depth];
+	trace_record(trace_system->scope_names[depth], TRACE_SCOPE, TRACE_TRACK_CPU, start, trace_now() - start);
+}
+
+void
+trace_count(TraceCounter counter, uint64_t amount)
+{
+	trace_system->counters[counter] += amount;
+	trace_system->totals[counter] += amount;
+}
+
+/* GPU time of frame, measured by a timer query issued at start, arrives frames later */
+void
+trace_gpu(const char *name, uint32_t frame, double start, double duration)
+{
+	trace_record(name, TRACE_SCOPE, TRACE_TRACK_GPU, start, duration);
+
+	if (trace_system->frame - frame < TRACE_FRAMES)
+		trace_system->frame_times[frame & TRACE_FRAMES_MASK][1] += (float)(duration * 1000.0);
+}
+
+/* Ends the frame, recording it as a scope and the counters it gathered */
+void
+trace_frame()
+{
+	double now = trace_now();
+	uint32_t frame = trace_system->frame, i = 0;
+
+	trace_record("frame", TRACE_SCOPE, TRACE_TRACK_CPU, trace_system->frame_start, now - trace_system->frame_start);
+
+	for (; i < TRACE_COUNTER_MAX; i++) {
+		trace_record(trace_counter_names[i], TRACE_VALUE, TRACE_TRACK_CPU, now, (double)trace_system->counters[i]);
+		trace_system->counters[i] = 0;
+	}
+
+	trace_system->frame_times[frame & TRACE_FRAMES_MASK][0] = (float)((now - trace_system->frame_start) * 1000.0);
+	trace_system->frame_times[(frame + 1) & TRACE_FRAMES_MASK][0] = 0;
+	trace_system->frame_times[(frame + 1) & TRACE_FRAMES_MASK][1] = 0;
+
+	trace_system->frame = frame + 1;
+	trace_system->frame_start = now;
+}
+
+/* Writes the kept events as Chrome trace event JSON, for chrome://tracing or Perfetto */
+int
+trace_system_write(const char *file_name)
+{
+	FILE *file = fopen(file_name, "w");
+	if (!file)
+		return -1;
+
+	uint64_t written = trace_system->written;
+	uint64_t i = written > TRACE_CAPACITY ? written - TRACE_CAPACITY : 0;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"CPU\"}},\n", TRACE_TRACK_CPU + 1);
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}", TRACE_TRACK_GPU + 1);
+
+	for (; i < written; i++) {
+		TraceEvent *e = &trace_system->events[i & TRACE_MASK];
+		double ts = (e->start - trace_system->epoch) * 1e6;
+
+		if (e->kind == TRACE_SCOPE) {
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				e->name, e->track + 1, ts, e->value * 1e6);
+		} else {
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%.0f}}",
+				e->name, e->track + 1, ts, e->value);
+		}
+	}
+
+	fprintf(file, "\n]}\n");
+
+	int failed = ferror(file);
+	if (fclose(file) != 0 || failed)
+		return -1;
+
+	return 0;
+}
+
+static
+double
+trace_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static
+void
+trace_record(const char *name, TraceEventKind kind, TraceTrack track, double start, double value)
+{
+	TraceEvent *e = &trace_system->events[trace_system->written & TRACE_MASK];
+	e->name = name;
+	e->start = start;
+	e->value = value;
+	e->kind = (uint8_t)kind;
+	e->track = (uint8_t)track;
+
+	trace_system->written++;
+}
@@ -0,0 +1,73 @@
+#ifndef PIXED_TRACE_H
+#define PIXED_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Events kept, must be a power of two. About 80 seconds of frames at 60 Hz */
+#define TRACE_CAPACITY (64 * 1024)
+
+/* Scopes open at once, deeper ones are timed by their parent only */
+#define TRACE_DEPTH    16
+
+/* Frames the HUD shows, must be a power of two */
+#define TRACE_FRAMES   128
+
+typedef enum {
+	TRACE_TRACK_CPU,
+	TRACE_TRACK_GPU
+} TraceTrack;
+
+typedef enum {
+	TRACE_COUNTER_EVENTS,   // input events dispatched
+	TRACE_COUNTER_PIXELS,   // pixels in the rectangles tools wrote to
+	TRACE_COUNTER_UPLOADED, // bytes handed to GL
+	TRACE_COUNTER_MAX
+} TraceCounter;
+
+typedef enum {
+	TRACE_SCOPE,  // name ran for duration seconds from start
+	TRACE_VALUE   // counter name was value over the frame ending at start
+} TraceEventKind;
+
+typedef struct {
+	const char    *name;  // string literal, never copied
+	double         start; // seconds, input_system_now() clock
+	double         value; // duration of scopes
+	uint8_t        kind;
+	uint8_t        track;
+} TraceEvent;
+
+/*
+ * Main thread only. Scopes and counters go to a ring of the last
+ * TRACE_CAPACITY events, nothing is allocated after initialization.
+ */
+typedef struct {
+	TraceEvent   events[TRACE_CAPACITY];
+	uint64_t     written; // events ever recorded, the last TRACE_CAPACITY are kept
+
+	const char  *scope_names[TRACE_DEPTH];
+	double       scope_starts[TRACE_DEPTH];
+	uint32_t     depth;
+
+	uint64_t     counters[TRACE_COUNTER_MAX]; // of the current frame
+	uint64_t     totals[TRACE_COUNTER_MAX];   // since initialization
+
+	uint32_t     frame;       // frames ended so far
+	double       frame_start;
+	float        frame_times[TRACE_FRAMES][2]; // frame and gpu milliseconds, at frame & (TRACE_FRAMES - 1)
+	double       epoch;       // trace timestamps are relative to it
+} TraceSystem;
+
+extern TraceSystem *trace_system;
+
+void              trace_system_initialize(void);
+void              trace_system_destroy(void);
+void              trace_begin(const char *);
+void              trace_end(void);
+void              trace_count(TraceCounter, uint64_t);
+void              trace_gpu(const char *, uint32_t, double, double);
+void              trace_frame(void);
+int               trace_system_write(const char *);
+
+#endif
@@ -2,6 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <stdint.h>
+
+#include "libpixed.h"
+
+#define SHADERS_MAX 20
 
 static const char shader_template[] = "const char *$NAME = \"$CODE\";";
 
@@ -22,18 +27,24 @@ int is_valid_extension(char *extension)
 	return 0;
 }
 
-char *read_file(const char *file_name)
+/* Every string of the compiler comes from the arena and is freed with it */
+char *read_file(PixedArena *arena, const char *file_name)
 {
 	FILE *file = fopen(file_name, "r");
 	if (!file)
 		return 0;
 
 	fseek(file, 0, SEEK_END);
-	int len = ftell(file);
-	fseek(file, SEEK_SET, 0);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
 
-	char *buffer = malloc(sizeof(char) * (len + 1));
-	fread(buffer, len + 1, 1, file);
+	char *buffer = len < 0 ? 0 : pixed_arena_alloc(arena, sizeof(char) * (len + 1));
+	if (!buffer) {
+		fclose(file);
+		return 0;
+	}
+
+	len = fread(buffer, 1, len, file);
 	buffer[len] = '\0';
 
 	fclose(file);
@@ -41,18 +52,17 @@ char *read_file(const char *file_name)
 	return buffer;
 }
 
-void str_replace(char **str_ptr, const char *search, const char *replace)
+char *str_replace(PixedArena *arena, const char *str, const char *search, const char *replace)
 {
-	char *str = *str_ptr;
 	size_t str_size = strlen(str);
 	size_t search_size = strlen(search);
 	size_t replace_size = strlen(replace);
 
 	size_t found = 0;
 
-	char *pos = 0;
-	char *rest_pos = str;
-	char *last_pos = str + str_size;
+	const char *pos = 0;
+	const char *rest_pos = str;
+	const char *last_pos = str + str_size;
 
 	while ((pos = strstr(rest_pos, search)) != 0) {
 		found++;
@@ -62,7 +72,10 @@ void str_replace(char **str_ptr, const char *search, const char *replace)
 	size_t diff = replace_size - search_size;
 	size_t new_str_size = str_size + (found * diff);
 
-	char *new_str = malloc(sizeof(char) * new_str_size + 1);
+	char *new_str = pixed_arena_alloc(arena, sizeof(char) * new_str_size + 1);
+	if (!new_str)
+		return 0;
+
 	new_str[0] = '\0';
 
 	pos = 0;
@@ -82,9 +95,7 @@ void str_replace(char **str_ptr, const char *search, const char *replace)
 	}
 
 	new_str[new_str_size] = '\0';
-
-	free(str);
-	*str_ptr = new_str;
+	return new_str;
 }
 
 void remove_new_lines(char *shader_code)
@@ -95,20 +106,23 @@ void remove_new_lines(char *shader_code)
 	}
 }
 
-char *compile_template(const char *shader_name, const char *shader_code)
+char *compile_template(PixedArena *arena, const char *shader_name, const char *shader_code)
 {
 	size_t template_size = strlen(shader_template);
 	size_t name_size = strlen(shader_name);
 	size_t code_size = strlen(shader_code);
-	size_t compiled_size = template_size - 10 + (name_size + code_size);
+	size_t compiled_size = template_size - 10 + (name_size + code_size) + 1;
+
+	char *compiled = pixed_arena_alloc(arena, sizeof(char) * compiled_size);
+	if (!compiled)
+		return 0;
 
-	char *compiled = malloc(sizeof(char) * compiled_size);
 	compiled[0] = '\0';
 
-	char *name_pos = strstr(shader_template, "$NAME");
-	char *name_after_pos = name_pos + 5;
-	char *code_pos = strstr(shader_template, "$CODE");
-	char *code_after_pos = code_pos + 5;
+	const char *name_pos = strstr(shader_template, "$NAME");
+	const char *name_after_pos = name_pos + 5;
+	const char *code_pos = strstr(shader_template, "$CODE");
+	const char *code_after_pos = code_pos + 5;
 
 	strncat(compiled, shader_template, name_pos - shader_template);
 	strcat(compiled, shader_name);
@@ -119,7 +133,7 @@ char *compile_template(const char *shader_name, const char *shader_code)
 	return compiled;
 }
 
-char *generate_c_file(char **compiled_templates, int length)
+char *generate_c_file(PixedArena *arena, char **compiled_templates, int length)
 {
 	char *c_file_content = 0;
 	size_t total_bytes = 0;
@@ -134,13 +148,14 @@ char *generate_c_file(char **compiled_templates, int length)
 		return 0;
 	}
 
-	c_file_content = malloc(sizeof(char) * total_bytes);
-	c_file_content[0] = '\0';
+	c_file_content = pixed_arena_alloc(arena, sizeof(char) * (total_bytes + 1));
 	if (!c_file_content) {
-		perror("c_file_content malloc failed");
+		perror("c_file_content allocation failed");
 		return 0;
 	}
 
+	c_file_content[0] = '\0';
+
 	for (i = 0; i < length; i++) {
 		strcat(c_file_content, compiled_templates[i]);
 		strcat(c_file_content, "\n");
@@ -152,9 +167,12 @@ char *generate_c_file(char **compiled_templates, int length)
 int
 main(int argc, char **argv)
 {
-	char *shader_compiles[20] = {0};
+	char *shader_compiles[SHADERS_MAX] = {0};
 	int compiled_shaders = 0;
 
+	PixedArena arena;
+	pixed_arena_init(&arena, 64 * 1024);
+
 	const char shader_dir_path[] = "./shaders";
 	DIR *shader_dir = opendir(shader_dir_path);
 	if (!shader_dir) {
@@ -168,39 +186,47 @@ main(int argc, char **argv)
 		size_t ext_pos = name_len - 4;
 		char *ext = entry->d_name + ext_pos;
 
-		if (!(ext_pos > 0 && is_valid_extension(ext))) {
+		if (!(name_len > 4 && is_valid_extension(ext))) {
 			continue;
 		}
 
-		char *shader_name = malloc(sizeof(char) * name_len + 7);
+		if (compiled_shaders == SHADERS_MAX) {
+			fprintf(stderr, "ERR: more than %d shaders\n", SHADERS_MAX);
+			break;
+		}
+
+		char *shader_name = pixed_arena_alloc(&arena, sizeof(char) * (name_len + 8));
+		char *shader_path = pixed_arena_alloc(&arena, sizeof(char) * (strlen(shader_dir_path) + name_len + 2));
+		if (!shader_name || !shader_path)
+			break;
+
 		strcpy(shader_name, "shader_");
 		strcpy(shader_name + 7, entry->d_name);
 
 		*(shader_name + 7 + (ext_pos - 1)) = '_';
 
-		char *shader_path = malloc(sizeof(char) * (strlen(shader_dir_path) + name_len + 1));
 		strcpy(shader_path, shader_dir_path);
 		strcat(shader_path, "/");
 		strcat(shader_path, entry->d_name);
 
-		char *shader_code = read_file(shader_path);
-		str_replace(&shader_code, "\n", "\\n");
-
-		char *template = compile_template(shader_name, shader_code);
-		shader_compiles[compiled_shaders++] = template;
+		char *shader_code = read_file(&arena, shader_path);
+		if (shader_code)
+			shader_code = str_replace(&arena, shader_code, "\n", "\\n");
 
+		char *template = shader_code ? compile_template(&arena, shader_name, shader_code) : 0;
+		if (!template) {
+			fprintf(stderr, "ERR: can't compile %s\n", shader_path);
+			continue;
+		}
 
-		free(shader_code);
-		free(shader_name);
-		free(shader_path);
+		shader_compiles[compiled_shaders++] = template;
 	}
 
-	char *c_file_content = generate_c_file(shader_compiles, compiled_shaders);
-	printf("%s", c_file_content);
-
-	for (int i = 0; i < compiled_shaders; i++)
-		free(shader_compiles[i]);
+	char *c_file_content = generate_c_file(&arena, shader_compiles, compiled_shaders);
+	if (c_file_content)
+		printf("%s", c_file_content);
 
-	free(c_file_content);
+	pixed_arena_free(&arena);
 	closedir(shader_dir);
+	return c_file_content ? 0 : 1;
 }
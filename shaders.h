@@ -0,0 +1,7 @@
+const char *shader_canvas_frag = "#version 330 core\n\nuniform sampler2D canvas;\nuniform sampler2D palette;\nuniform bool      indexed;\nuniform float     zoom;\nuniform vec4      selection; // x, y, width, height in pixels, nothing is selected while width is 0\n\nin vec2 canvasPosition;\nout vec4 color;\n\nvoid main()\n{\n  ivec2 texel = min(ivec2(floor(canvasPosition)), textureSize(canvas, 0) - 1);\n  vec4 pixel = texelFetch(canvas, texel, 0);\n\n  if (indexed)\n    pixel = texelFetch(palette, ivec2(int(pixel.r * 255.0f + 0.5f), 0), 0);\n\n  float checker = (((int(gl_FragCoord.x) >> 3) + (int(gl_FragCoord.y) >> 3)) & 1) == 1 ? 0.8f : 0.6f;\n  color = vec4(mix(vec3(checker), pixel.rgb, pixel.a), 1.0f);\n\n  // Dashed outline one screen pixel inside the selection\n  vec2 inside = canvasPosition - selection.xy;\n  vec2 edge = min(inside, selection.zw - inside) * zoom;\n\n  if (selection.z > 0 && all(greaterThanEqual(edge, vec2(0))) && min(edge.x, edge.y) < 1.0f) {\n    float dash = (((int(gl_FragCoord.x) + int(gl_FragCoord.y)) >> 2) & 1) == 1 ? 1.0f : 0.0f;\n    color = vec4(vec3(dash), 1.0f);\n  }\n}\n";
+const char *shader_pixel_frag = "#version 330 core\n\nin vec4 gColor;\nout vec4 color;\n\nvoid main()\n{\n  float checker = (((int(gl_FragCoord.x) >> 3) + (int(gl_FragCoord.y) >> 3)) & 1) == 1 ? 0.8f : 0.6f;\n  color = vec4(mix(vec3(checker), gColor.rgb, gColor.a), 1.0f);\n}\n";
+const char *shader_pixel_vert = "#version 330 core\n\nlayout (location = 0) in vec4 color;\n\nuniform float zoom;\nuniform vec2  pan;\nuniform vec2  viewport;\nuniform vec2  canvasSize;\n\nout vec4 vColor;\nout vec2 pixelSize;\n\nvoid main()\n{\n  vColor = color;\n\n  int columns = int(canvasSize.x);\n  vec2 position = vec2(gl_VertexID % columns, gl_VertexID / columns);\n\n  float width = zoom / (viewport.x / 2);\n  float height = zoom / (viewport.y / 2);\n\n  float pan_x = pan.x / (viewport.x / 2);\n  float pan_y = pan.y / (viewport.y / 2);\n\n  pixelSize.x = width;\n  pixelSize.y = height;\n\n  float x = -1 + (width * position.x) + pan_x;\n  float y =  1 - (height * position.y) - pan_y;\n\n  gl_Position = vec4(x, y, 0.0f, 1.0f);\n}\n\n";
+const char *shader_canvas_vert = "#version 330 core\n\nuniform float zoom;\nuniform vec2  pan;\nuniform vec2  viewport;\nuniform vec2  canvasSize;\n\nout vec2 canvasPosition;\n\nvoid main()\n{\n  vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n  canvasPosition = corner * canvasSize;\n\n  float width = zoom / (viewport.x / 2);\n  float height = zoom / (viewport.y / 2);\n\n  float pan_x = pan.x / (viewport.x / 2);\n  float pan_y = pan.y / (viewport.y / 2);\n\n  float x = -1 + (width * canvasPosition.x) + pan_x;\n  float y =  1 - (height * canvasPosition.y) - pan_y;\n\n  gl_Position = vec4(x, y, 0.0f, 1.0f);\n}\n";
+const char *shader_hud_frag = "#version 330 core\n\nin float milliseconds;\nflat in vec2 times;\nout vec4 color;\n\nvoid main()\n{\n  // GPU time at the foot of the bar, the rest by how it fits a 60 Hz frame\n  if (milliseconds < times.g)\n    color = vec4(0.3f, 0.5f, 1.0f, 1.0f);\n  else if (times.r <= 17.0f)\n    color = vec4(0.3f, 0.9f, 0.3f, 1.0f);\n  else if (times.r <= 34.0f)\n    color = vec4(1.0f, 0.8f, 0.2f, 1.0f);\n  else\n    color = vec4(1.0f, 0.3f, 0.2f, 1.0f);\n}\n";
+const char *shader_hud_vert = "#version 330 core\n\nuniform sampler2D frameTimes; // frame and gpu milliseconds of the last frames\nuniform int       newest;     // texel of the latest frame\nuniform vec2      viewport;\n\nout float milliseconds;\nflat out vec2 times;\n\nconst float barWidth = 2.0f;\nconst float barGap = 1.0f;\nconst float margin = 8.0f;\nconst float pixelsPerMillisecond = 3.0f;\nconst float maxMilliseconds = 50.0f;\n\nvoid main()\n{\n  int bars = textureSize(frameTimes, 0).x;\n  int bar = gl_VertexID / 6;\n  int vertex = gl_VertexID % 6;\n\n  // Two triangles per bar, oldest frame on the left\n  vec2 corner = vec2(vertex == 1 || vertex == 3 || vertex == 4, vertex == 2 || vertex == 4 || vertex == 5);\n  times = texelFetch(frameTimes, ivec2((newest + 1 + bar) % bars, 0), 0).rg;\n\n  float height = min(times.r, maxMilliseconds);\n  milliseconds = corner.y * height;\n\n  float x = margin + bar * (barWidth + barGap) + corner.x * barWidth;\n  float y = margin + milliseconds * pixelsPerMillisecond;\n\n  gl_Position = vec4(x / (viewport.x / 2) - 1, y / (viewport.y / 2) - 1, 0.0f, 1.0f);\n}\n";
+const char *shader_pixel_geom = "#version 330 core\n\nlayout (points) in;\nlayout (triangle_strip, max_vertices = 4) out;\n\nin vec4 vColor[];\nin vec2 pixelSize[];\n\nout vec4 gColor;\n\nvoid main()\n{\n  gColor = vColor[0];\n\n  float width = pixelSize[0].x;\n  float height = pixelSize[0].y;\n\n  gl_Position = gl_in[0].gl_Position + vec4(width, 0, 0, 0);\n  EmitVertex();\n\n  gl_Position = gl_in[0].gl_Position;\n  EmitVertex();\n\n  gl_Position = gl_in[0].gl_Position + vec4(width, -height, 0.0f, 0.0f);\n  EmitVertex();\n\n  gl_Position = gl_in[0].gl_Position + vec4(0, -height, 0.0f, 0.0f);\n  EmitVertex();\n\n  EndPrimitive();\n}\n";
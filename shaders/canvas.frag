@@ -0,0 +1,31 @@
+#version 330 core
+
+uniform sampler2D canvas;
+uniform sampler2D palette;
+uniform bool      indexed;
+uniform float     zoom;
+uniform vec4      selection; // x, y, width, height in pixels, nothing is selected while width is 0
+
+in vec2 canvasPosition;
+out vec4 color;
+
+void main()
+{
+  ivec2 texel = min(ivec2(floor(canvasPosition)), textureSize(canvas, 0) - 1);
+  vec4 pixel = texelFetch(canvas, texel, 0);
+
+  if (indexed)
+    pixel = texelFetch(palette, ivec2(int(pixel.r * 255.0f + 0.5f), 0), 0);
+
+  float checker = (((int(gl_FragCoord.x) >> 3) + (int(gl_FragCoord.y) >> 3)) & 1) == 1 ? 0.8f : 0.6f;
+  color = vec4(mix(vec3(checker), pixel.rgb, pixel.a), 1.0f);
+
+  // Dashed outline one screen pixel inside the selection
+  vec2 inside = canvasPosition - selection.xy;
+  vec2 edge = min(inside, selection.zw - inside) * zoom;
+
+  if (selection.z > 0 && all(greaterThanEqual(edge, vec2(0))) && min(edge.x, edge.y) < 1.0f) {
+    float dash = (((int(gl_FragCoord.x) + int(gl_FragCoord.y)) >> 2) & 1) == 1 ? 1.0f : 0.0f;
+    color = vec4(vec3(dash), 1.0f);
+  }
+}
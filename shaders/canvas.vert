@@ -0,0 +1,25 @@
+#version 330 core
+
+uniform float zoom;
+uniform vec2  pan;
+uniform vec2  viewport;
+uniform vec2  canvasSize;
+
+out vec2 canvasPosition;
+
+void main()
+{
+  vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+  canvasPosition = corner * canvasSize;
+
+  float width = zoom / (viewport.x / 2);
+  float height = zoom / (viewport.y / 2);
+
+  float pan_x = pan.x / (viewport.x / 2);
+  float pan_y = pan.y / (viewport.y / 2);
+
+  float x = -1 + (width * canvasPosition.x) + pan_x;
+  float y =  1 - (height * canvasPosition.y) - pan_y;
+
+  gl_Position = vec4(x, y, 0.0f, 1.0f);
+}
@@ -0,0 +1,18 @@
+#version 330 core
+
+in float milliseconds;
+flat in vec2 times;
+out vec4 color;
+
+void main()
+{
+  // GPU time at the foot of the bar, the rest by how it fits a 60 Hz frame
+  if (milliseconds < times.g)
+    color = vec4(0.3f, 0.5f, 1.0f, 1.0f);
+  else if (times.r <= 17.0f)
+    color = vec4(0.3f, 0.9f, 0.3f, 1.0f);
+  else if (times.r <= 34.0f)
+    color = vec4(1.0f, 0.8f, 0.2f, 1.0f);
+  else
+    color = vec4(1.0f, 0.3f, 0.2f, 1.0f);
+}
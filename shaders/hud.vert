@@ -0,0 +1,33 @@
+#version 330 core
+
+uniform sampler2D frameTimes; // frame and gpu milliseconds of the last frames
+uniform int       newest;     // texel of the latest frame
+uniform vec2      viewport;
+
+out float milliseconds;
+flat out vec2 times;
+
+const float barWidth = 2.0f;
+const float barGap = 1.0f;
+const float margin = 8.0f;
+const float pixelsPerMillisecond = 3.0f;
+const float maxMilliseconds = 50.0f;
+
+void main()
+{
+  int bars = textureSize(frameTimes, 0).x;
+  int bar = gl_VertexID / 6;
+  int vertex = gl_VertexID % 6;
+
+  // Two triangles per bar, oldest frame on the left
+  vec2 corner = vec2(vertex == 1 || vertex == 3 || vertex == 4, vertex == 2 || vertex == 4 || vertex == 5);
+  times = texelFetch(frameTimes, ivec2((newest + 1 + bar) % bars, 0), 0).rg;
+
+  float height = min(times.r, maxMilliseconds);
+  milliseconds = corner.y * height;
+
+  float x = margin + bar * (barWidth + barGap) + corner.x * barWidth;
+  float y = margin + milliseconds * pixelsPerMillisecond;
+
+  gl_Position = vec4(x / (viewport.x / 2) - 1, y / (viewport.y / 2) - 1, 0.0f, 1.0f);
+}
@@ -5,5 +5,6 @@ out vec4 color;
 
 void main()
 {
-  color = gColor;
+  float checker = (((int(gl_FragCoord.x) >> 3) + (int(gl_FragCoord.y) >> 3)) & 1) == 1 ? 0.8f : 0.6f;
+  color = vec4(mix(vec3(checker), gColor.rgb, gColor.a), 1.0f);
 }
@@ -1,18 +1,21 @@
 #version 330 core
 
-layout (location = 0) in vec2 position;
-layout (location = 1) in vec4 color;
+layout (location = 0) in vec4 color;
 
 uniform float zoom;
 uniform vec2  pan;
 uniform vec2  viewport;
+uniform vec2  canvasSize;
 
 out vec4 vColor;
 out vec2 pixelSize;
 
 void main()
 {
-  vColor = vec4(color.r, color.g, color.b, 1.0f);
+  vColor = color;
+
+  int columns = int(canvasSize.x);
+  vec2 position = vec2(gl_VertexID % columns, gl_VertexID / columns);
 
   float width = zoom / (viewport.x / 2);
   float height = zoom / (viewport.y / 2);